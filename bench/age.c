@@ -0,0 +1,412 @@
+#include <getopt.h>
+#include <math.h>
+#include "./../src/mapstore.h"
+
+#define HELP_TEXT "usage: age [<options>]\n\n"                                 \
+    "Ages a metadata only store with store/delete churn and prints CSV samples\n" \
+    "of fragmentation and planning time over simulated time.\n\n"               \
+    "options:\n"                                                               \
+    "  -p, --path <path>         path to mapstore (default: temporary folder)\n" \
+    "  -n, --ops <count>         objects stored over the run (default: 1000000)\n" \
+    "  -s, --stores <count>      number of map stores (default: 8)\n"         \
+    "  -m, --map <bytes>         size of each map store (default: 1GB)\n"     \
+    "  -i, --min-size <bytes>    smallest object (default: 4096)\n"           \
+    "  -x, --max-size <bytes>    largest object (default: 1048576)\n"         \
+    "  -d, --dist <name>         fixed, uniform or exponential sizes (default: exponential)\n" \
+    "  -L, --lifetime <ops>      mean object lifetime in stores (default: 2000)\n" \
+    "  -f, --lifetime-dist <name> fixed, uniform or exponential lifetimes (default: exponential)\n" \
+    "  -I, --interval <ops>      stores between samples (default: ops / 100)\n" \
+    "  -S, --shards <count>      metadata shards\n"                            \
+    "  -e, --seed <seed>         random seed (default: 1)\n"                   \
+    "  -o, --output <path>       write samples to file instead of stdout\n"   \
+    "  -h, --help                output usage information\n"                   \
+
+#define AGE_DEFAULT_PATH "mapstore-age-XXXXXX"
+
+typedef enum {
+    AGE_DIST_FIXED,
+    AGE_DIST_UNIFORM,
+    AGE_DIST_EXPONENTIAL
+} age_dist;
+
+static const char *age_dist_names[] = {"fixed", "uniform", "exponential"};
+
+typedef struct {
+    uint64_t ops;
+    uint64_t stores;
+    uint64_t map_size;
+    uint64_t min_size;
+    uint64_t max_size;
+    age_dist size_dist;
+    uint64_t lifetime;
+    age_dist lifetime_dist;
+    uint64_t interval;
+    uint64_t metadata_shards;
+    uint64_t seed;
+} age_config;
+
+/** Live objects ordered by the op they are deleted at */
+typedef struct {
+    uint64_t death;
+    uint64_t id;
+} age_object;
+
+typedef struct {
+    age_object *objects;
+    uint64_t total;
+} age_heap;
+
+static uint64_t rng = 0;
+
+/** xorshift64* so runs are reproducible */
+static uint64_t age_random() {
+    rng ^= rng >> 12;
+    rng ^= rng << 25;
+    rng ^= rng >> 27;
+    return rng * 2685821657736338717ULL;
+}
+
+static double age_unit() {
+    return (double)((age_random() >> 11) + 1) / 9007199254740993.0;
+}
+
+static uint64_t age_object_size(age_config *config) {
+    uint64_t span = config->max_size - config->min_size;
+    uint64_t size = 0;
+
+    switch (config->size_dist) {
+        case AGE_DIST_FIXED:
+            return config->max_size;
+        case AGE_DIST_UNIFORM:
+            return config->min_size + age_random() % (span + 1);
+        case AGE_DIST_EXPONENTIAL:
+            /* Mean of a quarter of the range so most objects are small */
+            size = config->min_size + (uint64_t)(-log(age_unit()) * (span / 4.0));
+            return (size > config->max_size) ? config->max_size : size;
+    }
+
+    return config->max_size;
+}
+
+/**
+* Lifetimes are counted in stores and average config->lifetime
+*/
+static uint64_t age_object_lifetime(age_config *config) {
+    switch (config->lifetime_dist) {
+        case AGE_DIST_FIXED:
+            return config->lifetime;
+        case AGE_DIST_UNIFORM:
+            return 1 + age_random() % (2 * config->lifetime);
+        case AGE_DIST_EXPONENTIAL:
+            return 1 + (uint64_t)(-log(age_unit()) * config->lifetime);
+    }
+
+    return config->lifetime;
+}
+
+static void age_hash(uint64_t id, char *hash) {
+    /* Spread ids over the hash prefix so metadata shards route them like real ones */
+    memset(hash, '\0', HASH_LENGTH + 1);
+    sprintf(hash, "%08"PRIx64"%032"PRIx64, (uint64_t)((id * 0x9E3779B97F4A7C15ULL) >> 32), id);
+}
+
+static void heap_push(age_heap *heap, uint64_t death, uint64_t id) {
+    uint64_t i = heap->total++;
+    age_object object = {death, id};
+
+    while (i > 0 && heap->objects[(i - 1) / 2].death > death) {
+        heap->objects[i] = heap->objects[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    heap->objects[i] = object;
+}
+
+static age_object heap_pop(age_heap *heap) {
+    age_object top = heap->objects[0];
+    age_object last = heap->objects[--heap->total];
+    uint64_t i = 0;
+    uint64_t child = 0;
+
+    while ((child = 2 * i + 1) < heap->total) {
+        if (child + 1 < heap->total && heap->objects[child + 1].death < heap->objects[child].death) {
+            child++;
+        }
+        if (last.death <= heap->objects[child].death) {
+            break;
+        }
+        heap->objects[i] = heap->objects[child];
+        i = child;
+    }
+    heap->objects[i] = last;
+
+    return top;
+}
+
+static int parse_dist(char *arg, age_dist *dist) {
+    for (int d = AGE_DIST_FIXED; d <= AGE_DIST_EXPONENTIAL; d++) {
+        if (strcmp(arg, age_dist_names[d]) == 0) {
+            *dist = d;
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/**
+* Planning time is the mean of the plan phase since the previous sample
+*/
+static int age_sample(FILE *output, mapstore_ctx *ctx, uint64_t op, uint64_t live, uint64_t failures,
+                      latency_summary *previous_plan) {
+    fragmentation_info info;
+    store_metrics metrics;
+    latency_summary *plan = &metrics.phases[MAPSTORE_PHASE_PLAN];
+    double plan_us = 0;
+
+    if (get_fragmentation_info(ctx, &info) != 0) {
+        return 1;
+    }
+
+    if (get_store_metrics(ctx, &metrics) == 0) {
+        if (plan->count > previous_plan->count) {
+            plan_us = (plan->total_ns - previous_plan->total_ns) / 1000.0 / (plan->count - previous_plan->count);
+        }
+        *previous_plan = *plan;
+    }
+
+    fprintf(output,
+            "%"PRIu64",%"PRIu64",%"PRIu64",%"PRIu64",%"PRIu64",%"PRIu64",%.4f,%.3f,%"PRIu64",%.2f\n",
+            op,
+            live,
+            info.total.size - info.total.free_space,
+            failures,
+            info.total.free_extents,
+            info.total.largest_free_extent,
+            info.total.fragmentation_index,
+            info.average_object_extents,
+            info.max_object_extents,
+            plan_us);
+    fflush(output);
+
+    fragmentation_info_free(&info);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    int status = 0;
+    int c;
+    int index = 0;
+    char *path = NULL;
+    char *output_path = NULL;
+    char shards_path[BUFSIZ];
+    char hash[HASH_LENGTH + 1];
+    char temp_path[] = AGE_DEFAULT_PATH;
+    bool temporary = false;
+    int report_fd = -1;
+    FILE *output = NULL;
+    uint64_t failures = 0;
+    age_config config;
+    age_heap heap;
+    age_object expired;
+    latency_summary previous_plan;
+    mapstore_ctx ctx;
+    mapstore_opts opts = {0};
+
+    memset(&config, 0, sizeof(age_config));
+    memset(&heap, 0, sizeof(age_heap));
+    memset(&previous_plan, 0, sizeof(latency_summary));
+    config.ops = 1000000;
+    config.stores = 8;
+    config.map_size = 1073741824;
+    config.min_size = 4096;
+    config.max_size = 1048576;
+    config.size_dist = AGE_DIST_EXPONENTIAL;
+    config.lifetime = 2000;
+    config.lifetime_dist = AGE_DIST_EXPONENTIAL;
+    config.seed = 1;
+
+    static struct option cmd_options[] = {
+        {"path", required_argument,  0, 'p'},
+        {"ops", required_argument,  0, 'n'},
+        {"stores", required_argument,  0, 's'},
+        {"map", required_argument,  0, 'm'},
+        {"min-size", required_argument,  0, 'i'},
+        {"max-size", required_argument,  0, 'x'},
+        {"dist", required_argument,  0, 'd'},
+        {"lifetime", required_argument,  0, 'L'},
+        {"lifetime-dist", required_argument,  0, 'f'},
+        {"interval", required_argument,  0, 'I'},
+        {"shards", required_argument,  0, 'S'},
+        {"seed", required_argument,  0, 'e'},
+        {"output", required_argument,  0, 'o'},
+        {"help", no_argument,  0, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    opterr = 0;
+
+    while ((c = getopt_long_only(argc, argv, "hp:n:s:m:i:x:d:L:f:I:S:e:o:",
+                                 cmd_options, &index)) != -1) {
+        switch (c) {
+            case 'p':
+                path = optarg;
+                break;
+            case 'n':
+                config.ops = strtoull(optarg, NULL, 10);
+                break;
+            case 's':
+                config.stores = strtoull(optarg, NULL, 10);
+                break;
+            case 'm':
+                config.map_size = strtoull(optarg, NULL, 10);
+                break;
+            case 'i':
+                config.min_size = strtoull(optarg, NULL, 10);
+                break;
+            case 'x':
+                config.max_size = strtoull(optarg, NULL, 10);
+                break;
+            case 'd':
+                if (parse_dist(optarg, &config.size_dist) != 0) {
+                    fprintf(stderr, "Unknown distribution: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'L':
+                config.lifetime = strtoull(optarg, NULL, 10);
+                break;
+            case 'f':
+                if (parse_dist(optarg, &config.lifetime_dist) != 0) {
+                    fprintf(stderr, "Unknown distribution: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'I':
+                config.interval = strtoull(optarg, NULL, 10);
+                break;
+            case 'S':
+                config.metadata_shards = strtoull(optarg, NULL, 10);
+                break;
+            case 'e':
+                config.seed = strtoull(optarg, NULL, 10);
+                break;
+            case 'o':
+                output_path = optarg;
+                break;
+            case 'h':
+                fprintf(stdout, HELP_TEXT);
+                exit(0);
+                break;
+            default:
+                fprintf(stderr, "%c is not a recognized option\n\n", c);
+                fprintf(stderr, HELP_TEXT);
+                exit(1);
+            break;
+        }
+    }
+
+    if (config.ops == 0 || config.stores == 0 || config.map_size == 0 || config.lifetime == 0 ||
+        config.max_size == 0 || config.min_size == 0 || config.min_size > config.max_size) {
+        fprintf(stderr, "Invalid simulation configuration\n\n");
+        fprintf(stderr, HELP_TEXT);
+        return 1;
+    }
+
+    if (config.interval == 0) {
+        config.interval = (config.ops >= 100) ? config.ops / 100 : 1;
+    }
+
+    rng = (config.seed + 1) * 0x9E3779B97F4A7C15ULL;
+
+    if (path == NULL) {
+        if (!mkdtemp(temp_path)) {
+            perror("mkdtemp");
+            return 1;
+        }
+        path = temp_path;
+        temporary = true;
+    } else if (create_directory(path) != 0) {
+        fprintf(stderr, "Could not create folder: %s\n", path);
+        return 1;
+    }
+
+    /* Keep stdout for the samples. Progress messages from the library go to stderr. */
+    fflush(stdout);
+    if ((report_fd = dup(STDOUT_FILENO)) < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+        perror("dup");
+        return 1;
+    }
+
+    output = (output_path) ? fopen(output_path, "w") : fdopen(report_fd, "w");
+    if (!output) {
+        fprintf(stderr, "Could not open output: %s\n", (output_path) ? output_path : "stdout");
+        return 1;
+    }
+
+    opts.allocation_size = config.stores * config.map_size;
+    opts.map_size = config.map_size;
+    opts.path = path;
+    opts.metadata_shards = config.metadata_shards;
+    opts.metadata_only = true;
+
+    if (initialize_mapstore(&ctx, opts) != 0) {
+        fprintf(stderr, "Error initializing mapstore\n");
+        return 1;
+    }
+
+    if (!(heap.objects = calloc(config.ops + 1, sizeof(age_object)))) {
+        status = 1;
+        goto end_age;
+    }
+
+    fprintf(output, "ops,live_objects,used_bytes,failed_stores,free_extents,largest_free_extent,"
+                    "fragmentation_index,average_object_extents,max_object_extents,plan_us\n");
+
+    for (uint64_t op = 1; op <= config.ops; op++) {
+        /* Objects whose lifetime ran out are deleted before the next store */
+        while (heap.total > 0 && heap.objects[0].death <= op) {
+            expired = heap_pop(&heap);
+            age_hash(expired.id, hash);
+            if (delete_data(&ctx, hash) != 0) {
+                fprintf(stderr, "Failed to delete object %"PRIu64"\n", expired.id);
+                status = 1;
+                goto end_age;
+            }
+        }
+
+        age_hash(op, hash);
+        if (store_data(&ctx, -1, age_object_size(&config), hash) == 0) {
+            heap_push(&heap, op + age_object_lifetime(&config), op);
+        } else {
+            failures++;
+        }
+
+        if (op % config.interval == 0 || op == config.ops) {
+            if (age_sample(output, &ctx, op, heap.total, failures, &previous_plan) != 0) {
+                status = 1;
+                goto end_age;
+            }
+        }
+    }
+
+end_age:
+    if (heap.objects) {
+        free(heap.objects);
+    }
+
+    if (output) {
+        fclose(output);
+    }
+
+    mapstore_ctx_free(&ctx);
+
+    /* Metadata only stores have no map files to remove */
+    if (temporary) {
+        memset(shards_path, '\0', BUFSIZ);
+        sprintf(shards_path, "%s%cshards", path, separator());
+        remove_directory(shards_path);
+        remove_directory(path);
+    }
+
+    return status;
+}
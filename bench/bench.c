@@ -0,0 +1,623 @@
+#include <getopt.h>
+#include <math.h>
+#include "./../src/mapstore.h"
+
+#define HELP_TEXT "usage: bench [<options>]\n\n"                               \
+    "Runs a mixed store/retrieve/delete workload and prints JSON results.\n\n"  \
+    "options:\n"                                                               \
+    "  -p, --path <path>         path to mapstore (default: temporary folder)\n" \
+    "  -n, --ops <count>         operations to run (default: 10000)\n"        \
+    "  -t, --threads <count>     concurrent workers (default: 1)\n"           \
+    "  -s, --stores <count>      number of map stores (default: 8)\n"         \
+    "  -m, --map <bytes>         size of each map store (default: 64MB)\n"    \
+    "  -i, --min-size <bytes>    smallest object (default: 4096)\n"           \
+    "  -x, --max-size <bytes>    largest object (default: 65536)\n"           \
+    "  -d, --dist <name>         fixed, uniform or exponential (default: uniform)\n" \
+    "  -w, --mix <r:w:d>         retrieve:store:delete weights (default: 40:50:10)\n" \
+    "  -l, --preload <count>     objects stored before timing (default: 0)\n" \
+    "  -r, --prealloc            preallocate map stores\n"                     \
+    "  -c, --read-connections <count> pooled read connections\n"              \
+    "  -S, --shards <count>      metadata shards\n"                            \
+    "  -e, --seed <seed>         random seed (default: 1)\n"                   \
+    "  -o, --output <path>       write results to file instead of stdout\n"   \
+    "  -h, --help                output usage information\n"                   \
+
+#define BENCH_DEFAULT_PATH "mapstore-bench-XXXXXX"
+
+typedef enum {
+    BENCH_RETRIEVE,
+    BENCH_STORE,
+    BENCH_DELETE,
+    BENCH_OPS
+} bench_op;
+
+static const char *bench_op_names[BENCH_OPS] = {"retrieve", "store", "delete"};
+
+typedef enum {
+    BENCH_DIST_FIXED,
+    BENCH_DIST_UNIFORM,
+    BENCH_DIST_EXPONENTIAL
+} bench_dist;
+
+static const char *bench_dist_names[] = {"fixed", "uniform", "exponential"};
+
+typedef struct {
+    uint64_t ops;
+    uint64_t threads;
+    uint64_t stores;
+    uint64_t map_size;
+    uint64_t min_size;
+    uint64_t max_size;
+    bench_dist dist;
+    uint64_t mix[BENCH_OPS];
+    uint64_t preload;
+    bool prealloc;
+    uint64_t read_connections;
+    uint64_t metadata_shards;
+    uint64_t seed;
+} bench_config;
+
+typedef struct {
+    mapstore_ctx *ctx;
+    bench_config *config;
+    uint64_t id;
+    uint64_t ops;
+    uint64_t preload;
+    uint64_t rng;
+    int data_fd;
+    int output_fd;
+    char data_path[BUFSIZ];
+    char output_path[BUFSIZ];
+    char (*hashes)[HASH_LENGTH + 1];
+    uint64_t *sizes;
+    uint64_t total_hashes;
+    uint64_t next_hash;
+    uint64_t *latencies[BENCH_OPS];
+    uint64_t counts[BENCH_OPS];
+    uint64_t bytes[BENCH_OPS];
+    uint64_t errors[BENCH_OPS];
+} bench_worker;
+
+/** xorshift64* so every worker has its own reproducible stream */
+static uint64_t bench_random(bench_worker *worker) {
+    worker->rng ^= worker->rng >> 12;
+    worker->rng ^= worker->rng << 25;
+    worker->rng ^= worker->rng >> 27;
+    return worker->rng * 2685821657736338717ULL;
+}
+
+static uint64_t bench_object_size(bench_worker *worker) {
+    bench_config *config = worker->config;
+    uint64_t span = config->max_size - config->min_size;
+    double u = 0;
+    uint64_t size = 0;
+
+    switch (config->dist) {
+        case BENCH_DIST_FIXED:
+            return config->max_size;
+        case BENCH_DIST_UNIFORM:
+            return config->min_size + bench_random(worker) % (span + 1);
+        case BENCH_DIST_EXPONENTIAL:
+            /* Mean of a quarter of the range so most objects are small */
+            u = (double)((bench_random(worker) >> 11) + 1) / 9007199254740993.0;
+            size = config->min_size + (uint64_t)(-log(u) * (span / 4.0));
+            return (size > config->max_size) ? config->max_size : size;
+    }
+
+    return config->max_size;
+}
+
+static bench_op bench_pick_op(bench_worker *worker) {
+    uint64_t *mix = worker->config->mix;
+    uint64_t total = mix[BENCH_RETRIEVE] + mix[BENCH_STORE] + mix[BENCH_DELETE];
+    uint64_t pick = bench_random(worker) % total;
+
+    if (pick < mix[BENCH_RETRIEVE]) {
+        return BENCH_RETRIEVE;
+    }
+
+    if (pick < mix[BENCH_RETRIEVE] + mix[BENCH_STORE]) {
+        return BENCH_STORE;
+    }
+
+    return BENCH_DELETE;
+}
+
+static int bench_store(bench_worker *worker, uint64_t *bytes) {
+    char *hash = worker->hashes[worker->total_hashes];
+    uint64_t size = bench_object_size(worker);
+
+    /* Hex hashes so metadata shards route them like real ones */
+    memset(hash, '\0', HASH_LENGTH + 1);
+    sprintf(hash, "%08"PRIx64"%032"PRIx64, worker->id, worker->next_hash++);
+    *bytes = size;
+
+    if (store_data(worker->ctx, worker->data_fd, size, hash) != 0) {
+        return 1;
+    }
+
+    worker->sizes[worker->total_hashes++] = size;
+    return 0;
+}
+
+static int bench_run_op(bench_worker *worker, bench_op op, uint64_t *bytes) {
+    uint64_t index = 0;
+    uint64_t last = 0;
+
+    if (op == BENCH_STORE) {
+        return bench_store(worker, bytes);
+    }
+
+    index = bench_random(worker) % worker->total_hashes;
+    *bytes = worker->sizes[index];
+
+    if (op == BENCH_RETRIEVE) {
+        return retrieve_data(worker->ctx, worker->output_fd, worker->hashes[index]);
+    }
+
+    if (delete_data(worker->ctx, worker->hashes[index]) != 0) {
+        return 1;
+    }
+
+    last = --worker->total_hashes;
+    memcpy(worker->hashes[index], worker->hashes[last], HASH_LENGTH + 1);
+    worker->sizes[index] = worker->sizes[last];
+    return 0;
+}
+
+static void bench_worker_run(void *arg) {
+    bench_worker *worker = arg;
+    bench_op op;
+    uint64_t bytes = 0;
+    uint64_t start = 0;
+    uint64_t elapsed = 0;
+
+    for (uint64_t i = 0; i < worker->ops; i++) {
+        op = bench_pick_op(worker);
+
+        /* Nothing to read or delete yet */
+        if (op != BENCH_STORE && worker->total_hashes == 0) {
+            op = BENCH_STORE;
+        }
+
+        start = uv_hrtime();
+        if (bench_run_op(worker, op, &bytes) != 0) {
+            worker->errors[op]++;
+            continue;
+        }
+        elapsed = uv_hrtime() - start;
+
+        worker->latencies[op][worker->counts[op]++] = elapsed;
+        worker->bytes[op] += bytes;
+    }
+}
+
+static int bench_worker_init(bench_worker *worker, mapstore_ctx *ctx, bench_config *config, char *path, uint64_t id) {
+    uint8_t buf[BUFSIZ];
+    uint64_t written = 0;
+    uint64_t capacity = 0;
+
+    memset(worker, 0, sizeof(bench_worker));
+    worker->ctx = ctx;
+    worker->config = config;
+    worker->id = id;
+    worker->rng = (config->seed + id + 1) * 0x9E3779B97F4A7C15ULL;
+    worker->ops = config->ops / config->threads + ((id < config->ops % config->threads) ? 1 : 0);
+    worker->preload = config->preload / config->threads + ((id < config->preload % config->threads) ? 1 : 0);
+    worker->data_fd = -1;
+    worker->output_fd = -1;
+
+    capacity = worker->ops + worker->preload;
+    worker->hashes = calloc(capacity + 1, HASH_LENGTH + 1);
+    worker->sizes = calloc(capacity + 1, sizeof(uint64_t));
+    if (!worker->hashes || !worker->sizes) {
+        return 1;
+    }
+
+    for (int op = 0; op < BENCH_OPS; op++) {
+        worker->latencies[op] = calloc(worker->ops + 1, sizeof(uint64_t));
+        if (!worker->latencies[op]) {
+            return 1;
+        }
+    }
+
+    sprintf(worker->data_path, "%s%cbench-%"PRIu64".data", path, separator(), id);
+    sprintf(worker->output_path, "%s%cbench-%"PRIu64".out", path, separator(), id);
+
+    if ((worker->data_fd = open(worker->data_path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0 ||
+        (worker->output_fd = open(worker->output_path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+        fprintf(stderr, "Could not open bench files in %s\n", path);
+        return 1;
+    }
+
+    /* Every object is a prefix of one random payload */
+    while (written < config->max_size) {
+        for (int i = 0; i < BUFSIZ; i++) {
+            buf[i] = bench_random(worker) & 0xff;
+        }
+        written += write(worker->data_fd, buf, (config->max_size - written > BUFSIZ) ? BUFSIZ : config->max_size - written);
+    }
+
+    return 0;
+}
+
+static void bench_worker_free(bench_worker *worker) {
+    if (!worker->config) {
+        return;
+    }
+
+    if (worker->data_fd >= 0) {
+        close(worker->data_fd);
+        remove(worker->data_path);
+    }
+
+    if (worker->output_fd >= 0) {
+        close(worker->output_fd);
+        remove(worker->output_path);
+    }
+
+    for (int op = 0; op < BENCH_OPS; op++) {
+        free(worker->latencies[op]);
+    }
+
+    free(worker->hashes);
+    free(worker->sizes);
+}
+
+static int compare_latency(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile_us(uint64_t *sorted, uint64_t count, double p) {
+    uint64_t index = 0;
+
+    if (count == 0) {
+        return 0;
+    }
+
+    index = (uint64_t)ceil(p * count);
+    index = (index > 0) ? index - 1 : 0;
+    return sorted[(index < count) ? index : count - 1] / 1000.0;
+}
+
+static json_object *bench_op_report(bench_worker *workers, uint64_t threads, bench_op op, double seconds) {
+    json_object *report = json_object_new_object();
+    uint64_t *all = NULL;
+    uint64_t count = 0;
+    uint64_t errors = 0;
+    uint64_t bytes = 0;
+
+    for (uint64_t t = 0; t < threads; t++) {
+        count += workers[t].counts[op];
+        errors += workers[t].errors[op];
+        bytes += workers[t].bytes[op];
+    }
+
+    all = calloc(count + 1, sizeof(uint64_t));
+    count = 0;
+    for (uint64_t t = 0; t < threads; t++) {
+        memcpy(all + count, workers[t].latencies[op], workers[t].counts[op] * sizeof(uint64_t));
+        count += workers[t].counts[op];
+    }
+    qsort(all, count, sizeof(uint64_t), compare_latency);
+
+    json_object_object_add(report, "ops", json_object_new_int64(count));
+    json_object_object_add(report, "errors", json_object_new_int64(errors));
+    json_object_object_add(report, "bytes", json_object_new_int64(bytes));
+    json_object_object_add(report, "ops_per_sec", json_object_new_double(count / seconds));
+    json_object_object_add(report, "mb_per_sec", json_object_new_double(bytes / seconds / 1048576.0));
+    json_object_object_add(report, "p50_us", json_object_new_double(percentile_us(all, count, 0.50)));
+    json_object_object_add(report, "p99_us", json_object_new_double(percentile_us(all, count, 0.99)));
+    json_object_object_add(report, "p999_us", json_object_new_double(percentile_us(all, count, 0.999)));
+
+    free(all);
+    return report;
+}
+
+static json_object *bench_config_report(bench_config *config) {
+    json_object *report = json_object_new_object();
+    json_object *mix = json_object_new_object();
+
+    json_object_object_add(report, "ops", json_object_new_int64(config->ops));
+    json_object_object_add(report, "threads", json_object_new_int64(config->threads));
+    json_object_object_add(report, "stores", json_object_new_int64(config->stores));
+    json_object_object_add(report, "map_size", json_object_new_int64(config->map_size));
+    json_object_object_add(report, "min_size", json_object_new_int64(config->min_size));
+    json_object_object_add(report, "max_size", json_object_new_int64(config->max_size));
+    json_object_object_add(report, "distribution", json_object_new_string(bench_dist_names[config->dist]));
+    json_object_object_add(report, "preload", json_object_new_int64(config->preload));
+    json_object_object_add(report, "prealloc", json_object_new_boolean(config->prealloc));
+    json_object_object_add(report, "read_connections", json_object_new_int64(config->read_connections));
+    json_object_object_add(report, "metadata_shards", json_object_new_int64(config->metadata_shards));
+    json_object_object_add(report, "seed", json_object_new_int64(config->seed));
+
+    for (int op = 0; op < BENCH_OPS; op++) {
+        json_object_object_add(mix, bench_op_names[op], json_object_new_int64(config->mix[op]));
+    }
+    json_object_object_add(report, "mix", mix);
+
+    return report;
+}
+
+static int parse_mix(char *arg, bench_config *config) {
+    if (sscanf(arg, "%"SCNu64":%"SCNu64":%"SCNu64,
+               &config->mix[BENCH_RETRIEVE],
+               &config->mix[BENCH_STORE],
+               &config->mix[BENCH_DELETE]) != 3) {
+        return 1;
+    }
+
+    return (config->mix[BENCH_RETRIEVE] + config->mix[BENCH_STORE] + config->mix[BENCH_DELETE] == 0) ? 1 : 0;
+}
+
+static int parse_dist(char *arg, bench_config *config) {
+    for (int d = BENCH_DIST_FIXED; d <= BENCH_DIST_EXPONENTIAL; d++) {
+        if (strcmp(arg, bench_dist_names[d]) == 0) {
+            config->dist = d;
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+int main(int argc, char **argv) {
+    int status = 0;
+    int c;
+    int index = 0;
+    char *path = NULL;
+    char *output_path = NULL;
+    char shards_path[BUFSIZ];
+    char temp_path[] = BENCH_DEFAULT_PATH;
+    bool temporary = false;
+    int report_fd = -1;
+    FILE *output = NULL;
+    uint64_t start = 0;
+    uint64_t bytes = 0;
+    uint64_t total_bytes = 0;
+    uint64_t total_ops = 0;
+    double seconds = 0;
+    bench_config config;
+    bench_worker *workers = NULL;
+    uv_thread_t *threads = NULL;
+    json_object *report = NULL;
+    json_object *total = NULL;
+    mapstore_ctx ctx;
+    mapstore_opts opts = {0};
+
+    memset(&config, 0, sizeof(bench_config));
+    config.ops = 10000;
+    config.threads = 1;
+    config.stores = 8;
+    config.map_size = 67108864;
+    config.min_size = 4096;
+    config.max_size = 65536;
+    config.dist = BENCH_DIST_UNIFORM;
+    config.mix[BENCH_RETRIEVE] = 40;
+    config.mix[BENCH_STORE] = 50;
+    config.mix[BENCH_DELETE] = 10;
+    config.read_connections = 0;
+    config.seed = 1;
+
+    static struct option cmd_options[] = {
+        {"path", required_argument,  0, 'p'},
+        {"ops", required_argument,  0, 'n'},
+        {"threads", required_argument,  0, 't'},
+        {"stores", required_argument,  0, 's'},
+        {"map", required_argument,  0, 'm'},
+        {"min-size", required_argument,  0, 'i'},
+        {"max-size", required_argument,  0, 'x'},
+        {"dist", required_argument,  0, 'd'},
+        {"mix", required_argument,  0, 'w'},
+        {"preload", required_argument,  0, 'l'},
+        {"prealloc", no_argument,  0, 'r'},
+        {"read-connections", required_argument,  0, 'c'},
+        {"shards", required_argument,  0, 'S'},
+        {"seed", required_argument,  0, 'e'},
+        {"output", required_argument,  0, 'o'},
+        {"help", no_argument,  0, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    opterr = 0;
+
+    while ((c = getopt_long_only(argc, argv, "hp:n:t:s:m:i:x:d:w:l:rc:S:e:o:",
+                                 cmd_options, &index)) != -1) {
+        switch (c) {
+            case 'p':
+                path = optarg;
+                break;
+            case 'n':
+                config.ops = strtoull(optarg, NULL, 10);
+                break;
+            case 't':
+                config.threads = strtoull(optarg, NULL, 10);
+                break;
+            case 's':
+                config.stores = strtoull(optarg, NULL, 10);
+                break;
+            case 'm':
+                config.map_size = strtoull(optarg, NULL, 10);
+                break;
+            case 'i':
+                config.min_size = strtoull(optarg, NULL, 10);
+                break;
+            case 'x':
+                config.max_size = strtoull(optarg, NULL, 10);
+                break;
+            case 'd':
+                if (parse_dist(optarg, &config) != 0) {
+                    fprintf(stderr, "Unknown distribution: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'w':
+                if (parse_mix(optarg, &config) != 0) {
+                    fprintf(stderr, "Invalid mix: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'l':
+                config.preload = strtoull(optarg, NULL, 10);
+                break;
+            case 'r':
+                config.prealloc = true;
+                break;
+            case 'c':
+                config.read_connections = strtoull(optarg, NULL, 10);
+                break;
+            case 'S':
+                config.metadata_shards = strtoull(optarg, NULL, 10);
+                break;
+            case 'e':
+                config.seed = strtoull(optarg, NULL, 10);
+                break;
+            case 'o':
+                output_path = optarg;
+                break;
+            case 'h':
+                fprintf(stdout, HELP_TEXT);
+                exit(0);
+                break;
+            default:
+                fprintf(stderr, "%c is not a recognized option\n\n", c);
+                fprintf(stderr, HELP_TEXT);
+                exit(1);
+            break;
+        }
+    }
+
+    if (config.threads == 0 || config.stores == 0 || config.map_size == 0 ||
+        config.max_size == 0 || config.min_size == 0 || config.min_size > config.max_size) {
+        fprintf(stderr, "Invalid benchmark configuration\n\n");
+        fprintf(stderr, HELP_TEXT);
+        return 1;
+    }
+
+    if (path == NULL) {
+        if (!mkdtemp(temp_path)) {
+            perror("mkdtemp");
+            return 1;
+        }
+        path = temp_path;
+        temporary = true;
+    } else if (create_directory(path) != 0) {
+        fprintf(stderr, "Could not create folder: %s\n", path);
+        return 1;
+    }
+
+    /* Keep stdout for the report. Progress messages from the library go to stderr. */
+    fflush(stdout);
+    if ((report_fd = dup(STDOUT_FILENO)) < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+        perror("dup");
+        return 1;
+    }
+
+    output = (output_path) ? fopen(output_path, "w") : fdopen(report_fd, "w");
+    if (!output) {
+        fprintf(stderr, "Could not open output: %s\n", (output_path) ? output_path : "stdout");
+        return 1;
+    }
+
+    opts.allocation_size = config.stores * config.map_size;
+    opts.map_size = config.map_size;
+    opts.path = path;
+    opts.prealloc = config.prealloc;
+    opts.read_connections = config.read_connections;
+    opts.metadata_shards = config.metadata_shards;
+
+    if (initialize_mapstore(&ctx, opts) != 0) {
+        fprintf(stderr, "Error initializing mapstore\n");
+        return 1;
+    }
+
+    workers = calloc(config.threads, sizeof(bench_worker));
+    threads = calloc(config.threads, sizeof(uv_thread_t));
+    if (!workers || !threads) {
+        status = 1;
+        goto end_bench;
+    }
+
+    for (uint64_t t = 0; t < config.threads; t++) {
+        if (bench_worker_init(&workers[t], &ctx, &config, path, t) != 0) {
+            status = 1;
+            goto end_bench;
+        }
+    }
+
+    /* Preloaded objects give retrieve and delete something to work on */
+    for (uint64_t t = 0; t < config.threads; t++) {
+        for (uint64_t i = 0; i < workers[t].preload; i++) {
+            if (bench_store(&workers[t], &bytes) != 0) {
+                fprintf(stderr, "Failed to preload object %"PRIu64"\n", i);
+                status = 1;
+                goto end_bench;
+            }
+        }
+    }
+
+    start = uv_hrtime();
+    for (uint64_t t = 0; t < config.threads; t++) {
+        uv_thread_create(&threads[t], bench_worker_run, &workers[t]);
+    }
+
+    for (uint64_t t = 0; t < config.threads; t++) {
+        uv_thread_join(&threads[t]);
+    }
+    seconds = (uv_hrtime() - start) / 1e9;
+
+    report = json_object_new_object();
+    json_object_object_add(report, "config", bench_config_report(&config));
+    json_object_object_add(report, "duration_sec", json_object_new_double(seconds));
+
+    for (int op = 0; op < BENCH_OPS; op++) {
+        json_object_object_add(report, bench_op_names[op], bench_op_report(workers, config.threads, op, seconds));
+    }
+
+    for (uint64_t t = 0; t < config.threads; t++) {
+        for (int op = 0; op < BENCH_OPS; op++) {
+            total_ops += workers[t].counts[op];
+            total_bytes += workers[t].bytes[op];
+        }
+    }
+
+    total = json_object_new_object();
+    json_object_object_add(total, "ops", json_object_new_int64(total_ops));
+    json_object_object_add(total, "ops_per_sec", json_object_new_double(total_ops / seconds));
+    json_object_object_add(total, "mb_per_sec", json_object_new_double(total_bytes / seconds / 1048576.0));
+    json_object_object_add(report, "total", total);
+
+    fprintf(output, "%s\n", json_object_to_json_string_ext(report, JSON_C_TO_STRING_PRETTY));
+    json_object_put(report);
+
+end_bench:
+    if (workers) {
+        for (uint64_t t = 0; t < config.threads; t++) {
+            bench_worker_free(&workers[t]);
+        }
+    }
+    free(workers);
+    free(threads);
+    fclose(output);
+
+    if (temporary) {
+        for (uint64_t f = 1; f <= ctx.total_mapstores; f++) {
+            memset(shards_path, '\0', BUFSIZ);
+            sprintf(shards_path, "%s%"PRIu64".map", ctx.mapstore_path, f);
+            remove(shards_path);
+        }
+    }
+
+    mapstore_ctx_free(&ctx);
+
+    if (temporary) {
+        memset(shards_path, '\0', BUFSIZ);
+        sprintf(shards_path, "%s%cshards", path, separator());
+        remove_directory(shards_path);
+        remove_directory(path);
+    }
+
+    return status;
+}
@@ -0,0 +1,549 @@
+#include "block_bitmap.h"
+
+static uint64_t store_blocks(mapstore_blocks *blocks, uint64_t store_id) {
+    return (blocks->sizes[store_id - 1] + blocks->block_size - 1) / blocks->block_size;
+}
+
+static uint64_t *store_words(mapstore_blocks *blocks, uint64_t store_id) {
+    return blocks->words + blocks->offsets[store_id - 1];
+}
+
+/**
+* Bytes covered by blocks [first, end). Only the last block of a store is short.
+*/
+static uint64_t block_bytes(mapstore_blocks *blocks, uint64_t store_id, uint64_t first, uint64_t end) {
+    uint64_t final = end * blocks->block_size;
+
+    if (final > blocks->sizes[store_id - 1]) {
+        final = blocks->sizes[store_id - 1];
+    }
+
+    return final - first * blocks->block_size;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+__attribute__((target("avx2")))
+static uint64_t skip_words_avx2(uint64_t *words, uint64_t w, uint64_t total, uint64_t skip) {
+    __m256i skipped = _mm256_set1_epi64x(skip);
+    int mask = 0;
+
+    for (; w + 4 <= total; w += 4) {
+        mask = _mm256_movemask_pd(_mm256_castsi256_pd(
+            _mm256_cmpeq_epi64(_mm256_loadu_si256((__m256i *)(words + w)), skipped)));
+        if (mask != 0xf) {
+            return w + __builtin_ctz(~mask);
+        }
+    }
+
+    for (; w < total && words[w] == skip; w++);
+    return w;
+}
+#endif
+
+/**
+* First of words [w, total) that is not skip, or total. Compares four words
+* at a time with AVX2 when the CPU has it, two with NEON, and one otherwise.
+*/
+static uint64_t skip_words(uint64_t *words, uint64_t w, uint64_t total, uint64_t skip) {
+#if defined(__x86_64__) && defined(__GNUC__)
+    if (__builtin_cpu_supports("avx2")) {
+        return skip_words_avx2(words, w, total, skip);
+    }
+#elif defined(__aarch64__)
+    uint64x2_t skipped = vdupq_n_u64(skip);
+    uint64x2_t equal;
+
+    for (; w + 2 <= total; w += 2) {
+        equal = vceqq_u64(vld1q_u64(words + w), skipped);
+        if ((vgetq_lane_u64(equal, 0) & vgetq_lane_u64(equal, 1)) == 0) {
+            break;
+        }
+    }
+#endif
+
+    for (; w < total && words[w] == skip; w++);
+    return w;
+}
+
+/**
+* First block in [bit, end) whose bit equals used, or end. Whole words that
+* can't hold a match are skipped by skip_words.
+*/
+static uint64_t next_block(uint64_t *words, uint64_t bit, uint64_t end, bool used) {
+    uint64_t w = bit / 64;
+    uint64_t word = 0;
+
+    if (bit >= end) {
+        return end;
+    }
+
+    word = (used ? words[w] : ~words[w]) & (UINT64_MAX << (bit % 64));
+    if (word == 0) {
+        w = skip_words(words, w + 1, (end + 63) / 64, (used) ? 0 : UINT64_MAX);
+        if (w * 64 >= end) {
+            return end;
+        }
+        word = used ? words[w] : ~words[w];
+    }
+
+    bit = w * 64 + __builtin_ctzll(word);
+    return (bit < end) ? bit : end;
+}
+
+/**
+* Set or clear the bits of blocks [first, end) and return the bytes of the
+* blocks that changed.
+*/
+static uint64_t mark_blocks(mapstore_blocks *blocks, uint64_t store_id, uint64_t first, uint64_t end, bool used) {
+    uint64_t *words = store_words(blocks, store_id);
+    uint64_t total = store_blocks(blocks, store_id);
+    uint64_t changed = 0;
+    uint64_t bits = 0;
+    uint64_t mask = 0;
+    bool short_tail = false;
+
+    if (end > total) {
+        end = total;
+    }
+
+    if (first >= end) {
+        return 0;
+    }
+
+    if (end == total) {
+        short_tail = ((words[(total - 1) / 64] >> ((total - 1) % 64)) & 1) != used;
+    }
+
+    for (uint64_t b = first; b < end; b += bits) {
+        bits = (end - b < 64 - b % 64) ? end - b : 64 - b % 64;
+        mask = ((bits == 64) ? UINT64_MAX : (UINT64_C(1) << bits) - 1) << (b % 64);
+
+        if (used) {
+            changed += __builtin_popcountll(~words[b / 64] & mask);
+            words[b / 64] |= mask;
+        } else {
+            changed += __builtin_popcountll(words[b / 64] & mask);
+            words[b / 64] &= ~mask;
+        }
+    }
+
+    changed *= blocks->block_size;
+    if (short_tail) {
+        changed -= total * blocks->block_size - blocks->sizes[store_id - 1];
+    }
+
+    return changed;
+}
+
+static void checksum_bitmap(mapstore_blocks *blocks, uint8_t *digest) {
+    struct sha256_ctx hasher;
+
+    sha256_init(&hasher);
+    sha256_update(&hasher, blocks->map_size - sizeof(block_bitmap_header), (uint8_t *)blocks->sizes);
+    sha256_digest(&hasher, SHA256_DIGEST_SIZE, digest);
+}
+
+/**
+* Mark the blocks of every stored object, including objects whose store was
+* interrupted, and write the free space of each map store back.
+*/
+static int rebuild_bitmap(mapstore_ctx *ctx) {
+    int status = 0;
+    int count = 0;
+    char hashes[RESTRUCTURE_BATCH][41];
+    char where[11 + MAX_UINT64_STR + 1];
+    char set[24 + MAX_UINT64_STR + 1];
+    uint64_t ids[RESTRUCTURE_BATCH];
+    uint64_t last_id = 0;
+    uint64_t store = 0;
+    json_object *location_array = NULL;
+    mapstore_blocks *blocks = ctx->blocks;
+    sqlite3 *db = NULL;
+    data_locations_row row;
+    free_space_info info;
+
+    memset(blocks->words, 0, blocks->offsets[ctx->total_mapstores] * sizeof(uint64_t));
+
+    // Blocks past the end of a store are never free
+    for (uint64_t f = 1; f <= ctx->total_mapstores; f++) {
+        if (store_blocks(blocks, f) % 64 != 0) {
+            store_words(blocks, f)[store_blocks(blocks, f) / 64] = UINT64_MAX << (store_blocks(blocks, f) % 64);
+        }
+    }
+
+    for (uint64_t s = 0; s < ctx->shards.total && status == 0; s++) {
+        db = ctx->shards.dbs[s];
+        last_id = 0;
+
+        while (status == 0 && (count = get_data_hashes_after(db, last_id, RESTRUCTURE_BATCH, hashes, ids)) > 0) {
+            for (int i = 0; i < count && status == 0; i++) {
+                if (get_data_locations_row(db, hashes[i], &row) != 0) {
+                    status = 1;
+                    break;
+                }
+
+                if (row.positions) {
+                    json_object_object_foreach(row.positions, store_id, pos) {
+                        store = strtoull(store_id, NULL, 10);
+                        if (store < 1 || store > ctx->total_mapstores) {
+                            continue;
+                        }
+
+                        for (uint64_t p = 0; p < json_object_array_length(pos); p++) {
+                            location_array = json_object_array_get_idx(pos, p);
+                            mark_blocks(blocks, store,
+                                        json_object_get_int64(json_object_array_get_idx(location_array, 1)) / blocks->block_size,
+                                        json_object_get_int64(json_object_array_get_idx(location_array, 2)) / blocks->block_size + 1,
+                                        true);
+                        }
+                    }
+                    json_object_put(row.positions);
+                }
+
+                free(row.hash);
+            }
+
+            last_id = ids[count - 1];
+        }
+
+        if (count < 0) {
+            fprintf(stderr, "Could not get data hashes\n");
+            status = 1;
+        }
+    }
+
+    for (uint64_t f = 1; f <= ctx->total_mapstores && status == 0; f++) {
+        block_free_space_info(ctx, f, &info);
+
+        memset(where, '\0', sizeof(where));
+        sprintf(where, "WHERE Id=%"PRIu64, f);
+        memset(set, '\0', sizeof(set));
+        sprintf(set, "SET free_space = %"PRIu64, info.free_space);
+        status = update_map_store(db_for_store(&ctx->shards, f), where, set);
+    }
+
+    return status;
+}
+
+/**
+* Refuse stores that hold data placed by another engine or block size. Their
+* extents may share blocks, which clearing bits on delete would not respect.
+*/
+static int check_block_size(mapstore_ctx *ctx) {
+    uint64_t block_size = 0;
+    uint64_t free_space = 0;
+    uint64_t size = 0;
+
+    if (get_setting(ctx->db, SETTING_BLOCK_SIZE, &block_size) != 0) {
+        return 1;
+    }
+
+    if (block_size == ctx->block_size) {
+        return 0;
+    }
+
+    if (block_size != 0) {
+        fprintf(stderr, "Store uses blocks of %"PRIu64" bytes\n", block_size);
+        return 1;
+    }
+
+    if (sum_column_for_shards(&ctx->shards, "free_space", "map_stores", &free_space) != 0 ||
+        sum_column_for_shards(&ctx->shards, "size", "map_stores", &size) != 0) {
+        return 1;
+    }
+
+    if (free_space != size) {
+        fprintf(stderr, "The bitmap engine needs a store without data in its map stores\n");
+        return 1;
+    }
+
+    return save_setting(ctx->db, SETTING_BLOCK_SIZE, ctx->block_size);
+}
+
+/**
+* Map the bitmaps of every map store. A clean file matching the map stores
+* is used as is, anything else is rebuilt. The file stays marked unclean
+* while the context is open.
+*/
+int open_block_bitmap(mapstore_ctx *ctx) {
+    int status = 0;
+    char path[BUFSIZ];
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    uint64_t header_size = sizeof(block_bitmap_header) + ctx->total_mapstores * sizeof(uint64_t);
+    uint64_t size = 0;
+    bool valid = false;
+    block_bitmap_header *header = NULL;
+    mapstore_blocks *blocks = NULL;
+
+    if (check_block_size(ctx) != 0) {
+        return 1;
+    }
+
+    if (!(blocks = calloc(1, sizeof(mapstore_blocks)))) {
+        return 1;
+    }
+    blocks->fd = -1;
+    blocks->block_size = ctx->block_size;
+    ctx->blocks = blocks;
+
+    if (!(blocks->offsets = calloc(ctx->total_mapstores + 1, sizeof(uint64_t)))) {
+        status = 1;
+        goto end_open_block_bitmap;
+    }
+
+    // Sizes are read before mapping to know where each store's words start
+    if (!(blocks->sizes = calloc(ctx->total_mapstores, sizeof(uint64_t)))) {
+        status = 1;
+        goto end_open_block_bitmap;
+    }
+
+    for (uint64_t f = 1; f <= ctx->total_mapstores; f++) {
+        if (get_store_size(db_for_store(&ctx->shards, f), f, &blocks->sizes[f - 1]) != 0) {
+            status = 1;
+            goto end_open_block_bitmap;
+        }
+        blocks->offsets[f] = blocks->offsets[f - 1] + (store_blocks(blocks, f) + 63) / 64;
+    }
+
+    blocks->map_size = header_size + blocks->offsets[ctx->total_mapstores] * sizeof(uint64_t);
+
+    memset(path, '\0', BUFSIZ);
+    sprintf(path, "%s%s", ctx->mapstore_path, BLOCK_BITMAP_FILE);
+
+    if ((blocks->fd = open(path, O_RDWR | O_CREAT, 0644)) < 0) {
+        fprintf(stderr, "Could not open block bitmap: %s\n", path);
+        status = 1;
+        goto end_open_block_bitmap;
+    }
+
+    size = get_file_size(blocks->fd);
+    if (size != blocks->map_size && ftruncate(blocks->fd, blocks->map_size) != 0) {
+        fprintf(stderr, "Could not resize block bitmap: %s\n", path);
+        status = 1;
+        goto end_open_block_bitmap;
+    }
+
+    if (map_file(blocks->fd, blocks->map_size, &blocks->map, false) != 0) {
+        fprintf(stderr, "Could not map block bitmap: %s\n", path);
+        blocks->map = NULL;
+        status = 1;
+        goto end_open_block_bitmap;
+    }
+
+    header = (block_bitmap_header *)blocks->map;
+
+    if (size == blocks->map_size &&
+        header->magic == BLOCK_BITMAP_MAGIC &&
+        header->block_size == blocks->block_size &&
+        header->total_mapstores == ctx->total_mapstores &&
+        header->clean &&
+        memcmp(blocks->map + sizeof(block_bitmap_header), blocks->sizes, ctx->total_mapstores * sizeof(uint64_t)) == 0) {
+        free(blocks->sizes);
+        blocks->sizes = (uint64_t *)(blocks->map + sizeof(block_bitmap_header));
+        checksum_bitmap(blocks, digest);
+        valid = memcmp(digest, header->checksum, SHA256_DIGEST_SIZE) == 0;
+    } else {
+        memcpy(blocks->map + sizeof(block_bitmap_header), blocks->sizes, ctx->total_mapstores * sizeof(uint64_t));
+        free(blocks->sizes);
+        blocks->sizes = (uint64_t *)(blocks->map + sizeof(block_bitmap_header));
+    }
+    blocks->words = (uint64_t *)(blocks->map + header_size);
+
+    // A crash from here on leaves the file unclean
+    header->magic = BLOCK_BITMAP_MAGIC;
+    header->block_size = blocks->block_size;
+    header->total_mapstores = ctx->total_mapstores;
+    header->clean = 0;
+    if (fsync(blocks->fd) != 0) {
+        fprintf(stderr, "Could not sync block bitmap: %s\n", path);
+        status = 1;
+        goto end_open_block_bitmap;
+    }
+
+    if (!valid && rebuild_bitmap(ctx) != 0) {
+        fprintf(stderr, "Could not rebuild block bitmap: %s\n", path);
+        status = 1;
+    }
+
+end_open_block_bitmap:
+    if (status != 0) {
+        close_block_bitmap(ctx, false);
+    }
+
+    return status;
+}
+
+/**
+* Unmap the bitmaps. With clean set they are checksummed and marked clean so
+* the next open can trust them. Otherwise the file is left to be rebuilt.
+*/
+void close_block_bitmap(mapstore_ctx *ctx, bool clean) {
+    mapstore_blocks *blocks = ctx->blocks;
+    block_bitmap_header *header = NULL;
+
+    if (!blocks) {
+        return;
+    }
+
+    if (blocks->map) {
+        if (clean) {
+            header = (block_bitmap_header *)blocks->map;
+            checksum_bitmap(blocks, header->checksum);
+            header->clean = 1;
+        }
+        unmap_file(blocks->map, blocks->map_size);
+    } else {
+        free(blocks->sizes);
+    }
+
+    if (blocks->fd >= 0) {
+        if (clean) {
+            fsync(blocks->fd);
+        }
+        close(blocks->fd);
+    }
+
+    free(blocks->offsets);
+    free(blocks);
+    ctx->blocks = NULL;
+}
+
+static void add_block_position(mapstore_blocks *blocks, json_object *store_positions,
+                               uint64_t pos, uint64_t block, uint64_t length) {
+    uint64_t first = block * blocks->block_size;
+
+    json_object_array_add(store_positions, json_data_positions_array(pos, first, first + length - 1));
+}
+
+/**
+* Place up to length bytes of data starting at offset in one map store. The
+* first free run that holds all of them is used, otherwise free runs are
+* filled from the start of the store. Returns the bytes placed and sets used
+* to the bytes of the blocks taken. Called with the store lock held.
+*/
+uint64_t reserve_blocks(mapstore_ctx *ctx, uint64_t store_id, uint64_t offset, uint64_t length,
+                        json_object *store_positions, uint64_t *used) {
+    mapstore_blocks *blocks = ctx->blocks;
+    uint64_t *words = store_words(blocks, store_id);
+    uint64_t total = store_blocks(blocks, store_id);
+    uint64_t placed = 0;
+    uint64_t bytes = 0;
+    uint64_t end = 0;
+    uint64_t take = 0;
+
+    *used = 0;
+
+    for (uint64_t bit = next_block(words, 0, total, false); bit < total; bit = next_block(words, end, total, false)) {
+        end = next_block(words, bit, total, true);
+
+        if (block_bytes(blocks, store_id, bit, end) >= length) {
+            take = bit + (length + blocks->block_size - 1) / blocks->block_size;
+            add_block_position(blocks, store_positions, offset, bit, length);
+            *used = mark_blocks(blocks, store_id, bit, take, true);
+            return length;
+        }
+    }
+
+    for (uint64_t bit = next_block(words, 0, total, false); bit < total && placed < length;
+         bit = next_block(words, end, total, false)) {
+        end = next_block(words, bit, total, true);
+        bytes = block_bytes(blocks, store_id, bit, end);
+        if (bytes > length - placed) {
+            bytes = length - placed;
+        }
+
+        take = bit + (bytes + blocks->block_size - 1) / blocks->block_size;
+        add_block_position(blocks, store_positions, offset + placed, bit, bytes);
+        *used += mark_blocks(blocks, store_id, bit, take, true);
+        placed += bytes;
+    }
+
+    return placed;
+}
+
+/**
+* Clear the blocks of the extents in store_positions and return their bytes.
+* Called with the store lock held.
+*/
+uint64_t release_blocks(mapstore_ctx *ctx, uint64_t store_id, json_object *store_positions) {
+    mapstore_blocks *blocks = ctx->blocks;
+    json_object *location_array = NULL;
+    uint64_t freed = 0;
+
+    for (uint64_t p = 0; p < json_object_array_length(store_positions); p++) {
+        location_array = json_object_array_get_idx(store_positions, p);
+        freed += mark_blocks(blocks, store_id,
+                             json_object_get_int64(json_object_array_get_idx(location_array, 1)) / blocks->block_size,
+                             json_object_get_int64(json_object_array_get_idx(location_array, 2)) / blocks->block_size + 1,
+                             false);
+    }
+
+    return freed;
+}
+
+/**
+* Punch holes in the blocks of the extents in store_positions that are still
+* free, trimmed to the file's blocks. Called with the store lock held.
+*/
+int punch_blocks(mapstore_ctx *ctx, uint64_t store_id, int store_fd, json_object *store_positions) {
+    mapstore_blocks *blocks = ctx->blocks;
+    uint64_t *words = store_words(blocks, store_id);
+    json_object *location_array = NULL;
+    uint64_t file_block = get_block_size(store_fd);
+    uint64_t first = 0;
+    uint64_t final = 0;
+    uint64_t end = 0;
+    uint64_t start = 0;
+    uint64_t stop = 0;
+    int ret = 0;
+
+    for (uint64_t p = 0; p < json_object_array_length(store_positions) && ret == 0; p++) {
+        location_array = json_object_array_get_idx(store_positions, p);
+        first = json_object_get_int64(json_object_array_get_idx(location_array, 1)) / blocks->block_size;
+        final = json_object_get_int64(json_object_array_get_idx(location_array, 2)) / blocks->block_size + 1;
+        if (final > store_blocks(blocks, store_id)) {
+            final = store_blocks(blocks, store_id);
+        }
+
+        for (uint64_t bit = next_block(words, first, final, false); bit < final && ret == 0;
+             bit = next_block(words, end, final, false)) {
+            end = next_block(words, bit, final, true);
+
+            start = (bit * blocks->block_size + file_block - 1) / file_block * file_block;
+            stop = (bit * blocks->block_size + block_bytes(blocks, store_id, bit, end)) / file_block * file_block;
+            if (stop > start) {
+                ret = punch_hole(store_fd, start, stop - start);
+            }
+        }
+    }
+
+    return ret;
+}
+
+/**
+* Free runs of one map store in the layout of get_store_fragmentation.
+* Called with the store lock held.
+*/
+void block_free_space_info(mapstore_ctx *ctx, uint64_t store_id, free_space_info *info) {
+    mapstore_blocks *blocks = ctx->blocks;
+    uint64_t *words = store_words(blocks, store_id);
+    uint64_t total = store_blocks(blocks, store_id);
+    uint64_t bytes = 0;
+    uint64_t end = 0;
+
+    memset(info, 0, sizeof(free_space_info));
+    info->store_id = store_id;
+    info->size = blocks->sizes[store_id - 1];
+
+    for (uint64_t bit = next_block(words, 0, total, false); bit < total; bit = next_block(words, end, total, false)) {
+        end = next_block(words, bit, total, true);
+        bytes = block_bytes(blocks, store_id, bit, end);
+
+        info->free_space += bytes;
+        info->free_extents++;
+        info->extent_histogram[extent_size_class(bytes)]++;
+        if (bytes > info->largest_free_extent) {
+            info->largest_free_extent = bytes;
+        }
+    }
+}
@@ -0,0 +1,52 @@
+/**
+ * @file block_bitmap.h
+ * @brief Block allocator of the bitmap engine.
+ *
+ * Every map store is split into blocks of block_size bytes, the last one
+ * possibly shorter, and bit n of the store's words is set while block n
+ * holds data. Extents always start on a block and own the rest of their last
+ * block, so placing an object scans words instead of parsing a free list and
+ * freeing it clears bits. The bitmaps are mapped from shards/blocks.bitmap.
+ * The file is marked clean with a checksum when the context is freed. A file
+ * that is not clean, or does not match the map stores, is rebuilt from
+ * data_locations. Only free_space is kept in map_stores.
+ */
+#ifndef MAPSTORE_BLOCK_BITMAP_H
+#define MAPSTORE_BLOCK_BITMAP_H
+
+#include "mapstore.h"
+
+#define BLOCK_BITMAP_MAGIC 0x4d4150424c4f434bULL
+#define BLOCK_BITMAP_FILE "blocks.bitmap"
+
+/**
+* Followed by the size of every map store and then their words. The checksum
+* covers both and is only valid while clean is set.
+*/
+typedef struct  {
+  uint64_t magic;
+  uint64_t block_size;
+  uint64_t total_mapstores;
+  uint64_t clean;
+  uint8_t checksum[SHA256_DIGEST_SIZE];
+} block_bitmap_header;
+
+struct mapstore_blocks {
+  int fd;
+  uint8_t *map;
+  uint64_t map_size;
+  uint64_t block_size;
+  uint64_t *sizes;
+  uint64_t *words;
+  uint64_t *offsets;
+};
+
+int open_block_bitmap(mapstore_ctx *ctx);
+void close_block_bitmap(mapstore_ctx *ctx, bool clean);
+uint64_t reserve_blocks(mapstore_ctx *ctx, uint64_t store_id, uint64_t offset, uint64_t length,
+                        json_object *store_positions, uint64_t *used);
+uint64_t release_blocks(mapstore_ctx *ctx, uint64_t store_id, json_object *store_positions);
+int punch_blocks(mapstore_ctx *ctx, uint64_t store_id, int store_fd, json_object *store_positions);
+void block_free_space_info(mapstore_ctx *ctx, uint64_t store_id, free_space_info *info);
+
+#endif /* MAPSTORE_BLOCK_BITMAP_H */
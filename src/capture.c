@@ -0,0 +1,415 @@
+#include "capture.h"
+#include "metrics.h"
+
+static uint64_t wall_clock_ns() {
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static void hash_to_bytes(char *hash, uint8_t *bytes) {
+    unsigned int byte = 0;
+
+    memset(bytes, 0, CAPTURE_HASH_BYTES);
+    for (int i = 0; i < CAPTURE_HASH_BYTES && hash[2 * i] && hash[2 * i + 1]; i++) {
+        if (sscanf(hash + 2 * i, "%2x", &byte) == 1) {
+            bytes[i] = byte;
+        }
+    }
+}
+
+static void bytes_to_hash(uint8_t *bytes, char *hash) {
+    for (int i = 0; i < CAPTURE_HASH_BYTES; i++) {
+        sprintf(hash + 2 * i, "%02x", bytes[i]);
+    }
+    hash[HASH_LENGTH] = '\0';
+}
+
+static void anonymize_hash(struct mapstore_capture *capture, uint8_t *bytes) {
+    struct sha256_ctx sha256ctx;
+    uint8_t digest[SHA256_DIGEST_SIZE];
+
+    sha256_init(&sha256ctx);
+    sha256_update(&sha256ctx, CAPTURE_SALT_BYTES, capture->salt);
+    sha256_update(&sha256ctx, CAPTURE_HASH_BYTES, bytes);
+    sha256_digest(&sha256ctx, SHA256_DIGEST_SIZE, digest);
+
+    memcpy(bytes, digest, CAPTURE_HASH_BYTES);
+}
+
+static int read_salt(const char *path, uint8_t *salt) {
+    int status = 0;
+    FILE *file = fopen(path, "rb");
+
+    if (!file || fread(salt, 1, CAPTURE_SALT_BYTES, file) != CAPTURE_SALT_BYTES) {
+        fprintf(stderr, "Could not read salt from %s\n", path);
+        status = 1;
+    }
+
+    if (file) {
+        fclose(file);
+    }
+
+    return status;
+}
+
+static int write_salt(const char *path, uint8_t *salt) {
+    int status = 0;
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+
+    if (fd < 0 || write_all(fd, (const char *)salt, CAPTURE_SALT_BYTES) != 0) {
+        fprintf(stderr, "Could not write salt to %s\n", path);
+        status = 1;
+    }
+
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    return status;
+}
+
+static void salt_id(struct mapstore_capture *capture, capture_header *header) {
+    struct sha256_ctx sha256ctx;
+
+    memset(header, 0, sizeof(capture_header));
+    if (!capture->anonymize) {
+        return;
+    }
+
+    sha256_init(&sha256ctx);
+    sha256_update(&sha256ctx, CAPTURE_SALT_BYTES, capture->salt);
+    sha256_digest(&sha256ctx, SHA256_DIGEST_SIZE, header->salt_id);
+}
+
+/**
+* A new capture gets a header and, when anonymized, a new salt. Runs that
+* append must hash the same way as the one that started the capture.
+*/
+static int open_capture_file(struct mapstore_capture *capture, const char *path) {
+    char magic[CAPTURE_MAGIC_LENGTH];
+    char salt_path[strlen(path) + strlen(CAPTURE_SALT_SUFFIX) + 1];
+    capture_header header;
+    capture_header expected;
+
+    sprintf(salt_path, "%s%s", path, CAPTURE_SALT_SUFFIX);
+
+    if (!(capture->file = fopen(path, "a+b"))) {
+        fprintf(stderr, "Could not open capture file: %s\n", path);
+        return 1;
+    }
+
+    fseek(capture->file, 0, SEEK_END);
+    if (ftell(capture->file) == 0) {
+        if (capture->anonymize &&
+            (read_salt("/dev/urandom", capture->salt) != 0 || write_salt(salt_path, capture->salt) != 0)) {
+            return 1;
+        }
+
+        salt_id(capture, &header);
+        if (fwrite(CAPTURE_MAGIC, 1, CAPTURE_MAGIC_LENGTH, capture->file) != CAPTURE_MAGIC_LENGTH ||
+            fwrite(&header, sizeof(capture_header), 1, capture->file) != 1) {
+            fprintf(stderr, "Could not write capture file: %s\n", path);
+            return 1;
+        }
+        return 0;
+    }
+
+    rewind(capture->file);
+    if (fread(magic, 1, CAPTURE_MAGIC_LENGTH, capture->file) != CAPTURE_MAGIC_LENGTH) {
+        fprintf(stderr, "Not a capture file: %s\n", path);
+        return 1;
+    }
+
+    if (memcmp(magic, CAPTURE_MAGIC_V1, CAPTURE_MAGIC_LENGTH) == 0) {
+        fprintf(stderr, "Can't append to a capture from an older version: %s\n", path);
+        return 1;
+    }
+
+    if (memcmp(magic, CAPTURE_MAGIC, CAPTURE_MAGIC_LENGTH) != 0 ||
+        fread(&header, sizeof(capture_header), 1, capture->file) != 1) {
+        fprintf(stderr, "Not a capture file: %s\n", path);
+        return 1;
+    }
+
+    if (capture->anonymize && read_salt(salt_path, capture->salt) != 0) {
+        return 1;
+    }
+
+    salt_id(capture, &expected);
+    if (memcmp(header.salt_id, expected.salt_id, SHA256_DIGEST_SIZE) != 0) {
+        fprintf(stderr, "Capture %s was not written with the same anonymization\n", path);
+        return 1;
+    }
+
+    return 0;
+}
+
+void capture_op(mapstore_ctx *ctx, mapstore_op op, char *hash, uint64_t started, uint64_t bytes, int status) {
+    struct mapstore_capture *capture = ctx->capture;
+    capture_record record;
+
+    if (!capture) {
+        return;
+    }
+
+    memset(&record, 0, sizeof(capture_record));
+    record.duration_ns = uv_hrtime() - started;
+    record.start_ns = wall_clock_ns() - record.duration_ns;
+    record.bytes = bytes;
+    record.op = op;
+    record.status = (status != 0);
+    hash_to_bytes(hash, record.hash);
+
+    if (capture->anonymize) {
+        anonymize_hash(capture, record.hash);
+    }
+
+    uv_mutex_lock(&capture->lock);
+    fwrite(&record, sizeof(capture_record), 1, capture->file);
+    uv_mutex_unlock(&capture->lock);
+}
+
+/**
+* Records are appended, so one capture can span several runs
+*/
+MAPSTORE_API int start_capture(mapstore_ctx *ctx, const char *path, bool anonymize) {
+    int status = 0;
+    struct mapstore_capture *capture = NULL;
+
+    if (ctx->capture) {
+        fprintf(stderr, "Capture already started\n");
+        return 1;
+    }
+
+    if (!(capture = calloc(1, sizeof(struct mapstore_capture)))) {
+        return 1;
+    }
+
+    capture->anonymize = anonymize;
+    if (open_capture_file(capture, path) != 0) {
+        status = 1;
+        goto end_start_capture;
+    }
+
+    if (uv_mutex_init(&capture->lock) != 0) {
+        status = 1;
+        goto end_start_capture;
+    }
+
+    ctx->capture = capture;
+
+end_start_capture:
+    if (status != 0) {
+        if (capture->file) {
+            fclose(capture->file);
+        }
+        free(capture);
+    }
+
+    return status;
+}
+
+MAPSTORE_API int stop_capture(mapstore_ctx *ctx) {
+    int status = 0;
+    struct mapstore_capture *capture = ctx->capture;
+
+    if (!capture) {
+        return 0;
+    }
+
+    ctx->capture = NULL;
+
+    if (fclose(capture->file) != 0) {
+        fprintf(stderr, "Could not write capture file\n");
+        status = 1;
+    }
+
+    uv_mutex_destroy(&capture->lock);
+    free(capture);
+
+    return status;
+}
+
+/**
+* Grow the scratch file data is stored from. Contents don't matter since the
+* hash is taken from the capture.
+*/
+static int fill_replay_data(int fd, uint64_t *filled, uint64_t size) {
+    char buf[BUFSIZ];
+    uint64_t length = 0;
+
+    for (int i = 0; i < BUFSIZ; i++) {
+        buf[i] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ"[rand() % 26];
+    }
+
+    while (*filled < size) {
+        length = (size - *filled > BUFSIZ) ? BUFSIZ : size - *filled;
+        if (pwrite(fd, buf, length, *filled) != length) {
+            fprintf(stderr, "Could not write replay data\n");
+            return 1;
+        }
+        *filled += length;
+    }
+
+    return 0;
+}
+
+static void sleep_until(uint64_t target) {
+    uint64_t now = uv_hrtime();
+    struct timespec wait;
+
+    if (target <= now) {
+        return;
+    }
+
+    wait.tv_sec = (target - now) / 1000000000ULL;
+    wait.tv_nsec = (target - now) % 1000000000ULL;
+    nanosleep(&wait, NULL);
+}
+
+/**
+* Drive the store with a capture. Speed 1 keeps the original pacing, 2 runs
+* twice as fast and 0 issues calls back to back. Data retrieved or deleted
+* before it was stored in the capture is stored first and not timed.
+*/
+MAPSTORE_API int replay_capture(mapstore_ctx *ctx, const char *path, double speed, replay_report *report) {
+    int status = 0;
+    int op_status = 0;
+    int data_fd = -1;
+    int output_fd = -1;
+    char magic[CAPTURE_MAGIC_LENGTH];
+    char hash[HASH_LENGTH + 1];
+    char data_path[BUFSIZ];
+    char output_path[BUFSIZ];
+    uint64_t filled = 0;
+    uint64_t first_ns = 0;
+    uint64_t began = 0;
+    uint64_t started = 0;
+    bool first = true;
+    FILE *file = NULL;
+    mapstore_metrics *latencies = NULL;
+    capture_header header;
+    capture_record record;
+    data_info info;
+
+    memset(report, 0, sizeof(replay_report));
+
+    if (!(file = fopen(path, "rb"))) {
+        fprintf(stderr, "Could not open capture file: %s\n", path);
+        return 1;
+    }
+
+    /* Captures from before the header was added are still replayed */
+    if (fread(magic, 1, CAPTURE_MAGIC_LENGTH, file) != CAPTURE_MAGIC_LENGTH ||
+        (memcmp(magic, CAPTURE_MAGIC_V1, CAPTURE_MAGIC_LENGTH) != 0 &&
+         (memcmp(magic, CAPTURE_MAGIC, CAPTURE_MAGIC_LENGTH) != 0 ||
+          fread(&header, sizeof(capture_header), 1, file) != 1))) {
+        fprintf(stderr, "Not a capture file: %s\n", path);
+        status = 1;
+        goto end_replay;
+    }
+
+    memset(data_path, '\0', BUFSIZ);
+    sprintf(data_path, "%s%c%s", ctx->base_path, separator(), REPLAY_DATA);
+    memset(output_path, '\0', BUFSIZ);
+    sprintf(output_path, "%s%c%s", ctx->base_path, separator(), REPLAY_OUTPUT);
+
+    if ((data_fd = open(data_path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0 ||
+        (output_fd = open(output_path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+        fprintf(stderr, "Could not open replay scratch files in %s\n", ctx->base_path);
+        status = 1;
+        goto end_replay;
+    }
+
+    if (!(latencies = calloc(1, sizeof(mapstore_metrics)))) {
+        status = 1;
+        goto end_replay;
+    }
+
+    began = uv_hrtime();
+
+    while (fread(&record, sizeof(capture_record), 1, file) == 1) {
+        if (record.op >= MAPSTORE_OPS) {
+            continue;
+        }
+
+        if (first) {
+            first_ns = record.start_ns;
+            first = false;
+        }
+
+        if (speed > 0 && record.start_ns > first_ns) {
+            sleep_until(began + (uint64_t)((record.start_ns - first_ns) / speed));
+        }
+
+        bytes_to_hash(record.hash, hash);
+
+        if (record.op != MAPSTORE_OP_STORE && record.status == 0) {
+            if (get_data_info(ctx, hash, &info) == 0) {
+                free(info.hash);
+            } else if (fill_replay_data(data_fd, &filled, record.bytes) != 0 ||
+                       store_data(ctx, data_fd, record.bytes, hash) != 0) {
+                fprintf(stderr, "Could not prepare data for replay: %s\n", hash);
+            }
+        }
+
+        if (record.op == MAPSTORE_OP_STORE && fill_replay_data(data_fd, &filled, record.bytes) != 0) {
+            status = 1;
+            goto end_replay;
+        }
+
+        started = uv_hrtime();
+        switch (record.op) {
+            case MAPSTORE_OP_STORE:
+                op_status = store_data(ctx, data_fd, record.bytes, hash);
+                break;
+            case MAPSTORE_OP_RETRIEVE:
+                op_status = retrieve_data(ctx, output_fd, hash);
+                break;
+            case MAPSTORE_OP_DELETE:
+                op_status = delete_data(ctx, hash);
+                break;
+        }
+        metrics_record(&latencies->ops[record.op], uv_hrtime() - started, record.bytes, op_status);
+
+        report->operations++;
+        if (op_status != 0) {
+            report->errors++;
+        } else {
+            report->bytes += record.bytes;
+        }
+    }
+
+    report->elapsed_ns = uv_hrtime() - began;
+    if (report->elapsed_ns > 0) {
+        report->operations_per_second = report->operations * 1e9 / report->elapsed_ns;
+        report->bytes_per_second = report->bytes * 1e9 / report->elapsed_ns;
+    }
+
+    for (int op = 0; op < MAPSTORE_OPS; op++) {
+        metrics_summarize(&latencies->ops[op], &report->ops[op]);
+    }
+
+end_replay:
+    if (file) {
+        fclose(file);
+    }
+
+    if (data_fd >= 0) {
+        close(data_fd);
+        remove(data_path);
+    }
+
+    if (output_fd >= 0) {
+        close(output_fd);
+        remove(output_path);
+    }
+
+    if (latencies) {
+        free(latencies);
+    }
+
+    return status;
+}
@@ -0,0 +1,58 @@
+/**
+ * @file capture.h
+ * @brief Map Store workload capture and replay.
+ *
+ * A capture file starts with CAPTURE_MAGIC and a capture_header, followed by
+ * fixed size records, one per store, retrieve or delete call, in host byte
+ * order. Hashes are kept as 20 raw bytes. Anonymized captures replace them
+ * with a salted SHA-256 so the same hash always maps to the same value within
+ * one capture. The salt is kept next to the capture in a .salt file, which is
+ * not needed for replay and should not be shared with it. The header only
+ * identifies the salt, so runs appending to the capture reuse the same one.
+ */
+#ifndef MAPSTORE_CAPTURE_H
+#define MAPSTORE_CAPTURE_H
+
+#include <time.h>
+#include <nettle/sha2.h>
+
+#include "mapstore.h"
+
+#define CAPTURE_MAGIC "MSCAPT02"
+#define CAPTURE_MAGIC_V1 "MSCAPT01"
+#define CAPTURE_MAGIC_LENGTH 8
+#define CAPTURE_HASH_BYTES (HASH_LENGTH / 2)
+#define CAPTURE_SALT_BYTES 32
+#define CAPTURE_SALT_SUFFIX ".salt"
+#define REPLAY_DATA "replay.data"
+#define REPLAY_OUTPUT "replay.out"
+
+/**
+* salt_id is the SHA-256 of the salt, or zero when hashes are not anonymized
+*/
+typedef struct  {
+  uint8_t salt_id[SHA256_DIGEST_SIZE];
+} capture_header;
+
+typedef struct  {
+  uint64_t start_ns;
+  uint64_t duration_ns;
+  uint64_t bytes;
+  uint8_t op;
+  uint8_t status;
+  uint8_t reserved[2];
+  uint8_t hash[CAPTURE_HASH_BYTES];
+} capture_record;
+
+struct mapstore_capture {
+  FILE *file;
+  uv_mutex_t lock;
+  bool anonymize;
+  uint8_t salt[CAPTURE_SALT_BYTES];
+};
+
+#define capture_now(ctx) ((ctx)->capture ? uv_hrtime() : 0)
+
+void capture_op(mapstore_ctx *ctx, mapstore_op op, char *hash, uint64_t started, uint64_t bytes, int status);
+
+#endif /* MAPSTORE_CAPTURE_H */
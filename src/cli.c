@@ -1,27 +1,529 @@
 #include "cli_helper.h"
 #include "mapstore.h"
+#include "server.h"
 
 static inline void noop() {};
 
 #define HELP_TEXT "usage: mapstore [<options>] <command> [<args>]\n\n"         \
     "These are common mapstore commands for various situations:\n\n"           \
     "  store <data-path>         store file\n"                                 \
-    "  stream <hash>             stream data into store\n"                     \
+    "  stream <hash|-> [<size>]  stream data into store\n"                     \
     "  retrieve <hash>           retrieve data from map store\n"               \
     "  delete <hash>             delete data from map store\n"                 \
-    "  restructure               chaange store size and/or compact store\n"    \
+    "  prefetch <hash>...        read data into the page cache\n"              \
+    "  evict <hash>...           drop data from the page cache\n"              \
+    "  restructure [<map> <alloc>] change store size and/or compact store\n"  \
+    "  gc                        rewrite log segments holding dead data\n"   \
     "  get-data-info <hash>      retrieve data info from map store\n"          \
     "  get-store-info            retrieve store info from map store\n"         \
+    "  get-fragmentation-info    report free space fragmentation\n"          \
+    "  replay <capture> [<speed>] replay a captured workload\n"               \
+    "  serve <socket>            serve the store on a Unix socket\n"         \
+    "  stats [<cmd> [<args>]]    run cmd and print latency metrics\n"         \
     "  help                      display help for [cmd]\n\n"                   \
     "options:\n"                                                               \
     "  -p, --path <path>         path to mapstore\n"                           \
     "  -r, --prealloc            if mapstore should be preallocated files\n"   \
     "  -a, --alloc <path>        total size of store\n"                        \
     "  -m, --map <path>          max file size for maps in store\n"            \
+    "  -M, --multi-process       share the store with other processes\n"      \
+    "  -s, --shards <count>      metadata databases for a new store\n"        \
+    "  -c, --capture <file>      append operations to a capture file\n"      \
+    "  -A, --anonymize           replace hashes in the capture\n"           \
+    "  -S, --socket <path>       send the command to a mapstore server\n"    \
+    "  -j, --jobs <count>        store files on count threads\n"            \
+    "  -D, --direct-io <bytes>   bypass the page cache for larger objects\n" \
+    "  -P, --punch-holes         give deleted space back to the filesystem\n" \
+    "  -L, --lazy <threads>      create map files in the background\n"      \
+    "  -I, --inline <bytes>      keep smaller objects in the metadata\n"    \
+    "  -E, --engine <name>       allocate with extent (default), log or bitmap\n" \
+    "  -B, --block-size <bytes>  block size of the bitmap engine\n"      \
+    "  -C, --slab-classes <list> comma separated object sizes to slab\n"   \
+    "  -N, --no-verify           skip checking extent checksums on read\n" \
     "  -h, --help                output usage information\n"                   \
     "  -v, --version             output the version number\n"                  \
 
 #define CLI_VERSION "1.0.0"
+#define STORE_PROGRESS_NS 1000000000
+#define CLI_SLAB_CLASSES 16
+
+static json_object *latency_summary_json(latency_summary *summary) {
+    json_object *obj = json_object_new_object();
+
+    json_object_object_add(obj, "count", json_object_new_int64(summary->count));
+    json_object_object_add(obj, "errors", json_object_new_int64(summary->errors));
+    json_object_object_add(obj, "bytes", json_object_new_int64(summary->bytes));
+    json_object_object_add(obj, "total_ns", json_object_new_int64(summary->total_ns));
+    json_object_object_add(obj, "max_ns", json_object_new_int64(summary->max_ns));
+    json_object_object_add(obj, "p50_ns", json_object_new_int64(summary->p50_ns));
+    json_object_object_add(obj, "p90_ns", json_object_new_int64(summary->p90_ns));
+    json_object_object_add(obj, "p99_ns", json_object_new_int64(summary->p99_ns));
+    json_object_object_add(obj, "p999_ns", json_object_new_int64(summary->p999_ns));
+
+    return obj;
+}
+
+static int print_store_metrics(mapstore_ctx *ctx) {
+    store_metrics metrics;
+    json_object *report = NULL;
+    json_object *ops = NULL;
+    json_object *phases = NULL;
+
+    if (get_store_metrics(ctx, &metrics) != 0) {
+        return 1;
+    }
+
+    report = json_object_new_object();
+    ops = json_object_new_object();
+    phases = json_object_new_object();
+
+    for (int op = 0; op < MAPSTORE_OPS; op++) {
+        json_object_object_add(ops, mapstore_op_name(op), latency_summary_json(&metrics.ops[op]));
+    }
+
+    for (int phase = 0; phase < MAPSTORE_PHASES; phase++) {
+        json_object_object_add(phases, mapstore_phase_name(phase), latency_summary_json(&metrics.phases[phase]));
+    }
+
+    json_object_object_add(report, "operations", ops);
+    json_object_object_add(report, "phases", phases);
+    json_object_object_add(report, "startup_ns", json_object_new_int64(metrics.startup_ns));
+    json_object_object_add(report, "map_files_ns", json_object_new_int64(metrics.map_files_ns));
+    json_object_object_add(report, "pending_map_stores", json_object_new_int64(metrics.pending_map_stores));
+    fprintf(stdout, "%s\n", json_object_to_json_string(report));
+    json_object_put(report);
+
+    return 0;
+}
+
+static json_object *free_space_info_json(free_space_info *info) {
+    json_object *obj = json_object_new_object();
+    json_object *histogram = json_object_new_object();
+    char size_class[MAX_UINT64_STR + 1];
+
+    /* Only size classes with free extents, keyed by their smallest size */
+    for (int c = 0; c < EXTENT_SIZE_CLASSES; c++) {
+        if (info->extent_histogram[c] > 0) {
+            sprintf(size_class, "%"PRIu64, (uint64_t)1 << c);
+            json_object_object_add(histogram, size_class, json_object_new_int64(info->extent_histogram[c]));
+        }
+    }
+
+    if (info->store_id > 0) {
+        json_object_object_add(obj, "store_id", json_object_new_int64(info->store_id));
+    }
+    json_object_object_add(obj, "size", json_object_new_int64(info->size));
+    json_object_object_add(obj, "free_space", json_object_new_int64(info->free_space));
+    json_object_object_add(obj, "free_extents", json_object_new_int64(info->free_extents));
+    json_object_object_add(obj, "largest_free_extent", json_object_new_int64(info->largest_free_extent));
+    json_object_object_add(obj, "fragmentation_index", json_object_new_double(info->fragmentation_index));
+    json_object_object_add(obj, "extent_histogram", histogram);
+
+    return obj;
+}
+
+static int print_fragmentation_info(mapstore_ctx *ctx) {
+    fragmentation_info info;
+    json_object *report = NULL;
+    json_object *stores = NULL;
+
+    if (get_fragmentation_info(ctx, &info) != 0) {
+        return 1;
+    }
+
+    report = free_space_info_json(&info.total);
+    stores = json_object_new_array();
+
+    for (uint64_t s = 0; s < info.total_stores; s++) {
+        json_object_array_add(stores, free_space_info_json(&info.stores[s]));
+    }
+
+    json_object_object_add(report, "objects", json_object_new_int64(info.objects));
+    json_object_object_add(report, "average_object_extents", json_object_new_double(info.average_object_extents));
+    json_object_object_add(report, "max_object_extents", json_object_new_int64(info.max_object_extents));
+    json_object_object_add(report, "stores", stores);
+    fprintf(stdout, "%s\n", json_object_to_json_string(report));
+
+    json_object_put(report);
+    fragmentation_info_free(&info);
+
+    return 0;
+}
+
+static int print_replay_report(replay_report *report) {
+    json_object *obj = json_object_new_object();
+    json_object *ops = json_object_new_object();
+
+    for (int op = 0; op < MAPSTORE_OPS; op++) {
+        json_object_object_add(ops, mapstore_op_name(op), latency_summary_json(&report->ops[op]));
+    }
+
+    json_object_object_add(obj, "operations", json_object_new_int64(report->operations));
+    json_object_object_add(obj, "errors", json_object_new_int64(report->errors));
+    json_object_object_add(obj, "bytes", json_object_new_int64(report->bytes));
+    json_object_object_add(obj, "elapsed_ns", json_object_new_int64(report->elapsed_ns));
+    json_object_object_add(obj, "operations_per_second", json_object_new_double(report->operations_per_second));
+    json_object_object_add(obj, "bytes_per_second", json_object_new_double(report->bytes_per_second));
+    json_object_object_add(obj, "latency", ops);
+    fprintf(stdout, "%s\n", json_object_to_json_string(obj));
+    json_object_put(obj);
+
+    return 0;
+}
+
+static int print_gc_report(gc_report *report) {
+    json_object *obj = json_object_new_object();
+
+    json_object_object_add(obj, "segments", json_object_new_int64(report->segments));
+    json_object_object_add(obj, "objects", json_object_new_int64(report->objects));
+    json_object_object_add(obj, "bytes", json_object_new_int64(report->bytes));
+    fprintf(stdout, "%s\n", json_object_to_json_string(obj));
+    json_object_put(obj);
+
+    return 0;
+}
+
+static int glob_paths(int argc, char **argv, int first, glob_t *results) {
+    int flags = 0;
+    int ret = 0;
+
+    for (int i = first; i < argc; i++) {
+        flags |= (i > first ? GLOB_APPEND : 0);
+
+        if ((ret = glob(argv[i], flags, 0, results)) != 0) {
+            fprintf(stderr, "%s: problem with %s (%s), stopping early\n",
+                    argv[0], argv[i],
+                    (ret == GLOB_ABORTED ? "filesystem problem" :
+                     ret == GLOB_NOMATCH ? "no match of pattern" :
+                     ret == GLOB_NOSPACE ? "no dynamic memory" :
+                     "unknown problem"));
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+* Sends every file before reading any response so the server can work on
+* them concurrently
+*/
+static int client_store(int fd, int argc, char **argv, int command_index) {
+    int status = 0;
+    glob_t results;
+    char **hashes = NULL;
+    uint32_t sent = 0;
+    server_frame frame;
+
+    memset(&results, 0, sizeof(glob_t));
+    fprintf(stdout, "Storing data...\n\n");
+
+    if (glob_paths(argc, argv, command_index + 1, &results) != 0) {
+        status = 1;
+        goto end_client_store;
+    }
+
+    if (!(hashes = calloc(results.gl_pathc, sizeof(char *)))) {
+        status = 1;
+        goto end_client_store;
+    }
+
+    for (uint32_t i = 0; i < results.gl_pathc; i++) {
+        FILE *data_file = NULL;
+        struct stat st;
+
+        if (stat(results.gl_pathv[i], &st) == 0 && S_ISDIR(st.st_mode)) {
+            continue;
+        }
+
+        if (!(data_file = fopen(results.gl_pathv[i], "r"))) {
+            fprintf(stderr, "Failed to access data: %s\n", results.gl_pathv[i]);
+            continue;
+        }
+
+        if (get_file_hash(fileno(data_file), &hashes[i]) != 0) {
+            fprintf(stderr, "Failed to get data hash: %s\n", results.gl_pathv[i]);
+            status = 1;
+        } else if (client_send(fd, i, SERVER_OP_STORE, hashes[i], fileno(data_file), st.st_size) != 0) {
+            fclose(data_file);
+            status = 1;
+            break;
+        } else {
+            sent++;
+        }
+
+        fclose(data_file);
+    }
+
+    for (uint32_t r = 0; r < sent; r++) {
+        if (client_receive(fd, &frame, -1) != 0 || frame.id >= results.gl_pathc) {
+            status = 1;
+            break;
+        }
+
+        if (frame.op == 0) {
+            fprintf(stdout, "Successfully stored data: %s\n", hashes[frame.id]);
+        } else {
+            fprintf(stderr, "Failed to store data: %s\n", hashes[frame.id]);
+            status = 1;
+        }
+    }
+
+end_client_store:
+    if (hashes) {
+        for (uint32_t i = 0; i < results.gl_pathc; i++) {
+            free(hashes[i]);
+        }
+        free(hashes);
+    }
+
+    globfree(&results);
+
+    return status;
+}
+
+/**
+* Runs a command against a mapstore server instead of opening the store
+*/
+static int run_client(char *socket_path, int argc, char **argv, int command_index) {
+    int status = 0;
+    int fd = -1;
+    char *command = argv[command_index];
+    char *data_hash = argv[command_index + 1];
+    char *retrieval_path = NULL;
+    int output_fd = STDOUT_FILENO;
+    server_op op;
+    server_frame frame;
+
+    if (strcmp(command, "store") == 0) {
+        op = SERVER_OP_STORE;
+    } else if (strcmp(command, "retrieve") == 0) {
+        op = SERVER_OP_RETRIEVE;
+        retrieval_path = (data_hash) ? argv[command_index + 2] : NULL;
+    } else if (strcmp(command, "delete") == 0) {
+        op = SERVER_OP_DELETE;
+    } else if (strcmp(command, "get-data-info") == 0) {
+        op = SERVER_OP_DATA_INFO;
+    } else if (strcmp(command, "get-store-info") == 0) {
+        op = SERVER_OP_STORE_INFO;
+        data_hash = NULL;
+    } else {
+        fprintf(stderr, "%s is not supported with --socket\n", command);
+        return 1;
+    }
+
+    if (op != SERVER_OP_STORE && op != SERVER_OP_STORE_INFO && data_hash == NULL) {
+        fprintf(stderr, "Missing data hash\n");
+        fprintf(stderr, HELP_TEXT);
+        return 1;
+    }
+
+    if (client_connect(socket_path, &fd) != 0) {
+        return 1;
+    }
+
+    if (op == SERVER_OP_STORE) {
+        status = client_store(fd, argc, argv, command_index);
+        goto end_client;
+    }
+
+    if (retrieval_path && (output_fd = open(retrieval_path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+        fprintf(stderr, "Invalid path: %s\n", retrieval_path);
+        status = 1;
+        goto end_client;
+    }
+
+    if (client_send(fd, 0, op, data_hash, -1, 0) != 0 ||
+        client_receive(fd, &frame, output_fd) != 0) {
+        status = 1;
+        goto end_client;
+    }
+
+    if (frame.op != 0) {
+        fprintf(stderr, "Request failed for %s\n", (data_hash) ? data_hash : command);
+        status = 1;
+    } else if (op == SERVER_OP_RETRIEVE) {
+        fprintf(stderr, "Successfully retrieved data: %s\n", data_hash);
+    } else if (op == SERVER_OP_DELETE) {
+        fprintf(stdout, "Successfully deleted data: %s\n", data_hash);
+    }
+
+end_client:
+    if (output_fd >= 0 && output_fd != STDOUT_FILENO) {
+        close(output_fd);
+    }
+
+    close(fd);
+
+    return status;
+}
+
+/**
+* Files are handed out to the store workers in glob order
+*/
+typedef struct  {
+  mapstore_ctx *ctx;
+  glob_t *results;
+  uint64_t next;
+  uint64_t stored;
+  uint64_t failed;
+  uint64_t bytes;
+  uint64_t finished;
+  uv_mutex_t lock;
+  uv_cond_t done;
+} store_pool;
+
+static int store_path(mapstore_ctx *ctx, char *data_path, uint64_t *bytes) {
+    int status = 0;
+    FILE *data_file = NULL;
+    char *data_hash = NULL;
+    struct stat st;
+
+    /* Don't read directories */
+    if (stat(data_path, &st) == 0 && S_ISDIR(st.st_mode)) {
+        return 0;
+    }
+
+    if (!(data_file = fopen(data_path, "r"))) {
+        fprintf(stderr, "Failed to access data: %s\n", data_path);
+        return 1;
+    }
+
+    if (store_data_hashed(ctx, fileno(data_file), 0, NULL, &data_hash) != 0) {
+        fprintf(stderr, "Failed to store data: %s\n", (data_hash) ? data_hash : data_path);
+        status = 1;
+    } else {
+        fprintf(stdout, "Successfully stored data: %s\n", data_hash);
+        *bytes = st.st_size;
+    }
+
+    fclose(data_file);
+
+    if (data_hash) {
+        free(data_hash);
+    }
+
+    return status;
+}
+
+static void store_worker(void *arg) {
+    store_pool *pool = arg;
+    uint64_t file = 0;
+    uint64_t bytes = 0;
+    int status = 0;
+
+    for (;;) {
+        uv_mutex_lock(&pool->lock);
+        file = pool->next++;
+        uv_mutex_unlock(&pool->lock);
+
+        if (file >= pool->results->gl_pathc) {
+            break;
+        }
+
+        bytes = 0;
+        status = store_path(pool->ctx, pool->results->gl_pathv[file], &bytes);
+
+        uv_mutex_lock(&pool->lock);
+        if (status == 0) {
+            pool->stored++;
+            pool->bytes += bytes;
+        } else {
+            pool->failed++;
+        }
+        uv_mutex_unlock(&pool->lock);
+    }
+
+    uv_mutex_lock(&pool->lock);
+    pool->finished++;
+    uv_cond_signal(&pool->done);
+    uv_mutex_unlock(&pool->lock);
+}
+
+/**
+* Hashes and stores files on jobs threads. Metadata is committed about once
+* per STORE_PROGRESS_NS and progress is reported on stderr at the same time.
+*/
+static int store_parallel(mapstore_ctx *ctx, glob_t *results, int jobs) {
+    int status = 0;
+    int started = 0;
+    bool batching = false;
+    uint64_t began = uv_hrtime();
+    uint64_t elapsed = 0;
+    uv_thread_t *workers = NULL;
+    store_pool pool;
+
+    memset(&pool, 0, sizeof(store_pool));
+    pool.ctx = ctx;
+    pool.results = results;
+
+    if (!(workers = calloc(jobs, sizeof(uv_thread_t))) ||
+        uv_mutex_init(&pool.lock) != 0) {
+        free(workers);
+        return 1;
+    }
+
+    if (uv_cond_init(&pool.done) != 0) {
+        uv_mutex_destroy(&pool.lock);
+        free(workers);
+        return 1;
+    }
+
+    /* Shared or sharded stores commit every call on its own */
+    batching = !ctx->multi_process && ctx->shards.total == 1 && mapstore_begin_batch(ctx) == 0;
+
+    for (started = 0; started < jobs; started++) {
+        if (uv_thread_create(&workers[started], store_worker, &pool) != 0) {
+            fprintf(stderr, "Could not start store worker\n");
+            status = 1;
+            break;
+        }
+    }
+
+    uv_mutex_lock(&pool.lock);
+    pool.finished += jobs - started;
+    while (pool.finished < jobs) {
+        if (uv_cond_timedwait(&pool.done, &pool.lock, STORE_PROGRESS_NS) != UV_ETIMEDOUT) {
+            continue;
+        }
+
+        elapsed = uv_hrtime() - began;
+        fprintf(stderr, "Stored %"PRIu64" of %zu files, %"PRIu64" failed, %.1f MB/s\n",
+                pool.stored, results->gl_pathc, pool.failed,
+                pool.bytes / 1e6 / (elapsed / 1e9));
+        uv_mutex_unlock(&pool.lock);
+
+        if (batching && (mapstore_end_batch(ctx) != 0 || mapstore_begin_batch(ctx) != 0)) {
+            status = 1;
+            batching = false;
+        }
+
+        uv_mutex_lock(&pool.lock);
+    }
+    uv_mutex_unlock(&pool.lock);
+
+    for (int i = 0; i < started; i++) {
+        uv_thread_join(&workers[i]);
+    }
+
+    if (batching && mapstore_end_batch(ctx) != 0) {
+        status = 1;
+    }
+
+    elapsed = uv_hrtime() - began;
+    fprintf(stderr, "Stored %"PRIu64" of %zu files, %"PRIu64" failed in %.1fs\n",
+            pool.stored, results->gl_pathc, pool.failed, elapsed / 1e9);
+
+    if (pool.failed > 0) {
+        status = 1;
+    }
+
+    uv_cond_destroy(&pool.done);
+    uv_mutex_destroy(&pool.lock);
+    free(workers);
+
+    return status;
+}
 
 int main (int argc, char **argv)
 {
@@ -34,6 +536,24 @@ int main (int argc, char **argv)
     uint64_t allocation_size = 0;
     uint64_t map_size = 0;
     int prealloc = false;
+    int multi_process = false;
+    uint64_t metadata_shards = 0;
+    bool print_stats = false;
+    char *capture_path = NULL;
+    int anonymize = false;
+    char *socket_path = NULL;
+    int jobs = 1;
+    uint64_t direct_io_threshold = 0;
+    int punch_holes = false;
+    int lazy_create = false;
+    uint64_t create_threads = 0;
+    uint64_t inline_threshold = 0;
+    mapstore_engine engine = MAPSTORE_ENGINE_EXTENT;
+    uint64_t slab_classes[CLI_SLAB_CLASSES];
+    uint64_t total_slab_classes = 0;
+    char *slab_class = NULL;
+    uint64_t block_size = 0;
+    int skip_verify = false;
 
     static struct option cmd_options[] = {
         {"version", no_argument,  0, 'v'},
@@ -41,13 +561,27 @@ int main (int argc, char **argv)
         {"alloc", required_argument,  0, 'a'},
         {"map", required_argument,  0, 'm'},
         {"path", required_argument,  0, 'p'},
+        {"multi-process", no_argument,  0, 'M'},
+        {"shards", required_argument,  0, 's'},
+        {"capture", required_argument,  0, 'c'},
+        {"anonymize", no_argument,  0, 'A'},
+        {"socket", required_argument,  0, 'S'},
+        {"jobs", required_argument,  0, 'j'},
+        {"direct-io", required_argument,  0, 'D'},
+        {"punch-holes", no_argument,  0, 'P'},
+        {"lazy", required_argument,  0, 'L'},
+        {"inline", required_argument,  0, 'I'},
+        {"engine", required_argument,  0, 'E'},
+        {"slab-classes", required_argument,  0, 'C'},
+        {"block-size", required_argument,  0, 'B'},
+        {"no-verify", no_argument,  0, 'N'},
         {"help", no_argument,  0, 'h'},
         {0, 0, 0, 0}
     };
 
     opterr = 0;
 
-    while ((c = getopt_long_only(argc, argv, "hdl:p:vV:",
+    while ((c = getopt_long_only(argc, argv, "hdl:p:vV:ra:m:Ms:c:AS:j:D:PL:I:E:C:B:N",
                                  cmd_options, &index)) != -1) {
         switch (c) {
             case 'l':
@@ -68,6 +602,59 @@ int main (int argc, char **argv)
             case 'r':
                 prealloc = true;
                 break;
+            case 'M':
+                multi_process = true;
+                break;
+            case 's':
+                metadata_shards = strtoull(optarg, NULL, 10);
+                break;
+            case 'c':
+                capture_path = optarg;
+                break;
+            case 'A':
+                anonymize = true;
+                break;
+            case 'S':
+                socket_path = optarg;
+                break;
+            case 'j':
+                jobs = atoi(optarg);
+                break;
+            case 'D':
+                direct_io_threshold = strtoull(optarg, NULL, 10);
+                break;
+            case 'P':
+                punch_holes = true;
+                break;
+            case 'L':
+                lazy_create = true;
+                create_threads = strtoull(optarg, NULL, 10);
+                break;
+            case 'I':
+                inline_threshold = strtoull(optarg, NULL, 10);
+                break;
+            case 'E':
+                if (strcmp(optarg, "log") == 0) {
+                    engine = MAPSTORE_ENGINE_LOG;
+                } else if (strcmp(optarg, "bitmap") == 0) {
+                    engine = MAPSTORE_ENGINE_BITMAP;
+                } else if (strcmp(optarg, "extent") != 0) {
+                    fprintf(stderr, "Unknown engine: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'C':
+                for (slab_class = strtok(optarg, ","); slab_class && total_slab_classes < CLI_SLAB_CLASSES;
+                     slab_class = strtok(NULL, ",")) {
+                    slab_classes[total_slab_classes++] = strtoull(slab_class, NULL, 10);
+                }
+                break;
+            case 'B':
+                block_size = strtoull(optarg, NULL, 10);
+                break;
+            case 'N':
+                skip_verify = true;
+                break;
             case 'V':
             case 'v':
                 fprintf(stdout, CLI_VERSION "\n\n");
@@ -98,40 +685,70 @@ int main (int argc, char **argv)
         return 0;
     }
 
+    if (socket_path) {
+        return run_client(socket_path, argc, argv, command_index);
+    }
+
     mapstore_ctx ctx;
     mapstore_opts opts;
 
+    memset(&opts, 0, sizeof(mapstore_opts));
     opts.allocation_size = (allocation_size > 0) ? allocation_size : 10737418240; // 10GB
     opts.map_size = (map_size > 0) ? map_size : 2147483648;         // 2GB
     opts.path = (mapstore_path != NULL) ? strdup(mapstore_path) : NULL;
     opts.prealloc = prealloc;
+    opts.multi_process = multi_process;
+    opts.metadata_shards = metadata_shards;
+    opts.direct_io_threshold = direct_io_threshold;
+    opts.punch_holes = punch_holes;
+    opts.lazy_create = lazy_create;
+    opts.create_threads = create_threads;
+    opts.inline_threshold = inline_threshold;
+    opts.engine = engine;
+    opts.slab_classes = slab_classes;
+    opts.total_slab_classes = total_slab_classes;
+    opts.block_size = block_size;
+    opts.skip_verify = skip_verify;
 
     if (initialize_mapstore(&ctx, opts) != 0) {
         fprintf(stderr, "Error initializing mapstore\n");
         return 1;
     }
 
+    if (capture_path && start_capture(&ctx, capture_path, anonymize) != 0) {
+        fprintf(stderr, "Error starting capture\n");
+        status = 1;
+        goto end_program;
+    }
+
+    /**
+     * Run the following command and print metrics collected while it ran
+     */
+    if (strcmp(command, "stats") == 0) {
+        print_stats = true;
+        command_index++;
+        command = argv[command_index];
+
+        if (!command) {
+            goto end_program;
+        }
+    }
+
     /**
      * Store File
      */
     if (strcmp(command, "store") == 0) {
         fprintf(stdout, "Storing data...\n\n");
-        int flags = 0;
         glob_t results;
         int ret = 0;
 
-        for (int i = command_index + 1; i < argc; i++) {
-            flags |= (i > command_index + 1 ? GLOB_APPEND : 0);
+        if (glob_paths(argc, argv, command_index + 1, &results) != 0) {
+            goto end_store;
+        }
 
-            if ((ret = glob(argv[i], flags, 0, &results)) != 0) {
-    			fprintf(stderr, "%s: problem with %s (%s), stopping early\n",
-    				argv[0], argv[i],
-    		        (ret == GLOB_ABORTED ? "filesystem problem" :
-    				 ret == GLOB_NOMATCH ? "no match of pattern" :
-    				 ret == GLOB_NOSPACE ? "no dynamic memory" :
-    				 "unknown problem"));
-                goto end_store;
-    		}
+        if (jobs > 1) {
+            status = store_parallel(&ctx, &results, jobs);
+            goto end_store;
         }
 
         for (int i = 0; i < results.gl_pathc; i++) {
@@ -154,14 +771,10 @@ int main (int argc, char **argv)
                 continue;
             }
 
-            if ((ret = get_file_hash(fileno(data_file), &data_hash)) != 0) {
-                fprintf(stderr, "Failed to get data hash: %s\n", data_path);
+            /* The hash is computed while the data is written */
+            if ((ret = store_data_hashed(&ctx, fileno(data_file), 0, NULL, &data_hash)) != 0) {
+                fprintf(stderr, "Failed to store data: %s\n", (data_hash) ? data_hash : data_path);
                 status = 1;
-            } else {
-                if ((ret = store_data(&ctx, fileno(data_file), 0, data_hash)) != 0) {
-                    fprintf(stderr, "Failed to store data: %s\n", data_hash);
-                    status = 1;
-                }
             }
 
             if (status == 0) {
@@ -255,6 +868,21 @@ end_retrieve:
             goto end_program;
         }
 
+        /* A hash of - is computed from the data as it is stored */
+        if (strcmp(data_hash, "-") == 0) {
+            char *stored_hash = NULL;
+
+            if (store_data_hashed(&ctx, STDIN_FILENO, data_size, NULL, &stored_hash) != 0) {
+                fprintf(stderr, "Failed to store data: %s\n", (stored_hash) ? stored_hash : data_hash);
+                status = 1;
+            } else {
+                fprintf(stderr, "Successfully stored data: %s\n", stored_hash);
+            }
+
+            free(stored_hash);
+            goto end_program;
+        }
+
         if (store_data(&ctx, STDIN_FILENO, data_size, data_hash) != 0) {
             fprintf(stderr, "Failed to store data: %s\n", data_hash);
             status = 1;
@@ -265,12 +893,39 @@ end_retrieve:
         goto end_program;
     }
 
+    if (strcmp(command, "prefetch") == 0 || strcmp(command, "evict") == 0) {
+        char **hashes = &argv[command_index + 1];
+        uint64_t count = argc - command_index - 1;
+        bool prefetch = strcmp(command, "prefetch") == 0;
+
+        if (count == 0) {
+            fprintf(stderr, "Missing data hash\n");
+            fprintf(stderr, HELP_TEXT);
+            status = 1;
+            goto end_program;
+        }
+
+        status = (prefetch) ? mapstore_prefetch(&ctx, hashes, count) : mapstore_evict(&ctx, hashes, count);
+        if (status != 0) {
+            fprintf(stderr, "Failed to %s some data\n", command);
+            goto end_program;
+        }
+
+        fprintf(stderr, "Successfully %s %"PRIu64" objects\n", (prefetch) ? "prefetched" : "evicted", count);
+        goto end_program;
+    }
+
     if (strcmp(command, "get-data-info") == 0) {
         char *data_hash = argv[command_index + 1];
 
         data_info info;
+        char *json = NULL;
         if ((status = get_data_info(&ctx, data_hash, &info)) == 0) {
-            fprintf(stdout, "{ \"hash\": \"%s\", \"size\": %"PRIu64" }\n", info.hash, info.size);
+            if ((json = data_info_json(&info))) {
+                fprintf(stdout, "%s", json);
+                free(json);
+            }
+            free(info.hash);
         } else {
             fprintf(stderr, "Hash %s does not exist in store.\n", data_hash);
         }
@@ -282,6 +937,11 @@ end_retrieve:
         uint64_t new_map_size = ctx.map_size;
         uint64_t new_allocation_size = ctx.allocation_size;
 
+        if (argv[command_index + 1] && argv[command_index + 2]) {
+            new_map_size = strtoull(argv[command_index + 1], NULL, 10);
+            new_allocation_size = strtoull(argv[command_index + 2], NULL, 10);
+        }
+
         if ((status = restructure(&ctx, new_map_size, new_allocation_size)) != 0) {
             status = 1;
             fprintf(stderr, "Failed to restructure\n");
@@ -292,23 +952,26 @@ end_retrieve:
         goto end_program;
     }
 
+    if (strcmp(command, "gc") == 0) {
+        gc_report report;
+
+        if ((status = mapstore_gc(&ctx, &report)) != 0) {
+            fprintf(stderr, "Failed to collect log segments\n");
+            goto end_program;
+        }
+
+        print_gc_report(&report);
+        goto end_program;
+    }
+
     if (strcmp(command, "get-store-info") == 0) {
         store_info info;
+        char *json = NULL;
         if ((status = get_store_info(&ctx, &info)) == 0) {
-            fprintf(stdout,
-                    "{ \"free_space\": %"PRIu64", "    \
-                    "\"used_space\": %"PRIu64", "     \
-                    "\"allocation_size\": %"PRIu64", "\
-                    "\"map_size\": %"PRIu64", "       \
-                    "\"data_count\": %"PRIu64", "     \
-                    "\"total_stores\": %"PRIu64" "    \
-                    "}\n",                            \
-                    info.free_space,
-                    info.used_space,
-                    info.allocation_size,
-                    info.map_size,
-                    info.data_count,
-                    info.total_mapstores);
+            if ((json = store_info_json(&info))) {
+                fprintf(stdout, "%s", json);
+                free(json);
+            }
         } else {
             fprintf(stderr, "Failed to get store info.\n");
         }
@@ -316,10 +979,62 @@ end_retrieve:
         goto end_program;
     }
 
+    if (strcmp(command, "replay") == 0) {
+        char *replay_path = argv[command_index + 1];
+        double speed = (replay_path && argv[command_index + 2]) ? strtod(argv[command_index + 2], NULL) : 1;
+        replay_report report;
+
+        if (replay_path == NULL) {
+            fprintf(stderr, "Missing capture file\n");
+            fprintf(stderr, HELP_TEXT);
+            status = 1;
+            goto end_program;
+        }
+
+        if ((status = replay_capture(&ctx, replay_path, speed, &report)) != 0) {
+            fprintf(stderr, "Failed to replay capture: %s\n", replay_path);
+            goto end_program;
+        }
+
+        print_replay_report(&report);
+        goto end_program;
+    }
+
+    if (strcmp(command, "serve") == 0) {
+        char *serve_path = argv[command_index + 1];
+
+        if (serve_path == NULL) {
+            fprintf(stderr, "Missing socket path\n");
+            fprintf(stderr, HELP_TEXT);
+            status = 1;
+            goto end_program;
+        }
+
+        fprintf(stderr, "Serving %s on %s\n", ctx.base_path, serve_path);
+        if ((status = serve_mapstore(&ctx, serve_path)) != 0) {
+            fprintf(stderr, "Failed to serve store\n");
+        }
+
+        goto end_program;
+    }
+
+    if (strcmp(command, "get-fragmentation-info") == 0) {
+        if ((status = print_fragmentation_info(&ctx)) != 0) {
+            fprintf(stderr, "Failed to get fragmentation info.\n");
+        }
+
+        goto end_program;
+    }
+
     fprintf(stderr, HELP_TEXT);
 
 end_program:
 
+    if (print_stats && print_store_metrics(&ctx) != 0) {
+        fprintf(stderr, "Failed to get store metrics.\n");
+        status = 1;
+    }
+
     if (opts.path) {
         free(opts.path);
     }
@@ -12,4 +12,6 @@
 #include <nettle/base16.h>
 #include <glob.h>
 
+#include "utils.h"
+
 int get_file_hash(int fd, char **hash);
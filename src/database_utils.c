@@ -1,5 +1,46 @@
 #include "database_utils.h"
 
+int open_database(char *path, sqlite3 **db) {
+    if (sqlite3_open_v2(
+        path,
+        db,
+        SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_SHAREDCACHE | SQLITE_OPEN_FULLMUTEX,
+        NULL) != SQLITE_OK) {
+        fprintf(stderr, "Can't open database: %s\n", sqlite3_errmsg(*db));
+        sqlite3_close_v2(*db);
+        *db = NULL;
+        return 1;
+    }
+
+    /* Other processes may hold the database lock for a short while */
+    sqlite3_busy_timeout(*db, DATABASE_BUSY_TIMEOUT);
+
+    /* WAL lets the read connections run while the writer commits */
+    if (sqlite3_exec(*db, "PRAGMA journal_mode=WAL", 0, 0, NULL) != SQLITE_OK) {
+        fprintf(stderr, "Could not enable WAL mode: %s\n", sqlite3_errmsg(*db));
+    }
+
+    return 0;
+}
+
+int open_read_database(char *path, sqlite3 **db) {
+    /* Each read connection is only used by one thread at a time */
+    if (sqlite3_open_v2(
+        path,
+        db,
+        SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX | SQLITE_OPEN_PRIVATECACHE,
+        NULL) != SQLITE_OK) {
+        fprintf(stderr, "Can't open database: %s\n", sqlite3_errmsg(*db));
+        sqlite3_close_v2(*db);
+        *db = NULL;
+        return 1;
+    }
+
+    sqlite3_busy_timeout(*db, DATABASE_BUSY_TIMEOUT);
+
+    return 0;
+}
+
 int prepare_tables(sqlite3 *db) {
     int status = 0;
     char *err_msg = NULL;
@@ -23,7 +64,10 @@ int prepare_tables(sqlite3 *db) {
         "`Id` INTEGER NOT NULL, "
         "`free_locations` TEXT NOT NULL, "
         "`free_space` INTEGER NOT NULL, "
-        "`size` INTEGER NOT NULL)";
+        "`size` INTEGER NOT NULL, "
+        "`free_extents` INTEGER NOT NULL DEFAULT 0, "
+        "`largest_free_extent` INTEGER NOT NULL DEFAULT 0, "
+        "`extent_histogram` TEXT NOT NULL DEFAULT '[]')";
 
     if(sqlite3_exec(db, map_stores, 0, 0, &err_msg) != SQLITE_OK) {
         fprintf(stderr, "Failed to create table\n");
@@ -46,10 +90,340 @@ int prepare_tables(sqlite3 *db) {
         goto end_prepare_tables;
     }
 
+    char *restructure_checkpoint = "CREATE TABLE IF NOT EXISTS `restructure_checkpoint` ( "
+        "`Id` INTEGER NOT NULL PRIMARY KEY, "
+        "`map_size` INTEGER NOT NULL, "
+        "`allocation_size` INTEGER NOT NULL, "
+        "`last_id` INTEGER NOT NULL, "
+        "`migrated` INTEGER NOT NULL, "
+        "`shard` INTEGER NOT NULL DEFAULT 0)";
+
+    if(sqlite3_exec(db, restructure_checkpoint, 0, 0, &err_msg) != SQLITE_OK) {
+        fprintf(stderr, "Failed to create table\n");
+        fprintf(stderr, "SQL error: %s\n", err_msg);
+        sqlite3_free(err_msg);
+        status = 1;
+        goto end_prepare_tables;
+    }
+
+    /* Checkpoints written before metadata sharding have no shard column */
+    if (add_column_if_missing(db, "restructure_checkpoint", "shard", "INTEGER NOT NULL DEFAULT 0") != 0) {
+        status = 1;
+        goto end_prepare_tables;
+    }
+
+    /* Map stores created before fragmentation stats are backfilled on open */
+    if (add_column_if_missing(db, "map_stores", "free_extents", "INTEGER NOT NULL DEFAULT 0") != 0 ||
+        add_column_if_missing(db, "map_stores", "largest_free_extent", "INTEGER NOT NULL DEFAULT 0") != 0 ||
+        add_column_if_missing(db, "map_stores", "extent_histogram", "TEXT NOT NULL DEFAULT '[]'") != 0) {
+        status = 1;
+        goto end_prepare_tables;
+    }
+
+    char *object_extent_stats = "CREATE TABLE IF NOT EXISTS `object_extent_stats` ( "
+        "`extents` INTEGER NOT NULL PRIMARY KEY, "
+        "`objects` INTEGER NOT NULL)";
+
+    if(sqlite3_exec(db, object_extent_stats, 0, 0, &err_msg) != SQLITE_OK) {
+        fprintf(stderr, "Failed to create table\n");
+        fprintf(stderr, "SQL error: %s\n", err_msg);
+        sqlite3_free(err_msg);
+        status = 1;
+        goto end_prepare_tables;
+    }
+
+    char *mapstore_settings = "CREATE TABLE IF NOT EXISTS `mapstore_settings` ( "
+        "`key` TEXT NOT NULL PRIMARY KEY, "
+        "`value` INTEGER NOT NULL)";
+
+    if(sqlite3_exec(db, mapstore_settings, 0, 0, &err_msg) != SQLITE_OK) {
+        fprintf(stderr, "Failed to create table\n");
+        fprintf(stderr, "SQL error: %s\n", err_msg);
+        sqlite3_free(err_msg);
+        status = 1;
+        goto end_prepare_tables;
+    }
+
+    char *inline_data = "CREATE TABLE IF NOT EXISTS `inline_data` ( "
+        "`hash` TEXT NOT NULL PRIMARY KEY, "
+        "`data` BLOB NOT NULL)";
+
+    if(sqlite3_exec(db, inline_data, 0, 0, &err_msg) != SQLITE_OK) {
+        fprintf(stderr, "Failed to create table\n");
+        fprintf(stderr, "SQL error: %s\n", err_msg);
+        sqlite3_free(err_msg);
+        status = 1;
+        goto end_prepare_tables;
+    }
+
+    char *slabs = "CREATE TABLE IF NOT EXISTS `slabs` ( "
+        "`Id` INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT, "
+        "`store_id` INTEGER NOT NULL, "
+        "`class_size` INTEGER NOT NULL, "
+        "`first` INTEGER NOT NULL, "
+        "`slots` INTEGER NOT NULL, "
+        "`bitmap` INTEGER NOT NULL, "
+        "`used` INTEGER NOT NULL); "
+        "CREATE INDEX IF NOT EXISTS `slabs_position` ON `slabs` (`store_id`, `first`); "
+        "CREATE INDEX IF NOT EXISTS `slabs_class` ON `slabs` (`class_size`, `used`)";
+
+    if(sqlite3_exec(db, slabs, 0, 0, &err_msg) != SQLITE_OK) {
+        fprintf(stderr, "Failed to create table\n");
+        fprintf(stderr, "SQL error: %s\n", err_msg);
+        sqlite3_free(err_msg);
+        status = 1;
+        goto end_prepare_tables;
+    }
+
 end_prepare_tables:
     return status;
 }
 
+int add_column_if_missing(sqlite3 *db, char *table, char *column, char *definition) {
+    int status = 0;
+    int rc;
+    bool found = false;
+    char *err_msg = NULL;
+    char query[BUFSIZ];
+    sqlite3_stmt *stmt = NULL;
+
+    memset(query, '\0', BUFSIZ);
+    snprintf(query, BUFSIZ, "PRAGMA table_info(`%s`)", table);
+    if ((rc = sqlite3_prepare_v2(db, query, strlen(query), &stmt, 0)) != SQLITE_OK) {
+        fprintf(stderr, "sql error: %s\n", sqlite3_errmsg(db));
+        status = 1;
+        goto end_add_column;
+    } else while((rc = sqlite3_step(stmt)) != SQLITE_DONE) {
+        switch(rc) {
+            case SQLITE_BUSY:
+                fprintf(stderr, "Database is busy\n");
+                sleep(1);
+                break;
+            case SQLITE_ERROR:
+                fprintf(stderr, "step error: %s\n", sqlite3_errmsg(db));
+                status = 1;
+                goto end_add_column;
+            case SQLITE_ROW:
+                if (strcmp((const char *)sqlite3_column_text(stmt, 1), column) == 0) {
+                    found = true;
+                }
+        }
+    }
+
+    if (found) {
+        goto end_add_column;
+    }
+
+    memset(query, '\0', BUFSIZ);
+    snprintf(query, BUFSIZ, "ALTER TABLE `%s` ADD COLUMN `%s` %s", table, column, definition);
+    if(sqlite3_exec(db, query, 0, 0, &err_msg) != SQLITE_OK) {
+        fprintf(stderr, "Failed to add column %s to %s\n", column, table);
+        fprintf(stderr, "SQL error: %s\n", err_msg);
+        sqlite3_free(err_msg);
+        status = 1;
+    }
+
+end_add_column:
+    sqlite3_finalize(stmt);
+    return status;
+}
+
+void shard_database_path(char *base_path, uint64_t shard, char *path, size_t len) {
+    memset(path, '\0', len);
+    if (shard == 0) {
+        snprintf(path, len, "%s%cshards.sqlite", base_path, separator());
+    } else {
+        snprintf(path, len, "%s%cshards.%"PRIu64".sqlite", base_path, separator(), shard);
+    }
+}
+
+/**
+* Open every metadata shard under base_path. Writers create missing shards and
+* their tables. stores_per_shard is read from the settings in shard 0.
+*/
+int open_metadata_shards(char *base_path, uint64_t total, bool read_only, metadata_shards *shards) {
+    int status = 0;
+    char path[BUFSIZ];
+
+    shards->total = 0;
+    shards->stores_per_shard = 1;
+    shards->dbs = calloc(total, sizeof(sqlite3 *));
+    if (!shards->dbs) {
+        return 1;
+    }
+
+    for (uint64_t s = 0; s < total; s++) {
+        shard_database_path(base_path, s, path, BUFSIZ);
+
+        status = (read_only) ? open_read_database(path, &shards->dbs[s]) : open_database(path, &shards->dbs[s]);
+        if (status != 0) {
+            status = 1;
+            goto end_open_metadata_shards;
+        }
+        shards->total = s + 1;
+
+        if (!read_only && prepare_tables(shards->dbs[s]) != 0) {
+            fprintf(stderr, "Could not create tables: %s\n", path);
+            status = 1;
+            goto end_open_metadata_shards;
+        }
+
+        if (!read_only && backfill_fragmentation_stats(shards->dbs[s]) != 0) {
+            fprintf(stderr, "Could not compute fragmentation stats: %s\n", path);
+            status = 1;
+            goto end_open_metadata_shards;
+        }
+    }
+
+    if (get_setting(shards->dbs[0], SETTING_STORES_PER_SHARD, &shards->stores_per_shard) != 0) {
+        status = 1;
+        goto end_open_metadata_shards;
+    }
+
+    if (shards->stores_per_shard == 0) {
+        shards->stores_per_shard = 1;
+    }
+
+end_open_metadata_shards:
+    if (status != 0) {
+        close_metadata_shards(shards);
+    }
+    return status;
+}
+
+void close_metadata_shards(metadata_shards *shards) {
+    if (!shards->dbs) {
+        return;
+    }
+
+    for (uint64_t s = 0; s < shards->total; s++) {
+        sqlite3_close_v2(shards->dbs[s]);
+    }
+
+    free(shards->dbs);
+    shards->dbs = NULL;
+    shards->total = 0;
+}
+
+/**
+* Route a hash by its first four hex digits so related lookups stay spread
+* evenly no matter how many shards there are.
+*/
+uint64_t shard_for_hash(metadata_shards *shards, char *hash) {
+    uint64_t prefix = 0;
+    int c;
+
+    if (shards->total <= 1) {
+        return 0;
+    }
+
+    for (int i = 0; i < 4 && hash[i] != '\0'; i++) {
+        c = tolower((unsigned char)hash[i]);
+        prefix = (prefix << 4) | ((isdigit(c)) ? c - '0' : (isxdigit(c)) ? c - 'a' + 10 : c & 0xf);
+    }
+
+    return prefix % shards->total;
+}
+
+/**
+* Route a map store by id range. Stores added when growing wrap around to the
+* first shard again.
+*/
+uint64_t shard_for_store(metadata_shards *shards, uint64_t store_id) {
+    if (shards->total <= 1 || store_id == 0) {
+        return 0;
+    }
+
+    return ((store_id - 1) / shards->stores_per_shard) % shards->total;
+}
+
+sqlite3 *db_for_hash(metadata_shards *shards, char *hash) {
+    return shards->dbs[shard_for_hash(shards, hash)];
+}
+
+sqlite3 *db_for_store(metadata_shards *shards, uint64_t store_id) {
+    return shards->dbs[shard_for_store(shards, store_id)];
+}
+
+int sum_column_for_shards(metadata_shards *shards, char *column, char *table, uint64_t *sum) {
+    uint64_t shard_sum = 0;
+
+    *sum = 0;
+    for (uint64_t s = 0; s < shards->total; s++) {
+        shard_sum = 0;
+        if (sum_column_for_table(shards->dbs[s], column, table, &shard_sum) != 0) {
+            return 1;
+        }
+        *sum += shard_sum;
+    }
+
+    return 0;
+}
+
+uint64_t get_count_for_shards(metadata_shards *shards, char *query) {
+    uint64_t count = 0;
+
+    for (uint64_t s = 0; s < shards->total; s++) {
+        count += get_count(shards->dbs[s], query);
+    }
+
+    return count;
+}
+
+int get_setting(sqlite3 *db, char *key, uint64_t *value) {
+    int status = 0;
+    int rc;
+    int len = 58 + strlen(key) + 1;
+    char query[len];
+    sqlite3_stmt *stmt = NULL;
+
+    *value = 0;
+
+    memset(query, '\0', len);
+    sprintf(query, "SELECT value FROM `mapstore_settings` WHERE key='%s' LIMIT 1", key);
+    if ((rc = sqlite3_prepare_v2(db, query, strlen(query), &stmt, 0)) != SQLITE_OK) {
+        fprintf(stderr, "sql error: %s\n", sqlite3_errmsg(db));
+        status = 1;
+        goto end_get_setting;
+    } else while((rc = sqlite3_step(stmt)) != SQLITE_DONE) {
+        switch(rc) {
+            case SQLITE_BUSY:
+                fprintf(stderr, "Database is busy\n");
+                sleep(1);
+                break;
+            case SQLITE_ERROR:
+                fprintf(stderr, "step error: %s\n", sqlite3_errmsg(db));
+                status = 1;
+                goto end_get_setting;
+            case SQLITE_ROW:
+                *value = sqlite3_column_int64(stmt, 0);
+        }
+    }
+
+end_get_setting:
+    sqlite3_finalize(stmt);
+    return status;
+}
+
+int save_setting(sqlite3 *db, char *key, uint64_t value) {
+    int status = 0;
+    char *err_msg = NULL;
+    int len = 62 + strlen(key) + MAX_UINT64_STR + 1;
+    char query[len];
+
+    memset(query, '\0', len);
+    sprintf(query, "INSERT OR REPLACE INTO `mapstore_settings` VALUES('%s', %"PRIu64")", key, value);
+
+    if(sqlite3_exec(db, query, 0, 0, &err_msg) != SQLITE_OK) {
+        fprintf(stderr, "Failed to save setting %s\n", key);
+        fprintf(stderr, "SQL error: %s\n", err_msg);
+        sqlite3_free(err_msg);
+        status = 1;
+    }
+
+    return status;
+}
+
 int get_latest_layout_row(sqlite3 *db, mapstore_layout_row *row) {
     int status = 0;
     int rc;
@@ -104,6 +478,43 @@ end_mapstore_layout_row:
     return status;
 }
 
+/**
+* Size of one map store without parsing its free list
+*/
+int get_store_size(sqlite3 *db, uint64_t store_id, uint64_t *size) {
+    int status = 0;
+    int rc;
+    char query[45 + MAX_UINT64_STR + 1];
+    sqlite3_stmt *stmt = NULL;
+
+    *size = 0;
+
+    memset(query, '\0', sizeof(query));
+    sprintf(query, "SELECT size FROM `map_stores` WHERE Id = %"PRIu64, store_id);
+    if ((rc = sqlite3_prepare_v2(db, query, strlen(query), &stmt, 0)) != SQLITE_OK) {
+        fprintf(stderr, "sql error: %s\n", sqlite3_errmsg(db));
+        status = 1;
+        goto end_get_store_size;
+    } else while((rc = sqlite3_step(stmt)) != SQLITE_DONE) {
+        switch(rc) {
+            case SQLITE_BUSY:
+                fprintf(stderr, "Database is busy\n");
+                sleep(1);
+                break;
+            case SQLITE_ERROR:
+                fprintf(stderr, "step error: %s\n", sqlite3_errmsg(db));
+                status = 1;
+                goto end_get_store_size;
+            case SQLITE_ROW:
+                *size = sqlite3_column_int64(stmt, 0);
+        }
+    }
+
+end_get_store_size:
+    sqlite3_finalize(stmt);
+    return status;
+}
+
 int get_store_rows(sqlite3 *db, char *where, mapstore_row *row) {
     int status = 0;
     int rc;
@@ -268,6 +679,45 @@ end_mapstore_row:
     return status;
 }
 
+/**
+* Size of every map store in db, indexed by id - 1. Ids past total are ignored.
+*/
+int get_map_store_sizes(sqlite3 *db, uint64_t *sizes, uint64_t total) {
+    int status = 0;
+    int rc;
+    char *query = "SELECT Id, size FROM map_stores;";
+    sqlite3_stmt *stmt = NULL;
+    uint64_t id = 0;
+
+    if ((rc = sqlite3_prepare_v2(db, query, strlen(query), &stmt, 0)) != SQLITE_OK) {
+        fprintf(stderr, "sql error: %s\n", sqlite3_errmsg(db));
+        status = 1;
+        goto end_map_store_sizes;
+    } else while((rc = sqlite3_step(stmt)) != SQLITE_DONE) {
+        switch(rc) {
+            case SQLITE_BUSY:
+                fprintf(stderr, "Database is busy\n");
+                sleep(1);
+                break;
+            case SQLITE_ERROR:
+                fprintf(stderr, "step error: %s\n", sqlite3_errmsg(db));
+                status = 1;
+                goto end_map_store_sizes;
+            case SQLITE_ROW:
+                {
+                    id = sqlite3_column_int64(stmt, 0);
+                    if (id >= 1 && id <= total) {
+                        sizes[id - 1] = sqlite3_column_int64(stmt, 1);
+                    }
+                }
+        }
+    }
+
+end_map_store_sizes:
+    sqlite3_finalize(stmt);
+    return status;
+}
+
 int update_map_store(sqlite3 *db, char *where, char *set) {
     int status = 0;
     char *err_msg = NULL;
@@ -307,20 +757,22 @@ int insert_to(sqlite3 *db, char *table, char *set) {
     return status;
 }
 
-int hash_exists_in_mapstore(sqlite3 *db, char *hash) {
+int get_slab_row(sqlite3 *db, char *where, slab_row *row) {
     int status = 0;
     int rc;
-    int len = 52 + HASH_LENGTH + 1;
+    int len = 30 + strlen(where) + 1;
     char query[len];
     char column_name[BUFSIZ];
     sqlite3_stmt *stmt = NULL;
 
+    memset(row, 0, sizeof(slab_row));
+
     memset(query, '\0', len);
-    sprintf(query, "SELECT * FROM `data_locations` WHERE hash='%s' LIMIT 1", hash);
+    sprintf(query, "SELECT * FROM `slabs` %s LIMIT 1", where);
     if ((rc = sqlite3_prepare_v2(db, query, strlen(query), &stmt, 0)) != SQLITE_OK) {
         fprintf(stderr, "sql error: %s\n", sqlite3_errmsg(db));
         status = 1;
-        goto end_mapstore_row;
+        goto end_slab_row;
     } else while((rc = sqlite3_step(stmt)) != SQLITE_DONE) {
         switch(rc) {
             case SQLITE_BUSY:
@@ -330,7 +782,119 @@ int hash_exists_in_mapstore(sqlite3 *db, char *hash) {
             case SQLITE_ERROR:
                 fprintf(stderr, "step error: %s\n", sqlite3_errmsg(db));
                 status = 1;
-                goto end_mapstore_row;
+                goto end_slab_row;
+            case SQLITE_ROW:
+                {
+                    int n = sqlite3_column_count(stmt);
+                    for (int i = 0; i < n; i++) {
+                        memset(column_name, '\0', BUFSIZ);
+                        strcpy(column_name, sqlite3_column_name(stmt, i));
+
+                        if (strcmp(column_name, "Id") == 0) {
+                            row->id = sqlite3_column_int64(stmt, i);
+                        } else if (strcmp(column_name, "store_id") == 0) {
+                            row->store_id = sqlite3_column_int64(stmt, i);
+                        } else if (strcmp(column_name, "class_size") == 0) {
+                            row->class_size = sqlite3_column_int64(stmt, i);
+                        } else if (strcmp(column_name, "first") == 0) {
+                            row->first = sqlite3_column_int64(stmt, i);
+                        } else if (strcmp(column_name, "slots") == 0) {
+                            row->slots = sqlite3_column_int64(stmt, i);
+                        } else if (strcmp(column_name, "bitmap") == 0) {
+                            row->bitmap = (uint64_t)sqlite3_column_int64(stmt, i);
+                        } else if (strcmp(column_name, "used") == 0) {
+                            row->used = sqlite3_column_int64(stmt, i);
+                        }
+                    }
+                }
+        }
+    }
+
+end_slab_row:
+    sqlite3_finalize(stmt);
+    return status;
+}
+
+int insert_slab(sqlite3 *db, slab_row *row) {
+    char values[96 + 6 * MAX_UINT64_STR + 1];
+
+    memset(values, '\0', sizeof(values));
+    sprintf(values,
+            "(store_id,class_size,first,slots,bitmap,used) VALUES(%"PRIu64",%"PRIu64",%"PRIu64",%"PRIu64",%"PRId64",%"PRIu64")",
+            row->store_id,
+            row->class_size,
+            row->first,
+            row->slots,
+            (int64_t)row->bitmap,
+            row->used);
+
+    return insert_to(db, "slabs", values);
+}
+
+int update_slab(sqlite3 *db, slab_row *row) {
+    int status = 0;
+    char *err_msg = NULL;
+    char query[56 + 3 * MAX_UINT64_STR + 1];
+
+    memset(query, '\0', sizeof(query));
+    sprintf(query,
+            "UPDATE `slabs` SET bitmap=%"PRId64", used=%"PRIu64" WHERE Id=%"PRIu64,
+            (int64_t)row->bitmap,
+            row->used,
+            row->id);
+
+    if(sqlite3_exec(db, query, 0, 0, &err_msg) != SQLITE_OK) {
+        fprintf(stderr, "Failed to update slabs\n");
+        fprintf(stderr, "SQL error: %s\n", err_msg);
+        sqlite3_free(err_msg);
+        status = 1;
+    }
+
+    return status;
+}
+
+int delete_slab(sqlite3 *db, uint64_t id) {
+    int status = 0;
+    char *err_msg = NULL;
+    char query[29 + MAX_UINT64_STR + 1];
+
+    memset(query, '\0', sizeof(query));
+    sprintf(query, "DELETE FROM `slabs` WHERE Id=%"PRIu64, id);
+
+    if(sqlite3_exec(db, query, 0, 0, &err_msg) != SQLITE_OK) {
+        fprintf(stderr, "Failed to delete from slabs\n");
+        fprintf(stderr, "SQL error: %s\n", err_msg);
+        sqlite3_free(err_msg);
+        status = 1;
+    }
+
+    return status;
+}
+
+int hash_exists_in_mapstore(sqlite3 *db, char *hash) {
+    int status = 0;
+    int rc;
+    int len = 52 + HASH_LENGTH + 1;
+    char query[len];
+    char column_name[BUFSIZ];
+    sqlite3_stmt *stmt = NULL;
+
+    memset(query, '\0', len);
+    sprintf(query, "SELECT * FROM `data_locations` WHERE hash='%s' LIMIT 1", hash);
+    if ((rc = sqlite3_prepare_v2(db, query, strlen(query), &stmt, 0)) != SQLITE_OK) {
+        fprintf(stderr, "sql error: %s\n", sqlite3_errmsg(db));
+        status = 1;
+        goto end_mapstore_row;
+    } else while((rc = sqlite3_step(stmt)) != SQLITE_DONE) {
+        switch(rc) {
+            case SQLITE_BUSY:
+                fprintf(stderr, "Database is busy\n");
+                sleep(1);
+                break;
+            case SQLITE_ERROR:
+                fprintf(stderr, "step error: %s\n", sqlite3_errmsg(db));
+                status = 1;
+                goto end_mapstore_row;
             case SQLITE_IOERR:
                 fprintf(stderr, "step error: %s\n", sqlite3_errmsg(db));
                 status = 1;
@@ -358,22 +922,25 @@ end_mapstore_row:
     return status;
 }
 
-int mark_as_uploaded(sqlite3 *db, char *hash) {
+/**
+* Positions are written again with the upload flag as writing the data adds
+* the checksum of every extent to them.
+*/
+int mark_as_uploaded(sqlite3 *db, char *hash, json_object *positions) {
     int status = 0;
-    char *err_msg = NULL;
-
-    int len = 57 + HASH_LENGTH + 1;
-    char query[len];
-    memset(query, '\0', len);
-    sprintf(query, "UPDATE `data_locations` SET uploaded='true' WHERE hash='%s'", hash);
+    char *query = "UPDATE `data_locations` SET uploaded='true', positions=? WHERE hash=?";
+    sqlite3_stmt *stmt = NULL;
 
-    if(sqlite3_exec(db, query, 0, 0, &err_msg) != SQLITE_OK) {
+    if (sqlite3_prepare_v2(db, query, strlen(query), &stmt, 0) != SQLITE_OK ||
+        sqlite3_bind_text(stmt, 1, json_object_to_json_string(positions), -1, SQLITE_TRANSIENT) != SQLITE_OK ||
+        sqlite3_bind_text(stmt, 2, hash, -1, SQLITE_STATIC) != SQLITE_OK ||
+        sqlite3_step(stmt) != SQLITE_DONE) {
         fprintf(stderr, "Failed to update data_locations\n");
-        fprintf(stderr, "SQL error: %s\n", err_msg);
-        sqlite3_free(err_msg);
+        fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(db));
         status = 1;
     }
 
+    sqlite3_finalize(stmt);
     return status;
 }
 
@@ -423,6 +990,142 @@ end_mapstore_row:
     return status;
 }
 
+/**
+* Positions of every stored hash in hashes, added to found keyed by hash.
+* Hashes that are not stored are left out.
+*/
+int get_pos_for_hashes(sqlite3 *db, char **hashes, uint64_t count, json_object *found) {
+    int status = 0;
+    int rc;
+    char *query = NULL;
+    char *end = NULL;
+    sqlite3_stmt *stmt = NULL;
+
+    if (count == 0) {
+        return 0;
+    }
+
+    query = calloc(64 + count * (HASH_LENGTH + 3), sizeof(char));
+    if (!query) {
+        return 1;
+    }
+
+    end = query + sprintf(query, "SELECT hash, positions FROM `data_locations` WHERE hash IN (");
+    for (uint64_t h = 0; h < count; h++) {
+        end += sprintf(end, "%s'%.*s'", (h > 0) ? "," : "", HASH_LENGTH, hashes[h]);
+    }
+    strcpy(end, ")");
+
+    if ((rc = sqlite3_prepare_v2(db, query, strlen(query), &stmt, 0)) != SQLITE_OK) {
+        fprintf(stderr, "sql error: %s\n", sqlite3_errmsg(db));
+        status = 1;
+        goto end_get_pos_for_hashes;
+    } else while((rc = sqlite3_step(stmt)) != SQLITE_DONE) {
+        switch(rc) {
+            case SQLITE_BUSY:
+                fprintf(stderr, "Database is busy\n");
+                sleep(1);
+                break;
+            case SQLITE_ERROR:
+                fprintf(stderr, "step error: %s\n", sqlite3_errmsg(db));
+                status = 1;
+                goto end_get_pos_for_hashes;
+            case SQLITE_ROW:
+                json_object_object_add(found,
+                                       (const char *)sqlite3_column_text(stmt, 0),
+                                       json_tokener_parse((const char *)sqlite3_column_text(stmt, 1)));
+                break;
+        }
+    }
+
+end_get_pos_for_hashes:
+    sqlite3_finalize(stmt);
+    free(query);
+    return status;
+}
+
+int insert_inline_data(sqlite3 *db, char *hash, const uint8_t *data, uint64_t size) {
+    int status = 0;
+    char *query = "INSERT INTO `inline_data` (hash,data) VALUES(?,?)";
+    sqlite3_stmt *stmt = NULL;
+
+    if (sqlite3_prepare_v2(db, query, strlen(query), &stmt, 0) != SQLITE_OK ||
+        sqlite3_bind_text(stmt, 1, hash, -1, SQLITE_STATIC) != SQLITE_OK ||
+        sqlite3_bind_blob64(stmt, 2, data, size, SQLITE_STATIC) != SQLITE_OK ||
+        sqlite3_step(stmt) != SQLITE_DONE) {
+        fprintf(stderr, "Failed to insert into inline_data\n");
+        fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(db));
+        status = 1;
+    }
+
+    sqlite3_finalize(stmt);
+    return status;
+}
+
+/**
+* Copy of the bytes stored inline for hash, to be freed by the caller. data
+* is left NULL when nothing is stored inline.
+*/
+int get_inline_data(sqlite3 *db, char *hash, uint8_t **data, uint64_t *size) {
+    int status = 0;
+    int rc;
+    char *query = "SELECT data FROM `inline_data` WHERE hash=? LIMIT 1";
+    sqlite3_stmt *stmt = NULL;
+
+    *data = NULL;
+    *size = 0;
+
+    if ((rc = sqlite3_prepare_v2(db, query, strlen(query), &stmt, 0)) != SQLITE_OK ||
+        (rc = sqlite3_bind_text(stmt, 1, hash, -1, SQLITE_STATIC)) != SQLITE_OK) {
+        fprintf(stderr, "sql error: %s\n", sqlite3_errmsg(db));
+        status = 1;
+        goto end_get_inline_data;
+    } else while((rc = sqlite3_step(stmt)) != SQLITE_DONE) {
+        switch(rc) {
+            case SQLITE_BUSY:
+                fprintf(stderr, "Database is busy\n");
+                sleep(1);
+                break;
+            case SQLITE_ERROR:
+                fprintf(stderr, "step error: %s\n", sqlite3_errmsg(db));
+                status = 1;
+                goto end_get_inline_data;
+            case SQLITE_ROW:
+                {
+                    *size = sqlite3_column_bytes(stmt, 0);
+                    if (!(*data = malloc(*size + 1))) {
+                        status = 1;
+                        goto end_get_inline_data;
+                    }
+                    memcpy(*data, sqlite3_column_blob(stmt, 0), *size);
+                }
+        }
+    }
+
+end_get_inline_data:
+    sqlite3_finalize(stmt);
+    return status;
+}
+
+int delete_inline_data(sqlite3 *db, char *hash) {
+    int status = 0;
+    char *err_msg = NULL;
+    int len = 45 + HASH_LENGTH + 1;
+
+    char query[len];
+    memset(query, '\0', len);
+    sprintf(query, "DELETE FROM `inline_data` WHERE hash='%s'", hash);
+
+    if(sqlite3_exec(db, query, 0, 0, &err_msg) != SQLITE_OK) {
+        fprintf(stderr, "Failed to delete hash from inline_data\n");
+        fprintf(stderr, "SQL error: %s\n", err_msg);
+        sqlite3_free(err_msg);
+        status = 1;
+    }
+
+    return status;
+}
+
 int delete_by_hash_from_data_locations(sqlite3 *db, char *hash) {
     int status = 0;
     char *err_msg = NULL;
@@ -540,3 +1243,490 @@ int get_data_hashes(sqlite3 *db, char hashes[][41]) {
     sqlite3_finalize(stmt);
     return 0;
 }
+
+int get_data_hashes_after(sqlite3 *db, uint64_t after_id, int limit, char hashes[][41], uint64_t *ids) {
+    int rc;
+    int len = 76 + MAX_UINT64_STR + MAX_UINT64_STR + 1;
+    char query[len];
+    sqlite3_stmt *stmt = NULL;
+    int x = 0;
+
+    memset(query, '\0', len);
+    sprintf(query, "SELECT Id, hash FROM `data_locations` WHERE Id > %"PRIu64" ORDER BY Id ASC LIMIT %d;", after_id, limit);
+
+    if ((rc = sqlite3_prepare_v2(db, query, strlen(query), &stmt, 0)) != SQLITE_OK) {
+        fprintf(stderr, "sql error: %s\n", sqlite3_errmsg(db));
+        return -1;
+    } else while((rc = sqlite3_step(stmt)) != SQLITE_DONE) {
+        switch(rc) {
+            case SQLITE_BUSY:
+                fprintf(stderr, "Database is busy\n");
+                sleep(1);
+                break;
+            case SQLITE_ERROR:
+                fprintf(stderr, "step error: %s\n", sqlite3_errmsg(db));
+                sqlite3_finalize(stmt);
+                return -1;
+            case SQLITE_ROW:
+                {
+                    ids[x] = sqlite3_column_int64(stmt, 0);
+                    memset(hashes[x], '\0', 41);
+                    strncpy(hashes[x], (const char *)sqlite3_column_text(stmt, 1), 40);
+                    x++;
+                }
+        }
+    }
+
+    sqlite3_finalize(stmt);
+    return x;
+}
+
+int get_restructure_checkpoint(sqlite3 *db, restructure_checkpoint_row *row) {
+    int status = 0;
+    int rc;
+    sqlite3_stmt *stmt = NULL;
+
+    row->id = 0;
+    row->allocation_size = 0;
+    row->map_size = 0;
+    row->last_id = 0;
+    row->migrated = 0;
+    row->shard = 0;
+
+    char *query = "SELECT Id, map_size, allocation_size, last_id, migrated, shard FROM `restructure_checkpoint` LIMIT 1";
+    if ((rc = sqlite3_prepare_v2(db, query, strlen(query), &stmt, 0)) != SQLITE_OK) {
+        fprintf(stderr, "sql error: %s\n", sqlite3_errmsg(db));
+        status = 1;
+        goto end_restructure_checkpoint;
+    } else while((rc = sqlite3_step(stmt)) != SQLITE_DONE) {
+        switch(rc) {
+            case SQLITE_BUSY:
+                fprintf(stderr, "Database is busy\n");
+                sleep(1);
+                break;
+            case SQLITE_ERROR:
+                fprintf(stderr, "step error: %s\n", sqlite3_errmsg(db));
+                status = 1;
+                goto end_restructure_checkpoint;
+            case SQLITE_ROW:
+                {
+                    row->id = sqlite3_column_int64(stmt, 0);
+                    row->map_size = sqlite3_column_int64(stmt, 1);
+                    row->allocation_size = sqlite3_column_int64(stmt, 2);
+                    row->last_id = sqlite3_column_int64(stmt, 3);
+                    row->migrated = sqlite3_column_int64(stmt, 4);
+                    row->shard = sqlite3_column_int64(stmt, 5);
+                }
+        }
+    }
+
+end_restructure_checkpoint:
+    sqlite3_finalize(stmt);
+    return status;
+}
+
+int save_restructure_checkpoint(sqlite3 *db, restructure_checkpoint_row *row) {
+    int status = 0;
+    char *err_msg = NULL;
+    int len = 124 + 5 * MAX_UINT64_STR + 1;
+    char query[len];
+
+    memset(query, '\0', len);
+    sprintf(query,
+            "INSERT OR REPLACE INTO `restructure_checkpoint` VALUES(1, %"PRIu64", %"PRIu64", %"PRIu64", %"PRIu64", %"PRIu64")",
+            row->map_size,
+            row->allocation_size,
+            row->last_id,
+            row->migrated,
+            row->shard);
+
+    if(sqlite3_exec(db, query, 0, 0, &err_msg) != SQLITE_OK) {
+        fprintf(stderr, "Failed to save restructure checkpoint\n");
+        fprintf(stderr, "SQL error: %s\n", err_msg);
+        sqlite3_free(err_msg);
+        status = 1;
+    }
+
+    row->id = 1;
+    return status;
+}
+
+/**
+* Point the data_locations row with id at new positions. Ids are never
+* reused, so moved is false when the row was deleted in the meantime.
+* object_extent_stats moves the object from old_extents in the same
+* transaction.
+*/
+int move_data_location(sqlite3 *db, uint64_t id, json_object *positions, uint64_t old_extents, bool *moved) {
+    int status = 0;
+    char *err_msg = NULL;
+    char *query = "UPDATE `data_locations` SET positions=? WHERE Id=?";
+    sqlite3_stmt *stmt = NULL;
+
+    *moved = false;
+
+    sqlite3_mutex_enter(sqlite3_db_mutex(db));
+
+    if(sqlite3_exec(db, "SAVEPOINT move_data_location", 0, 0, &err_msg) != SQLITE_OK) {
+        fprintf(stderr, "SQL error: %s\n", err_msg);
+        sqlite3_free(err_msg);
+        status = 1;
+        goto end_move_data_location;
+    }
+
+    if (sqlite3_prepare_v2(db, query, strlen(query), &stmt, 0) != SQLITE_OK ||
+        sqlite3_bind_text(stmt, 1, json_object_to_json_string(positions), -1, SQLITE_TRANSIENT) != SQLITE_OK ||
+        sqlite3_bind_int64(stmt, 2, id) != SQLITE_OK ||
+        sqlite3_step(stmt) != SQLITE_DONE) {
+        fprintf(stderr, "Failed to update data_locations\n");
+        fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(db));
+        status = 1;
+    } else {
+        *moved = sqlite3_changes(db) == 1;
+    }
+
+    if (status == 0 && *moved &&
+        (update_object_extent_stats(db, old_extents, -1) != 0 ||
+         update_object_extent_stats(db, positions_extents(positions), 1) != 0)) {
+        status = 1;
+    }
+
+    if (status != 0) {
+        sqlite3_exec(db, "ROLLBACK TO move_data_location", 0, 0, NULL);
+        *moved = false;
+    }
+
+    if(sqlite3_exec(db, "RELEASE move_data_location", 0, 0, &err_msg) != SQLITE_OK) {
+        fprintf(stderr, "SQL error: %s\n", err_msg);
+        sqlite3_free(err_msg);
+        status = 1;
+    }
+
+end_move_data_location:
+    sqlite3_mutex_leave(sqlite3_db_mutex(db));
+
+    sqlite3_finalize(stmt);
+    return status;
+}
+
+/**
+* Add a data_locations row and count the object in object_extent_stats in
+* the same transaction. Fails if the hash is already stored.
+*/
+int insert_data_location_row(sqlite3 *db, char *values, uint64_t extents) {
+    int status = 0;
+    char *err_msg = NULL;
+
+    sqlite3_mutex_enter(sqlite3_db_mutex(db));
+
+    if(sqlite3_exec(db, "SAVEPOINT insert_data_location_row", 0, 0, &err_msg) != SQLITE_OK) {
+        fprintf(stderr, "SQL error: %s\n", err_msg);
+        sqlite3_free(err_msg);
+        status = 1;
+        goto end_insert_data_location_row;
+    }
+
+    if ((status = insert_to(db, "data_locations", values)) != 0 ||
+        (status = update_object_extent_stats(db, extents, 1)) != 0) {
+        sqlite3_exec(db, "ROLLBACK TO insert_data_location_row", 0, 0, NULL);
+        status = 1;
+    }
+
+    if(sqlite3_exec(db, "RELEASE insert_data_location_row", 0, 0, &err_msg) != SQLITE_OK) {
+        fprintf(stderr, "SQL error: %s\n", err_msg);
+        sqlite3_free(err_msg);
+        status = 1;
+    }
+
+end_insert_data_location_row:
+    sqlite3_mutex_leave(sqlite3_db_mutex(db));
+    return status;
+}
+
+/**
+* Remove the data_locations row for hash and return its positions. Only one
+* caller can take a given row so concurrent deletes never free space twice.
+* Data stored inline goes with the row, and the object leaves
+* object_extent_stats in the same transaction.
+*/
+int take_data_locations_row(sqlite3 *db, char *hash, json_object **positions) {
+    int status = 0;
+    char *err_msg = NULL;
+
+    *positions = NULL;
+
+    sqlite3_mutex_enter(sqlite3_db_mutex(db));
+
+    if(sqlite3_exec(db, "SAVEPOINT take_data_locations_row", 0, 0, &err_msg) != SQLITE_OK) {
+        fprintf(stderr, "SQL error: %s\n", err_msg);
+        sqlite3_free(err_msg);
+        status = 1;
+        goto end_take_data_locations_row;
+    }
+
+    if ((status = get_pos_from_data_locations(db, hash, positions)) != 0 ||
+        (status = delete_by_hash_from_data_locations(db, hash)) != 0 ||
+        sqlite3_changes(db) != 1 ||
+        (status = delete_inline_data(db, hash)) != 0 ||
+        (status = update_object_extent_stats(db, positions_extents(*positions), -1)) != 0) {
+        sqlite3_exec(db, "ROLLBACK TO take_data_locations_row", 0, 0, NULL);
+        status = 1;
+    }
+
+    if(sqlite3_exec(db, "RELEASE take_data_locations_row", 0, 0, &err_msg) != SQLITE_OK) {
+        fprintf(stderr, "SQL error: %s\n", err_msg);
+        sqlite3_free(err_msg);
+        status = 1;
+    }
+
+end_take_data_locations_row:
+    sqlite3_mutex_leave(sqlite3_db_mutex(db));
+
+    if (status != 0 && *positions) {
+        json_object_put(*positions);
+        *positions = NULL;
+    }
+    return status;
+}
+
+/**
+* Count one more (delta 1) or one less (delta -1) object made of extents
+* pieces. Rows are keyed by extent count so the table stays tiny. Objects
+* stored inline have no extents and are not counted.
+*/
+int update_object_extent_stats(sqlite3 *db, uint64_t extents, int delta) {
+    int status = 0;
+    char *err_msg = NULL;
+    int len = 160 + 3 * MAX_UINT64_STR + 1;
+    char query[len];
+
+    if (extents == 0) {
+        return 0;
+    }
+
+    memset(query, '\0', len);
+    sprintf(query,
+            "INSERT OR IGNORE INTO `object_extent_stats` VALUES(%"PRIu64", 0); "
+            "UPDATE `object_extent_stats` SET objects = objects + (%d) WHERE extents = %"PRIu64";",
+            extents,
+            delta,
+            extents);
+
+    if(sqlite3_exec(db, query, 0, 0, &err_msg) != SQLITE_OK) {
+        fprintf(stderr, "Failed to update object_extent_stats\n");
+        fprintf(stderr, "SQL error: %s\n", err_msg);
+        sqlite3_free(err_msg);
+        status = 1;
+    }
+
+    return status;
+}
+
+int get_object_extent_stats(sqlite3 *db, uint64_t *objects, uint64_t *total_extents, uint64_t *max_extents) {
+    int status = 0;
+    int rc;
+    sqlite3_stmt *stmt = NULL;
+
+    *objects = 0;
+    *total_extents = 0;
+    *max_extents = 0;
+
+    char *query = "SELECT SUM(objects), SUM(extents * objects), MAX(extents) "
+                  "FROM `object_extent_stats` WHERE objects > 0";
+    if ((rc = sqlite3_prepare_v2(db, query, strlen(query), &stmt, 0)) != SQLITE_OK) {
+        fprintf(stderr, "sql error: %s\n", sqlite3_errmsg(db));
+        status = 1;
+        goto end_object_extent_stats;
+    } else while((rc = sqlite3_step(stmt)) != SQLITE_DONE) {
+        switch(rc) {
+            case SQLITE_BUSY:
+                fprintf(stderr, "Database is busy\n");
+                sleep(1);
+                break;
+            case SQLITE_ERROR:
+                fprintf(stderr, "step error: %s\n", sqlite3_errmsg(db));
+                status = 1;
+                goto end_object_extent_stats;
+            case SQLITE_ROW:
+                *objects = sqlite3_column_int64(stmt, 0);
+                *total_extents = sqlite3_column_int64(stmt, 1);
+                *max_extents = sqlite3_column_int64(stmt, 2);
+        }
+    }
+
+end_object_extent_stats:
+    sqlite3_finalize(stmt);
+    return status;
+}
+
+/**
+* Read the stored fragmentation stats of a map store without parsing its
+* free list.
+*/
+int get_store_fragmentation(sqlite3 *db, uint64_t store_id, free_space_info *info) {
+    int status = 0;
+    int rc;
+    int len = 110 + MAX_UINT64_STR + 1;
+    char query[len];
+    sqlite3_stmt *stmt = NULL;
+    json_object *histogram = NULL;
+
+    memset(info, 0, sizeof(free_space_info));
+    info->store_id = store_id;
+
+    memset(query, '\0', len);
+    sprintf(query,
+            "SELECT size, free_space, free_extents, largest_free_extent, extent_histogram "
+            "FROM `map_stores` WHERE Id = %"PRIu64" LIMIT 1",
+            store_id);
+    if ((rc = sqlite3_prepare_v2(db, query, strlen(query), &stmt, 0)) != SQLITE_OK) {
+        fprintf(stderr, "sql error: %s\n", sqlite3_errmsg(db));
+        status = 1;
+        goto end_store_fragmentation;
+    } else while((rc = sqlite3_step(stmt)) != SQLITE_DONE) {
+        switch(rc) {
+            case SQLITE_BUSY:
+                fprintf(stderr, "Database is busy\n");
+                sleep(1);
+                break;
+            case SQLITE_ERROR:
+                fprintf(stderr, "step error: %s\n", sqlite3_errmsg(db));
+                status = 1;
+                goto end_store_fragmentation;
+            case SQLITE_ROW:
+                info->size = sqlite3_column_int64(stmt, 0);
+                info->free_space = sqlite3_column_int64(stmt, 1);
+                info->free_extents = sqlite3_column_int64(stmt, 2);
+                info->largest_free_extent = sqlite3_column_int64(stmt, 3);
+
+                histogram = json_tokener_parse((const char *)sqlite3_column_text(stmt, 4));
+                for (int c = 0; histogram && c < json_object_array_length(histogram) && c < EXTENT_SIZE_CLASSES; c++) {
+                    info->extent_histogram[c] = json_object_get_int64(json_object_array_get_idx(histogram, c));
+                }
+
+                if (histogram) {
+                    json_object_put(histogram);
+                    histogram = NULL;
+                }
+        }
+    }
+
+end_store_fragmentation:
+    sqlite3_finalize(stmt);
+    return status;
+}
+
+/**
+* Compute fragmentation stats for rows written before they were tracked. This
+* scans the shard once and is skipped afterwards.
+*/
+int backfill_fragmentation_stats(sqlite3 *db) {
+    int status = 0;
+    int rc;
+    char where[11 + MAX_UINT64_STR + 1];
+    char *set = NULL;
+    char *stats_set = NULL;
+    char *err_msg = NULL;
+    uint64_t done = 0;
+    uint64_t store_count = 0;
+    uint64_t *store_ids = NULL;
+    uint64_t extents = 0;
+    sqlite3_stmt *stmt = NULL;
+    json_object *positions = NULL;
+    mapstore_row row;
+
+    if (get_setting(db, SETTING_FRAGMENTATION_STATS, &done) != 0) {
+        return 1;
+    }
+
+    if (done) {
+        return 0;
+    }
+
+    if(sqlite3_exec(db, "BEGIN", 0, 0, &err_msg) != SQLITE_OK) {
+        fprintf(stderr, "SQL error: %s\n", err_msg);
+        sqlite3_free(err_msg);
+        return 1;
+    }
+
+    store_count = get_count(db, "SELECT count(*) FROM `map_stores`;");
+    store_ids = calloc(store_count + 1, sizeof(uint64_t));
+
+    char *store_query = "SELECT Id FROM `map_stores`";
+    if ((rc = sqlite3_prepare_v2(db, store_query, strlen(store_query), &stmt, 0)) != SQLITE_OK) {
+        fprintf(stderr, "sql error: %s\n", sqlite3_errmsg(db));
+        status = 1;
+        goto end_backfill;
+    }
+
+    for (uint64_t i = 0; i < store_count && sqlite3_step(stmt) == SQLITE_ROW; i++) {
+        store_ids[i] = sqlite3_column_int64(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
+    stmt = NULL;
+
+    for (uint64_t i = 0; i < store_count; i++) {
+        memset(where, '\0', 11 + MAX_UINT64_STR + 1);
+        sprintf(where, "WHERE Id = %"PRIu64, store_ids[i]);
+
+        if (get_store_rows(db, where, &row) != 0 || row.free_locations == NULL) {
+            status = 1;
+            goto end_backfill;
+        }
+
+        stats_set = free_list_stats_set(row.free_locations);
+        set = calloc(strlen(stats_set) + 5, sizeof(char));
+        sprintf(set, "SET %s", stats_set);
+        status = update_map_store(db, where, set);
+
+        free(set);
+        free(stats_set);
+        json_object_put(row.free_locations);
+
+        if (status != 0) {
+            goto end_backfill;
+        }
+    }
+
+    if(sqlite3_exec(db, "DELETE FROM `object_extent_stats`", 0, 0, &err_msg) != SQLITE_OK) {
+        fprintf(stderr, "SQL error: %s\n", err_msg);
+        sqlite3_free(err_msg);
+        status = 1;
+        goto end_backfill;
+    }
+
+    char *data_query = "SELECT positions FROM `data_locations`";
+    if ((rc = sqlite3_prepare_v2(db, data_query, strlen(data_query), &stmt, 0)) != SQLITE_OK) {
+        fprintf(stderr, "sql error: %s\n", sqlite3_errmsg(db));
+        status = 1;
+        goto end_backfill;
+    }
+
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        positions = json_tokener_parse((const char *)sqlite3_column_text(stmt, 0));
+        extents = (positions) ? positions_extents(positions) : 0;
+
+        if (positions) {
+            json_object_put(positions);
+        }
+
+        if (update_object_extent_stats(db, extents, 1) != 0) {
+            status = 1;
+            goto end_backfill;
+        }
+    }
+
+    status = save_setting(db, SETTING_FRAGMENTATION_STATS, 1);
+
+end_backfill:
+    sqlite3_finalize(stmt);
+    free(store_ids);
+
+    if(sqlite3_exec(db, (status == 0) ? "COMMIT" : "ROLLBACK", 0, 0, &err_msg) != SQLITE_OK) {
+        fprintf(stderr, "SQL error: %s\n", err_msg);
+        sqlite3_free(err_msg);
+        status = 1;
+    }
+
+    return status;
+}
@@ -9,6 +9,7 @@
 #define _GNU_SOURCE
 
 #include <assert.h>
+#include <ctype.h>
 #include <errno.h>
 #include <math.h>
 #include <json-c/json.h>
@@ -22,9 +23,45 @@
 #include <sys/stat.h>
 #include <sqlite3.h>
 
+/**
+* Metadata can be split across several databases. data_locations rows are
+* routed by hash prefix and map_stores rows by ranges of stores_per_shard ids.
+* Shard 0 is shards.sqlite and also holds the layout, settings and
+* restructure checkpoint.
+*/
+typedef struct  {
+  sqlite3 **dbs;
+  uint64_t total;
+  uint64_t stores_per_shard;
+} metadata_shards;
+
+#define EXTENT_SIZE_CLASSES 64
+
+/**
+* Free space layout of one map store, or of the whole store when store_id is
+* 0. extent_histogram[n] counts free extents of [2^n, 2^(n+1)) bytes. The
+* fragmentation index is 1 - largest_free_extent / free_space.
+*/
+typedef struct  {
+  uint64_t store_id;
+  uint64_t size;
+  uint64_t free_space;
+  uint64_t free_extents;
+  uint64_t largest_free_extent;
+  uint64_t extent_histogram[EXTENT_SIZE_CLASSES];
+  double fragmentation_index;
+} free_space_info;
+
 #include "mapstore.h"
 #include "utils.h"
 
+#define DATABASE_BUSY_TIMEOUT 10000
+#define DEFAULT_READ_CONNECTIONS 4
+#define SETTING_METADATA_SHARDS "metadata_shards"
+#define SETTING_STORES_PER_SHARD "stores_per_shard"
+#define SETTING_FRAGMENTATION_STATS "fragmentation_stats"
+#define SETTING_BLOCK_SIZE "block_size"
+
 typedef struct  {
   int id;
   char *hash;
@@ -40,25 +77,82 @@ typedef struct  {
   uint64_t size;
 } mapstore_row;
 
+/**
+* A region of a map store split into slots of class_size bytes. Bit n of
+* bitmap is set while slot n holds an object.
+*/
+typedef struct  {
+  uint64_t id;
+  uint64_t store_id;
+  uint64_t class_size;
+  uint64_t first;
+  uint64_t slots;
+  uint64_t bitmap;
+  uint64_t used;
+} slab_row;
+
 typedef struct  {
   int id;
   uint64_t allocation_size;
   uint64_t map_size;
 } mapstore_layout_row;
 
+typedef struct  {
+  int id;
+  uint64_t allocation_size;
+  uint64_t map_size;
+  uint64_t last_id;
+  uint64_t migrated;
+  uint64_t shard;
+} restructure_checkpoint_row;
+
+int open_database(char *path, sqlite3 **db);
+int open_read_database(char *path, sqlite3 **db);
 int prepare_tables(sqlite3 *db);
+int add_column_if_missing(sqlite3 *db, char *table, char *column, char *definition);
+void shard_database_path(char *base_path, uint64_t shard, char *path, size_t len);
+int open_metadata_shards(char *base_path, uint64_t total, bool read_only, metadata_shards *shards);
+void close_metadata_shards(metadata_shards *shards);
+uint64_t shard_for_hash(metadata_shards *shards, char *hash);
+uint64_t shard_for_store(metadata_shards *shards, uint64_t store_id);
+sqlite3 *db_for_hash(metadata_shards *shards, char *hash);
+sqlite3 *db_for_store(metadata_shards *shards, uint64_t store_id);
+int sum_column_for_shards(metadata_shards *shards, char *column, char *table, uint64_t *sum);
+uint64_t get_count_for_shards(metadata_shards *shards, char *query);
+int get_setting(sqlite3 *db, char *key, uint64_t *value);
+int save_setting(sqlite3 *db, char *key, uint64_t value);
+int update_object_extent_stats(sqlite3 *db, uint64_t extents, int delta);
+int get_object_extent_stats(sqlite3 *db, uint64_t *objects, uint64_t *total_extents, uint64_t *max_extents);
+int get_store_fragmentation(sqlite3 *db, uint64_t store_id, free_space_info *info);
+int backfill_fragmentation_stats(sqlite3 *db);
 int get_latest_layout_row(sqlite3 *db, mapstore_layout_row *row);
+int get_store_size(sqlite3 *db, uint64_t store_id, uint64_t *size);
 int get_store_rows(sqlite3 *db, char *where, mapstore_row *row);
 int get_data_locations_row(sqlite3 *db, char *hash, data_locations_row *row);
 int sum_column_for_table(sqlite3 *db, char *column, char *table, uint64_t *sum);
+int get_map_store_sizes(sqlite3 *db, uint64_t *sizes, uint64_t total);
 int update_map_store(sqlite3 *db, char *where, char *set);
 int insert_to(sqlite3 *db, char *table, char *set);
+int get_slab_row(sqlite3 *db, char *where, slab_row *row);
+int insert_slab(sqlite3 *db, slab_row *row);
+int update_slab(sqlite3 *db, slab_row *row);
+int delete_slab(sqlite3 *db, uint64_t id);
 int hash_exists_in_mapstore(sqlite3 *db, char *hash);
-int mark_as_uploaded(sqlite3 *db, char *hash);
+int mark_as_uploaded(sqlite3 *db, char *hash, json_object *positions);
 int get_pos_from_data_locations(sqlite3 *db, char *hash, json_object **positions);
+int get_pos_for_hashes(sqlite3 *db, char **hashes, uint64_t count, json_object *found);
+int insert_inline_data(sqlite3 *db, char *hash, const uint8_t *data, uint64_t size);
+int get_inline_data(sqlite3 *db, char *hash, uint8_t **data, uint64_t *size);
+int delete_inline_data(sqlite3 *db, char *hash);
 int delete_by_hash_from_data_locations(sqlite3 *db, char *hash);
+int take_data_locations_row(sqlite3 *db, char *hash, json_object **positions);
+int move_data_location(sqlite3 *db, uint64_t id, json_object *positions, uint64_t old_extents, bool *moved);
+int insert_data_location_row(sqlite3 *db, char *values, uint64_t extents);
 int delete_by_id_from_map_stores(sqlite3 *db, uint64_t id);
 int get_count(sqlite3 *db, char *query);
 int get_data_hashes(sqlite3 *db, char hashes[][41]);
+int get_data_hashes_after(sqlite3 *db, uint64_t after_id, int limit, char hashes[][41], uint64_t *ids);
+int get_restructure_checkpoint(sqlite3 *db, restructure_checkpoint_row *row);
+int save_restructure_checkpoint(sqlite3 *db, restructure_checkpoint_row *row);
 
 #endif /* MAPSTORE_DATABASE_UTILS_H */
@@ -1,4 +1,9 @@
 #include "mapstore.h"
+#include "shared_state.h"
+#include "block_bitmap.h"
+#include "metrics.h"
+#include "trace.h"
+#include "capture.h"
 
 /**
 * Initialize everything
@@ -6,8 +11,13 @@
 MAPSTORE_API int initialize_mapstore(mapstore_ctx *ctx, mapstore_opts opts) {
     int status = 0;
     sqlite3 *db = NULL;
+    uint64_t block_size = 0;
+    uint64_t started = metrics_now();
     // ctx = NULL;
     ctx->db = NULL;
+    ctx->shards.dbs = NULL;
+    ctx->shards.total = 0;
+    ctx->shards.stores_per_shard = 1;
 
     /* Initialized path variables */
     ctx->mapstore_path = NULL;
@@ -15,6 +25,38 @@ MAPSTORE_API int initialize_mapstore(mapstore_ctx *ctx, mapstore_opts opts) {
     ctx->base_path = NULL;
     char *base_path = NULL;
     char *map_folder = NULL;
+    char *values = NULL;
+
+    ctx->store_locks = NULL;
+    ctx->total_store_locks = 0;
+    ctx->multi_process = opts.multi_process;
+    ctx->shared_state_fd = -1;
+    ctx->shared_state = NULL;
+    ctx->shared_state_size = 0;
+    ctx->reader_sets = NULL;
+    ctx->metrics = NULL;
+    ctx->sync_writes = opts.sync_writes;
+    ctx->direct_io_threshold = opts.direct_io_threshold;
+    ctx->punch_holes = opts.punch_holes;
+    ctx->inline_threshold = opts.inline_threshold;
+    ctx->engine = opts.engine;
+    ctx->gc_live_ratio = opts.gc_live_ratio;
+    ctx->log = NULL;
+    ctx->slab_classes = NULL;
+    ctx->total_slab_classes = 0;
+    ctx->has_slabs = false;
+    ctx->block_size = (opts.block_size) ? opts.block_size : DEFAULT_BLOCK_SIZE;
+    ctx->blocks = NULL;
+    ctx->skip_verify = opts.skip_verify;
+    ctx->lazy_create = opts.lazy_create && !opts.metadata_only;
+    ctx->creator = NULL;
+    ctx->capture = NULL;
+    ctx->metadata_only = opts.metadata_only;
+    ctx->batch = NULL;
+    memset(&ctx->trace, 0, sizeof(mapstore_trace_callbacks));
+    ctx->readers = NULL;
+    ctx->total_readers = 0;
+    ctx->available_readers = 0;
 
     ctx->prealloc = (opts.prealloc) ? opts.prealloc : false;
 
@@ -26,6 +68,64 @@ MAPSTORE_API int initialize_mapstore(mapstore_ctx *ctx, mapstore_opts opts) {
         goto end_initalize;
     }
 
+    /* Another process could truncate a file this one is already writing to */
+    if (ctx->lazy_create && ctx->multi_process) {
+        fprintf(stderr, "Can't initialize mapstore context: " \
+                        "lazy_create is not available with multi_process\n");
+        status = 1;
+        goto end_initalize;
+    }
+
+    /* Each process would append to its own idea of the active segment */
+    if (ctx->engine == MAPSTORE_ENGINE_LOG && ctx->multi_process) {
+        fprintf(stderr, "Can't initialize mapstore context: " \
+                        "the log engine is not available with multi_process\n");
+        status = 1;
+        goto end_initalize;
+    }
+
+    /* Slabs never move, which the log would need them to */
+    if (ctx->engine == MAPSTORE_ENGINE_LOG && opts.total_slab_classes > 0) {
+        fprintf(stderr, "Can't initialize mapstore context: " \
+                        "slab classes are not available with the log engine\n");
+        status = 1;
+        goto end_initalize;
+    }
+
+    /* The block bitmap is private to one process */
+    if (ctx->engine == MAPSTORE_ENGINE_BITMAP && ctx->multi_process) {
+        fprintf(stderr, "Can't initialize mapstore context: " \
+                        "the bitmap engine is not available with multi_process\n");
+        status = 1;
+        goto end_initalize;
+    }
+
+    /* Slabs are carved from the free lists the bitmap engine doesn't keep */
+    if (ctx->engine == MAPSTORE_ENGINE_BITMAP && opts.total_slab_classes > 0) {
+        fprintf(stderr, "Can't initialize mapstore context: " \
+                        "slab classes are not available with the bitmap engine\n");
+        status = 1;
+        goto end_initalize;
+    }
+
+    /* Extents start on a block so blocks must keep direct I/O aligned */
+    if (ctx->engine == MAPSTORE_ENGINE_BITMAP && ctx->direct_io_threshold > 0 &&
+        ctx->block_size % DIRECT_IO_ALIGN != 0) {
+        fprintf(stderr, "Can't initialize mapstore context: " \
+                        "block_size must be a multiple of %d for direct I/O\n", DIRECT_IO_ALIGN);
+        status = 1;
+        goto end_initalize;
+    }
+
+    if (opts.total_slab_classes > 0) {
+        if (!(ctx->slab_classes = calloc(opts.total_slab_classes, sizeof(uint64_t)))) {
+            status = 1;
+            goto end_initalize;
+        }
+        memcpy(ctx->slab_classes, opts.slab_classes, opts.total_slab_classes * sizeof(uint64_t));
+        ctx->total_slab_classes = opts.total_slab_classes;
+    }
+
     ctx->allocation_size = opts.allocation_size;
     ctx->map_size = (opts.map_size) ? opts.map_size : 2147483648; // Default to 2GB if not map_size provided
 
@@ -53,12 +153,14 @@ MAPSTORE_API int initialize_mapstore(mapstore_ctx *ctx, mapstore_opts opts) {
     ctx->database_path = calloc(strlen(base_path) + 15, sizeof(char));
     sprintf(ctx->database_path, "%s%cshards.sqlite", base_path, separator());
 
-    if (sqlite3_open_v2(
-        ctx->database_path,
-        &db,
-        SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_SHAREDCACHE | SQLITE_OPEN_FULLMUTEX,
-        NULL) != SQLITE_OK) {
-        fprintf(stderr, "Can't open database: %s\n", sqlite3_errmsg(db));
+    /* Roll forward a restructure that was interrupted while swapping stores */
+    if (finish_restructure_swap(ctx->base_path) != 0) {
+        fprintf(stderr, "Could not finish swapping restructured store\n");
+        status = 1;
+        goto end_initalize;
+    }
+
+    if (open_database(ctx->database_path, &db) != 0) {
         status = 1;
         goto end_initalize;
     }
@@ -84,21 +186,74 @@ MAPSTORE_API int initialize_mapstore(mapstore_ctx *ctx, mapstore_opts opts) {
     /* get previous layout for comparing size changes */
     mapstore_layout_row previous_layout;
     if (get_latest_layout_row(ctx->db, &previous_layout) != 0) {
+        status = 1;
         goto end_initalize;
     };
 
-    if (previous_layout.allocation_size != 0 &&
-        previous_layout.map_size != 0 &&
-        (previous_layout.map_size != ctx->map_size ||
-        previous_layout.allocation_size != ctx->allocation_size)) {
-        fprintf(stdout, "Cannot create mapstore of different values on top of current store\n");
+    /* Open the remaining metadata shards. Shard 0 replaces the connection above. */
+    if (configure_metadata_shards(ctx, opts.metadata_shards, previous_layout.map_size != 0) != 0) {
+        fprintf(stderr, "Could not open metadata shards\n");
         status = 1;
         goto end_initalize;
     }
 
-    if (previous_layout.map_size == ctx->map_size &&
-        previous_layout.allocation_size == ctx->allocation_size) {
-        // fprintf(stdout, "Map store already created\n");
+    sqlite3_close_v2(db);
+    ctx->db = db = ctx->shards.dbs[0];
+
+    /* Resume a restructure that was interrupted while migrating data */
+    restructure_checkpoint_row checkpoint;
+    if (get_restructure_checkpoint(ctx->db, &checkpoint) != 0) {
+        status = 1;
+        goto end_initalize;
+    }
+
+    if (checkpoint.id != 0 && previous_layout.map_size != 0) {
+        uint64_t requested_map_size = ctx->map_size;
+        uint64_t requested_allocation_size = ctx->allocation_size;
+
+        ctx->map_size = previous_layout.map_size;
+        ctx->allocation_size = previous_layout.allocation_size;
+        ctx->total_mapstores = get_count_for_shards(&ctx->shards, "SELECT count(*) FROM `map_stores`;");
+
+        fprintf(stdout, "Resuming restructure after %"PRIu64" migrated items\n", checkpoint.migrated);
+        if (restructure(ctx, checkpoint.map_size, checkpoint.allocation_size) != 0) {
+            fprintf(stderr, "Failed to resume restructure\n");
+            status = 1;
+            goto end_initalize;
+        }
+
+        db = ctx->db;
+        ctx->map_size = requested_map_size;
+        ctx->allocation_size = requested_allocation_size;
+
+        if (get_latest_layout_row(ctx->db, &previous_layout) != 0) {
+            status = 1;
+            goto end_initalize;
+        }
+    }
+
+    if (previous_layout.allocation_size != 0 && previous_layout.map_size != 0) {
+        /* Existing stores may have been grown unevenly so trust the table over the formula */
+        ctx->total_mapstores = get_count_for_shards(&ctx->shards, "SELECT count(*) FROM `map_stores`;");
+
+        if (previous_layout.map_size == ctx->map_size &&
+            previous_layout.allocation_size == ctx->allocation_size) {
+            // fprintf(stdout, "Map store already created\n");
+            goto end_initalize;
+        }
+
+        if (previous_layout.map_size > ctx->map_size ||
+            previous_layout.allocation_size > ctx->allocation_size) {
+            fprintf(stdout, "Cannot shrink mapstore in place. Use restructure instead\n");
+            status = 1;
+            goto end_initalize;
+        }
+
+        /* Sizes only went up so we can grow without moving any data */
+        if (grow_map_stores(ctx) != 0) {
+            fprintf(stderr, "Failed to grow mapstore\n");
+            status = 1;
+        }
         goto end_initalize;
     }
 
@@ -121,23 +276,19 @@ MAPSTORE_API int initialize_mapstore(mapstore_ctx *ctx, mapstore_opts opts) {
     /* Update database to know metadata about each mmap file */
     for (uint64_t f = 1; f <= ctx->total_mapstores; f++) {
         /* Insert new data */
-        memset(query, '\0', BUFSIZ);
-        sprintf(query,
-                "VALUES(%"PRIu64", '[[ 0, %"PRIu64" ]]', %"PRIu64", %"PRIu64")",
-                f,
-                ctx->map_size - 1,
-                ctx->map_size,
-                ctx->map_size);
+        values = new_map_store_values(f, ctx->map_size);
+        status = insert_to(db_for_store(&ctx->shards, f), "map_stores", values);
+        free(values);
 
-        if (insert_to(db, "map_stores", query) != 0) {
-            status = 1;
+        if (status != 0) {
             goto end_initalize;
         }
 
         // Create map file
         memset(mapstore_path, '\0', BUFSIZ);
         sprintf(mapstore_path, "%s%"PRIu64".map", ctx->mapstore_path, f);
-        if (create_map_store(mapstore_path, ctx->map_size, ctx->prealloc) != 0) {
+        if (!ctx->metadata_only && !ctx->lazy_create &&
+            create_map_store(mapstore_path, ctx->map_size, ctx->prealloc) != 0) {
             fprintf(stderr,
                 "Failed to create mapped file: %s of size %"PRIu64,
                 ctx->mapstore_path,
@@ -150,6 +301,71 @@ MAPSTORE_API int initialize_mapstore(mapstore_ctx *ctx, mapstore_opts opts) {
     }
 
 end_initalize:
+    if (status == 0 && init_metrics(ctx) != 0) {
+        fprintf(stderr, "Could not allocate metrics\n");
+        status = 1;
+    }
+
+    if (status == 0 && init_store_locks(ctx) != 0) {
+        fprintf(stderr, "Could not create map store locks\n");
+        status = 1;
+    }
+
+    if (status == 0 && init_batch(ctx) != 0) {
+        fprintf(stderr, "Could not create batch lock\n");
+        status = 1;
+    }
+
+    /* Slabs outlive the options that made them */
+    if (status == 0) {
+        ctx->has_slabs = ctx->total_slab_classes > 0 ||
+                         get_count_for_shards(&ctx->shards, "SELECT count(*) FROM `slabs`;") > 0;
+    }
+
+    if (status == 0 && ctx->engine == MAPSTORE_ENGINE_LOG && init_log(ctx) != 0) {
+        fprintf(stderr, "Could not create log engine state\n");
+        status = 1;
+    }
+
+    if (status == 0 && ctx->engine == MAPSTORE_ENGINE_BITMAP && open_block_bitmap(ctx) != 0) {
+        fprintf(stderr, "Could not open block bitmap\n");
+        status = 1;
+    }
+
+    /* Other engines would place extents inside blocks the bitmap owns */
+    if (status == 0 && ctx->engine != MAPSTORE_ENGINE_BITMAP &&
+        (get_setting(ctx->db, SETTING_BLOCK_SIZE, &block_size) != 0 || block_size != 0)) {
+        fprintf(stderr, "Can't initialize mapstore context: " \
+                        "store uses the bitmap engine\n");
+        status = 1;
+    }
+
+    if (status == 0 && ctx->multi_process && open_shared_state(ctx) != 0) {
+        fprintf(stderr, "Could not open shared allocator state\n");
+        status = 1;
+    }
+
+    if (status == 0 &&
+        init_read_pool(ctx, (opts.read_connections) ? opts.read_connections : DEFAULT_READ_CONNECTIONS) != 0) {
+        fprintf(stderr, "Could not open read connections\n");
+        status = 1;
+    }
+
+    if (status == 0 && ctx->lazy_create && init_map_creator(ctx, opts.create_threads, started) != 0) {
+        fprintf(stderr, "Could not start creating map stores\n");
+        status = 1;
+    }
+
+    /* Files a lazy context didn't get to are created now, whatever the layout */
+    if (status == 0 && !ctx->lazy_create && !ctx->metadata_only && finish_map_files(ctx) != 0) {
+        fprintf(stderr, "Could not create map stores\n");
+        status = 1;
+    }
+
+    if (status == 0) {
+        metrics_startup(ctx, started);
+    }
+
     if (status == 1) {
         struct stat st;
         for (uint64_t store = 1; store <= ctx->total_mapstores; store++) {
@@ -169,35 +385,127 @@ end_initalize:
 
         if (ctx->mapstore_path) {
             free(ctx->mapstore_path);
+            ctx->mapstore_path = NULL;
         }
 
         if (ctx->database_path) {
             free(ctx->database_path);
+            ctx->database_path = NULL;
         }
 
         if (base_path) {
             free(base_path);
+            ctx->base_path = NULL;
+        }
+
+        free_map_creator(ctx);
+        free_read_pool(ctx);
+        free_batch(ctx);
+        free_log(ctx);
+        free(ctx->slab_classes);
+        ctx->slab_classes = NULL;
+        close_block_bitmap(ctx, false);
+
+        if (ctx->shards.dbs) {
+            close_metadata_shards(&ctx->shards);
+        } else if (ctx->db) {
+            sqlite3_close_v2(ctx->db);
         }
+        ctx->db = NULL;
+
+        free_store_locks(ctx);
+        close_shared_state(ctx);
+        free_metrics(ctx);
     }
 
     return status;
 }
 
 /**
-* Store data
+* Fails if the hash is already stored
 */
-MAPSTORE_API int store_data(mapstore_ctx *ctx, int fd, uint64_t data_size, char *hash) {
+static int check_new_hash(mapstore_ctx *ctx, char *hash, uint64_t data_size) {
+    int status = 0;
+    uint64_t timer = metrics_now();
+    trace_span span;
+
+    TRACE_BEGIN(ctx, &span, MAPSTORE_TRACE_HASH_CHECK, hash, data_size, NULL);
+    metadata_shards *readers = checkout_reader(ctx);
+    status = hash_exists_in_mapstore(db_for_hash(readers, hash), hash);
+    checkin_reader(ctx, readers);
+    TRACE_END(ctx, &span, NULL, status);
+    METRICS_PHASE(ctx->metrics, MAPSTORE_PHASE_HASH_CHECK, timer);
+
+    if (status != 0) {
+        fprintf(stderr, "Hash already exists in mapstore\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+* Add the data to data_locations. Fails if another thread stored the same hash
+* first.
+*/
+static int insert_data_location(mapstore_ctx *ctx, char *hash, uint64_t data_size,
+                                json_object *positions, bool *inserted) {
     int status = 0;
-    json_object *map_plan = json_object_new_object();
-    char where[BUFSIZ];
     char *set = NULL;
-    json_object *free_pos_obj = NULL;
-    json_object *store_positions_obj = NULL;
-    json_object *used_space_obj = NULL;
+    sqlite3 *db = db_for_hash(&ctx->shards, hash);
+    uint64_t timer = metrics_now();
+    trace_span span;
+
+    set = calloc(strlen(json_object_to_json_string(positions)) + MAX_UINT64_STR + HASH_LENGTH + 55 + 1, sizeof(char));
+    sprintf(set,
+            "(hash,size,positions,uploaded) VALUES('%s',%"PRIu64",'%s','false')",
+            hash,
+            data_size,
+            json_object_to_json_string(positions));
+
+    TRACE_BEGIN(ctx, &span, MAPSTORE_TRACE_METADATA, hash, data_size, positions);
+    if ((status = insert_data_location_row(db, set, positions_extents(positions))) != 0) {
+        status = 1;
+        goto end_insert_data_location;
+    }
+    *inserted = true;
+    METRICS_PHASE(ctx->metrics, MAPSTORE_PHASE_METADATA, timer);
+
+end_insert_data_location:
+    TRACE_END(ctx, &span, NULL, status);
+    free(set);
+
+    return status;
+}
+
+/**
+* Stores data under hash. Without a hash, or when hashing, the content hash
+* is computed while the data is written. A known hash is then verified and
+* an unknown one is checked and recorded once the data is written.
+*/
+static int store_object(mapstore_ctx *ctx, int fd, uint64_t data_size, char *hash,
+                        bool hashing, char **computed) {
+    int status = 0;
+    bool inserted = false;
+    bool inlined = false;
+    bool stored_inline = false;
+    uint8_t *inline_data = NULL;
+    char *digest = NULL;
     json_object *all_data_locations = json_object_new_object();
+    json_object *taken = NULL;
+    struct sha256_ctx hasher;
+    uint64_t started = metrics_now();
+    uint64_t timer = started;
+    uint64_t captured = capture_now(ctx);
+    trace_span span;
 
-    if((status = hash_exists_in_mapstore(ctx->db, hash)) != 0) {
-        fprintf(stderr, "Hash already exists in mapstore\n");
+    span.enabled = false;
+    hashing = hashing && !ctx->metadata_only;
+    sha256_init(&hasher);
+
+    enter_batch(ctx);
+
+    if (hash && check_new_hash(ctx, hash, data_size) != 0) {
         status = 1;
         goto end_store_data;
     }
@@ -210,71 +518,179 @@ MAPSTORE_API int store_data(mapstore_ctx *ctx, int fd, uint64_t data_size, char
         goto end_store_data;
     }
 
-    // Determine space available
-    if((status = get_map_plan(ctx->db, ctx->total_mapstores, data_size, map_plan)) != 0) {
+    // Tiny objects skip the map stores, their bytes go into the metadata shard
+    stored_inline = ctx->inline_threshold > 0 && !ctx->metadata_only && data_size <= ctx->inline_threshold;
+
+    // Reserve space and update map_stores free_locations and free_space
+    if (!stored_inline) {
+        TRACE_BEGIN(ctx, &span, MAPSTORE_TRACE_PLAN, hash, data_size, NULL);
+        status = reserve_map_space(ctx, data_size, all_data_locations);
+        TRACE_END(ctx, &span, all_data_locations, status);
+    }
+
+    if(status != 0) {
+        json_object_put(all_data_locations);
+        all_data_locations = NULL;
         status = 1;
         goto end_store_data;
     }
 
-    // Update map_stores free_locations and free_space
-    json_object_object_foreach(map_plan, store_id, store_meta) {
-        if (set) {
-            free(set);
-            set = NULL;
-        }
-        json_object_object_get_ex(store_meta, "free_positions", &free_pos_obj);
-        json_object_object_get_ex(store_meta, "store_positions", &store_positions_obj);
-        json_object_object_get_ex(store_meta, "used_space", &used_space_obj);
+    if (hash && insert_data_location(ctx, hash, data_size, all_data_locations, &inserted) != 0) {
+        status = 1;
+        goto end_store_data;
+    }
 
-        memset(where, '\0', BUFSIZ);
-        sprintf(where, "WHERE Id=%s", store_id);
-        set = calloc(strlen(json_object_to_json_string(free_pos_obj)) + MAX_UINT64_STR + 51 + 1, sizeof(char));
-        sprintf(set,
-                "SET free_space = free_space - %"PRIu64", free_locations = '%s'",
-                json_object_get_int64(used_space_obj),
-                json_object_to_json_string(free_pos_obj));
+    // Store data in mmap files. No locks are held while doing I/O.
+    timer = metrics_now();
+    TRACE_BEGIN(ctx, &span, MAPSTORE_TRACE_DATA_WRITE, hash, data_size, all_data_locations);
+    if (stored_inline) {
+        status = read_to_buffer(fd, data_size, &inline_data, (hashing) ? &hasher : NULL);
+    } else if (!ctx->metadata_only) {
+        status = write_to_store(fd, ctx->mapstore_path, all_data_locations, (hashing) ? &hasher : NULL,
+                                DIRECT_IO(ctx, data_size));
+    }
+    if (status != 0) {
+        status = 1;
+        goto end_store_data;
+    }
+    TRACE_END(ctx, &span, NULL, 0);
 
-        if((status = update_map_store(ctx->db, where, set)) != 0) {
+    // Data must be durable before it is marked as uploaded
+    if (ctx->sync_writes && !ctx->metadata_only && !stored_inline) {
+        TRACE_BEGIN(ctx, &span, MAPSTORE_TRACE_FSYNC, hash, data_size, all_data_locations);
+        if((status = sync_map_stores(ctx->mapstore_path, all_data_locations)) != 0) {
             status = 1;
             goto end_store_data;
         }
-
-        json_object_object_add(all_data_locations, store_id, store_positions_obj);
+        TRACE_END(ctx, &span, NULL, 0);
     }
+    METRICS_PHASE(ctx->metrics, MAPSTORE_PHASE_DATA_IO, timer);
 
-    // Add file to data_locations
-    set = calloc(strlen(json_object_to_json_string(all_data_locations)) + MAX_UINT64_STR + HASH_LENGTH + 55 + 1, sizeof(char));
-    sprintf(set,
-            "(hash,size,positions,uploaded) VALUES('%s',%"PRIu64",'%s','false')",
-            hash,
-            data_size,
-            json_object_to_json_string(all_data_locations));
+    if (hashing) {
+        if (!(digest = hash_digest(&hasher))) {
+            status = 1;
+            goto end_store_data;
+        }
 
-    if((status = insert_to(ctx->db, "data_locations", set)) != 0) {
-        status = 1;
-        goto end_store_data;
+        if (hash && strcmp(hash, digest) != 0) {
+            fprintf(stderr, "Data does not match hash %s\n", hash);
+            status = 1;
+            goto end_store_data;
+        }
+
+        if (!hash) {
+            hash = digest;
+            if (check_new_hash(ctx, hash, data_size) != 0 ||
+                insert_data_location(ctx, hash, data_size, all_data_locations, &inserted) != 0) {
+                status = 1;
+                goto end_store_data;
+            }
+        }
     }
 
-    // Store data in mmap files
-    if((status = write_to_store(fd, ctx->mapstore_path, all_data_locations)) != 0) {
-        status = 1;
-        goto end_store_data;
+    if (stored_inline) {
+        if (insert_inline_data(db_for_hash(&ctx->shards, hash), hash, inline_data, data_size) != 0) {
+            status = 1;
+            goto end_store_data;
+        }
+        inlined = true;
     }
 
     // Set uploaded to true in data_locations
-    if((status = mark_as_uploaded(ctx->db, hash)) != 0) {
+    timer = metrics_now();
+    TRACE_BEGIN(ctx, &span, MAPSTORE_TRACE_COMMIT, hash, data_size, all_data_locations);
+    if((status = mark_as_uploaded(db_for_hash(&ctx->shards, hash), hash, all_data_locations)) != 0) {
         status = 1;
         goto end_store_data;
     }
+    TRACE_END(ctx, &span, NULL, 0);
+    METRICS_PHASE(ctx->metrics, MAPSTORE_PHASE_MARK_UPLOADED, timer);
 
 end_store_data:
-    if (set) {
-        free(set);
+    TRACE_END(ctx, &span, NULL, status);
+
+    if (status != 0 && all_data_locations) {
+        if (inserted && take_data_locations_row(db_for_hash(&ctx->shards, hash), hash, &taken) == 0) {
+            json_object_put(taken);
+        }
+        if (inlined) {
+            delete_inline_data(db_for_hash(&ctx->shards, hash), hash);
+        }
+        release_map_space(ctx, all_data_locations);
+    }
+
+    free(inline_data);
+
+    if (all_data_locations) {
+        json_object_put(all_data_locations);
     }
 
-    if (map_plan) {
-        json_object_put(map_plan);
+    leave_batch(ctx);
+
+    METRICS_OP(ctx->metrics, MAPSTORE_OP_STORE, started, data_size, status);
+    capture_op(ctx, MAPSTORE_OP_STORE, (hash) ? hash : "", captured, data_size, status);
+
+    if (computed) {
+        *computed = digest;
+    } else if (digest) {
+        free(digest);
     }
+
+    return status;
+}
+
+/**
+* Store data
+*/
+MAPSTORE_API int store_data(mapstore_ctx *ctx, int fd, uint64_t data_size, char *hash) {
+    if (!hash) {
+        fprintf(stderr, "Missing data hash\n");
+        return 1;
+    }
+
+    return store_object(ctx, fd, data_size, hash, false, NULL);
+}
+
+/**
+* Store data and compute its hash while writing it. A given expected_hash is
+* verified and the store is rolled back if the data does not match.
+*/
+MAPSTORE_API int store_data_hashed(mapstore_ctx *ctx, int fd, uint64_t data_size, char *expected_hash, char **hash) {
+    if (hash) {
+        *hash = NULL;
+    }
+
+    if (!expected_hash && ctx->metadata_only) {
+        fprintf(stderr, "Metadata only stores need the data hash\n");
+        return 1;
+    }
+
+    return store_object(ctx, fd, data_size, expected_hash, true, hash);
+}
+
+/**
+* Write the bytes of an object stored inline, in order when fd can't seek
+*/
+static int copy_inline(mapstore_ctx *ctx, char *hash, int fd, bool in_order, uint64_t *size) {
+    int status = 0;
+    uint8_t *data = NULL;
+
+    metadata_shards *readers = checkout_reader(ctx);
+    status = get_inline_data(db_for_hash(readers, hash), hash, &data, size);
+    checkin_reader(ctx, readers);
+
+    if (status != 0 || !data) {
+        goto end_copy_inline;
+    }
+
+    if (in_order) {
+        status = write_all(fd, (const char *)data, *size);
+    } else if (pwrite(fd, data, *size, 0) != (ssize_t)*size) {
+        status = 1;
+    }
+
+end_copy_inline:
+    free(data);
     return status;
 }
 
@@ -284,119 +700,556 @@ end_store_data:
 MAPSTORE_API int retrieve_data(mapstore_ctx *ctx, int fd, char *hash) {
     int status = 0;
     json_object *positions = NULL;
+    uint64_t bytes = 0;
+    uint64_t started = metrics_now();
+    uint64_t timer = started;
+    uint64_t captured = capture_now(ctx);
+    trace_span span;
 
     // get data map
-    if ((status = get_pos_from_data_locations(ctx->db, hash, &positions)) != 0) {
+    TRACE_BEGIN(ctx, &span, MAPSTORE_TRACE_METADATA, hash, 0, NULL);
+    metadata_shards *readers = checkout_reader(ctx);
+    status = get_pos_from_data_locations(db_for_hash(readers, hash), hash, &positions);
+    checkin_reader(ctx, readers);
+    TRACE_END(ctx, &span, positions, status);
+
+    if (status != 0) {
         fprintf(stderr, "Failed to get positions from data_locations table\n");
         status = 1;
         goto end_retrieve_data;
     }
 
+    METRICS_PHASE(ctx->metrics, MAPSTORE_PHASE_METADATA, timer);
+
     // read from files according to data maps
-    if((status = read_from_store(fd, ctx->mapstore_path, positions)) != 0) {
+    timer = metrics_now();
+    TRACE_BEGIN(ctx, &span, MAPSTORE_TRACE_DATA_READ, hash, positions_size(positions), positions);
+    if (!ctx->metadata_only && positions_extents(positions) == 0) {
+        status = copy_inline(ctx, hash, fd, fd == STDOUT_FILENO || lseek(fd, 0, SEEK_CUR) < 0, &bytes);
+    } else if (!ctx->metadata_only) {
+        status = read_from_store(fd, ctx->mapstore_path, positions, DIRECT_IO(ctx, positions_size(positions)),
+                                 !ctx->skip_verify);
+    }
+    if (status != 0) {
         fprintf(stderr, "Failed to get retreive data from store\n");
         status = 1;
         goto end_retrieve_data;
     }
+    TRACE_END(ctx, &span, NULL, 0);
+    METRICS_PHASE(ctx->metrics, MAPSTORE_PHASE_DATA_IO, timer);
 
 end_retrieve_data:
+    TRACE_END(ctx, &span, NULL, status);
     if (positions) {
+        bytes += positions_size(positions);
         json_object_put(positions);
     }
+
+    METRICS_OP(ctx->metrics, MAPSTORE_OP_RETRIEVE, started, bytes, status);
+    capture_op(ctx, MAPSTORE_OP_RETRIEVE, hash, captured, bytes, status);
     return status;
 }
 
 /**
-* Delete data
+* One extent of an object to copy to its output. in_order extents go to
+* outputs that can't seek and must be written in position order.
 */
-MAPSTORE_API int delete_data(mapstore_ctx *ctx, char *hash) {
+typedef struct  {
+  uint64_t store_id;
+  uint64_t first;
+  uint64_t final;
+  uint64_t position;
+  uint64_t object;
+  json_object *location;
+  bool in_order;
+} read_extent;
+
+/**
+* Positioned outputs are read in elevator order by map store and offset, the
+* others afterwards one object at a time
+*/
+static int compare_read_extents(const void *a, const void *b) {
+    const read_extent *x = a;
+    const read_extent *y = b;
+
+    if (x->in_order != y->in_order) {
+        return (x->in_order) ? 1 : -1;
+    }
+
+    if (x->in_order) {
+        if (x->object != y->object) {
+            return (x->object < y->object) ? -1 : 1;
+        }
+        return (x->position < y->position) ? -1 : (x->position > y->position);
+    }
+
+    if (x->store_id != y->store_id) {
+        return (x->store_id < y->store_id) ? -1 : 1;
+    }
+    return (x->first < y->first) ? -1 : (x->first > y->first);
+}
+
+/**
+* Positions for all hashes, with one query per metadata shard for every
+* MULTI_GET_BATCH hashes
+*/
+static int lookup_positions(mapstore_ctx *ctx, char **hashes, uint64_t count, json_object *found) {
+    int status = 0;
+    uint64_t batched = 0;
+    char **batch = calloc(MULTI_GET_BATCH, sizeof(char *));
+    metadata_shards *readers = NULL;
+
+    if (!batch) {
+        return 1;
+    }
+
+    readers = checkout_reader(ctx);
+    for (uint64_t s = 0; s < readers->total && status == 0; s++) {
+        batched = 0;
+        for (uint64_t h = 0; h < count && status == 0; h++) {
+            if (!valid_hash(hashes[h]) || shard_for_hash(readers, hashes[h]) != s) {
+                continue;
+            }
+
+            batch[batched++] = hashes[h];
+            if (batched == MULTI_GET_BATCH) {
+                status = get_pos_for_hashes(readers->dbs[s], batch, batched, found);
+                batched = 0;
+            }
+        }
+
+        if (status == 0 && batched > 0) {
+            status = get_pos_for_hashes(readers->dbs[s], batch, batched, found);
+        }
+    }
+    checkin_reader(ctx, readers);
+
+    free(batch);
+    return status;
+}
+
+/**
+* Retrieve many objects at once. Every object is written to its own output,
+* at its offsets when the output can seek and in order otherwise. statuses,
+* if given, receives the result of each object.
+*/
+MAPSTORE_API int retrieve_data_multi(mapstore_ctx *ctx, char **hashes, int *outputs, uint64_t count, int *statuses) {
     int status = 0;
+    int store_fd = -1;
+    int *results = statuses;
+    uint64_t *sizes = NULL;
+    uint64_t total_extents = 0;
+    uint64_t open_store = 0;
+    uint64_t total_bytes = 0;
+    uint64_t largest = 0;
+    char mapstore_path[BUFSIZ];
+    char *buf = NULL;
+    json_object *found = json_object_new_object();
     json_object *positions = NULL;
-    json_object *updated_positions = NULL;
-    json_object *free_pos_obj = NULL;
-    json_object *free_space_obj = NULL;
-    char where[9 + MAX_UINT64_STR + 1];
-    char *set = NULL;
+    json_object *location = NULL;
+    read_extent *extents = NULL;
+    read_extent *extent = NULL;
+    uint64_t started = metrics_now();
+    uint64_t timer = started;
+    uint64_t captured = capture_now(ctx);
+    trace_span span;
 
-    // get data map
-    if ((status = get_pos_from_data_locations(ctx->db, hash, &positions)) != 0) {
+    span.enabled = false;
+
+    if (!results && !(results = calloc(count, sizeof(int)))) {
+        status = 1;
+        goto end_retrieve_data_multi;
+    }
+
+    if (!(sizes = calloc(count, sizeof(uint64_t)))) {
+        status = 1;
+        goto end_retrieve_data_multi;
+    }
+
+    TRACE_BEGIN(ctx, &span, MAPSTORE_TRACE_METADATA, NULL, 0, NULL);
+    if (lookup_positions(ctx, hashes, count, found) != 0) {
         fprintf(stderr, "Failed to get positions from data_locations table\n");
         status = 1;
-        goto end_delete_data;
+        goto end_retrieve_data_multi;
     }
+    TRACE_END(ctx, &span, NULL, 0);
+    METRICS_PHASE(ctx->metrics, MAPSTORE_PHASE_METADATA, timer);
+
+    for (uint64_t i = 0; i < count; i++) {
+        results[i] = 0;
+        if (!valid_hash(hashes[i]) || !json_object_object_get_ex(found, hashes[i], &positions)) {
+            fprintf(stderr, "Failed to get positions for %s\n", (hashes[i]) ? hashes[i] : "(null)");
+            results[i] = 1;
+            continue;
+        }
 
-    // add each location to map_stores table free_locations
-    if ((status = get_updated_free_locations(ctx->db, positions, &updated_positions)) != 0) {
+        sizes[i] = positions_size(positions);
+        total_bytes += sizes[i];
+        largest = (sizes[i] > largest) ? sizes[i] : largest;
+        total_extents += positions_extents(positions);
+    }
+
+    if (total_extents > 0 && (!(extents = calloc(total_extents, sizeof(read_extent))) ||
+                              !(buf = malloc(chunk_buffer_size(largest))))) {
         status = 1;
-        goto end_delete_data;
-    };
+        goto end_retrieve_data_multi;
+    }
+
+    total_extents = 0;
+    for (uint64_t i = 0; i < count; i++) {
+        if (results[i] != 0) {
+            continue;
+        }
+
+        json_object_object_get_ex(found, hashes[i], &positions);
+        bool in_order = lseek(outputs[i], 0, SEEK_CUR) < 0;
+
+        json_object_object_foreach(positions, store_id, arr) {
+            for (uint64_t e = 0; e < json_object_array_length(arr); e++) {
+                location = json_object_array_get_idx(arr, e);
+                extent = &extents[total_extents++];
+                extent->store_id = strtoull(store_id, NULL, 10);
+                extent->position = json_object_get_int64(json_object_array_get_idx(location, 0));
+                extent->first = json_object_get_int64(json_object_array_get_idx(location, 1));
+                extent->final = json_object_get_int64(json_object_array_get_idx(location, 2));
+                extent->object = i;
+                extent->location = location;
+                extent->in_order = in_order;
+            }
+        }
+    }
+
+    qsort(extents, total_extents, sizeof(read_extent), compare_read_extents);
+
+    timer = metrics_now();
+    TRACE_BEGIN(ctx, &span, MAPSTORE_TRACE_DATA_READ, NULL, total_bytes, NULL);
+    for (uint64_t e = 0; e < total_extents && !ctx->metadata_only; e++) {
+        extent = &extents[e];
+        if (results[extent->object] != 0) {
+            continue;
+        }
+
+        if (extent->store_id != open_store) {
+            if (store_fd >= 0) {
+                close(store_fd);
+            }
+
+            memset(mapstore_path, '\0', BUFSIZ);
+            sprintf(mapstore_path, "%s%"PRIu64".map", ctx->mapstore_path, extent->store_id);
+            open_store = extent->store_id;
+            if ((store_fd = open(mapstore_path, O_RDONLY)) < 0) {
+                fprintf(stderr, "Error opening mapstore for reading: %s\n", mapstore_path);
+            }
+        }
 
-    // Update freespace for map_store with updated_positions
-    json_object_object_foreach(updated_positions, store_id, store_meta) {
-        json_object_object_get_ex(store_meta, "free_positions", &free_pos_obj);
-        json_object_object_get_ex(store_meta, "free_space", &free_space_obj);
-        memset(where, '\0', 9 + MAX_UINT64_STR + 1);
-        if (set) {
-            free(set);
-        }
-        set = calloc(38 + strlen(json_object_to_json_string(free_pos_obj)) + MAX_UINT64_STR + 1, sizeof(char));
-        sprintf(where, "WHERE Id=%s", store_id);
-        sprintf(set,
-                "SET free_space = %"PRIu64", free_locations = '%s'",
-                json_object_get_int64(free_space_obj),
-                json_object_to_json_string(free_pos_obj));
-
-        if((status = update_map_store(ctx->db, where, set)) != 0) {
+        if (store_fd < 0 || copy_from_store(store_fd, -1, extent->location, outputs[extent->object],
+                                            extent->in_order, !ctx->skip_verify, buf) != 0) {
+            fprintf(stderr, "Failed to retrieve data: %s\n", hashes[extent->object]);
+            results[extent->object] = 1;
+        }
+    }
+
+    /* Objects without extents are stored inline */
+    for (uint64_t i = 0; i < count && !ctx->metadata_only; i++) {
+        if (results[i] != 0 || sizes[i] > 0) {
+            continue;
+        }
+
+        json_object_object_get_ex(found, hashes[i], &positions);
+        if (positions_extents(positions) == 0 &&
+            copy_inline(ctx, hashes[i], outputs[i], lseek(outputs[i], 0, SEEK_CUR) < 0, &sizes[i]) != 0) {
+            fprintf(stderr, "Failed to retrieve data: %s\n", hashes[i]);
+            results[i] = 1;
+        }
+    }
+    TRACE_END(ctx, &span, NULL, 0);
+    METRICS_PHASE(ctx->metrics, MAPSTORE_PHASE_DATA_IO, timer);
+
+end_retrieve_data_multi:
+    TRACE_END(ctx, &span, NULL, status);
+
+    if (store_fd >= 0) {
+        close(store_fd);
+    }
+
+    /* A failed lookup fails every object */
+    for (uint64_t i = 0, aborted = status; i < count && results; i++) {
+        if (aborted) {
+            results[i] = 1;
+        }
+        status |= results[i];
+        METRICS_OP(ctx->metrics, MAPSTORE_OP_RETRIEVE, started, (sizes) ? sizes[i] : 0, results[i]);
+        capture_op(ctx, MAPSTORE_OP_RETRIEVE, (hashes[i]) ? hashes[i] : "", captured, (sizes) ? sizes[i] : 0, results[i]);
+    }
+
+    if (results && results != statuses) {
+        free(results);
+    }
+
+    free(sizes);
+    free(extents);
+    free(buf);
+    json_object_put(found);
+
+    return (status != 0) ? 1 : 0;
+}
+
+/**
+* Hint the page cache for every extent of the given objects, sorted by map
+* store and offset with neighbouring extents merged into one call
+*/
+static int advise_objects(mapstore_ctx *ctx, char **hashes, uint64_t count, bool willneed) {
+    int status = 0;
+    int store_fd = -1;
+    uint64_t total_extents = 0;
+    uint64_t open_store = 0;
+    uint64_t first = 0;
+    uint64_t final = 0;
+    char mapstore_path[BUFSIZ];
+    json_object *found = json_object_new_object();
+    json_object *positions = NULL;
+    json_object *location = NULL;
+    read_extent *extents = NULL;
+    read_extent *extent = NULL;
+
+    if (lookup_positions(ctx, hashes, count, found) != 0) {
+        fprintf(stderr, "Failed to get positions from data_locations table\n");
+        status = 1;
+        goto end_advise_objects;
+    }
+
+    for (uint64_t i = 0; i < count; i++) {
+        if (!valid_hash(hashes[i]) || !json_object_object_get_ex(found, hashes[i], &positions)) {
+            fprintf(stderr, "Failed to get positions for %s\n", (hashes[i]) ? hashes[i] : "(null)");
             status = 1;
-            goto end_delete_data;
+            continue;
         }
+        total_extents += positions_extents(positions);
     }
 
-    // Delete data_locations row by hash
-    if((status = delete_by_hash_from_data_locations(ctx->db, hash)) != 0) {
+    if (total_extents == 0 || ctx->metadata_only) {
+        goto end_advise_objects;
+    }
+
+    if (!(extents = calloc(total_extents, sizeof(read_extent)))) {
+        status = 1;
+        goto end_advise_objects;
+    }
+
+    total_extents = 0;
+    json_object_object_foreach(found, hash, found_positions) {
+        (void)hash;
+        json_object_object_foreach(found_positions, store_id, arr) {
+            for (uint64_t e = 0; e < json_object_array_length(arr); e++) {
+                location = json_object_array_get_idx(arr, e);
+                extent = &extents[total_extents++];
+                extent->store_id = strtoull(store_id, NULL, 10);
+                extent->first = json_object_get_int64(json_object_array_get_idx(location, 1));
+                extent->final = json_object_get_int64(json_object_array_get_idx(location, 2));
+            }
+        }
+    }
+
+    qsort(extents, total_extents, sizeof(read_extent), compare_read_extents);
+
+    for (uint64_t e = 0; e < total_extents; e++) {
+        extent = &extents[e];
+
+        if (extent->store_id != open_store) {
+            if (store_fd >= 0) {
+                close(store_fd);
+            }
+
+            memset(mapstore_path, '\0', BUFSIZ);
+            sprintf(mapstore_path, "%s%"PRIu64".map", ctx->mapstore_path, extent->store_id);
+            open_store = extent->store_id;
+            if ((store_fd = open(mapstore_path, O_RDONLY)) < 0) {
+                fprintf(stderr, "Error opening mapstore for reading: %s\n", mapstore_path);
+                status = 1;
+            }
+        }
+
+        if (store_fd < 0) {
+            continue;
+        }
+
+        first = extent->first;
+        final = extent->final;
+        while (e + 1 < total_extents && extents[e + 1].store_id == extent->store_id &&
+               extents[e + 1].first <= final + 1) {
+            e++;
+            final = (extents[e].final > final) ? extents[e].final : final;
+        }
+
+        if (advise_range(store_fd, first, final - first + 1, willneed) != 0) {
+            fprintf(stderr, "Failed to advise mapstore: %s\n", mapstore_path);
+            status = 1;
+        }
+    }
+
+end_advise_objects:
+    if (store_fd >= 0) {
+        close(store_fd);
+    }
+
+    free(extents);
+    json_object_put(found);
+
+    return status;
+}
+
+/**
+* Start reading the given objects into the page cache without waiting for
+* them. Returns 1 if any object is missing, the others are still prefetched.
+*/
+MAPSTORE_API int mapstore_prefetch(mapstore_ctx *ctx, char **hashes, uint64_t count) {
+    return advise_objects(ctx, hashes, count, true);
+}
+
+/**
+* Drop the given objects from the page cache, so a one off scan doesn't push
+* out hot data. Only pages already written back can be dropped.
+*/
+MAPSTORE_API int mapstore_evict(mapstore_ctx *ctx, char **hashes, uint64_t count) {
+    return advise_objects(ctx, hashes, count, false);
+}
+
+/**
+* Delete data
+*/
+MAPSTORE_API int delete_data(mapstore_ctx *ctx, char *hash) {
+    int status = 0;
+    json_object *positions = NULL;
+    uint64_t bytes = 0;
+    uint64_t started = metrics_now();
+    uint64_t captured = capture_now(ctx);
+    trace_span span;
+
+    enter_batch(ctx);
+
+    // Remove data_locations row by hash and get its data map
+    TRACE_BEGIN(ctx, &span, MAPSTORE_TRACE_METADATA, hash, 0, NULL);
+    if ((status = take_data_locations_row(db_for_hash(&ctx->shards, hash), hash, &positions)) != 0) {
+        fprintf(stderr, "Failed to get positions from data_locations table\n");
         status = 1;
         goto end_delete_data;
     }
 
-end_delete_data:
-    if (set) {
-        free(set);
+    // add each location to map_stores table free_locations
+    if ((status = release_deleted_space(ctx, positions)) != 0) {
+        status = 1;
+        goto end_delete_data;
+    };
+
+    // Failing to punch leaves the space allocated but the delete stands
+    if (ctx->punch_holes && release_disk_space(ctx, positions) != 0) {
+        fprintf(stderr, "Failed to release disk space for %s\n", hash);
     }
 
+    TRACE_END(ctx, &span, positions, 0);
+    METRICS_PHASE(ctx->metrics, MAPSTORE_PHASE_METADATA, started);
+
+end_delete_data:
+    TRACE_END(ctx, &span, positions, status);
     if (positions) {
+        bytes = positions_size(positions);
         json_object_put(positions);
     }
 
-    if (updated_positions) {
-        json_object_put(updated_positions);
-    }
+    leave_batch(ctx);
+
+    METRICS_OP(ctx->metrics, MAPSTORE_OP_DELETE, started, bytes, status);
+    capture_op(ctx, MAPSTORE_OP_DELETE, hash, captured, bytes, status);
     return status;
 }
 
+/**
+* Resize and compact the store into a new layout. Progress is checkpointed in
+* the current database so an interrupted restructure resumes on the next open,
+* and the new store is swapped into place through a journal.
+*/
 MAPSTORE_API int restructure(mapstore_ctx *ctx, uint64_t map_size, uint64_t alloc_size) {
     int status = 0;
-    char new_path[strlen(ctx->base_path) + 2];
+    char new_path[strlen(ctx->base_path) + strlen(RESTRUCTURE_DIR) + 2];
+    char tmp_path[BUFSIZ];
+    char journal_path[BUFSIZ];
+    char hashes[RESTRUCTURE_BATCH][41];
+    uint64_t ids[RESTRUCTURE_BATCH];
+    int count = 0;
+    int tmp_fd = -1;
+    uint64_t total_readers = 0;
+    uint64_t total_shards = ctx->shards.total;
+    sqlite3 *shard_db = NULL;
+    FILE *journal = NULL;
+    bool new_ctx_initialized = false;
+    bool reopen_blocks = false;
+    mapstore_ctx new_ctx;
+    mapstore_opts opts;
     store_info info;
+    restructure_checkpoint_row checkpoint;
+    data_locations_row old_row;
+    data_locations_row new_row;
 
     if (get_store_info(ctx, &info) != 0) {
         return 1;
     }
 
-    char hashes[info.data_count][41];
+    if (info.used_space > alloc_size) {
+        fprintf(stderr, "Cannot restructure to size %"PRIu64" with %"PRIu64" worth of data\n", alloc_size, info.used_space);
+        status = 1;
+        goto end_restructure;
+    }
+
+    if (get_restructure_checkpoint(ctx->db, &checkpoint) != 0) {
+        status = 1;
+        goto end_restructure;
+    }
 
-    if (info.used_space > map_size) {
-        fprintf(stderr, "Cannot restructure to size %"PRIu64" with %"PRIu64" worth of data\n", map_size, info.used_space);
+    if (checkpoint.id != 0 &&
+        (checkpoint.map_size != map_size || checkpoint.allocation_size != alloc_size)) {
+        fprintf(stderr,
+                "A restructure to map size %"PRIu64" and allocation size %"PRIu64" is still in progress\n",
+                checkpoint.map_size,
+                checkpoint.allocation_size);
         status = 1;
         goto end_restructure;
     }
 
-    mapstore_opts opts;
-    opts.allocation_size = alloc_size; // 10GB
-    opts.map_size = map_size;         // 2GB
-    opts.prealloc = ctx->prealloc;
+    /* A new store without a checkpoint was left by an older run and can't be trusted */
+    if (checkpoint.id == 0) {
+        if (remove_restructure_store(ctx->base_path) != 0) {
+            fprintf(stderr, "Could not remove stale restructure store\n");
+            status = 1;
+            goto end_restructure;
+        }
+
+        checkpoint.map_size = map_size;
+        checkpoint.allocation_size = alloc_size;
+        if (save_restructure_checkpoint(ctx->db, &checkpoint) != 0) {
+            status = 1;
+            goto end_restructure;
+        }
+    }
 
-    memset(new_path, '\0', strlen(ctx->base_path) + 2);
-    sprintf(new_path, "%s%cT", ctx->base_path, separator());
+    memset(&opts, 0, sizeof(mapstore_opts));
+    opts.allocation_size = alloc_size;
+    opts.map_size = map_size;
+    opts.prealloc = ctx->prealloc;
+    opts.metadata_shards = total_shards;
+    opts.sync_writes = ctx->sync_writes;
+    opts.direct_io_threshold = ctx->direct_io_threshold;
+    opts.punch_holes = ctx->punch_holes;
+    opts.inline_threshold = ctx->inline_threshold;
+    opts.engine = ctx->engine;
+    opts.gc_live_ratio = ctx->gc_live_ratio;
+    opts.slab_classes = ctx->slab_classes;
+    opts.total_slab_classes = ctx->total_slab_classes;
+    opts.block_size = ctx->block_size;
+    opts.skip_verify = ctx->skip_verify;
+    opts.metadata_only = ctx->metadata_only;
+
+    memset(new_path, '\0', strlen(ctx->base_path) + strlen(RESTRUCTURE_DIR) + 2);
+    sprintf(new_path, "%s%c%s", ctx->base_path, separator(), RESTRUCTURE_DIR);
     opts.path = new_path;
 
     /* Create map store folder */
@@ -406,64 +1259,217 @@ MAPSTORE_API int restructure(mapstore_ctx *ctx, uint64_t map_size, uint64_t allo
         goto end_restructure;
     };
 
-    mapstore_ctx new_ctx;
     if (initialize_mapstore(&new_ctx, opts) != 0) {
         fprintf(stderr, "Error initializing mapstore\n");
         status = 1;
         goto end_restructure;
     }
+    new_ctx_initialized = true;
 
-    if (get_data_hashes(ctx->db, hashes) != 0) {
-        fprintf(stderr, "Could not get data hashes\n");
+    /* Data is staged through a scratch file between the two stores */
+    memset(tmp_path, '\0', BUFSIZ);
+    sprintf(tmp_path, "%s%c%s", new_path, separator(), RESTRUCTURE_TMP);
+    if ((tmp_fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+        fprintf(stderr, "Could not open scratch file: %s\n", tmp_path);
         status = 1;
         goto end_restructure;
     }
 
-    for (int i = 0; i < info.data_count; i++) {
-        fprintf(stdout, "Hash: %s\n", hashes[i]);
-        int des_p[2];
-        if(pipe(des_p) == -1) {
-          fprintf(stderr, "Failed to create pipe\n");
-          status = 1;
-          goto end_restructure;
-        }
+    /* Shards are migrated one after another. last_id is local to checkpoint.shard. */
+    for (; checkpoint.shard < total_shards; checkpoint.shard++, checkpoint.last_id = 0) {
+        shard_db = ctx->shards.dbs[checkpoint.shard];
+
+        while ((count = get_data_hashes_after(shard_db, checkpoint.last_id, RESTRUCTURE_BATCH, hashes, ids)) > 0) {
+            for (int i = 0; i < count; i++) {
+                if (get_data_locations_row(db_for_hash(&new_ctx.shards, hashes[i]), hashes[i], &new_row) != 0) {
+                    status = 1;
+                    goto end_restructure;
+                }
+
+                if (new_row.positions) {
+                    json_object_put(new_row.positions);
+                }
+
+                if (new_row.hash) {
+                    free(new_row.hash);
+
+                    /* Already migrated before the last checkpoint */
+                    if (new_row.uploaded) {
+                        continue;
+                    }
+
+                    /* Partially migrated when we were interrupted */
+                    if (delete_data(&new_ctx, hashes[i]) != 0) {
+                        status = 1;
+                        goto end_restructure;
+                    }
+                }
+
+                if (get_data_locations_row(shard_db, hashes[i], &old_row) != 0 || old_row.hash == NULL) {
+                    fprintf(stderr, "Could not get data info: %s\n", hashes[i]);
+                    status = 1;
+                    goto end_restructure;
+                }
+
+                free(old_row.hash);
+                if (old_row.positions) {
+                    json_object_put(old_row.positions);
+                }
+
+                if (retrieve_data(ctx, tmp_fd, hashes[i]) != 0) {
+                    fprintf(stderr, "Failed to retrieve data: %s\n", hashes[i]);
+                    status = 1;
+                    goto end_restructure;
+                }
+
+                if (store_data(&new_ctx, tmp_fd, old_row.size, hashes[i]) != 0) {
+                    fprintf(stderr, "Failed to store data: %s\n", hashes[i]);
+                    status = 1;
+                    goto end_restructure;
+                }
+
+                checkpoint.migrated++;
+            }
 
-        if(fork() == 0) {
-            close(des_p[0]);       //closing pipe read
-            close(des_p[1]);
-            if ((status = retrieve_data(ctx, des_p[1], hashes[i])) != 0) {
-                perror("retrieve_data failed");
-                exit(1);
+            checkpoint.last_id = ids[count - 1];
+            if (save_restructure_checkpoint(ctx->db, &checkpoint) != 0) {
+                status = 1;
+                goto end_restructure;
             }
-            exit(0);
+
+            fprintf(stdout, "Restructured %"PRIu64"/%"PRIu64" items\n", checkpoint.migrated, info.data_count);
         }
 
-        if(fork() == 0) {
-            close(des_p[1]);       //closing pipe write
-            close(des_p[0]);
-            if ((status = store_data(&new_ctx, des_p[0], 0, hashes[i])) != 0) {
-                perror("store_data failed");
-                exit(1);
-            }
-            exit(0);
+        if (count < 0) {
+            fprintf(stderr, "Could not get data hashes\n");
+            status = 1;
+            goto end_restructure;
         }
+    }
+
+    close(tmp_fd);
+    tmp_fd = -1;
+    mapstore_ctx_free(&new_ctx);
+    new_ctx_initialized = false;
+
+    /* Once the journal exists the swap is committed and will be rolled forward */
+    memset(journal_path, '\0', BUFSIZ);
+    sprintf(journal_path, "%s%c%s", ctx->base_path, separator(), RESTRUCTURE_JOURNAL);
+    if (!(journal = fopen(journal_path, "w")) || fsync(fileno(journal)) != 0) {
+        fprintf(stderr, "Could not create restructure journal: %s\n", journal_path);
+        status = 1;
+        goto end_restructure;
+    }
+    fclose(journal);
+    journal = NULL;
+
+    /* The old map files are going away, stop creating them */
+    free_map_creator(ctx);
+    reopen_blocks = ctx->blocks != NULL;
+    close_block_bitmap(ctx, false);
 
-        close(des_p[0]);
-        close(des_p[1]);
-        wait(0);
-        wait(0);
+    total_readers = ctx->total_readers;
+    free_read_pool(ctx);
+    close_metadata_shards(&ctx->shards);
+    ctx->db = NULL;
+
+    if (finish_restructure_swap(ctx->base_path) != 0) {
+        fprintf(stderr, "Failed to swap restructured store\n");
+        status = 1;
+        goto end_restructure;
+    }
+
+    if (open_metadata_shards(ctx->base_path, total_shards, false, &ctx->shards) != 0) {
+        status = 1;
+        goto end_restructure;
+    }
+    ctx->db = ctx->shards.dbs[0];
+
+    ctx->map_size = map_size;
+    ctx->allocation_size = alloc_size;
+    ctx->total_mapstores = get_count_for_shards(&ctx->shards, "SELECT count(*) FROM `map_stores`;");
+
+    if (init_store_locks(ctx) != 0) {
+        fprintf(stderr, "Could not create map store locks\n");
+        status = 1;
+        goto end_restructure;
+    }
+
+    /* The restructured log starts appending from the first segment again */
+    if (ctx->log && init_log(ctx) != 0) {
+        fprintf(stderr, "Could not create log engine state\n");
+        status = 1;
+        goto end_restructure;
+    }
+
+    if (reopen_blocks && open_block_bitmap(ctx) != 0) {
+        fprintf(stderr, "Could not open block bitmap\n");
+        status = 1;
+        goto end_restructure;
+    }
+
+    if (ctx->multi_process) {
+        close_shared_state(ctx);
+        if (open_shared_state(ctx) != 0) {
+            fprintf(stderr, "Could not open shared allocator state\n");
+            status = 1;
+            goto end_restructure;
+        }
+    }
+
+    if (total_readers > 0 && init_read_pool(ctx, total_readers) != 0) {
+        fprintf(stderr, "Could not open read connections\n");
+        status = 1;
+        goto end_restructure;
     }
-    // Delete old structure
-    // rename new structure
-    // set old ctx to new ctx values
 
 end_restructure:
+    if (tmp_fd >= 0) {
+        close(tmp_fd);
+    }
+
+    if (journal) {
+        fclose(journal);
+    }
+
+    if (new_ctx_initialized) {
+        mapstore_ctx_free(&new_ctx);
+    }
+
+    return status;
+}
+
+/**
+* Collect log segments whose live ratio fell below gc_live_ratio. Only
+* available with the log engine.
+*/
+MAPSTORE_API int mapstore_gc(mapstore_ctx *ctx, gc_report *report) {
+    int status = 0;
+    gc_report collected;
+
+    if (!ctx->log) {
+        fprintf(stderr, "Garbage collection needs the log engine\n");
+        return 1;
+    }
+
+    enter_batch(ctx);
+    status = collect_log_segments(ctx, &collected);
+    leave_batch(ctx);
+
+    if (report) {
+        *report = collected;
+    }
+
     return status;
 }
 
 MAPSTORE_API int get_data_info(mapstore_ctx *ctx, char *hash, data_info *info) {
     data_locations_row row;
-    if (get_data_locations_row(ctx->db, hash, &row) != 0) {
+    metadata_shards *readers = checkout_reader(ctx);
+    int status = get_data_locations_row(db_for_hash(readers, hash), hash, &row);
+    checkin_reader(ctx, readers);
+
+    if (status != 0) {
         return 1;
     };
 
@@ -482,19 +1488,21 @@ MAPSTORE_API int get_store_info(mapstore_ctx *ctx, store_info *info) {
     uint64_t free_space = 0;
     uint64_t used_space = 0;
     uint64_t data_count = 0;
+    int store_fd = -1;
+    char mapstore_path[BUFSIZ];
 
-    if (sum_column_for_table(ctx->db, "free_space", "map_stores", &free_space) != 0) {
+    if (sum_column_for_shards(&ctx->shards, "free_space", "map_stores", &free_space) != 0) {
         status = 1;
         goto end_get_store_info;
     }
 
-    if (sum_column_for_table(ctx->db, "size", "data_locations", &used_space) != 0) {
+    if (sum_column_for_shards(&ctx->shards, "size", "data_locations", &used_space) != 0) {
         status = 1;
         goto end_get_store_info;
     }
 
     char *query = "SELECT count(*) FROM 'data_locations';";
-    data_count = get_count(ctx->db, query);
+    data_count = get_count_for_shards(&ctx->shards, query);
 
     info->free_space = free_space;
     info->used_space = used_space;
@@ -502,12 +1510,114 @@ MAPSTORE_API int get_store_info(mapstore_ctx *ctx, store_info *info) {
     info->map_size = ctx->map_size;
     info->total_mapstores = ctx->total_mapstores;
     info->data_count = data_count;
+    info->physical_space = 0;
+    info->pending_map_stores = pending_map_stores(ctx);
+
+    for (uint64_t i = 1; i <= ctx->total_mapstores && !ctx->metadata_only; i++) {
+        memset(mapstore_path, '\0', BUFSIZ);
+        sprintf(mapstore_path, "%s%"PRIu64".map", ctx->mapstore_path, i);
+        if ((store_fd = open(mapstore_path, O_RDONLY)) < 0) {
+            continue;
+        }
+        info->physical_space += get_allocated_size(store_fd);
+        close(store_fd);
+    }
 
 end_get_store_info:
     return status;
 }
 
+/**
+* Free space topology of every map store and of the store as a whole. Stats
+* are kept up to date on every free list write so this never parses free
+* lists or data maps. The bitmap engine counts free runs in its bitmaps.
+*/
+MAPSTORE_API int get_fragmentation_info(mapstore_ctx *ctx, fragmentation_info *info) {
+    int status = 0;
+    uint64_t objects = 0;
+    uint64_t total_extents = 0;
+    uint64_t max_extents = 0;
+    uint64_t object_extents = 0;
+    free_space_info *store = NULL;
+
+    memset(info, 0, sizeof(fragmentation_info));
+
+    info->stores = calloc(ctx->total_mapstores, sizeof(free_space_info));
+    if (!info->stores) {
+        status = 1;
+        goto end_get_fragmentation_info;
+    }
+
+    for (uint64_t f = 1; f <= ctx->total_mapstores; f++) {
+        store = &info->stores[f - 1];
+
+        if (ctx->blocks) {
+            lock_map_store(ctx, f);
+            block_free_space_info(ctx, f, store);
+            unlock_map_store(ctx, f);
+        } else if (get_store_fragmentation(db_for_store(&ctx->shards, f), f, store) != 0) {
+            status = 1;
+            goto end_get_fragmentation_info;
+        }
+
+        if (store->free_space > 0) {
+            store->fragmentation_index = 1.0 - (double)store->largest_free_extent / store->free_space;
+        }
+
+        info->total.size += store->size;
+        info->total.free_space += store->free_space;
+        info->total.free_extents += store->free_extents;
+        if (store->largest_free_extent > info->total.largest_free_extent) {
+            info->total.largest_free_extent = store->largest_free_extent;
+        }
+        for (int c = 0; c < EXTENT_SIZE_CLASSES; c++) {
+            info->total.extent_histogram[c] += store->extent_histogram[c];
+        }
+
+        info->total_stores++;
+    }
+
+    if (info->total.free_space > 0) {
+        info->total.fragmentation_index = 1.0 - (double)info->total.largest_free_extent / info->total.free_space;
+    }
+
+    for (uint64_t s = 0; s < ctx->shards.total; s++) {
+        if (get_object_extent_stats(ctx->shards.dbs[s], &objects, &total_extents, &max_extents) != 0) {
+            status = 1;
+            goto end_get_fragmentation_info;
+        }
+
+        info->objects += objects;
+        object_extents += total_extents;
+        if (max_extents > info->max_object_extents) {
+            info->max_object_extents = max_extents;
+        }
+    }
+
+    if (info->objects > 0) {
+        info->average_object_extents = (double)object_extents / info->objects;
+    }
+
+end_get_fragmentation_info:
+    if (status != 0) {
+        fragmentation_info_free(info);
+    }
+
+    return status;
+}
+
+MAPSTORE_API void fragmentation_info_free(fragmentation_info *info) {
+    if (info->stores) {
+        free(info->stores);
+        info->stores = NULL;
+    }
+
+    info->total_stores = 0;
+}
+
 MAPSTORE_API int mapstore_ctx_free(mapstore_ctx *ctx) {
+    free_map_creator(ctx);
+
     if (ctx->mapstore_path) {
         free(ctx->mapstore_path);
     }
@@ -520,10 +1630,21 @@ MAPSTORE_API int mapstore_ctx_free(mapstore_ctx *ctx) {
         free(ctx->base_path);
     }
 
-    if (ctx->db) {
-        // Sometimes I don't free all the memory properly 😕
-        sqlite3_close_v2(ctx->db);
-    }
+    free_read_pool(ctx);
+    free_batch(ctx);
+    free_log(ctx);
+    free(ctx->slab_classes);
+    ctx->slab_classes = NULL;
+    close_block_bitmap(ctx, true);
+
+    // Sometimes I don't free all the memory properly 😕
+    close_metadata_shards(&ctx->shards);
+    ctx->db = NULL;
+
+    free_store_locks(ctx);
+    close_shared_state(ctx);
+    free_metrics(ctx);
+    stop_capture(ctx);
 
     return 0;
 }
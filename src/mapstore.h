@@ -34,6 +34,7 @@ extern "C" {
 #include <inttypes.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <uv.h>
 
 #include "utils.h"
 #include "database_utils.h"
@@ -42,7 +43,101 @@ extern "C" {
 #define WRITE_END 1
 #define MAX_UINT64_STR 20
 #define HASH_LENGTH 40
+#define RESTRUCTURE_DIR "T"
+#define RESTRUCTURE_JOURNAL "restructure.swap"
+#define RESTRUCTURE_TMP "restructure.tmp"
+#define RESTRUCTURE_BATCH 100
+#define MULTI_GET_BATCH 500
+#define SLAB_SLOTS 64
+#define GC_LIVE_RATIO 0.5
+#define GC_TMP "gc.tmp"
+#define DEFAULT_BLOCK_SIZE 4096
+#define DIRECT_IO(ctx, size) ((ctx)->direct_io_threshold > 0 && (size) >= (ctx)->direct_io_threshold)
 
+/**
+* extent fills free locations anywhere in the map stores. log appends to the
+* head of one segment (map store) at a time and leaves deleted space dead
+* until mapstore_gc rewrites the segment. bitmap splits every map store into
+* blocks of block_size bytes tracked by one bit each.
+*/
+typedef enum {
+  MAPSTORE_ENGINE_EXTENT,
+  MAPSTORE_ENGINE_LOG,
+  MAPSTORE_ENGINE_BITMAP
+} mapstore_engine;
+
+typedef enum {
+  MAPSTORE_OP_STORE,
+  MAPSTORE_OP_RETRIEVE,
+  MAPSTORE_OP_DELETE,
+  MAPSTORE_OPS
+} mapstore_op;
+
+/**
+* Phases timed inside an operation. plan is spent choosing extents, metadata
+* in SQLite reads and updates, data_io reading and writing map files.
+*/
+typedef enum {
+  MAPSTORE_PHASE_HASH_CHECK,
+  MAPSTORE_PHASE_PLAN,
+  MAPSTORE_PHASE_METADATA,
+  MAPSTORE_PHASE_DATA_IO,
+  MAPSTORE_PHASE_MARK_UPLOADED,
+  MAPSTORE_PHASES
+} mapstore_phase;
+
+typedef struct mapstore_metrics mapstore_metrics;
+typedef struct mapstore_capture mapstore_capture;
+typedef struct mapstore_batch mapstore_batch;
+typedef struct mapstore_creator mapstore_creator;
+typedef struct mapstore_log mapstore_log;
+typedef struct mapstore_blocks mapstore_blocks;
+
+/**
+* Points traced with begin and end events. plan covers choosing and reserving
+* extents, commit marks stored data as uploaded and fsync only happens when
+* sync_writes is set.
+*/
+typedef enum {
+  MAPSTORE_TRACE_HASH_CHECK,
+  MAPSTORE_TRACE_PLAN,
+  MAPSTORE_TRACE_METADATA,
+  MAPSTORE_TRACE_DATA_WRITE,
+  MAPSTORE_TRACE_DATA_READ,
+  MAPSTORE_TRACE_FSYNC,
+  MAPSTORE_TRACE_COMMIT,
+  MAPSTORE_TRACE_POINTS
+} mapstore_trace_point;
+
+/**
+* store_ids lists the map stores touched once they are known and status is
+* only set on end events. hash is NULL while store_data_hashed has not yet
+* computed it. Pointers are only valid during the callback.
+*/
+typedef struct  {
+  mapstore_trace_point point;
+  const char *hash;
+  uint64_t bytes;
+  const uint64_t *store_ids;
+  uint64_t total_store_ids;
+  int status;
+} mapstore_trace_event;
+
+/**
+* Callbacks are called from whichever thread runs the operation.
+*/
+typedef struct  {
+  void (*begin)(void *data, const mapstore_trace_event *event);
+  void (*end)(void *data, const mapstore_trace_event *event);
+  void *data;
+} mapstore_trace_callbacks;
+
+/**
+* Once initialized a context can be shared between threads for store_data,
+* retrieve_data, delete_data, get_data_info and get_store_info.
+* initialize_mapstore, restructure and mapstore_ctx_free must not run
+* concurrently with any other call on the same context.
+*/
 typedef struct  {
   uint64_t allocation_size;
   uint64_t map_size;
@@ -51,14 +146,67 @@ typedef struct  {
   char *database_path;
   char *base_path;
   sqlite3 *db;
+  metadata_shards shards;
   bool prealloc;
+  uv_mutex_t *store_locks;
+  uint64_t total_store_locks;
+  bool multi_process;
+  int shared_state_fd;
+  uint8_t *shared_state;
+  uint64_t shared_state_size;
+  metadata_shards *reader_sets;
+  metadata_shards **readers;
+  uint64_t total_readers;
+  uint64_t available_readers;
+  uv_mutex_t readers_lock;
+  uv_cond_t readers_cond;
+  mapstore_metrics *metrics;
+  mapstore_trace_callbacks trace;
+  bool sync_writes;
+  mapstore_capture *capture;
+  bool metadata_only;
+  mapstore_batch *batch;
+  uint64_t direct_io_threshold;
+  bool punch_holes;
+  bool lazy_create;
+  mapstore_creator *creator;
+  uint64_t inline_threshold;
+  mapstore_engine engine;
+  double gc_live_ratio;
+  mapstore_log *log;
+  uint64_t *slab_classes;
+  uint64_t total_slab_classes;
+  bool has_slabs;
+  uint64_t block_size;
+  mapstore_blocks *blocks;
+  bool skip_verify;
 } mapstore_ctx;
 
+/**
+* Options for initialize_mapstore. Zero initialize the struct so options
+* added in later versions keep their defaults.
+*/
 typedef struct  {
   uint64_t allocation_size;
   uint64_t map_size;
   char *path;
   bool prealloc;
+  bool multi_process;
+  uint64_t read_connections;
+  uint64_t metadata_shards;
+  bool sync_writes;
+  bool metadata_only;
+  uint64_t direct_io_threshold;
+  bool punch_holes;
+  bool lazy_create;
+  uint64_t create_threads;
+  uint64_t inline_threshold;
+  mapstore_engine engine;
+  double gc_live_ratio;
+  uint64_t *slab_classes;
+  uint64_t total_slab_classes;
+  uint64_t block_size;
+  bool skip_verify;
 } mapstore_opts;
 
 typedef struct  {
@@ -73,20 +221,129 @@ typedef struct  {
   uint64_t map_size;
   uint64_t data_count;
   uint64_t total_mapstores;
+  uint64_t physical_space;
+  uint64_t pending_map_stores;
 } store_info;
 
+typedef struct  {
+  free_space_info total;
+  free_space_info *stores;
+  uint64_t total_stores;
+  uint64_t objects;
+  double average_object_extents;
+  uint64_t max_object_extents;
+} fragmentation_info;
+
+/**
+* Latencies are in nanoseconds. Failed calls are only counted in errors.
+*/
+typedef struct  {
+  uint64_t count;
+  uint64_t errors;
+  uint64_t bytes;
+  uint64_t total_ns;
+  uint64_t max_ns;
+  uint64_t p50_ns;
+  uint64_t p90_ns;
+  uint64_t p99_ns;
+  uint64_t p999_ns;
+} latency_summary;
+
+/**
+* startup_ns is how long initialize_mapstore took and map_files_ns how long
+* until every map file was ready, 0 while pending_map_stores are still being
+* created in the background.
+*/
+typedef struct  {
+  latency_summary ops[MAPSTORE_OPS];
+  latency_summary phases[MAPSTORE_PHASES];
+  uint64_t startup_ns;
+  uint64_t map_files_ns;
+  uint64_t pending_map_stores;
+} store_metrics;
+
+/**
+* Failed calls are counted in errors and left out of bytes.
+*/
+typedef struct  {
+  uint64_t operations;
+  uint64_t errors;
+  uint64_t bytes;
+  uint64_t elapsed_ns;
+  double operations_per_second;
+  double bytes_per_second;
+  latency_summary ops[MAPSTORE_OPS];
+} replay_report;
+
+/**
+* Segments collected by mapstore_gc and the live objects moved out of them
+*/
+typedef struct  {
+  uint64_t segments;
+  uint64_t objects;
+  uint64_t bytes;
+} gc_report;
+
 MAPSTORE_API int store_data(mapstore_ctx *ctx, int fd, uint64_t data_size, char *hash);
+MAPSTORE_API int store_data_hashed(mapstore_ctx *ctx, int fd, uint64_t data_size, char *expected_hash, char **hash);
 MAPSTORE_API int retrieve_data(mapstore_ctx *ctx, int fd, char *hash);
+MAPSTORE_API int retrieve_data_multi(mapstore_ctx *ctx, char **hashes, int *outputs, uint64_t count, int *statuses);
+MAPSTORE_API int mapstore_prefetch(mapstore_ctx *ctx, char **hashes, uint64_t count);
+MAPSTORE_API int mapstore_evict(mapstore_ctx *ctx, char **hashes, uint64_t count);
 MAPSTORE_API int delete_data(mapstore_ctx *ctx, char *hash);
 MAPSTORE_API int get_data_info(mapstore_ctx *ctx, char *hash, data_info *info);
 MAPSTORE_API int get_store_info(mapstore_ctx *ctx, store_info *info);
 MAPSTORE_API int initialize_mapstore(mapstore_ctx *ctx, mapstore_opts opts);
 MAPSTORE_API int restructure(mapstore_ctx *ctx, uint64_t map_size, uint64_t alloc_size);
 MAPSTORE_API int mapstore_ctx_free(mapstore_ctx *ctx);
+MAPSTORE_API int get_store_metrics(mapstore_ctx *ctx, store_metrics *metrics);
+MAPSTORE_API int get_fragmentation_info(mapstore_ctx *ctx, fragmentation_info *info);
+MAPSTORE_API void fragmentation_info_free(fragmentation_info *info);
+MAPSTORE_API const char *mapstore_op_name(mapstore_op op);
+MAPSTORE_API const char *mapstore_phase_name(mapstore_phase phase);
+MAPSTORE_API void mapstore_set_trace(mapstore_ctx *ctx, mapstore_trace_callbacks *callbacks);
+MAPSTORE_API const char *mapstore_trace_point_name(mapstore_trace_point point);
+MAPSTORE_API int start_capture(mapstore_ctx *ctx, const char *path, bool anonymize);
+MAPSTORE_API int stop_capture(mapstore_ctx *ctx);
+MAPSTORE_API int replay_capture(mapstore_ctx *ctx, const char *path, double speed, replay_report *report);
+MAPSTORE_API int serve_mapstore(mapstore_ctx *ctx, const char *socket_path);
+MAPSTORE_API int mapstore_begin_batch(mapstore_ctx *ctx);
+MAPSTORE_API int mapstore_end_batch(mapstore_ctx *ctx);
+MAPSTORE_API int mapstore_gc(mapstore_ctx *ctx, gc_report *report);
 
 
 int get_map_plan(sqlite3 *db, uint64_t total_stores, uint64_t data_size, json_object *map_coordinates);
 int get_updated_free_locations(sqlite3 *db, json_object *positions, json_object **updated_positions);
+int grow_map_stores(mapstore_ctx *ctx);
+int configure_metadata_shards(mapstore_ctx *ctx, uint64_t requested, bool existing);
+int remove_restructure_store(char *base_path);
+int finish_restructure_swap(char *base_path);
+int init_store_locks(mapstore_ctx *ctx);
+void free_store_locks(mapstore_ctx *ctx);
+void lock_map_store(mapstore_ctx *ctx, uint64_t store_id);
+void unlock_map_store(mapstore_ctx *ctx, uint64_t store_id);
+int reserve_map_space(mapstore_ctx *ctx, uint64_t data_size, json_object *positions);
+int release_map_space(mapstore_ctx *ctx, json_object *positions);
+int init_read_pool(mapstore_ctx *ctx, uint64_t total_readers);
+void free_read_pool(mapstore_ctx *ctx);
+metadata_shards *checkout_reader(mapstore_ctx *ctx);
+void checkin_reader(mapstore_ctx *ctx, metadata_shards *readers);
+int init_batch(mapstore_ctx *ctx);
+void free_batch(mapstore_ctx *ctx);
+void enter_batch(mapstore_ctx *ctx);
+void leave_batch(mapstore_ctx *ctx);
+int punch_map_space(mapstore_ctx *ctx, json_object *positions);
+int release_deleted_space(mapstore_ctx *ctx, json_object *positions);
+int release_disk_space(mapstore_ctx *ctx, json_object *positions);
+int init_map_creator(mapstore_ctx *ctx, uint64_t total_threads, uint64_t started);
+void free_map_creator(mapstore_ctx *ctx);
+int finish_map_files(mapstore_ctx *ctx);
+bool map_store_ready(mapstore_ctx *ctx, uint64_t store_id);
+int ensure_map_store(mapstore_ctx *ctx, uint64_t store_id);
+uint64_t pending_map_stores(mapstore_ctx *ctx);
+int init_log(mapstore_ctx *ctx);
+void free_log(mapstore_ctx *ctx);
+int collect_log_segments(mapstore_ctx *ctx, gc_report *report);
 
 #ifdef __cplusplus
 }
@@ -1,4 +1,7 @@
 #include "mapstore.h"
+#include "shared_state.h"
+#include "block_bitmap.h"
+#include "metrics.h"
 
 int get_map_plan(sqlite3 *db,
                         uint64_t total_stores,
@@ -48,6 +51,7 @@ int get_map_plan(sqlite3 *db,
                                              row.free_locations,
                                              data_size - remaining,
                                              remaining,
+                                             0,
                                              map_coordinates);
 
         json_object_put(row.free_locations);
@@ -118,3 +122,1864 @@ int get_updated_free_locations(sqlite3 *db, json_object *positions, json_object
 end_update_free_locations:
     return status;
 }
+
+int grow_map_stores(mapstore_ctx *ctx) {
+    int status = 0;
+    char where[11 + MAX_UINT64_STR + 1];
+    char query[BUFSIZ];
+    char mapstore_path[BUFSIZ];
+    char *set = NULL;
+    char *stats_set = NULL;
+    mapstore_row row;
+    json_object *free_locations = NULL;
+    uint64_t store_count = 0;
+    uint64_t current_size = 0;
+    uint64_t remaining = 0;
+    uint64_t growth = 0;
+
+    store_count = get_count_for_shards(&ctx->shards, "SELECT count(*) FROM `map_stores`;");
+
+    if ((status = sum_column_for_shards(&ctx->shards, "size", "map_stores", &current_size)) != 0) {
+        goto end_grow_map_stores;
+    }
+
+    if (current_size > ctx->allocation_size) {
+        fprintf(stderr, "Map stores already use more than %"PRIu64" bytes\n", ctx->allocation_size);
+        status = 1;
+        goto end_grow_map_stores;
+    }
+
+    remaining = ctx->allocation_size - current_size;
+
+    /* Extend existing map stores up to the new map size first */
+    for (uint64_t f = 1; f <= store_count && remaining > 0; f++) {
+        memset(where, '\0', 11 + MAX_UINT64_STR + 1);
+        sprintf(where, "WHERE Id = %"PRIu64, f);
+
+        if (get_store_rows(db_for_store(&ctx->shards, f), where, &row) != 0) {
+            status = 1;
+            goto end_grow_map_stores;
+        }
+
+        if (row.size >= ctx->map_size) {
+            if (row.free_locations) {
+                json_object_put(row.free_locations);
+            }
+            continue;
+        }
+
+        growth = (ctx->map_size - row.size > remaining) ? remaining : ctx->map_size - row.size;
+
+        memset(mapstore_path, '\0', BUFSIZ);
+        sprintf(mapstore_path, "%s%"PRIu64".map", ctx->mapstore_path, f);
+        if (!ctx->metadata_only && !ctx->lazy_create &&
+            extend_map_store(mapstore_path, row.size + growth, ctx->prealloc) != 0) {
+            fprintf(stderr, "Failed to extend map store: %s\n", mapstore_path);
+            json_object_put(row.free_locations);
+            status = 1;
+            goto end_grow_map_stores;
+        }
+
+        free_locations = expand_free_space_list(row.free_locations, row.size, row.size + growth);
+
+        stats_set = free_list_stats_set(free_locations);
+        set = calloc(strlen(json_object_to_json_string(free_locations)) + strlen(stats_set) + 2 * MAX_UINT64_STR + 77 + 1, sizeof(char));
+        sprintf(set,
+                "SET size = size + %"PRIu64", free_space = free_space + %"PRIu64", free_locations = '%s', %s",
+                growth,
+                growth,
+                json_object_to_json_string(free_locations),
+                stats_set);
+        free(stats_set);
+        stats_set = NULL;
+
+        status = update_map_store(db_for_store(&ctx->shards, f), where, set);
+
+        free(set);
+        set = NULL;
+        json_object_put(free_locations);
+        json_object_put(row.free_locations);
+
+        if (status != 0) {
+            goto end_grow_map_stores;
+        }
+
+        remaining -= growth;
+    }
+
+    /* Whatever is left over goes into new map stores */
+    while (remaining > 0) {
+        store_count++;
+        growth = (remaining > ctx->map_size) ? ctx->map_size : remaining;
+
+        memset(mapstore_path, '\0', BUFSIZ);
+        sprintf(mapstore_path, "%s%"PRIu64".map", ctx->mapstore_path, store_count);
+        if (!ctx->metadata_only && !ctx->lazy_create &&
+            create_map_store(mapstore_path, growth, ctx->prealloc) != 0) {
+            fprintf(stderr, "Failed to create mapped file: %s of size %"PRIu64"\n", mapstore_path, growth);
+            status = 1;
+            goto end_grow_map_stores;
+        }
+
+        set = new_map_store_values(store_count, growth);
+        status = insert_to(db_for_store(&ctx->shards, store_count), "map_stores", set);
+        free(set);
+        set = NULL;
+
+        if (status != 0) {
+            goto end_grow_map_stores;
+        }
+
+        remaining -= growth;
+    }
+
+    ctx->total_mapstores = store_count;
+
+    memset(query, '\0', BUFSIZ);
+    sprintf(query,
+            "(map_size,allocation_size) VALUES(%"PRIu64",%"PRIu64")",
+            ctx->map_size,
+            ctx->allocation_size);
+
+    status = insert_to(ctx->db, "mapstore_layout", query);
+
+end_grow_map_stores:
+    return status;
+}
+
+/**
+* Decide how many metadata shards the store uses and open them. The count is
+* fixed when the store is created and stores created before sharding have one.
+*/
+int configure_metadata_shards(mapstore_ctx *ctx, uint64_t requested, bool existing) {
+    uint64_t total = 0;
+    uint64_t stores_per_shard = 0;
+
+    if (get_setting(ctx->db, SETTING_METADATA_SHARDS, &total) != 0) {
+        return 1;
+    }
+
+    if (total == 0) {
+        total = (existing || requested == 0) ? 1 : requested;
+        stores_per_shard = (ctx->total_mapstores + total - 1) / total;
+        stores_per_shard = (stores_per_shard > 0) ? stores_per_shard : 1;
+
+        if (save_setting(ctx->db, SETTING_METADATA_SHARDS, total) != 0 ||
+            save_setting(ctx->db, SETTING_STORES_PER_SHARD, stores_per_shard) != 0) {
+            return 1;
+        }
+    }
+
+    if (requested != 0 && requested != total) {
+        fprintf(stderr,
+                "Cannot change metadata shards from %"PRIu64" to %"PRIu64" on an existing mapstore\n",
+                total,
+                requested);
+        return 1;
+    }
+
+    return open_metadata_shards(ctx->base_path, total, false, &ctx->shards);
+}
+
+int remove_restructure_store(char *base_path) {
+    int status = 0;
+    char path[BUFSIZ];
+
+    memset(path, '\0', BUFSIZ);
+    sprintf(path, "%s%c%s%cshards", base_path, separator(), RESTRUCTURE_DIR, separator());
+    if (remove_directory(path) != 0) {
+        status = 1;
+    }
+
+    memset(path, '\0', BUFSIZ);
+    sprintf(path, "%s%c%s%cshards.sqlite", base_path, separator(), RESTRUCTURE_DIR, separator());
+    remove(path);
+
+    memset(path, '\0', BUFSIZ);
+    sprintf(path, "%s%c%s", base_path, separator(), RESTRUCTURE_DIR);
+    if (remove_directory(path) != 0) {
+        status = 1;
+    }
+
+    return status;
+}
+
+/**
+* Swap the restructured store into place. Every step checks what is on disk
+* so an interrupted swap can be rolled forward by simply calling this again.
+*/
+int finish_restructure_swap(char *base_path) {
+    int status = 0;
+    char journal_path[BUFSIZ];
+    char old_dir[BUFSIZ];
+    char new_dir[BUFSIZ];
+    char backup_dir[BUFSIZ];
+    char old_db[BUFSIZ];
+    char new_db[BUFSIZ];
+    char new_base[BUFSIZ];
+    char wal_path[BUFSIZ + 4];
+
+    memset(journal_path, '\0', BUFSIZ);
+    sprintf(journal_path, "%s%c%s", base_path, separator(), RESTRUCTURE_JOURNAL);
+
+    if (!path_exists(journal_path)) {
+        goto end_restructure_swap;
+    }
+
+    memset(old_dir, '\0', BUFSIZ);
+    memset(new_dir, '\0', BUFSIZ);
+    memset(backup_dir, '\0', BUFSIZ);
+    memset(new_base, '\0', BUFSIZ);
+    sprintf(old_dir, "%s%cshards", base_path, separator());
+    sprintf(new_dir, "%s%c%s%cshards", base_path, separator(), RESTRUCTURE_DIR, separator());
+    sprintf(backup_dir, "%s%cshards.old", base_path, separator());
+    sprintf(new_base, "%s%c%s", base_path, separator(), RESTRUCTURE_DIR);
+
+    if (path_exists(new_dir)) {
+        if (path_exists(old_dir)) {
+            if (path_exists(backup_dir) && remove_directory(backup_dir) != 0) {
+                status = 1;
+                goto end_restructure_swap;
+            }
+
+            if (rename(old_dir, backup_dir) != 0) {
+                perror("rename");
+                status = 1;
+                goto end_restructure_swap;
+            }
+        }
+
+        if (rename(new_dir, old_dir) != 0) {
+            perror("rename");
+            status = 1;
+            goto end_restructure_swap;
+        }
+    }
+
+    /* Renaming over the old databases replaces them atomically. A WAL left by
+       an old database must not be replayed into the new one. Shards that were
+       already moved by an interrupted swap are skipped. */
+    for (uint64_t shard = 0; ; shard++) {
+        shard_database_path(base_path, shard, old_db, BUFSIZ);
+        shard_database_path(new_base, shard, new_db, BUFSIZ);
+
+        if (!path_exists(new_db)) {
+            if (!path_exists(old_db)) {
+                break;
+            }
+            continue;
+        }
+
+        snprintf(wal_path, sizeof(wal_path), "%s-wal", old_db);
+        remove(wal_path);
+        snprintf(wal_path, sizeof(wal_path), "%s-shm", old_db);
+        remove(wal_path);
+
+        if (rename(new_db, old_db) != 0) {
+            perror("rename");
+            status = 1;
+            goto end_restructure_swap;
+        }
+    }
+
+    if (remove_directory(backup_dir) != 0 || remove_restructure_store(base_path) != 0) {
+        status = 1;
+        goto end_restructure_swap;
+    }
+
+    if (remove(journal_path) != 0) {
+        perror("remove");
+        status = 1;
+    }
+
+end_restructure_swap:
+    return status;
+}
+
+int init_store_locks(mapstore_ctx *ctx) {
+    free_store_locks(ctx);
+
+    ctx->store_locks = calloc(ctx->total_mapstores, sizeof(uv_mutex_t));
+    if (!ctx->store_locks) {
+        return 1;
+    }
+
+    for (uint64_t f = 0; f < ctx->total_mapstores; f++) {
+        if (uv_mutex_init(&ctx->store_locks[f]) != 0) {
+            ctx->total_store_locks = f;
+            free_store_locks(ctx);
+            return 1;
+        }
+    }
+
+    ctx->total_store_locks = ctx->total_mapstores;
+    return 0;
+}
+
+void free_store_locks(mapstore_ctx *ctx) {
+    if (!ctx->store_locks) {
+        return;
+    }
+
+    for (uint64_t f = 0; f < ctx->total_store_locks; f++) {
+        uv_mutex_destroy(&ctx->store_locks[f]);
+    }
+
+    free(ctx->store_locks);
+    ctx->store_locks = NULL;
+    ctx->total_store_locks = 0;
+}
+
+void lock_map_store(mapstore_ctx *ctx, uint64_t store_id) {
+    uv_mutex_lock(&ctx->store_locks[store_id - 1]);
+
+    /* fcntl locks belong to the process so threads are serialized first */
+    if (ctx->multi_process) {
+        lock_shared_store(ctx, store_id);
+    }
+}
+
+void unlock_map_store(mapstore_ctx *ctx, uint64_t store_id) {
+    if (ctx->multi_process) {
+        unlock_shared_store(ctx, store_id);
+    }
+
+    uv_mutex_unlock(&ctx->store_locks[store_id - 1]);
+}
+
+/**
+* State of the log engine. Appends start at the active segment and move on to
+* the next one with free space at its head. Segments being collected are
+* skipped so live data is never moved back into them.
+*/
+struct mapstore_log {
+  atomic_uint_fast64_t active;
+  uv_mutex_t gc_lock;
+  uv_rwlock_t victims_lock;
+  bool *victims;
+  uint64_t total_victims;
+};
+
+int init_log(mapstore_ctx *ctx) {
+    free_log(ctx);
+
+    if (!(ctx->log = calloc(1, sizeof(mapstore_log)))) {
+        return 1;
+    }
+
+    atomic_init(&ctx->log->active, 1);
+
+    if (uv_mutex_init(&ctx->log->gc_lock) != 0) {
+        free(ctx->log);
+        ctx->log = NULL;
+        return 1;
+    }
+
+    if (uv_rwlock_init(&ctx->log->victims_lock) != 0) {
+        uv_mutex_destroy(&ctx->log->gc_lock);
+        free(ctx->log);
+        ctx->log = NULL;
+        return 1;
+    }
+
+    return 0;
+}
+
+void free_log(mapstore_ctx *ctx) {
+    if (!ctx->log) {
+        return;
+    }
+
+    uv_rwlock_destroy(&ctx->log->victims_lock);
+    uv_mutex_destroy(&ctx->log->gc_lock);
+    free(ctx->log->victims);
+    free(ctx->log);
+    ctx->log = NULL;
+}
+
+static bool collecting_segment(mapstore_ctx *ctx, uint64_t store_id) {
+    bool collecting = false;
+
+    uv_rwlock_rdlock(&ctx->log->victims_lock);
+    collecting = ctx->log->victims && store_id < ctx->log->total_victims && ctx->log->victims[store_id];
+    uv_rwlock_rdunlock(&ctx->log->victims_lock);
+
+    return collecting;
+}
+
+/**
+* Empty positions after the space in them was released
+*/
+static void clear_positions(json_object *positions) {
+    while (json_object_object_length(positions) > 0) {
+        json_object_object_foreach(positions, store_id, pos) {
+            (void)pos;
+            json_object_object_del(positions, store_id);
+            break;
+        }
+    }
+}
+
+/**
+* Row of a map store to plan from. Processes sharing the store use the free
+* lists in the shared state.
+*/
+static int read_store_row(mapstore_ctx *ctx, uint64_t store_id, char *where, mapstore_row *row) {
+    if (ctx->multi_process) {
+        return get_shared_store_row(ctx, store_id, row);
+    }
+
+    return get_store_rows(db_for_store(&ctx->shards, store_id), where, row);
+}
+
+/**
+* Reserve space for data_size bytes one map store at a time. Each map store's
+* free list is read and written back under that store's lock so concurrent
+* callers never hand out the same extent. With contiguous set the space is a
+* single extent or nothing. On failure anything reserved so far is released
+* again.
+*/
+static int reserve_space(mapstore_ctx *ctx, uint64_t data_size, json_object *positions, bool contiguous) {
+    int status = 0;
+    char where[31 + MAX_UINT64_STR + 1];
+    char block_set[37 + MAX_UINT64_STR + 1];
+    char store_id_str[MAX_UINT64_STR + 1];
+    char *set = NULL;
+    char *stats_set = NULL;
+    mapstore_row row;
+    json_object *store_plan = NULL;
+    json_object *store_meta = NULL;
+    json_object *free_pos_obj = NULL;
+    json_object *store_positions_obj = NULL;
+    uint64_t remaining = data_size;
+    uint64_t used = 0;
+    uint64_t taken = 0;
+    uint64_t total_free_space = 0;
+    uint64_t timer = 0;
+    uint64_t plan_ns = 0;
+    uint64_t metadata_ns = 0;
+    uint64_t passes = 1;
+    uint64_t start = 0;
+    uint64_t f = 0;
+
+    // Determine space available before taking any locks
+    if (ctx->multi_process) {
+        total_free_space = get_shared_total_free_space(ctx);
+    } else if ((status = sum_column_for_shards(&ctx->shards, "free_space", "map_stores", &total_free_space)) != 0) {
+        goto end_reserve_map_space;
+    }
+
+    if (total_free_space < data_size) {
+        if (!contiguous) {
+            fprintf(stderr, "Not free enough space in mapstore\n");
+        }
+        status = 1;
+        goto end_reserve_map_space;
+    }
+
+    /*
+    * While map files are created in the background the stores that are ready
+    * are tried first. A second pass creates or waits for the others.
+    */
+    passes = (ctx->creator) ? 2 : 1;
+    start = (ctx->log) ? atomic_load_explicit(&ctx->log->active, memory_order_relaxed) - 1 : 0;
+    for (uint64_t i = 0; i < passes * ctx->total_mapstores && remaining > 0; i++) {
+        f = (start + i) % ctx->total_mapstores + 1;
+
+        if (i < ctx->total_mapstores && passes > 1 && !map_store_ready(ctx, f)) {
+            continue;
+        }
+
+        if (ctx->log && collecting_segment(ctx, f)) {
+            continue;
+        }
+
+        if (i >= ctx->total_mapstores && ensure_map_store(ctx, f) != 0) {
+            fprintf(stderr, "Map store %"PRIu64" could not be created\n", f);
+            status = 1;
+            goto end_reserve_map_space;
+        }
+
+        lock_map_store(ctx, f);
+
+        // The bitmap engine finds free blocks without reading the free list
+        if (ctx->blocks) {
+            timer = metrics_now();
+            store_positions_obj = json_object_new_array();
+            used = reserve_blocks(ctx, f, data_size - remaining, remaining, store_positions_obj, &taken);
+            plan_ns += metrics_now() - timer;
+
+            if (used > 0) {
+                memset(where, '\0', 31 + MAX_UINT64_STR + 1);
+                sprintf(where, "WHERE Id=%"PRIu64, f);
+                memset(block_set, '\0', 37 + MAX_UINT64_STR + 1);
+                sprintf(block_set, "SET free_space = free_space - %"PRIu64, taken);
+
+                timer = metrics_now();
+                status = update_map_store(db_for_store(&ctx->shards, f), where, block_set);
+                metadata_ns += metrics_now() - timer;
+
+                if (status == 0) {
+                    memset(store_id_str, '\0', MAX_UINT64_STR + 1);
+                    sprintf(store_id_str, "%"PRIu64, f);
+                    json_object_object_add(positions, store_id_str, json_object_get(store_positions_obj));
+                    remaining -= used;
+                } else {
+                    release_blocks(ctx, f, store_positions_obj);
+                }
+            }
+
+            json_object_put(store_positions_obj);
+            unlock_map_store(ctx, f);
+
+            if (status != 0) {
+                status = 1;
+                goto end_reserve_map_space;
+            }
+            continue;
+        }
+
+        memset(where, '\0', 31 + MAX_UINT64_STR + 1);
+        sprintf(where, "WHERE Id = %"PRIu64" AND free_space > 0", f);
+
+        timer = metrics_now();
+        if (read_store_row(ctx, f, where, &row) != 0) {
+            unlock_map_store(ctx, f);
+            status = 1;
+            goto end_reserve_map_space;
+        }
+        metadata_ns += metrics_now() - timer;
+
+        // If row is empty
+        if (row.free_space <= 0) {
+            if (row.free_locations) {
+                json_object_put(row.free_locations);
+            }
+            unlock_map_store(ctx, f);
+            continue;
+        }
+
+        timer = metrics_now();
+        store_plan = json_object_new_object();
+        if (contiguous) {
+            used = prepare_region_positions(f, row.free_locations, data_size, store_plan);
+        } else if (ctx->log) {
+            used = prepare_log_positions(f, row.free_locations, row.size, data_size - remaining, remaining, store_plan);
+        } else {
+            used = prepare_store_positions(f, row.free_locations, data_size - remaining, remaining,
+                                           (DIRECT_IO(ctx, data_size)) ? DIRECT_IO_ALIGN : 0, store_plan);
+        }
+        json_object_put(row.free_locations);
+        plan_ns += metrics_now() - timer;
+
+        if (used > 0) {
+            json_object_object_foreach(store_plan, store_id, meta) {
+                store_meta = meta;
+            }
+
+            json_object_object_get_ex(store_meta, "free_positions", &free_pos_obj);
+            json_object_object_get_ex(store_meta, "store_positions", &store_positions_obj);
+
+            memset(where, '\0', 31 + MAX_UINT64_STR + 1);
+            sprintf(where, "WHERE Id=%"PRIu64, f);
+            stats_set = free_list_stats_set(free_pos_obj);
+            set = calloc(strlen(json_object_to_json_string(free_pos_obj)) + strlen(stats_set) + MAX_UINT64_STR + 53 + 1, sizeof(char));
+            sprintf(set,
+                    "SET free_space = free_space - %"PRIu64", free_locations = '%s', %s",
+                    used,
+                    json_object_to_json_string(free_pos_obj),
+                    stats_set);
+            free(stats_set);
+            stats_set = NULL;
+
+            if (ctx->multi_process) {
+                begin_shared_store_update(ctx, f);
+            }
+
+            timer = metrics_now();
+            status = update_map_store(db_for_store(&ctx->shards, f), where, set);
+            metadata_ns += metrics_now() - timer;
+            free(set);
+            set = NULL;
+
+            if (status == 0) {
+                json_object_object_add(positions, store_id, json_object_get(store_positions_obj));
+                remaining -= used;
+
+                if (ctx->multi_process) {
+                    end_shared_store_update(ctx, f, free_pos_obj, row.free_space - used);
+                }
+
+                if (ctx->log) {
+                    atomic_store_explicit(&ctx->log->active, f, memory_order_relaxed);
+                }
+            }
+        }
+
+        json_object_put(store_plan);
+        unlock_map_store(ctx, f);
+
+        if (status != 0) {
+            status = 1;
+            goto end_reserve_map_space;
+        }
+    }
+
+    if (remaining > 0) {
+        if (!contiguous) {
+            fprintf(stderr, "Not free enough space in mapstore\n");
+        }
+        status = 1;
+    }
+
+end_reserve_map_space:
+    if (status != 0) {
+        release_map_space(ctx, positions);
+        clear_positions(positions);
+    } else {
+        METRICS_ADD_PHASE(ctx->metrics, MAPSTORE_PHASE_PLAN, plan_ns);
+        METRICS_ADD_PHASE(ctx->metrics, MAPSTORE_PHASE_METADATA, metadata_ns);
+    }
+    return status;
+}
+
+static int collect_segments(mapstore_ctx *ctx, gc_report *report);
+
+static bool slab_class(mapstore_ctx *ctx, uint64_t data_size) {
+    for (uint64_t c = 0; c < ctx->total_slab_classes; c++) {
+        if (ctx->slab_classes[c] == data_size) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static uint64_t slab_mask(uint64_t slots) {
+    return (slots >= SLAB_SLOTS) ? UINT64_MAX : (UINT64_C(1) << slots) - 1;
+}
+
+static void add_slab_position(json_object *positions, uint64_t store_id, uint64_t first, uint64_t size) {
+    char store_id_str[MAX_UINT64_STR + 1];
+    json_object *store_positions = json_object_new_array();
+
+    memset(store_id_str, '\0', MAX_UINT64_STR + 1);
+    sprintf(store_id_str, "%"PRIu64, store_id);
+    json_object_array_add(store_positions, json_data_positions_array(0, first, first + size - 1));
+    json_object_object_add(positions, store_id_str, store_positions);
+}
+
+/**
+* Take a slot in a slab of class_size, dedicating a new slab to the class
+* when all of them are full. Slots are found and freed with bit operations
+* on the slab's bitmap under the lock of the map store holding the slab.
+*/
+static int reserve_slab(mapstore_ctx *ctx, uint64_t class_size, json_object *positions) {
+    int status = 0;
+    char where[48 + MAX_UINT64_STR + 1];
+    slab_row row;
+    slab_row current;
+    json_object *region = NULL;
+    json_object *location_array = NULL;
+    sqlite3 *db = NULL;
+    uint64_t slots = 0;
+    uint64_t slot = 0;
+
+    for (uint64_t s = 0; s < ctx->shards.total; s++) {
+        db = ctx->shards.dbs[s];
+
+        while (true) {
+            memset(where, '\0', sizeof(where));
+            sprintf(where, "WHERE class_size = %"PRIu64" AND used < slots", class_size);
+            if (get_slab_row(db, where, &row) != 0) {
+                return 1;
+            }
+
+            if (row.id == 0) {
+                break;
+            }
+
+            // Another caller may have taken the last slot since
+            lock_map_store(ctx, row.store_id);
+            memset(where, '\0', sizeof(where));
+            sprintf(where, "WHERE Id = %"PRIu64, row.id);
+            if ((status = get_slab_row(db, where, &current)) == 0 && current.id != 0 && current.used < current.slots) {
+                slot = __builtin_ctzll(~current.bitmap & slab_mask(current.slots));
+                current.bitmap |= UINT64_C(1) << slot;
+                current.used++;
+
+                if ((status = update_slab(db, &current)) == 0) {
+                    add_slab_position(positions, current.store_id, current.first + slot * class_size, class_size);
+                }
+                unlock_map_store(ctx, row.store_id);
+                return status;
+            }
+            unlock_map_store(ctx, row.store_id);
+
+            if (status != 0) {
+                return 1;
+            }
+        }
+    }
+
+    // Carve a new slab from one free location, smaller if none holds a full one
+    slots = (ctx->map_size / class_size < SLAB_SLOTS) ? ctx->map_size / class_size : SLAB_SLOTS;
+    for (; slots > 0; slots /= 2) {
+        region = json_object_new_object();
+        if (reserve_space(ctx, slots * class_size, region, true) == 0) {
+            break;
+        }
+        json_object_put(region);
+        region = NULL;
+    }
+
+    if (!region) {
+        return 1;
+    }
+
+    memset(&row, 0, sizeof(slab_row));
+    json_object_object_foreach(region, store_id, pos) {
+        location_array = json_object_array_get_idx(pos, 0);
+        row.store_id = strtoull(store_id, NULL, 10);
+        row.first = json_object_get_int64(json_object_array_get_idx(location_array, 1));
+    }
+    row.class_size = class_size;
+    row.slots = slots;
+    row.bitmap = 1;
+    row.used = 1;
+
+    lock_map_store(ctx, row.store_id);
+    status = insert_slab(db_for_store(&ctx->shards, row.store_id), &row);
+    unlock_map_store(ctx, row.store_id);
+
+    if (status == 0) {
+        add_slab_position(positions, row.store_id, row.first, class_size);
+    } else {
+        release_map_space(ctx, region);
+    }
+
+    json_object_put(region);
+    return status;
+}
+
+/**
+* Free the slot holding the extent at first, if it is in a slab. A slab left
+* empty goes back to the free list. Called with the store lock held.
+*/
+static int release_slab_slot(mapstore_ctx *ctx, uint64_t store_id, uint64_t first, json_object *free_locations, bool *slotted) {
+    int status = 0;
+    char where[90 + 3 * MAX_UINT64_STR + 1];
+    sqlite3 *db = db_for_store(&ctx->shards, store_id);
+    slab_row row;
+
+    *slotted = false;
+
+    // Other processes may have carved slabs since this one opened the store
+    if (!ctx->has_slabs && !(ctx->multi_process && shared_has_slabs(ctx))) {
+        return 0;
+    }
+
+    memset(where, '\0', sizeof(where));
+    sprintf(where,
+            "WHERE store_id = %"PRIu64" AND first <= %"PRIu64" AND first + slots * class_size > %"PRIu64,
+            store_id,
+            first,
+            first);
+    if (get_slab_row(db, where, &row) != 0) {
+        return 1;
+    }
+
+    if (row.id == 0) {
+        return 0;
+    }
+
+    *slotted = true;
+    row.bitmap &= ~(UINT64_C(1) << ((first - row.first) / row.class_size));
+    row.used = __builtin_popcountll(row.bitmap);
+
+    if (row.used > 0) {
+        return update_slab(db, &row);
+    }
+
+    if ((status = delete_slab(db, row.id)) == 0) {
+        json_object_array_add(free_locations, json_free_space_array(row.first, row.first + row.slots * row.class_size - 1));
+    }
+
+    return status;
+}
+
+/**
+* Reserve space for data_size bytes. Objects the size of a slab class go in
+* a slab. With the log engine dead space only comes back when segments are
+* collected, so a reservation that fails collects them once and tries again.
+* Moves made by the collector never trigger another collection.
+*/
+int reserve_map_space(mapstore_ctx *ctx, uint64_t data_size, json_object *positions) {
+    int status = 0;
+    gc_report report = {0};
+
+    if (slab_class(ctx, data_size) && reserve_slab(ctx, data_size, positions) == 0) {
+        return 0;
+    }
+
+    status = reserve_space(ctx, data_size, positions, false);
+
+    if (status != 0 && ctx->log && uv_mutex_trylock(&ctx->log->gc_lock) == 0) {
+        if (collect_segments(ctx, &report) == 0 && report.segments > 0) {
+            status = reserve_space(ctx, data_size, positions, false);
+        }
+        uv_mutex_unlock(&ctx->log->gc_lock);
+    }
+
+    return status;
+}
+
+/**
+* Give the extents in positions back to the free lists of their map stores.
+*/
+int release_map_space(mapstore_ctx *ctx, json_object *positions) {
+    int status = 0;
+    char where[11 + MAX_UINT64_STR + 1];
+    char block_set[37 + MAX_UINT64_STR + 1];
+    char *set = NULL;
+    char *stats_set = NULL;
+    mapstore_row row;
+    json_object *location_array = NULL;
+    json_object *free_locations = NULL;
+    json_object *free_positions = NULL;
+    uint64_t store = 0;
+    uint64_t freespace = 0;
+    uint64_t first = 0;
+    bool slotted = false;
+    int arr_i = 0;
+
+    json_object_object_foreach(positions, store_id, pos) {
+        store = strtoull(store_id, NULL, 10);
+        if (store < 1 || store > ctx->total_mapstores) {
+            fprintf(stderr, "Unknown map store: %s\n", store_id);
+            status = 1;
+            continue;
+        }
+
+        lock_map_store(ctx, store);
+
+        memset(where, '\0', 11 + MAX_UINT64_STR + 1);
+        sprintf(where, "WHERE Id = %"PRIu64, store);
+
+        if (ctx->blocks) {
+            memset(block_set, '\0', 37 + MAX_UINT64_STR + 1);
+            sprintf(block_set, "SET free_space = free_space + %"PRIu64, release_blocks(ctx, store, pos));
+            if (update_map_store(db_for_store(&ctx->shards, store), where, block_set) != 0) {
+                status = 1;
+            }
+            unlock_map_store(ctx, store);
+            continue;
+        }
+
+        if (read_store_row(ctx, store, where, &row) != 0 || row.free_locations == NULL) {
+            unlock_map_store(ctx, store);
+            status = 1;
+            continue;
+        }
+
+        // Combine used locations with free locations
+        free_locations = json_object_new_array();
+
+        for (arr_i = 0; arr_i < json_object_array_length(row.free_locations); arr_i++) {
+            json_object_array_add(free_locations, json_object_get(json_object_array_get_idx(row.free_locations, arr_i)));
+        }
+
+        for (arr_i = 0; arr_i < json_object_array_length(pos); arr_i++) {
+            location_array = json_object_array_get_idx(pos, arr_i);
+            first = json_object_get_int64(json_object_array_get_idx(location_array, 1));
+
+            // Slots go back to their slab instead of the free list
+            if (release_slab_slot(ctx, store, first, free_locations, &slotted) != 0) {
+                status = 1;
+            }
+
+            if (!slotted) {
+                json_object_array_add(free_locations,
+                    json_free_space_array(first, json_object_get_int64(json_object_array_get_idx(location_array, 2))));
+            }
+        }
+
+        freespace = 0;
+        free_positions = combine_positions(free_locations, &freespace);
+
+        stats_set = free_list_stats_set(free_positions);
+        set = calloc(40 + strlen(json_object_to_json_string(free_positions)) + strlen(stats_set) + MAX_UINT64_STR + 1, sizeof(char));
+        sprintf(set,
+                "SET free_space = %"PRIu64", free_locations = '%s', %s",
+                freespace,
+                json_object_to_json_string(free_positions),
+                stats_set);
+        free(stats_set);
+        stats_set = NULL;
+
+        if (ctx->multi_process) {
+            begin_shared_store_update(ctx, store);
+        }
+
+        if (update_map_store(db_for_store(&ctx->shards, store), where, set) != 0) {
+            status = 1;
+        } else if (ctx->multi_process) {
+            end_shared_store_update(ctx, store, free_positions, freespace);
+        }
+
+        free(set);
+        set = NULL;
+        json_object_put(free_positions);
+        json_object_put(free_locations);
+        json_object_put(row.free_locations);
+
+        unlock_map_store(ctx, store);
+    }
+
+    return status;
+}
+
+/**
+* Punch holes in the free space around the extents in positions. Whole free
+* locations are used so blocks shared with neighbouring free space go too,
+* trimmed to the file's blocks. The store lock keeps the space from being
+* reserved while it is punched.
+*/
+int punch_map_space(mapstore_ctx *ctx, json_object *positions) {
+    int status = 0;
+    int store_fd = -1;
+    char where[11 + MAX_UINT64_STR + 1];
+    char mapstore_path[BUFSIZ];
+    mapstore_row row;
+    json_object *free_location = NULL;
+    json_object *location_array = NULL;
+    uint64_t store = 0;
+    uint64_t block = 0;
+    uint64_t first = 0;
+    uint64_t final = 0;
+    uint64_t start = 0;
+    uint64_t end = 0;
+    int ret = 0;
+
+    if (ctx->metadata_only) {
+        return 0;
+    }
+
+    json_object_object_foreach(positions, store_id, pos) {
+        store = strtoull(store_id, NULL, 10);
+        if (store < 1 || store > ctx->total_mapstores) {
+            continue;
+        }
+
+        lock_map_store(ctx, store);
+
+        memset(where, '\0', 11 + MAX_UINT64_STR + 1);
+        sprintf(where, "WHERE Id = %"PRIu64, store);
+
+        memset(mapstore_path, '\0', BUFSIZ);
+        sprintf(mapstore_path, "%s%"PRIu64".map", ctx->mapstore_path, store);
+
+        if ((store_fd = open(mapstore_path, O_RDWR)) < 0) {
+            fprintf(stderr, "Error opening mapstore for punching: %s\n", mapstore_path);
+            unlock_map_store(ctx, store);
+            status = 1;
+            continue;
+        }
+
+        // Freed blocks are punched where they are still free
+        if (ctx->blocks) {
+            if ((ret = punch_blocks(ctx, store, store_fd, pos)) != 0) {
+                fprintf(stderr, "Failed to punch hole in %s: %s\n", mapstore_path, strerror(ret));
+                status = 1;
+            }
+
+            close(store_fd);
+            unlock_map_store(ctx, store);
+
+            if (ret == ENOTSUP) {
+                break;
+            }
+            ret = 0;
+            continue;
+        }
+
+        if (read_store_row(ctx, store, where, &row) != 0 || row.free_locations == NULL) {
+            close(store_fd);
+            unlock_map_store(ctx, store);
+            status = 1;
+            continue;
+        }
+
+        block = get_block_size(store_fd);
+        for (uint64_t f = 0; f < json_object_array_length(row.free_locations) && ret == 0; f++) {
+            free_location = json_object_array_get_idx(row.free_locations, f);
+            first = json_object_get_int64(json_object_array_get_idx(free_location, 0));
+            final = json_object_get_int64(json_object_array_get_idx(free_location, 1));
+
+            for (uint64_t p = 0; p < json_object_array_length(pos); p++) {
+                location_array = json_object_array_get_idx(pos, p);
+                if (json_object_get_int64(json_object_array_get_idx(location_array, 1)) > final ||
+                    json_object_get_int64(json_object_array_get_idx(location_array, 2)) < first) {
+                    continue;
+                }
+
+                start = (first + block - 1) / block * block;
+                end = (final + 1) / block * block;
+                if (end > start && (ret = punch_hole(store_fd, start, end - start)) != 0) {
+                    fprintf(stderr, "Failed to punch hole in %s: %s\n", mapstore_path, strerror(ret));
+                    status = 1;
+                }
+                break;
+            }
+        }
+
+        json_object_put(row.free_locations);
+        close(store_fd);
+        unlock_map_store(ctx, store);
+
+        if (ret == ENOTSUP) {
+            break;
+        }
+        ret = 0;
+    }
+
+    return status;
+}
+
+int init_read_pool(mapstore_ctx *ctx, uint64_t total_readers) {
+    free_read_pool(ctx);
+
+    ctx->reader_sets = calloc(total_readers, sizeof(metadata_shards));
+    ctx->readers = calloc(total_readers, sizeof(metadata_shards *));
+    if (!ctx->reader_sets || !ctx->readers) {
+        free(ctx->reader_sets);
+        free(ctx->readers);
+        ctx->reader_sets = NULL;
+        ctx->readers = NULL;
+        return 1;
+    }
+
+    if (uv_mutex_init(&ctx->readers_lock) != 0) {
+        free(ctx->reader_sets);
+        free(ctx->readers);
+        ctx->reader_sets = NULL;
+        ctx->readers = NULL;
+        return 1;
+    }
+
+    if (uv_cond_init(&ctx->readers_cond) != 0) {
+        uv_mutex_destroy(&ctx->readers_lock);
+        free(ctx->reader_sets);
+        free(ctx->readers);
+        ctx->reader_sets = NULL;
+        ctx->readers = NULL;
+        return 1;
+    }
+
+    /* Each pooled reader holds one connection per metadata shard */
+    for (uint64_t r = 0; r < total_readers; r++) {
+        if (open_metadata_shards(ctx->base_path, ctx->shards.total, true, &ctx->reader_sets[r]) != 0) {
+            ctx->total_readers = r;
+            ctx->available_readers = r;
+            free_read_pool(ctx);
+            return 1;
+        }
+        ctx->readers[r] = &ctx->reader_sets[r];
+    }
+
+    ctx->total_readers = total_readers;
+    ctx->available_readers = total_readers;
+    return 0;
+}
+
+/**
+* Close every read connection. All connections must have been checked in.
+*/
+void free_read_pool(mapstore_ctx *ctx) {
+    if (!ctx->readers) {
+        return;
+    }
+
+    for (uint64_t r = 0; r < ctx->total_readers; r++) {
+        close_metadata_shards(&ctx->reader_sets[r]);
+    }
+
+    uv_cond_destroy(&ctx->readers_cond);
+    uv_mutex_destroy(&ctx->readers_lock);
+    free(ctx->reader_sets);
+    free(ctx->readers);
+    ctx->reader_sets = NULL;
+    ctx->readers = NULL;
+    ctx->total_readers = 0;
+    ctx->available_readers = 0;
+}
+
+/**
+* Take a set of read only connections from the pool, waiting for one to be
+* returned if they are all in use. Falls back to the writers when there is no
+* pool.
+*/
+metadata_shards *checkout_reader(mapstore_ctx *ctx) {
+    metadata_shards *readers = NULL;
+
+    if (!ctx->readers) {
+        return &ctx->shards;
+    }
+
+    uv_mutex_lock(&ctx->readers_lock);
+    while (ctx->available_readers == 0) {
+        uv_cond_wait(&ctx->readers_cond, &ctx->readers_lock);
+    }
+    readers = ctx->readers[--ctx->available_readers];
+    uv_mutex_unlock(&ctx->readers_lock);
+
+    return readers;
+}
+
+void checkin_reader(mapstore_ctx *ctx, metadata_shards *readers) {
+    if (!ctx->readers || readers == &ctx->shards) {
+        return;
+    }
+
+    uv_mutex_lock(&ctx->readers_lock);
+    ctx->readers[ctx->available_readers++] = readers;
+    uv_cond_signal(&ctx->readers_cond);
+    uv_mutex_unlock(&ctx->readers_lock);
+}
+
+/**
+* Calls that write metadata pass through the batch gate so a batch only
+* begins or commits between calls. A waiting commit holds back new calls.
+*/
+struct mapstore_batch {
+  uv_mutex_t lock;
+  uv_cond_t cond;
+  uint64_t active;
+  bool closing;
+  bool open;
+  json_object *freed;
+  json_object *punched;
+};
+
+int init_batch(mapstore_ctx *ctx) {
+    free_batch(ctx);
+
+    if (!(ctx->batch = calloc(1, sizeof(mapstore_batch)))) {
+        return 1;
+    }
+
+    if (uv_mutex_init(&ctx->batch->lock) != 0) {
+        free(ctx->batch);
+        ctx->batch = NULL;
+        return 1;
+    }
+
+    if (uv_cond_init(&ctx->batch->cond) != 0) {
+        uv_mutex_destroy(&ctx->batch->lock);
+        free(ctx->batch);
+        ctx->batch = NULL;
+        return 1;
+    }
+
+    return 0;
+}
+
+void free_batch(mapstore_ctx *ctx) {
+    if (!ctx->batch) {
+        return;
+    }
+
+    if (ctx->batch->open && ctx->shards.dbs) {
+        mapstore_end_batch(ctx);
+    }
+
+    if (ctx->batch->freed) {
+        json_object_put(ctx->batch->freed);
+    }
+
+    if (ctx->batch->punched) {
+        json_object_put(ctx->batch->punched);
+    }
+
+    uv_cond_destroy(&ctx->batch->cond);
+    uv_mutex_destroy(&ctx->batch->lock);
+    free(ctx->batch);
+    ctx->batch = NULL;
+}
+
+void enter_batch(mapstore_ctx *ctx) {
+    if (!ctx->batch) {
+        return;
+    }
+
+    uv_mutex_lock(&ctx->batch->lock);
+    while (ctx->batch->closing) {
+        uv_cond_wait(&ctx->batch->cond, &ctx->batch->lock);
+    }
+    ctx->batch->active++;
+    uv_mutex_unlock(&ctx->batch->lock);
+}
+
+void leave_batch(mapstore_ctx *ctx) {
+    if (!ctx->batch) {
+        return;
+    }
+
+    uv_mutex_lock(&ctx->batch->lock);
+    if (--ctx->batch->active == 0) {
+        uv_cond_broadcast(&ctx->batch->cond);
+    }
+    uv_mutex_unlock(&ctx->batch->lock);
+}
+
+static void queue_positions(mapstore_batch *batch, json_object **queue, json_object *positions) {
+    json_object *queued = NULL;
+
+    uv_mutex_lock(&batch->lock);
+    if (!*queue) {
+        *queue = json_object_new_object();
+    }
+
+    json_object_object_foreach(positions, store_id, pos) {
+        if (!json_object_object_get_ex(*queue, store_id, &queued)) {
+            queued = json_object_new_array();
+            json_object_object_add(*queue, store_id, queued);
+        }
+
+        for (uint64_t p = 0; p < json_object_array_length(pos); p++) {
+            json_object_array_add(queued, json_object_get(json_object_array_get_idx(pos, p)));
+        }
+    }
+    uv_mutex_unlock(&batch->lock);
+}
+
+/**
+* Give back space freed by delete_data and garbage collection. Inside a batch
+* the rows that pointed at it are only gone once the batch commits, so the
+* extents stay off the free lists until mapstore_end_batch.
+*/
+int release_deleted_space(mapstore_ctx *ctx, json_object *positions) {
+    if (!ctx->batch || !ctx->batch->open) {
+        return release_map_space(ctx, positions);
+    }
+
+    queue_positions(ctx->batch, &ctx->batch->freed, positions);
+    return 0;
+}
+
+/**
+* Punch holes for space freed by delete_data. Inside a batch the free list
+* isn't committed yet, so the extents wait for mapstore_end_batch.
+*/
+int release_disk_space(mapstore_ctx *ctx, json_object *positions) {
+    if (!ctx->batch || !ctx->batch->open) {
+        return punch_map_space(ctx, positions);
+    }
+
+    queue_positions(ctx->batch, &ctx->batch->punched, positions);
+    return 0;
+}
+
+static void close_batch_gate(mapstore_batch *batch) {
+    uv_mutex_lock(&batch->lock);
+    while (batch->closing) {
+        uv_cond_wait(&batch->cond, &batch->lock);
+    }
+    batch->closing = true;
+    while (batch->active > 0) {
+        uv_cond_wait(&batch->cond, &batch->lock);
+    }
+}
+
+static void open_batch_gate(mapstore_batch *batch) {
+    batch->closing = false;
+    uv_cond_broadcast(&batch->cond);
+    uv_mutex_unlock(&batch->lock);
+}
+
+static int exec_on_shard(sqlite3 *db, const char *sql) {
+    char *err_msg = NULL;
+
+    if (sqlite3_exec(db, sql, 0, 0, &err_msg) != SQLITE_OK) {
+        fprintf(stderr, "Batch statement failed: %s\n", sql);
+        fprintf(stderr, "SQL error: %s\n", err_msg);
+        sqlite3_free(err_msg);
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+* Groups the metadata writes of the following calls into one transaction.
+* Only stores with a single metadata shard can batch, since separate shards
+* can't commit together.
+*/
+MAPSTORE_API int mapstore_begin_batch(mapstore_ctx *ctx) {
+    int status = 0;
+
+    if (!ctx->batch) {
+        return 1;
+    }
+
+    if (ctx->multi_process) {
+        fprintf(stderr, "Batches need exclusive access to the store\n");
+        return 1;
+    }
+
+    if (ctx->shards.total != 1) {
+        fprintf(stderr, "Batches need a single metadata shard\n");
+        return 1;
+    }
+
+    close_batch_gate(ctx->batch);
+
+    if (ctx->batch->open) {
+        fprintf(stderr, "A batch is already open\n");
+        status = 1;
+        goto end_begin_batch;
+    }
+
+    if (exec_on_shard(ctx->shards.dbs[0], "BEGIN IMMEDIATE") != 0) {
+        status = 1;
+        goto end_begin_batch;
+    }
+
+    ctx->batch->open = true;
+
+end_begin_batch:
+    open_batch_gate(ctx->batch);
+    return status;
+}
+
+/**
+* Commits the open batch. If the commit fails the batch is rolled back, and
+* the space it freed stays in use by the rows that come back.
+*/
+MAPSTORE_API int mapstore_end_batch(mapstore_ctx *ctx) {
+    int status = 0;
+
+    if (!ctx->batch) {
+        return 1;
+    }
+
+    close_batch_gate(ctx->batch);
+
+    if (!ctx->batch->open) {
+        fprintf(stderr, "No batch is open\n");
+        status = 1;
+        goto end_end_batch;
+    }
+
+    if (exec_on_shard(ctx->shards.dbs[0], "COMMIT") != 0) {
+        exec_on_shard(ctx->shards.dbs[0], "ROLLBACK");
+        status = 1;
+    }
+
+    ctx->batch->open = false;
+
+    /* Freed space can only be reused once the deletes are committed */
+    if (ctx->batch->freed) {
+        if (status == 0 && release_map_space(ctx, ctx->batch->freed) != 0) {
+            status = 1;
+        }
+        json_object_put(ctx->batch->freed);
+        ctx->batch->freed = NULL;
+    }
+
+    /* Holes are only safe once the free lists they come from are committed */
+    if (ctx->batch->punched) {
+        if (status == 0 && punch_map_space(ctx, ctx->batch->punched) != 0) {
+            status = 1;
+        }
+        json_object_put(ctx->batch->punched);
+        ctx->batch->punched = NULL;
+    }
+
+end_end_batch:
+    open_batch_gate(ctx->batch);
+    return status;
+}
+
+/**
+* Map files created by background threads with lazy_create. Threads take
+* stores in order so the ones the planner fills first are ready first, and an
+* allocation that needs a store nobody has got to yet creates it itself.
+*/
+typedef enum {
+  MAP_FILE_PENDING,
+  MAP_FILE_CREATING,
+  MAP_FILE_READY,
+  MAP_FILE_FAILED
+} map_file_state;
+
+struct mapstore_creator {
+  uv_mutex_t lock;
+  uv_cond_t cond;
+  uint8_t *states;
+  uint64_t *sizes;
+  uint64_t total;
+  uint64_t next;
+  uint64_t pending;
+  uv_thread_t *threads;
+  uint64_t total_threads;
+  bool stopping;
+  char *mapstore_path;
+  bool prealloc;
+  mapstore_metrics *metrics;
+  uint64_t started;
+};
+
+/**
+* Create or finish a map file. An existing file is only grown, so files left
+* short by an earlier run are completed and full ones are left alone.
+*/
+static int create_map_file(char *store_dir, uint64_t store_id, uint64_t size, bool prealloc) {
+    int fd = -1;
+    char mapstore_path[BUFSIZ];
+
+    memset(mapstore_path, '\0', BUFSIZ);
+    sprintf(mapstore_path, "%s%"PRIu64".map", store_dir, store_id);
+
+    if ((fd = open(mapstore_path, O_RDWR | O_CREAT, 0666)) < 0) {
+        fprintf(stderr, "Could not open map store: %s\n", mapstore_path);
+        return 1;
+    }
+    close(fd);
+
+    return extend_map_store(mapstore_path, size, prealloc);
+}
+
+/**
+* Called with the lock held after a store is created
+*/
+static void finish_map_file(mapstore_creator *creator, uint64_t store_id, int status) {
+    creator->states[store_id - 1] = (status == 0) ? MAP_FILE_READY : MAP_FILE_FAILED;
+    if (--creator->pending == 0 && creator->metrics) {
+        atomic_store_explicit(&creator->metrics->map_files_ns, metrics_now() - creator->started, memory_order_relaxed);
+    }
+    uv_cond_broadcast(&creator->cond);
+}
+
+static void create_map_files(void *arg) {
+    mapstore_creator *creator = arg;
+    uint64_t store_id = 0;
+    int status = 0;
+
+    uv_mutex_lock(&creator->lock);
+    while (!creator->stopping) {
+        while (creator->next < creator->total && creator->states[creator->next] != MAP_FILE_PENDING) {
+            creator->next++;
+        }
+
+        if (creator->next == creator->total) {
+            break;
+        }
+
+        store_id = ++creator->next;
+        creator->states[store_id - 1] = MAP_FILE_CREATING;
+        uv_mutex_unlock(&creator->lock);
+
+        status = create_map_file(creator->mapstore_path, store_id, creator->sizes[store_id - 1], creator->prealloc);
+        if (status != 0) {
+            fprintf(stderr, "Failed to create map store %"PRIu64"\n", store_id);
+        }
+
+        uv_mutex_lock(&creator->lock);
+        finish_map_file(creator, store_id, status);
+    }
+    uv_mutex_unlock(&creator->lock);
+}
+
+/**
+* Start creating every map store in the background on total_threads threads.
+* With no threads stores are only created when first allocated.
+*/
+int init_map_creator(mapstore_ctx *ctx, uint64_t total_threads, uint64_t started) {
+    int status = 0;
+    mapstore_creator *creator = NULL;
+
+    free_map_creator(ctx);
+
+    if (!(creator = calloc(1, sizeof(mapstore_creator)))) {
+        return 1;
+    }
+
+    creator->total = ctx->total_mapstores;
+    creator->pending = ctx->total_mapstores;
+    creator->mapstore_path = ctx->mapstore_path;
+    creator->prealloc = ctx->prealloc;
+    creator->metrics = ctx->metrics;
+    creator->started = started;
+
+    if (!(creator->states = calloc(creator->total, sizeof(uint8_t))) ||
+        !(creator->sizes = calloc(creator->total, sizeof(uint64_t))) ||
+        (total_threads > 0 && !(creator->threads = calloc(total_threads, sizeof(uv_thread_t))))) {
+        status = 1;
+        goto end_init_map_creator;
+    }
+
+    for (uint64_t s = 0; s < ctx->shards.total; s++) {
+        if (get_map_store_sizes(ctx->shards.dbs[s], creator->sizes, creator->total) != 0) {
+            status = 1;
+            goto end_init_map_creator;
+        }
+    }
+
+    if (uv_mutex_init(&creator->lock) != 0) {
+        status = 1;
+        goto end_init_map_creator;
+    }
+
+    if (uv_cond_init(&creator->cond) != 0) {
+        uv_mutex_destroy(&creator->lock);
+        status = 1;
+        goto end_init_map_creator;
+    }
+
+    ctx->creator = creator;
+
+    for (; creator->total_threads < total_threads; creator->total_threads++) {
+        if (uv_thread_create(&creator->threads[creator->total_threads], create_map_files, creator) != 0) {
+            fprintf(stderr, "Could not start map store creator\n");
+            break;
+        }
+    }
+
+end_init_map_creator:
+    if (status != 0) {
+        free(creator->states);
+        free(creator->sizes);
+        free(creator->threads);
+        free(creator);
+    }
+    return status;
+}
+
+/**
+* Stops the background threads once their current store is done. Stores not
+* created yet are finished the next time the store is opened, by
+* finish_map_files or by a new creator.
+*/
+void free_map_creator(mapstore_ctx *ctx) {
+    mapstore_creator *creator = ctx->creator;
+
+    if (!creator) {
+        return;
+    }
+
+    uv_mutex_lock(&creator->lock);
+    creator->stopping = true;
+    uv_mutex_unlock(&creator->lock);
+
+    for (uint64_t t = 0; t < creator->total_threads; t++) {
+        uv_thread_join(&creator->threads[t]);
+    }
+
+    uv_cond_destroy(&creator->cond);
+    uv_mutex_destroy(&creator->lock);
+    free(creator->states);
+    free(creator->sizes);
+    free(creator->threads);
+    free(creator);
+    ctx->creator = NULL;
+}
+
+/**
+* Create map files that are missing and grow ones that are shorter than
+* their map store. Files can be left that way by a context opened with
+* lazy_create that was freed before its threads got to them.
+*/
+int finish_map_files(mapstore_ctx *ctx) {
+    int status = 0;
+    char mapstore_path[BUFSIZ];
+    uint64_t *sizes = NULL;
+    struct stat st;
+
+    if (ctx->total_mapstores == 0) {
+        return 0;
+    }
+
+    if (!(sizes = calloc(ctx->total_mapstores, sizeof(uint64_t)))) {
+        return 1;
+    }
+
+    for (uint64_t s = 0; s < ctx->shards.total && status == 0; s++) {
+        status = get_map_store_sizes(ctx->shards.dbs[s], sizes, ctx->total_mapstores);
+    }
+
+    for (uint64_t store_id = 1; store_id <= ctx->total_mapstores && status == 0; store_id++) {
+        memset(mapstore_path, '\0', BUFSIZ);
+        sprintf(mapstore_path, "%s%"PRIu64".map", ctx->mapstore_path, store_id);
+
+        if (stat(mapstore_path, &st) == 0 && (uint64_t)st.st_size >= sizes[store_id - 1]) {
+            continue;
+        }
+
+        if ((status = create_map_file(ctx->mapstore_path, store_id, sizes[store_id - 1], ctx->prealloc)) != 0) {
+            fprintf(stderr, "Failed to create map store %"PRIu64"\n", store_id);
+        }
+    }
+
+    free(sizes);
+    return status;
+}
+
+bool map_store_ready(mapstore_ctx *ctx, uint64_t store_id) {
+    bool ready = true;
+
+    if (!ctx->creator || store_id < 1 || store_id > ctx->creator->total) {
+        return true;
+    }
+
+    uv_mutex_lock(&ctx->creator->lock);
+    ready = ctx->creator->states[store_id - 1] == MAP_FILE_READY;
+    uv_mutex_unlock(&ctx->creator->lock);
+
+    return ready;
+}
+
+/**
+* Make sure a map store's file exists before it is allocated from, creating
+* it now or waiting for the thread that is
+*/
+int ensure_map_store(mapstore_ctx *ctx, uint64_t store_id) {
+    mapstore_creator *creator = ctx->creator;
+    int status = 0;
+
+    if (!creator || store_id < 1 || store_id > creator->total) {
+        return 0;
+    }
+
+    uv_mutex_lock(&creator->lock);
+    while (creator->states[store_id - 1] == MAP_FILE_CREATING) {
+        uv_cond_wait(&creator->cond, &creator->lock);
+    }
+
+    if (creator->states[store_id - 1] == MAP_FILE_PENDING) {
+        creator->states[store_id - 1] = MAP_FILE_CREATING;
+        uv_mutex_unlock(&creator->lock);
+
+        status = create_map_file(creator->mapstore_path, store_id, creator->sizes[store_id - 1], creator->prealloc);
+
+        uv_mutex_lock(&creator->lock);
+        finish_map_file(creator, store_id, status);
+    }
+
+    status = (creator->states[store_id - 1] == MAP_FILE_READY) ? 0 : 1;
+    uv_mutex_unlock(&creator->lock);
+
+    return status;
+}
+
+uint64_t pending_map_stores(mapstore_ctx *ctx) {
+    uint64_t pending = 0;
+
+    if (!ctx->creator) {
+        return 0;
+    }
+
+    uv_mutex_lock(&ctx->creator->lock);
+    pending = ctx->creator->pending;
+    uv_mutex_unlock(&ctx->creator->lock);
+
+    return pending;
+}
+
+/**
+* Move a live object to the head of the log and give its old extents back
+* to the segments being collected
+*/
+static int move_object(mapstore_ctx *ctx, sqlite3 *db, data_locations_row *row, int tmp_fd, gc_report *report) {
+    int status = 0;
+    bool moved = false;
+    json_object *positions = json_object_new_object();
+
+    if (reserve_space(ctx, row->size, positions, false) != 0) {
+        status = 1;
+        goto end_move_object;
+    }
+
+    if (!ctx->metadata_only &&
+        (read_from_store(tmp_fd, ctx->mapstore_path, row->positions, false, !ctx->skip_verify) != 0 ||
+         write_to_store(tmp_fd, ctx->mapstore_path, positions, NULL, false) != 0 ||
+         (ctx->sync_writes && sync_map_stores(ctx->mapstore_path, positions) != 0))) {
+        fprintf(stderr, "Failed to move data: %s\n", row->hash);
+        status = 1;
+        goto end_move_object;
+    }
+
+    if (move_data_location(db, row->id, positions, positions_extents(row->positions), &moved) != 0) {
+        status = 1;
+        goto end_move_object;
+    }
+
+    // Deleted while it was being copied
+    if (!moved) {
+        goto end_move_object;
+    }
+
+    if (release_deleted_space(ctx, row->positions) != 0) {
+        status = 1;
+        goto end_move_object;
+    }
+
+    if (ctx->punch_holes && release_disk_space(ctx, row->positions) != 0) {
+        fprintf(stderr, "Failed to release disk space for %s\n", row->hash);
+    }
+
+    report->objects++;
+    report->bytes += row->size;
+
+end_move_object:
+    if (!moved) {
+        release_map_space(ctx, positions);
+    }
+    json_object_put(positions);
+    return status;
+}
+
+static bool in_victims(json_object *positions, bool *victims, uint64_t total_victims) {
+    uint64_t store = 0;
+
+    json_object_object_foreach(positions, store_id, pos) {
+        (void)pos;
+        store = strtoull(store_id, NULL, 10);
+        if (store < total_victims && victims[store]) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+* Rewrite the segments whose live data is below gc_live_ratio of what was
+* appended to them. Their live objects are appended to other segments, which
+* leaves them empty. The active segment is never collected. Called with
+* gc_lock held.
+*/
+static int collect_segments(mapstore_ctx *ctx, gc_report *report) {
+    int status = 0;
+    int tmp_fd = -1;
+    int count = 0;
+    char where[11 + MAX_UINT64_STR + 1];
+    char tmp_path[BUFSIZ];
+    char hashes[RESTRUCTURE_BATCH][41];
+    uint64_t ids[RESTRUCTURE_BATCH];
+    uint64_t last_id = 0;
+    uint64_t head = 0;
+    uint64_t dead = 0;
+    uint64_t total_victims = ctx->total_mapstores + 1;
+    uint64_t active = atomic_load_explicit(&ctx->log->active, memory_order_relaxed);
+    double live_ratio = (ctx->gc_live_ratio > 0) ? ctx->gc_live_ratio : GC_LIVE_RATIO;
+    bool *victims = NULL;
+    sqlite3 *db = NULL;
+    mapstore_row row;
+    data_locations_row data_row;
+
+    memset(report, 0, sizeof(gc_report));
+
+    if (!(victims = calloc(total_victims, sizeof(bool)))) {
+        return 1;
+    }
+
+    for (uint64_t f = 1; f <= ctx->total_mapstores; f++) {
+        memset(where, '\0', 11 + MAX_UINT64_STR + 1);
+        sprintf(where, "WHERE Id = %"PRIu64, f);
+
+        lock_map_store(ctx, f);
+        status = get_store_rows(db_for_store(&ctx->shards, f), where, &row);
+        unlock_map_store(ctx, f);
+
+        if (status != 0 || row.free_locations == NULL) {
+            status = 1;
+            goto end_collect_segments;
+        }
+
+        head = log_head(row.free_locations, row.size);
+        dead = row.free_space - (row.size - head);
+        json_object_put(row.free_locations);
+
+        if (f != active && head > 0 && head - dead < live_ratio * head) {
+            victims[f] = true;
+            report->segments++;
+        }
+    }
+
+    if (report->segments == 0) {
+        goto end_collect_segments;
+    }
+
+    uv_rwlock_wrlock(&ctx->log->victims_lock);
+    ctx->log->victims = victims;
+    ctx->log->total_victims = total_victims;
+    uv_rwlock_wrunlock(&ctx->log->victims_lock);
+
+    /* Data is staged through a scratch file between its old and new extents */
+    if (!ctx->metadata_only) {
+        memset(tmp_path, '\0', BUFSIZ);
+        sprintf(tmp_path, "%s%c%s", ctx->base_path, separator(), GC_TMP);
+        if ((tmp_fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+            fprintf(stderr, "Could not open scratch file: %s\n", tmp_path);
+            status = 1;
+            goto end_collect_segments;
+        }
+    }
+
+    for (uint64_t s = 0; s < ctx->shards.total && status == 0; s++) {
+        db = ctx->shards.dbs[s];
+        last_id = 0;
+
+        while (status == 0 && (count = get_data_hashes_after(db, last_id, RESTRUCTURE_BATCH, hashes, ids)) > 0) {
+            for (int i = 0; i < count && status == 0; i++) {
+                if (get_data_locations_row(db, hashes[i], &data_row) != 0) {
+                    status = 1;
+                    break;
+                }
+
+                // Objects still being stored are left where they are
+                if (data_row.hash && data_row.uploaded && data_row.positions &&
+                    in_victims(data_row.positions, victims, total_victims)) {
+                    status = move_object(ctx, db, &data_row, tmp_fd, report);
+                }
+
+                free(data_row.hash);
+                if (data_row.positions) {
+                    json_object_put(data_row.positions);
+                }
+            }
+
+            last_id = ids[count - 1];
+        }
+
+        if (count < 0) {
+            fprintf(stderr, "Could not get data hashes\n");
+            status = 1;
+        }
+    }
+
+end_collect_segments:
+    if (tmp_fd >= 0) {
+        close(tmp_fd);
+        remove(tmp_path);
+    }
+
+    uv_rwlock_wrlock(&ctx->log->victims_lock);
+    ctx->log->victims = NULL;
+    ctx->log->total_victims = 0;
+    uv_rwlock_wrunlock(&ctx->log->victims_lock);
+
+    free(victims);
+    return status;
+}
+
+int collect_log_segments(mapstore_ctx *ctx, gc_report *report) {
+    int status = 0;
+
+    uv_mutex_lock(&ctx->log->gc_lock);
+    status = collect_segments(ctx, report);
+    uv_mutex_unlock(&ctx->log->gc_lock);
+
+    return status;
+}
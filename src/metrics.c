@@ -0,0 +1,170 @@
+#include "metrics.h"
+
+static const char *op_names[MAPSTORE_OPS] = {
+    "store",
+    "retrieve",
+    "delete"
+};
+
+static const char *phase_names[MAPSTORE_PHASES] = {
+    "hash_check",
+    "plan",
+    "metadata",
+    "data_io",
+    "mark_uploaded"
+};
+
+int init_metrics(mapstore_ctx *ctx) {
+#ifdef MAPSTORE_DISABLE_METRICS
+    ctx->metrics = NULL;
+    return 0;
+#else
+    ctx->metrics = calloc(1, sizeof(mapstore_metrics));
+    return (ctx->metrics) ? 0 : 1;
+#endif
+}
+
+void free_metrics(mapstore_ctx *ctx) {
+    if (ctx->metrics) {
+        free(ctx->metrics);
+        ctx->metrics = NULL;
+    }
+}
+
+/**
+* Values below 16 get a bucket each. Above that every power of two is split
+* into 16 linear sub buckets.
+*/
+uint64_t metrics_bucket_index(uint64_t value) {
+    uint64_t exponent = 0;
+
+    if (value < METRICS_SUB_BUCKETS) {
+        return value;
+    }
+
+    exponent = 63 - __builtin_clzll(value);
+    return (exponent - METRICS_SUB_BUCKET_BITS + 1) * METRICS_SUB_BUCKETS +
+           ((value >> (exponent - METRICS_SUB_BUCKET_BITS)) & (METRICS_SUB_BUCKETS - 1));
+}
+
+/**
+* Midpoint of the values that fall into a bucket
+*/
+uint64_t metrics_bucket_value(uint64_t index) {
+    uint64_t shift = 0;
+    uint64_t lower = 0;
+
+    if (index < METRICS_SUB_BUCKETS) {
+        return index;
+    }
+
+    shift = index / METRICS_SUB_BUCKETS - 1;
+    lower = (METRICS_SUB_BUCKETS + index % METRICS_SUB_BUCKETS) << shift;
+    return lower + (((uint64_t)1 << shift) >> 1);
+}
+
+void metrics_record(metrics_histogram *histogram, uint64_t ns, uint64_t bytes, int status) {
+    uint64_t max = 0;
+
+    if (!histogram) {
+        return;
+    }
+
+    if (status != 0) {
+        atomic_fetch_add_explicit(&histogram->errors, 1, memory_order_relaxed);
+        return;
+    }
+
+    atomic_fetch_add_explicit(&histogram->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->bytes, bytes, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->total_ns, ns, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->buckets[metrics_bucket_index(ns)], 1, memory_order_relaxed);
+
+    max = atomic_load_explicit(&histogram->max_ns, memory_order_relaxed);
+    while (ns > max &&
+           !atomic_compare_exchange_weak_explicit(&histogram->max_ns, &max, ns,
+                                                  memory_order_relaxed, memory_order_relaxed)) {
+    }
+}
+
+void metrics_summarize(metrics_histogram *histogram, latency_summary *summary) {
+    double quantiles[4] = {0.5, 0.9, 0.99, 0.999};
+    uint64_t *results[4] = {&summary->p50_ns, &summary->p90_ns, &summary->p99_ns, &summary->p999_ns};
+    uint64_t seen = 0;
+    uint64_t total = 0;
+    int q = 0;
+
+    memset(summary, 0, sizeof(latency_summary));
+    summary->count = atomic_load_explicit(&histogram->count, memory_order_relaxed);
+    summary->errors = atomic_load_explicit(&histogram->errors, memory_order_relaxed);
+    summary->bytes = atomic_load_explicit(&histogram->bytes, memory_order_relaxed);
+    summary->total_ns = atomic_load_explicit(&histogram->total_ns, memory_order_relaxed);
+    summary->max_ns = atomic_load_explicit(&histogram->max_ns, memory_order_relaxed);
+
+    /* Buckets may move on while we read them so count what we actually saw */
+    for (uint64_t b = 0; b < METRICS_BUCKETS; b++) {
+        total += atomic_load_explicit(&histogram->buckets[b], memory_order_relaxed);
+    }
+
+    if (total == 0) {
+        return;
+    }
+
+    for (uint64_t b = 0; b < METRICS_BUCKETS && q < 4; b++) {
+        seen += atomic_load_explicit(&histogram->buckets[b], memory_order_relaxed);
+        while (q < 4 && seen >= quantiles[q] * total) {
+            *results[q] = metrics_bucket_value(b);
+            if (*results[q] > summary->max_ns) {
+                *results[q] = summary->max_ns;
+            }
+            q++;
+        }
+    }
+}
+
+/**
+* Map files are all ready at startup unless they are created in the background
+*/
+void metrics_startup(mapstore_ctx *ctx, uint64_t started) {
+    uint64_t elapsed = metrics_now() - started;
+
+    if (!ctx->metrics) {
+        return;
+    }
+
+    atomic_store_explicit(&ctx->metrics->startup_ns, elapsed, memory_order_relaxed);
+    if (!ctx->creator) {
+        atomic_store_explicit(&ctx->metrics->map_files_ns, elapsed, memory_order_relaxed);
+    }
+}
+
+MAPSTORE_API int get_store_metrics(mapstore_ctx *ctx, store_metrics *metrics) {
+    memset(metrics, 0, sizeof(store_metrics));
+
+    if (!ctx->metrics) {
+        fprintf(stderr, "Metrics are disabled\n");
+        return 1;
+    }
+
+    for (int op = 0; op < MAPSTORE_OPS; op++) {
+        metrics_summarize(&ctx->metrics->ops[op], &metrics->ops[op]);
+    }
+
+    for (int phase = 0; phase < MAPSTORE_PHASES; phase++) {
+        metrics_summarize(&ctx->metrics->phases[phase], &metrics->phases[phase]);
+    }
+
+    metrics->startup_ns = atomic_load_explicit(&ctx->metrics->startup_ns, memory_order_relaxed);
+    metrics->map_files_ns = atomic_load_explicit(&ctx->metrics->map_files_ns, memory_order_relaxed);
+    metrics->pending_map_stores = pending_map_stores(ctx);
+
+    return 0;
+}
+
+MAPSTORE_API const char *mapstore_op_name(mapstore_op op) {
+    return (op >= 0 && op < MAPSTORE_OPS) ? op_names[op] : "unknown";
+}
+
+MAPSTORE_API const char *mapstore_phase_name(mapstore_phase phase) {
+    return (phase >= 0 && phase < MAPSTORE_PHASES) ? phase_names[phase] : "unknown";
+}
@@ -0,0 +1,62 @@
+/**
+ * @file metrics.h
+ * @brief Map Store latency metrics.
+ *
+ * Lock free counters and log-linear latency histograms for every operation
+ * and for the phases of an operation. Each histogram bucket covers 1/16th of
+ * a power of two so recorded latencies keep about 6% precision. Building with
+ * MAPSTORE_DISABLE_METRICS turns every recording macro into a no-op.
+ */
+#ifndef MAPSTORE_METRICS_H
+#define MAPSTORE_METRICS_H
+
+#include <stdatomic.h>
+
+#include "mapstore.h"
+
+#define METRICS_SUB_BUCKET_BITS 4
+#define METRICS_SUB_BUCKETS (1 << METRICS_SUB_BUCKET_BITS)
+#define METRICS_BUCKETS ((64 - METRICS_SUB_BUCKET_BITS + 1) * METRICS_SUB_BUCKETS)
+
+typedef struct  {
+  atomic_uint_fast64_t count;
+  atomic_uint_fast64_t errors;
+  atomic_uint_fast64_t bytes;
+  atomic_uint_fast64_t total_ns;
+  atomic_uint_fast64_t max_ns;
+  atomic_uint_fast64_t buckets[METRICS_BUCKETS];
+} metrics_histogram;
+
+struct mapstore_metrics {
+  metrics_histogram ops[MAPSTORE_OPS];
+  metrics_histogram phases[MAPSTORE_PHASES];
+  atomic_uint_fast64_t startup_ns;
+  atomic_uint_fast64_t map_files_ns;
+};
+
+#ifdef MAPSTORE_DISABLE_METRICS
+#define metrics_now() 0
+/* The no-ops still consume their arguments so timers don't go unused */
+#define METRICS_PHASE(metrics, phase, start) ((void)(metrics), (void)(start))
+#define METRICS_ADD_PHASE(metrics, phase, ns) ((void)(metrics), (void)(ns))
+#define METRICS_OP(metrics, op, start, bytes, status) \
+    ((void)(metrics), (void)(start), (void)(bytes), (void)(status))
+#else
+#define metrics_now() uv_hrtime()
+#define METRICS_PHASE(metrics, phase, start) \
+    metrics_record((metrics) ? &(metrics)->phases[phase] : NULL, uv_hrtime() - (start), 0, 0)
+#define METRICS_ADD_PHASE(metrics, phase, ns) \
+    metrics_record((metrics) ? &(metrics)->phases[phase] : NULL, ns, 0, 0)
+#define METRICS_OP(metrics, op, start, bytes, status) \
+    metrics_record((metrics) ? &(metrics)->ops[op] : NULL, uv_hrtime() - (start), bytes, status)
+#endif
+
+int init_metrics(mapstore_ctx *ctx);
+void free_metrics(mapstore_ctx *ctx);
+uint64_t metrics_bucket_index(uint64_t value);
+uint64_t metrics_bucket_value(uint64_t index);
+void metrics_record(metrics_histogram *histogram, uint64_t ns, uint64_t bytes, int status);
+void metrics_summarize(metrics_histogram *histogram, latency_summary *summary);
+void metrics_startup(mapstore_ctx *ctx, uint64_t started);
+
+#endif /* MAPSTORE_METRICS_H */
@@ -0,0 +1,632 @@
+#define _GNU_SOURCE
+#include "server.h"
+
+#include <signal.h>
+
+typedef struct server_conn server_conn;
+
+typedef struct  {
+  uv_work_t work;
+  uv_write_t write;
+  server_conn *conn;
+  server_frame frame;
+  server_frame response;
+  char hash[HASH_LENGTH + 1];
+  int data_fd;
+  uint64_t data_size;
+  uint8_t *map;
+  char *body;
+  uint64_t body_length;
+  int status;
+} server_request;
+
+/**
+* A connection stays allocated until it is closed and every request it
+* dispatched has been answered or dropped.
+*/
+struct server_conn {
+  uv_pipe_t pipe;
+  mapstore_ctx *ctx;
+  server_frame frame;
+  uint64_t frame_received;
+  server_request *request;
+  uint64_t payload_received;
+  uint64_t pending;
+  bool closed;
+};
+
+static int send_all(int fd, const void *data, uint64_t length) {
+    const char *position = data;
+    ssize_t sent = 0;
+
+    while (length > 0) {
+        if ((sent = send(fd, position, length, MSG_NOSIGNAL)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return 1;
+        }
+        position += sent;
+        length -= sent;
+    }
+
+    return 0;
+}
+
+static int recv_all(int fd, void *data, uint64_t length) {
+    char *position = data;
+    ssize_t received = 0;
+
+    while (length > 0) {
+        if ((received = recv(fd, position, length, 0)) <= 0) {
+            if (received < 0 && errno == EINTR) {
+                continue;
+            }
+            return 1;
+        }
+        position += received;
+        length -= received;
+    }
+
+    return 0;
+}
+
+/**
+* Unlinked scratch file in the store directory for request data
+*/
+static int open_spool(mapstore_ctx *ctx) {
+    char path[BUFSIZ];
+    int fd = -1;
+
+    memset(path, '\0', BUFSIZ);
+    sprintf(path, "%s%c%s", ctx->base_path, separator(), SERVER_SPOOL);
+
+    if ((fd = mkstemp(path)) < 0) {
+        fprintf(stderr, "Could not create spool file in %s\n", ctx->base_path);
+        return -1;
+    }
+
+    unlink(path);
+    return fd;
+}
+
+char *data_info_json(data_info *info) {
+    char *json = NULL;
+
+    if (asprintf(&json, "{ \"hash\": \"%s\", \"size\": %"PRIu64" }\n", info->hash, info->size) < 0) {
+        return NULL;
+    }
+
+    return json;
+}
+
+char *store_info_json(store_info *info) {
+    char *json = NULL;
+
+    if (asprintf(&json,
+                 "{ \"free_space\": %"PRIu64", "    \
+                 "\"used_space\": %"PRIu64", "     \
+                 "\"allocation_size\": %"PRIu64", "\
+                 "\"map_size\": %"PRIu64", "       \
+                 "\"data_count\": %"PRIu64", "     \
+                 "\"total_stores\": %"PRIu64", "  \
+                 "\"physical_space\": %"PRIu64", "  \
+                 "\"pending_map_stores\": %"PRIu64" "  \
+                 "}\n",                            \
+                 info->free_space,
+                 info->used_space,
+                 info->allocation_size,
+                 info->map_size,
+                 info->data_count,
+                 info->total_mapstores,
+                 info->physical_space,
+                 info->pending_map_stores) < 0) {
+        return NULL;
+    }
+
+    return json;
+}
+
+static void free_request(server_request *request) {
+    if (request->map) {
+        unmap_file(request->map, request->body_length);
+    }
+
+    if (request->body) {
+        free(request->body);
+    }
+
+    if (request->data_fd >= 0) {
+        close(request->data_fd);
+    }
+
+    free(request);
+}
+
+static void on_conn_close(uv_handle_t *handle) {
+    server_conn *conn = handle->data;
+
+    if (conn->request) {
+        free_request(conn->request);
+        conn->request = NULL;
+    }
+
+    conn->closed = true;
+    if (conn->pending == 0) {
+        free(conn);
+    }
+}
+
+static void close_conn(server_conn *conn) {
+    if (!uv_is_closing((uv_handle_t *)&conn->pipe)) {
+        uv_close((uv_handle_t *)&conn->pipe, on_conn_close);
+    }
+}
+
+static void release_conn(server_conn *conn) {
+    conn->pending--;
+    if (conn->closed && conn->pending == 0) {
+        free(conn);
+    }
+}
+
+/**
+* Runs on the libuv thread pool so slow requests don't hold up the others
+*/
+static void run_request(uv_work_t *work) {
+    server_request *request = work->data;
+    mapstore_ctx *ctx = request->conn->ctx;
+    data_info data;
+    store_info store;
+    struct stat st;
+
+    switch (request->frame.op) {
+        case SERVER_OP_STORE:
+            request->status = store_data(ctx, request->data_fd, request->data_size, request->hash);
+            break;
+        case SERVER_OP_RETRIEVE:
+            if ((request->data_fd = open_spool(ctx)) < 0 ||
+                retrieve_data(ctx, request->data_fd, request->hash) != 0 ||
+                fstat(request->data_fd, &st) != 0) {
+                request->status = 1;
+                break;
+            }
+
+            request->body_length = st.st_size;
+            if (request->body_length > 0 &&
+                map_file(request->data_fd, request->body_length, &request->map, true) != 0) {
+                request->map = NULL;
+                request->status = 1;
+            }
+            break;
+        case SERVER_OP_DELETE:
+            request->status = delete_data(ctx, request->hash);
+            break;
+        case SERVER_OP_DATA_INFO:
+            if ((request->status = get_data_info(ctx, request->hash, &data)) == 0) {
+                request->body = data_info_json(&data);
+                free(data.hash);
+            }
+            break;
+        case SERVER_OP_STORE_INFO:
+            if ((request->status = get_store_info(ctx, &store)) == 0) {
+                request->body = store_info_json(&store);
+            }
+            break;
+    }
+
+    if (request->body) {
+        request->body_length = strlen(request->body);
+    }
+}
+
+static void on_response_written(uv_write_t *write, int status) {
+    server_request *request = write->data;
+    server_conn *conn = request->conn;
+
+    free_request(request);
+
+    if (status < 0) {
+        close_conn(conn);
+    }
+
+    release_conn(conn);
+}
+
+static void on_request_done(uv_work_t *work, int status) {
+    server_request *request = work->data;
+    server_conn *conn = request->conn;
+    uv_buf_t bufs[2];
+
+    if (status != 0 || request->status != 0 ||
+        (request->body_length > 0 && !request->map && !request->body)) {
+        request->status = 1;
+    }
+
+    if (uv_is_closing((uv_handle_t *)&conn->pipe)) {
+        free_request(request);
+        release_conn(conn);
+        return;
+    }
+
+    request->response.id = request->frame.id;
+    request->response.op = request->status;
+    request->response.length = (request->status == 0) ? request->body_length : 0;
+
+    bufs[0].base = (char *)&request->response;
+    bufs[0].len = sizeof(server_frame);
+    bufs[1].base = request->map ? (char *)request->map : request->body;
+    bufs[1].len = request->response.length;
+
+    request->write.data = request;
+    if (uv_write(&request->write, (uv_stream_t *)&conn->pipe, bufs,
+                 (request->response.length > 0) ? 2 : 1, on_response_written) != 0) {
+        free_request(request);
+        close_conn(conn);
+        release_conn(conn);
+    }
+}
+
+static int start_request(server_conn *conn) {
+    server_frame *frame = &conn->frame;
+    server_request *request = NULL;
+    bool valid = false;
+
+    switch (frame->op) {
+        case SERVER_OP_STORE:
+            valid = frame->length >= HASH_LENGTH;
+            break;
+        case SERVER_OP_RETRIEVE:
+        case SERVER_OP_DELETE:
+        case SERVER_OP_DATA_INFO:
+            valid = frame->length == HASH_LENGTH;
+            break;
+        case SERVER_OP_STORE_INFO:
+            valid = frame->length == 0;
+            break;
+    }
+
+    if (!valid) {
+        fprintf(stderr, "Invalid request %"PRIu32": op %d, length %"PRIu64"\n", frame->id, frame->op, frame->length);
+        return 1;
+    }
+
+    if (!(request = calloc(1, sizeof(server_request)))) {
+        return 1;
+    }
+
+    request->conn = conn;
+    request->frame = *frame;
+    request->data_fd = -1;
+
+    if (frame->op == SERVER_OP_STORE) {
+        request->data_size = frame->length - HASH_LENGTH;
+        if ((request->data_fd = open_spool(conn->ctx)) < 0) {
+            free_request(request);
+            return 1;
+        }
+    }
+
+    conn->request = request;
+    conn->payload_received = 0;
+
+    return 0;
+}
+
+static int dispatch_request(server_conn *conn) {
+    server_request *request = conn->request;
+
+    conn->request = NULL;
+    conn->pending++;
+    request->work.data = request;
+
+    if (uv_queue_work(conn->pipe.loop, &request->work, run_request, on_request_done) != 0) {
+        free_request(request);
+        conn->pending--;
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+* Splits the byte stream into frames. Hashes are kept with the request and
+* store data goes straight to its spool file.
+*/
+static int consume(server_conn *conn, char *data, uint64_t length) {
+    server_request *request = NULL;
+    uint64_t take = 0;
+
+    while (length > 0 || (conn->request && conn->payload_received == conn->request->frame.length)) {
+        request = conn->request;
+
+        if (!request) {
+            take = sizeof(server_frame) - conn->frame_received;
+            take = (take > length) ? length : take;
+            memcpy((char *)&conn->frame + conn->frame_received, data, take);
+            conn->frame_received += take;
+            data += take;
+            length -= take;
+
+            if (conn->frame_received < sizeof(server_frame)) {
+                break;
+            }
+
+            conn->frame_received = 0;
+            if (start_request(conn) != 0) {
+                return 1;
+            }
+        } else if (conn->payload_received < HASH_LENGTH && conn->payload_received < request->frame.length) {
+            take = HASH_LENGTH - conn->payload_received;
+            take = (take > length) ? length : take;
+            memcpy(request->hash + conn->payload_received, data, take);
+            conn->payload_received += take;
+            data += take;
+            length -= take;
+
+            if (conn->payload_received == HASH_LENGTH && !valid_hash(request->hash)) {
+                fprintf(stderr, "Invalid hash in request %"PRIu32"\n", request->frame.id);
+                return 1;
+            }
+        } else if (conn->payload_received < request->frame.length) {
+            take = request->frame.length - conn->payload_received;
+            take = (take > length) ? length : take;
+            if (write_all(request->data_fd, data, take) != 0) {
+                fprintf(stderr, "Could not spool request %"PRIu32"\n", request->frame.id);
+                return 1;
+            }
+            conn->payload_received += take;
+            data += take;
+            length -= take;
+        }
+
+        if (conn->request && conn->payload_received == conn->request->frame.length &&
+            dispatch_request(conn) != 0) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static void alloc_buffer(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
+    buf->base = malloc(suggested_size);
+    buf->len = (buf->base) ? suggested_size : 0;
+}
+
+static void on_read(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf) {
+    server_conn *conn = stream->data;
+
+    if (nread < 0 || (nread > 0 && consume(conn, buf->base, nread) != 0)) {
+        close_conn(conn);
+    }
+
+    if (buf->base) {
+        free(buf->base);
+    }
+}
+
+static void on_connection(uv_stream_t *listener, int status) {
+    server_conn *conn = NULL;
+
+    if (status < 0 || !(conn = calloc(1, sizeof(server_conn)))) {
+        fprintf(stderr, "Could not accept connection\n");
+        return;
+    }
+
+    conn->ctx = listener->loop->data;
+    uv_pipe_init(listener->loop, &conn->pipe, 0);
+    conn->pipe.data = conn;
+
+    if (uv_accept(listener, (uv_stream_t *)&conn->pipe) != 0 ||
+        uv_read_start((uv_stream_t *)&conn->pipe, alloc_buffer, on_read) != 0) {
+        close_conn(conn);
+    }
+}
+
+static void close_handle(uv_handle_t *handle, void *arg) {
+    if (!uv_is_closing(handle)) {
+        uv_close(handle, (handle->data) ? on_conn_close : NULL);
+    }
+}
+
+/**
+* Closing every handle lets the loop finish the requests already queued
+*/
+static void on_signal(uv_signal_t *handle, int signum) {
+    uv_walk(handle->loop, close_handle, NULL);
+}
+
+static bool socket_in_use(const char *socket_path) {
+    struct sockaddr_un addr;
+    bool in_use = false;
+    int fd = -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) >= 0) {
+        in_use = connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+        close(fd);
+    }
+
+    return in_use;
+}
+
+MAPSTORE_API int serve_mapstore(mapstore_ctx *ctx, const char *socket_path) {
+    int status = 0;
+    int ret = 0;
+    uv_loop_t loop;
+    uv_pipe_t listener;
+    uv_signal_t interrupt;
+    uv_signal_t terminate;
+    struct stat st;
+    mode_t mask;
+
+    if (strlen(socket_path) >= sizeof(((struct sockaddr_un *)0)->sun_path)) {
+        fprintf(stderr, "Socket path is too long: %s\n", socket_path);
+        return 1;
+    }
+
+    /* A socket left behind by a daemon that died can be replaced */
+    if (stat(socket_path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode) || socket_in_use(socket_path)) {
+            fprintf(stderr, "Socket path is in use: %s\n", socket_path);
+            return 1;
+        }
+        unlink(socket_path);
+    }
+
+    if (uv_loop_init(&loop) != 0) {
+        fprintf(stderr, "Could not start event loop\n");
+        return 1;
+    }
+
+    loop.data = ctx;
+    signal(SIGPIPE, SIG_IGN);
+
+    uv_pipe_init(&loop, &listener, 0);
+    uv_signal_init(&loop, &interrupt);
+    uv_signal_init(&loop, &terminate);
+    listener.data = NULL;
+    interrupt.data = NULL;
+    terminate.data = NULL;
+
+    /* Only the owner may connect. The socket is created without group or
+       other permissions so there is no window before a chmod. */
+    mask = umask(0177);
+    ret = uv_pipe_bind(&listener, socket_path);
+    umask(mask);
+
+    if (ret != 0 ||
+        (ret = uv_listen((uv_stream_t *)&listener, SERVER_BACKLOG, on_connection)) != 0) {
+        fprintf(stderr, "Could not listen on %s: %s\n", socket_path, uv_strerror(ret));
+        status = 1;
+        uv_walk(&loop, close_handle, NULL);
+    } else {
+        uv_signal_start(&interrupt, on_signal, SIGINT);
+        uv_signal_start(&terminate, on_signal, SIGTERM);
+    }
+
+    uv_run(&loop, UV_RUN_DEFAULT);
+
+    if (status == 0) {
+        unlink(socket_path);
+    }
+
+    if (uv_loop_close(&loop) != 0) {
+        fprintf(stderr, "Event loop closed with active handles\n");
+        status = 1;
+    }
+
+    return status;
+}
+
+int client_connect(const char *socket_path, int *fd) {
+    struct sockaddr_un addr;
+
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path is too long: %s\n", socket_path);
+        return 1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+
+    if ((*fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        fprintf(stderr, "Could not create socket\n");
+        return 1;
+    }
+
+    if (connect(*fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        fprintf(stderr, "Could not connect to %s\n", socket_path);
+        close(*fd);
+        *fd = -1;
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+* Sends one request. Store data is read from data_fd at offset 0 if it is
+* seekable, otherwise from its current position.
+*/
+int client_send(int fd, uint32_t id, server_op op, char *hash, int data_fd, uint64_t data_size) {
+    server_frame frame;
+    char buf[BUFSIZ];
+    uint64_t sent = 0;
+    ssize_t bytes_read = 0;
+    bool seekable = true;
+
+    if (hash && strlen(hash) != HASH_LENGTH) {
+        fprintf(stderr, "Invalid hash: %s\n", hash);
+        return 1;
+    }
+
+    memset(&frame, 0, sizeof(server_frame));
+    frame.id = id;
+    frame.op = op;
+    frame.length = ((hash) ? HASH_LENGTH : 0) + data_size;
+
+    if (send_all(fd, &frame, sizeof(server_frame)) != 0 ||
+        (hash && send_all(fd, hash, HASH_LENGTH) != 0)) {
+        fprintf(stderr, "Could not send request %"PRIu32"\n", id);
+        return 1;
+    }
+
+    while (sent < data_size) {
+        uint64_t bytes_to_read = (data_size - sent > BUFSIZ) ? BUFSIZ : data_size - sent;
+
+        if (seekable && (bytes_read = pread(data_fd, buf, bytes_to_read, sent)) < 0 && errno == ESPIPE) {
+            seekable = false;
+        }
+        if (!seekable) {
+            bytes_read = read(data_fd, buf, bytes_to_read);
+        }
+
+        if (bytes_read <= 0 || send_all(fd, buf, bytes_read) != 0) {
+            fprintf(stderr, "Could not send data for request %"PRIu32"\n", id);
+            return 1;
+        }
+
+        sent += bytes_read;
+    }
+
+    return 0;
+}
+
+/**
+* Reads one response and copies its payload to output_fd, or drops it when
+* output_fd is negative. The request status is left in frame->op.
+*/
+int client_receive(int fd, server_frame *frame, int output_fd) {
+    char buf[BUFSIZ];
+    uint64_t received = 0;
+    uint64_t chunk = 0;
+
+    if (recv_all(fd, frame, sizeof(server_frame)) != 0) {
+        fprintf(stderr, "Connection to server closed\n");
+        return 1;
+    }
+
+    while (received < frame->length) {
+        chunk = (frame->length - received > BUFSIZ) ? BUFSIZ : frame->length - received;
+
+        if (recv_all(fd, buf, chunk) != 0) {
+            fprintf(stderr, "Connection to server closed\n");
+            return 1;
+        }
+
+        if (output_fd >= 0 && write_all(output_fd, buf, chunk) != 0) {
+            fprintf(stderr, "Could not write response %"PRIu32"\n", frame->id);
+            return 1;
+        }
+
+        received += chunk;
+    }
+
+    return 0;
+}
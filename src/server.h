@@ -0,0 +1,46 @@
+/**
+ * @file server.h
+ * @brief Map Store daemon and client protocol.
+ *
+ * serve_mapstore keeps one context open and answers requests on a Unix
+ * domain socket. Every request and response is a server_frame header followed
+ * by length payload bytes, in host byte order. Requests carry the hash first,
+ * store requests follow it with the data. Responses reuse the request id with
+ * op set to the status and carry the data or info JSON. Clients may send many
+ * requests before reading responses. They run concurrently and complete in
+ * any order, so match responses by id and wait for a store to finish before
+ * asking for the same hash.
+ */
+#ifndef MAPSTORE_SERVER_H
+#define MAPSTORE_SERVER_H
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "mapstore.h"
+
+#define SERVER_BACKLOG 128
+#define SERVER_SPOOL "serve.XXXXXX"
+
+typedef enum {
+  SERVER_OP_STORE = 1,
+  SERVER_OP_RETRIEVE,
+  SERVER_OP_DELETE,
+  SERVER_OP_DATA_INFO,
+  SERVER_OP_STORE_INFO
+} server_op;
+
+typedef struct  {
+  uint64_t length;
+  uint32_t id;
+  uint8_t op;
+  uint8_t reserved[3];
+} server_frame;
+
+char *data_info_json(data_info *info);
+char *store_info_json(store_info *info);
+int client_connect(const char *socket_path, int *fd);
+int client_send(int fd, uint32_t id, server_op op, char *hash, int data_fd, uint64_t data_size);
+int client_receive(int fd, server_frame *frame, int output_fd);
+
+#endif /* MAPSTORE_SERVER_H */
@@ -0,0 +1,256 @@
+#include "shared_state.h"
+
+#ifndef _WIN32
+static int lock_state_range(int fd, short type, uint64_t offset, uint64_t length) {
+    struct flock lock;
+
+    memset(&lock, 0, sizeof(lock));
+    lock.l_type = type;
+    lock.l_whence = SEEK_SET;
+    lock.l_start = offset;
+    lock.l_len = length;
+
+    while (fcntl(fd, F_SETLKW, &lock) == -1) {
+        if (errno != EINTR) {
+            perror("fcntl");
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static uint64_t store_state_offset(uint64_t store_id) {
+    return sizeof(shared_state_header) + (store_id - 1) * sizeof(shared_store_state);
+}
+
+static shared_store_state *get_store_state(mapstore_ctx *ctx, uint64_t store_id) {
+    return (shared_store_state *)(ctx->shared_state + store_state_offset(store_id));
+}
+
+static void copy_free_locations(shared_store_state *store_state, json_object *free_locations) {
+    json_object *free_location = NULL;
+    uint64_t total = json_object_array_length(free_locations);
+
+    // Longer lists are left to the database
+    store_state->total_extents = total;
+    if (total > SHARED_FREE_EXTENTS) {
+        return;
+    }
+
+    for (uint64_t i = 0; i < total; i++) {
+        free_location = json_object_array_get_idx(free_locations, i);
+        store_state->extents[i].first = json_object_get_int64(json_object_array_get_idx(free_location, 0));
+        store_state->extents[i].final = json_object_get_int64(json_object_array_get_idx(free_location, 1));
+    }
+}
+
+/**
+* Reload a map store from the database and hand its row to the caller. The
+* store stays marked updating until the copy is complete. Called with the
+* store lock held.
+*/
+static int load_store_state(mapstore_ctx *ctx, uint64_t store_id, mapstore_row *row) {
+    char where[11 + MAX_UINT64_STR + 1];
+    shared_store_state *store_state = get_store_state(ctx, store_id);
+
+    memset(where, '\0', 11 + MAX_UINT64_STR + 1);
+    sprintf(where, "WHERE Id = %"PRIu64, store_id);
+    if (get_store_rows(db_for_store(&ctx->shards, store_id), where, row) != 0 || row->free_locations == NULL) {
+        if (row->free_locations) {
+            json_object_put(row->free_locations);
+            row->free_locations = NULL;
+        }
+        return 1;
+    }
+
+    store_state->updating = 1;
+    store_state->free_space = row->free_space;
+    store_state->size = row->size;
+    copy_free_locations(store_state, row->free_locations);
+    store_state->updating = 0;
+
+    return 0;
+}
+#endif
+
+/**
+* Map the shared state file and load it from the database. Map stores are
+* loaded one at a time under their lock so processes already using a store
+* are never disturbed.
+*/
+int open_shared_state(mapstore_ctx *ctx) {
+#ifdef _WIN32
+    fprintf(stderr, "Multi process mode is not supported on this platform\n");
+    return 1;
+#else
+    int status = 0;
+    char path[BUFSIZ];
+    mapstore_row row;
+    shared_state_header *header = NULL;
+
+    ctx->shared_state_size = store_state_offset(ctx->total_mapstores + 1);
+
+    memset(path, '\0', BUFSIZ);
+    sprintf(path, "%s%cshards.state", ctx->base_path, separator());
+
+    if ((ctx->shared_state_fd = open(path, O_RDWR | O_CREAT, 0644)) < 0) {
+        fprintf(stderr, "Could not open shared state: %s\n", path);
+        return 1;
+    }
+
+    /* Only one process may resize or reset the header at a time */
+    if (lock_state_range(ctx->shared_state_fd, F_WRLCK, 0, sizeof(shared_state_header)) != 0) {
+        status = 1;
+        goto end_open_shared_state;
+    }
+
+    if (get_file_size(ctx->shared_state_fd) < ctx->shared_state_size &&
+        ftruncate(ctx->shared_state_fd, ctx->shared_state_size) != 0) {
+        fprintf(stderr, "Could not resize shared state: %s\n", path);
+        status = 1;
+        goto end_open_shared_state;
+    }
+
+    if (map_file(ctx->shared_state_fd, ctx->shared_state_size, &ctx->shared_state, false) != 0) {
+        fprintf(stderr, "Could not map shared state: %s\n", path);
+        ctx->shared_state = NULL;
+        status = 1;
+        goto end_open_shared_state;
+    }
+
+    header = (shared_state_header *)ctx->shared_state;
+    if (header->magic != SHARED_STATE_MAGIC) {
+        header->has_slabs = 0;
+    }
+    header->magic = SHARED_STATE_MAGIC;
+    header->total_mapstores = ctx->total_mapstores;
+
+    /* Never cleared while the file is in use, so slots are always looked up */
+    if (ctx->has_slabs) {
+        header->has_slabs = 1;
+    }
+
+    for (uint64_t f = 1; f <= ctx->total_mapstores; f++) {
+        lock_shared_store(ctx, f);
+        status = load_store_state(ctx, f, &row);
+        unlock_shared_store(ctx, f);
+
+        if (status != 0) {
+            goto end_open_shared_state;
+        }
+        json_object_put(row.free_locations);
+    }
+
+end_open_shared_state:
+    lock_state_range(ctx->shared_state_fd, F_UNLCK, 0, sizeof(shared_state_header));
+
+    if (status != 0) {
+        close_shared_state(ctx);
+    }
+
+    return status;
+#endif
+}
+
+void close_shared_state(mapstore_ctx *ctx) {
+    if (ctx->shared_state) {
+        unmap_file(ctx->shared_state, ctx->shared_state_size);
+        ctx->shared_state = NULL;
+    }
+
+    if (ctx->shared_state_fd >= 0) {
+        close(ctx->shared_state_fd);
+        ctx->shared_state_fd = -1;
+    }
+}
+
+void lock_shared_store(mapstore_ctx *ctx, uint64_t store_id) {
+#ifndef _WIN32
+    lock_state_range(ctx->shared_state_fd, F_WRLCK, store_state_offset(store_id), sizeof(shared_store_state));
+#endif
+}
+
+void unlock_shared_store(mapstore_ctx *ctx, uint64_t store_id) {
+#ifndef _WIN32
+    lock_state_range(ctx->shared_state_fd, F_UNLCK, store_state_offset(store_id), sizeof(shared_store_state));
+#endif
+}
+
+/**
+* Row of a map store built from the shared free list. Stores a process died
+* while updating, and stores whose free list does not fit, come from the
+* database instead. Called with the store lock held.
+*/
+int get_shared_store_row(mapstore_ctx *ctx, uint64_t store_id, mapstore_row *row) {
+#ifdef _WIN32
+    return 1;
+#else
+    shared_store_state *store_state = get_store_state(ctx, store_id);
+
+    if (store_state->updating || store_state->total_extents > SHARED_FREE_EXTENTS) {
+        return load_store_state(ctx, store_id, row);
+    }
+
+    row->id = store_id;
+    row->free_space = store_state->free_space;
+    row->size = store_state->size;
+    row->free_locations = json_object_new_array();
+
+    for (uint64_t i = 0; i < store_state->total_extents; i++) {
+        json_object_array_add(row->free_locations,
+                              json_free_space_array(store_state->extents[i].first, store_state->extents[i].final));
+    }
+
+    return 0;
+#endif
+}
+
+/**
+* Mark a map store updating before its row is written to the database.
+*/
+void begin_shared_store_update(mapstore_ctx *ctx, uint64_t store_id) {
+#ifndef _WIN32
+    get_store_state(ctx, store_id)->updating = 1;
+#endif
+}
+
+/**
+* Copy the free list written to the database into the shared state. A store
+* whose write failed is left updating and reloaded by the next caller.
+*/
+void end_shared_store_update(mapstore_ctx *ctx, uint64_t store_id, json_object *free_locations, uint64_t free_space) {
+#ifndef _WIN32
+    shared_store_state *store_state = get_store_state(ctx, store_id);
+
+    store_state->free_space = free_space;
+    copy_free_locations(store_state, free_locations);
+    store_state->updating = 0;
+#endif
+}
+
+uint64_t get_shared_free_space(mapstore_ctx *ctx, uint64_t store_id) {
+#ifdef _WIN32
+    return 0;
+#else
+    return get_store_state(ctx, store_id)->free_space;
+#endif
+}
+
+uint64_t get_shared_total_free_space(mapstore_ctx *ctx) {
+    uint64_t total = 0;
+
+    for (uint64_t f = 1; f <= ctx->total_mapstores; f++) {
+        total += get_shared_free_space(ctx, f);
+    }
+
+    return total;
+}
+
+bool shared_has_slabs(mapstore_ctx *ctx) {
+#ifdef _WIN32
+    return false;
+#else
+    return ((shared_state_header *)ctx->shared_state)->has_slabs != 0;
+#endif
+}
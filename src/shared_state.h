@@ -0,0 +1,54 @@
+/**
+ * @file shared_state.h
+ * @brief Map Store allocator state shared between processes.
+ *
+ * A memory mapped file next to the database holding the free list of every
+ * map store. Every map store has its own fcntl byte range lock so separate
+ * processes can reserve space in different map stores at the same time.
+ * Reservations are planned from the shared free lists and the result is
+ * written through to SQLite, which stays the durable record. A store is
+ * marked updating before its row is written and cleared once the shared copy
+ * matches, so a process that died in between leaves the store to be reloaded
+ * from the database by the next process that locks it.
+ */
+#ifndef MAPSTORE_SHARED_STATE_H
+#define MAPSTORE_SHARED_STATE_H
+
+#include "mapstore.h"
+
+#define SHARED_STATE_MAGIC 0x4d415053544f5246ULL
+
+/* Free lists longer than this are read from the database */
+#define SHARED_FREE_EXTENTS 1024
+
+typedef struct  {
+  uint64_t magic;
+  uint64_t total_mapstores;
+  uint64_t has_slabs;
+} shared_state_header;
+
+typedef struct  {
+  uint64_t first;
+  uint64_t final;
+} shared_extent;
+
+typedef struct  {
+  uint64_t free_space;
+  uint64_t size;
+  uint64_t updating;
+  uint64_t total_extents;
+  shared_extent extents[SHARED_FREE_EXTENTS];
+} shared_store_state;
+
+int open_shared_state(mapstore_ctx *ctx);
+void close_shared_state(mapstore_ctx *ctx);
+void lock_shared_store(mapstore_ctx *ctx, uint64_t store_id);
+void unlock_shared_store(mapstore_ctx *ctx, uint64_t store_id);
+int get_shared_store_row(mapstore_ctx *ctx, uint64_t store_id, mapstore_row *row);
+void begin_shared_store_update(mapstore_ctx *ctx, uint64_t store_id);
+void end_shared_store_update(mapstore_ctx *ctx, uint64_t store_id, json_object *free_locations, uint64_t free_space);
+uint64_t get_shared_free_space(mapstore_ctx *ctx, uint64_t store_id);
+uint64_t get_shared_total_free_space(mapstore_ctx *ctx);
+bool shared_has_slabs(mapstore_ctx *ctx);
+
+#endif /* MAPSTORE_SHARED_STATE_H */
@@ -0,0 +1,99 @@
+#include "trace.h"
+
+#ifdef HAVE_SYS_SDT_H
+__extension__ unsigned short mapstore_phase__begin_semaphore __attribute__((unused)) __attribute__((section(".probes")));
+__extension__ unsigned short mapstore_phase__end_semaphore __attribute__((unused)) __attribute__((section(".probes")));
+#endif
+
+static const char *point_names[MAPSTORE_TRACE_POINTS] = {
+    "hash_check",
+    "plan",
+    "metadata",
+    "data_write",
+    "data_read",
+    "fsync",
+    "commit"
+};
+
+/**
+* Map stores are only known once extents are planned, so the ids can be
+* filled in by either the begin or the end event.
+*/
+static void trace_store_ids(trace_span *span, json_object *positions) {
+    uint64_t total = 0;
+    uint64_t i = 0;
+
+    if (!positions || span->store_ids) {
+        return;
+    }
+
+    total = json_object_object_length(positions);
+    if (total == 0 || !(span->store_ids = calloc(total, sizeof(uint64_t)))) {
+        return;
+    }
+
+    json_object_object_foreach(positions, store_id, arr) {
+        (void)arr;
+        span->store_ids[i++] = strtoull(store_id, NULL, 10);
+    }
+
+    span->event.store_ids = span->store_ids;
+    span->event.total_store_ids = total;
+}
+
+void trace_begin(mapstore_ctx *ctx, trace_span *span, mapstore_trace_point point,
+                 const char *hash, uint64_t bytes, json_object *positions) {
+    memset(span, 0, sizeof(trace_span));
+    span->enabled = true;
+    span->event.point = point;
+    span->event.hash = hash;
+    span->event.bytes = bytes;
+
+    trace_store_ids(span, positions);
+
+    if (ctx->trace.begin) {
+        ctx->trace.begin(ctx->trace.data, &span->event);
+    }
+
+#ifdef HAVE_SYS_SDT_H
+    DTRACE_PROBE5(mapstore, phase__begin, point_names[point], span->event.hash, span->event.bytes,
+                  span->event.store_ids, span->event.total_store_ids);
+#endif
+}
+
+void trace_end(mapstore_ctx *ctx, trace_span *span, json_object *positions, int status) {
+    trace_store_ids(span, positions);
+    span->event.status = status;
+
+    if (ctx->trace.end) {
+        ctx->trace.end(ctx->trace.data, &span->event);
+    }
+
+#ifdef HAVE_SYS_SDT_H
+    DTRACE_PROBE6(mapstore, phase__end, point_names[span->event.point], span->event.hash, span->event.bytes,
+                  span->event.store_ids, span->event.total_store_ids, span->event.status);
+#endif
+
+    if (span->store_ids) {
+        free(span->store_ids);
+    }
+
+    span->store_ids = NULL;
+    span->event.store_ids = NULL;
+    span->enabled = false;
+}
+
+/**
+* Set before the context is shared between threads. NULL turns callbacks off.
+*/
+MAPSTORE_API void mapstore_set_trace(mapstore_ctx *ctx, mapstore_trace_callbacks *callbacks) {
+    if (callbacks) {
+        ctx->trace = *callbacks;
+    } else {
+        memset(&ctx->trace, 0, sizeof(mapstore_trace_callbacks));
+    }
+}
+
+MAPSTORE_API const char *mapstore_trace_point_name(mapstore_trace_point point) {
+    return (point >= 0 && point < MAPSTORE_TRACE_POINTS) ? point_names[point] : "unknown";
+}
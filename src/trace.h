@@ -0,0 +1,59 @@
+/**
+ * @file trace.h
+ * @brief Map Store tracing hooks.
+ *
+ * Begin and end events around the internal phases of an operation. Events go
+ * to the callbacks registered with mapstore_set_trace and, when sys/sdt.h is
+ * available, to the mapstore:phase__begin and mapstore:phase__end USDT probes.
+ * Probe semaphores let events be skipped entirely while nothing is attached.
+ */
+#ifndef MAPSTORE_TRACE_H
+#define MAPSTORE_TRACE_H
+
+#include "mapstore.h"
+
+#ifdef HAVE_SYS_SDT_H
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+extern unsigned short mapstore_phase__begin_semaphore;
+extern unsigned short mapstore_phase__end_semaphore;
+
+#define trace_probes_enabled() \
+    __builtin_expect(mapstore_phase__begin_semaphore || mapstore_phase__end_semaphore, 0)
+#else
+#define trace_probes_enabled() 0
+#endif
+
+#define trace_enabled(ctx) ((ctx)->trace.begin || (ctx)->trace.end || trace_probes_enabled())
+
+/**
+* Arguments are only evaluated while tracing. Ending a span that was never
+* begun or already ended does nothing, so cleanup code can always end it.
+*/
+#define TRACE_BEGIN(ctx, span, point, hash, bytes, positions)                \
+    do {                                                                     \
+        (span)->enabled = false;                                             \
+        if (trace_enabled(ctx)) {                                            \
+            trace_begin(ctx, span, point, hash, bytes, positions);           \
+        }                                                                    \
+    } while (0)
+
+#define TRACE_END(ctx, span, positions, status)                              \
+    do {                                                                     \
+        if ((span)->enabled) {                                               \
+            trace_end(ctx, span, positions, status);                         \
+        }                                                                    \
+    } while (0)
+
+typedef struct  {
+  mapstore_trace_event event;
+  uint64_t *store_ids;
+  bool enabled;
+} trace_span;
+
+void trace_begin(mapstore_ctx *ctx, trace_span *span, mapstore_trace_point point,
+                 const char *hash, uint64_t bytes, json_object *positions);
+void trace_end(mapstore_ctx *ctx, trace_span *span, json_object *positions, int status);
+
+#endif /* MAPSTORE_TRACE_H */
@@ -106,6 +106,29 @@ win_finished:
 }
 
 
+/**
+* Give the blocks of a range back to the filesystem, keeping the file size.
+* Returns ENOTSUP where the platform can't punch holes.
+*/
+int punch_hole(int fd, uint64_t offset, uint64_t length)
+{
+#if defined(FALLOC_FL_PUNCH_HOLE)
+    if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length)) {
+        return errno;
+    }
+    return 0;
+#elif defined(F_PUNCHHOLE)
+    struct fpunchhole hole = {0, 0, offset, length};
+    if (fcntl(fd, F_PUNCHHOLE, &hole) == -1) {
+        return errno;
+    }
+    return 0;
+#else
+    return ENOTSUP;
+#endif
+}
+
+
 int unmap_file(uint8_t *map, uint64_t filesize)
 {
 #ifdef _WIN32
@@ -181,6 +204,56 @@ int create_directory(char *path) {
 #endif
 }
 
+/**
+* Hashes end up in SQL statements, so anything but 40 hex digits is refused
+*/
+bool valid_hash(char *hash) {
+    return hash && strlen(hash) == HASH_LENGTH && strspn(hash, "0123456789abcdefABCDEF") == HASH_LENGTH;
+}
+
+bool path_exists(char *path) {
+    struct stat st;
+    return stat(path, &st) == 0;
+}
+
+int remove_directory(char *path) {
+#ifdef _WIN32
+    return (RemoveDirectory(path) != 0) ? 0 : 1;
+#else
+    int status = 0;
+    char file_path[BUFSIZ];
+    struct dirent *entry = NULL;
+    DIR *dir = opendir(path);
+
+    if (!dir) {
+        return (errno == ENOENT) ? 0 : 1;
+    }
+
+    /* Map store directories are flat so only files need removing */
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+
+        memset(file_path, '\0', BUFSIZ);
+        snprintf(file_path, BUFSIZ, "%s%c%s", path, separator(), entry->d_name);
+        if (unlink(file_path) != 0) {
+            perror("unlink");
+            status = 1;
+        }
+    }
+
+    closedir(dir);
+
+    if (rmdir(path) != 0) {
+        perror("rmdir");
+        status = 1;
+    }
+
+    return status;
+#endif
+}
+
 json_object *json_free_space_array(uint64_t start, uint64_t end) {
     if (end < start) {
         return NULL;
@@ -233,16 +306,17 @@ json_object *expand_free_space_list(json_object *old_free_space, uint64_t old_si
                 needs_new_coordinates = false;
                 json_object_array_add(new_free_space, new_jarray);
             } else {
-                json_object_array_add(new_free_space, old_jarray);
+                json_object_array_add(new_free_space, json_object_get(old_jarray));
             }
         }
 
         if (needs_new_coordinates) {
-            new_jarray = json_free_space_array(old_size - 1, new_size - 1);
+            new_jarray = json_free_space_array(old_size, new_size - 1);
             json_object_array_add(new_free_space, new_jarray);
         }
     } else {
-        return old_free_space;
+        json_object_put(new_free_space);
+        return json_object_get(old_free_space);
     }
 
     // fprintf(stderr, "new_space: %s\n",json_object_to_json_string(new_free_space));
@@ -255,9 +329,19 @@ int create_map_store(char *path, uint64_t size, bool prealloc) {
     uint8_t *mmap_store = NULL;         // Memory Mapped map_store
     FILE *fmap_store = fopen(path, "wb");
 
+    if (!fmap_store) {
+        fprintf(stderr, "Could not open map store: %s\n", path);
+        return 1;
+    }
+
     fprintf(stdout, "Created mapstore: %s, size: %"PRIu64"\n", path, size);
 
+    /* Without preallocation the file is left sparse at its full size */
     if (!prealloc) {
+        if (ftruncate(fileno(fmap_store), size) != 0) {
+            status = 1;
+            fprintf(stdout, "Could not set size of map store: %s\n", path);
+        }
         goto create_map_store;
     }
 
@@ -278,6 +362,38 @@ create_map_store:
     return status;
 }
 
+int extend_map_store(char *path, uint64_t size, bool prealloc) {
+    int status = 0;
+    int fd = open(path, O_RDWR);
+
+    if (fd < 0) {
+        fprintf(stderr, "Could not open map store: %s\n", path);
+        return 1;
+    }
+
+    if (get_file_size(fd) >= size) {
+        goto end_extend_map_store;
+    }
+
+    if (prealloc) {
+        int falloc_status = allocatefile(fd, size);
+        if (falloc_status) {
+            status = 1;
+            fprintf(stdout, "Could not allocate space for map store: %s, %i\n", path, falloc_status);
+        }
+        goto end_extend_map_store;
+    }
+
+    if (ftruncate(fd, size) != 0) {
+        status = 1;
+        fprintf(stdout, "Could not set size of map store: %s\n", path);
+    }
+
+end_extend_map_store:
+    close(fd);
+    return status;
+}
+
 uint64_t get_file_size(int fd) {
     int ret = 0;
     struct stat st;
@@ -291,12 +407,52 @@ uint64_t get_file_size(int fd) {
     return st.st_size;
 }
 
+/**
+* Bytes the file takes on disk, less than its size when it is sparse
+*/
+uint64_t get_allocated_size(int fd) {
+#ifdef _WIN32
+    return get_file_size(fd);
+#else
+    struct stat st;
+
+    if (fstat(fd, &st) != 0) {
+        fprintf(stderr, "Could not get file size\n");
+        return 0;
+    }
+
+    return (uint64_t)st.st_blocks * 512;
+#endif
+}
+
+/**
+* Block size holes should be aligned to
+*/
+uint64_t get_block_size(int fd) {
+#ifdef _WIN32
+    return DIRECT_IO_ALIGN;
+#else
+    struct stat st;
+
+    if (fstat(fd, &st) != 0 || st.st_blksize <= 0) {
+        return DIRECT_IO_ALIGN;
+    }
+
+    return st.st_blksize;
+#endif
+}
+
 uint64_t sector_min(uint64_t data_size) {
     // TODO: Optimize minimum piece separation for data
     return 0;
 }
 
-uint64_t prepare_store_positions(uint64_t store_id, json_object *free_locations_arr, uint64_t data_position, uint64_t data_size, json_object *map_plan) {
+/**
+* Plan where data_size bytes go in a map store's free locations. With align
+* set, data that fits in a free location starts at its first aligned offset
+* and the bytes skipped stay free.
+*/
+uint64_t prepare_store_positions(uint64_t store_id, json_object *free_locations_arr, uint64_t data_position, uint64_t data_size, uint64_t align, json_object *map_plan) {
     uint64_t sector_size = 0;            //
     uint64_t space_to_use = 0;           //
     json_object *location_array = NULL;  // json object containing free location array
@@ -329,6 +485,16 @@ uint64_t prepare_store_positions(uint64_t store_id, json_object *free_locations_
             continue;
         }
 
+        // Skip to an aligned start if the rest of the data still fits
+        if (align > 0 && first % align != 0) {
+            uint64_t aligned = (first + align - 1) / align * align;
+            if (aligned <= old_final && old_final - aligned + 1 >= remaining) {
+                json_object_array_add(updated_free_positions, json_free_space_array(first, aligned - 1));
+                first = aligned;
+                sector_size = old_final - first + 1;
+            }
+        }
+
         // Calculate the amount of space to be stored
         space_to_use = (sector_size > remaining) ? remaining : sector_size;
         new_final = (sector_size > remaining) ? first + space_to_use - 1 : old_final;
@@ -354,137 +520,721 @@ uint64_t prepare_store_positions(uint64_t store_id, json_object *free_locations_
 
         json_object_object_add(map_plan, store_id_str, map_store_obj);
 
+    } else {
+        json_object_put(store_positions);
+        json_object_put(updated_free_positions);
+        json_object_put(map_store_obj);
     }
 
     return total_used;
 }
 
-int write_to_store(int data_fd, char *store_dir, json_object *data_locations) {
+/**
+* Start of the free location running to the end of a map store, where a log
+* segment is appended to. size when nothing is free at the end.
+*/
+uint64_t log_head(json_object *free_locations_arr, uint64_t size) {
+    json_object *location_array = NULL;
+
+    for (uint64_t arr_i = 0; arr_i < json_object_array_length(free_locations_arr); arr_i++) {
+        location_array = json_object_array_get_idx(free_locations_arr, arr_i);
+        if (json_object_get_int64(json_object_array_get_idx(location_array, 1)) == size - 1) {
+            return json_object_get_int64(json_object_array_get_idx(location_array, 0));
+        }
+    }
+
+    return size;
+}
+
+/**
+* Plan data_size bytes in the free location starting at first only. The
+* other free locations are left as they are.
+*/
+static uint64_t prepare_positions_at(uint64_t store_id,
+                                     json_object *free_locations_arr,
+                                     uint64_t first,
+                                     uint64_t data_position,
+                                     uint64_t data_size,
+                                     json_object *map_plan) {
+    uint64_t used = 0;
+    json_object *location_array = NULL;
+    json_object *store_meta = NULL;
+    json_object *free_positions = NULL;
+    json_object *others = json_object_new_array();
+    json_object *chosen = json_object_new_array();
+    char store_id_str[MAX_UINT64_STR + 1];
+
+    for (uint64_t arr_i = 0; arr_i < json_object_array_length(free_locations_arr); arr_i++) {
+        location_array = json_object_array_get_idx(free_locations_arr, arr_i);
+        json_object_array_add((json_object_get_int64(json_object_array_get_idx(location_array, 0)) == first) ? chosen : others,
+                              json_object_get(location_array));
+    }
+
+    if ((used = prepare_store_positions(store_id, chosen, data_position, data_size, 0, map_plan)) > 0) {
+        memset(store_id_str, '\0', MAX_UINT64_STR + 1);
+        sprintf(store_id_str, "%"PRIu64, store_id);
+        json_object_object_get_ex(map_plan, store_id_str, &store_meta);
+        json_object_object_get_ex(store_meta, "free_positions", &free_positions);
+
+        for (uint64_t arr_i = 0; arr_i < json_object_array_length(free_positions); arr_i++) {
+            json_object_array_add(others, json_object_get(json_object_array_get_idx(free_positions, arr_i)));
+        }
+        json_object_object_add(store_meta, "free_positions", json_object_get(others));
+    }
+
+    json_object_put(others);
+    json_object_put(chosen);
+    return used;
+}
+
+/**
+* Plan data_size bytes at the head of a log segment. Free locations before
+* the head hold dead data and are left alone.
+*/
+uint64_t prepare_log_positions(uint64_t store_id,
+                               json_object *free_locations_arr,
+                               uint64_t size,
+                               uint64_t data_position,
+                               uint64_t data_size,
+                               json_object *map_plan) {
+    return prepare_positions_at(store_id, free_locations_arr, log_head(free_locations_arr, size),
+                                data_position, data_size, map_plan);
+}
+
+/**
+* Plan length bytes in the first free location that holds them whole, or
+* nothing if there is none
+*/
+uint64_t prepare_region_positions(uint64_t store_id, json_object *free_locations_arr, uint64_t length, json_object *map_plan) {
+    json_object *location_array = NULL;
+    uint64_t first = 0;
+    uint64_t final = 0;
+
+    for (uint64_t arr_i = 0; arr_i < json_object_array_length(free_locations_arr); arr_i++) {
+        location_array = json_object_array_get_idx(free_locations_arr, arr_i);
+        first = json_object_get_int64(json_object_array_get_idx(location_array, 0));
+        final = json_object_get_int64(json_object_array_get_idx(location_array, 1));
+        if (final - first + 1 >= length) {
+            return prepare_positions_at(store_id, free_locations_arr, first, 0, length, map_plan);
+        }
+    }
+
+    return 0;
+}
+
+/**
+* Open a map store bypassing the page cache. Returns -1 when the platform or
+* filesystem can't do direct I/O, callers then use buffered I/O only.
+*/
+int open_direct(char *path, int flags) {
+#if defined(O_DIRECT)
+    return open(path, flags | O_DIRECT);
+#elif defined(__APPLE__)
+    int fd = open(path, flags);
+    if (fd >= 0 && fcntl(fd, F_NOCACHE, 1) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+#else
+    return -1;
+#endif
+}
+
+/**
+* Buffer aligned for direct I/O, or NULL if it can't be allocated
+*/
+void *direct_buffer(uint64_t size) {
+    void *buf = NULL;
+#if HAVE_POSIX_MEMALIGN
+    if (posix_memalign(&buf, DIRECT_IO_ALIGN, size) != 0) {
+        return NULL;
+    }
+#elif HAVE_ALIGNED_ALLOC
+    buf = aligned_alloc(DIRECT_IO_ALIGN, size);
+#endif
+    return buf;
+}
+
+/**
+* Aligned middle of the extent [first, final] that can use direct I/O. Empty
+* (start == end) when the extent doesn't cover a whole aligned block.
+*/
+static void direct_span(uint64_t first, uint64_t final, uint64_t *start, uint64_t *end) {
+    *start = (first + DIRECT_IO_ALIGN - 1) / DIRECT_IO_ALIGN * DIRECT_IO_ALIGN;
+    *end = (final + 1) / DIRECT_IO_ALIGN * DIRECT_IO_ALIGN;
+
+    if (*end <= *start) {
+        *start = *end = first;
+    }
+}
+
+/**
+* Read up to length bytes, stopping early only at the end of the data
+*/
+static ssize_t read_data(int data_fd, char *buf, uint64_t length, uint64_t offset) {
+    uint64_t total = 0;
+    ssize_t bytes_read = 0;
+
+    while (total < length) {
+        if (data_fd == STDIN_FILENO) {
+            bytes_read = read(data_fd, buf + total, length - total);
+        } else {
+            bytes_read = pread(data_fd, buf + total, length - total, offset + total);
+        }
+
+        if (bytes_read < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read < 0) {
+            return (total > 0) ? (ssize_t)total : -1;
+        }
+        if (bytes_read == 0) {
+            break;
+        }
+        total += bytes_read;
+    }
+
+    return total;
+}
+
+/**
+* Read exactly size bytes of data into a new buffer, hashing them if asked
+*/
+int read_to_buffer(int data_fd, uint64_t size, uint8_t **data, struct sha256_ctx *hasher) {
+    if (!(*data = malloc(size + 1))) {
+        return 1;
+    }
+
+    if (read_data(data_fd, (char *)*data, size, 0) != (ssize_t)size) {
+        fprintf(stderr, "Data ended before %"PRIu64" bytes\n", size);
+        free(*data);
+        *data = NULL;
+        return 1;
+    }
+
+    if (hasher) {
+        sha256_update(hasher, size, *data);
+    }
+
+    return 0;
+}
+
+static const uint32_t crc32c_table[256] = {
+    0x00000000, 0xf26b8303, 0xe13b70f7, 0x1350f3f4, 0xc79a971f, 0x35f1141c,
+    0x26a1e7e8, 0xd4ca64eb, 0x8ad958cf, 0x78b2dbcc, 0x6be22838, 0x9989ab3b,
+    0x4d43cfd0, 0xbf284cd3, 0xac78bf27, 0x5e133c24, 0x105ec76f, 0xe235446c,
+    0xf165b798, 0x030e349b, 0xd7c45070, 0x25afd373, 0x36ff2087, 0xc494a384,
+    0x9a879fa0, 0x68ec1ca3, 0x7bbcef57, 0x89d76c54, 0x5d1d08bf, 0xaf768bbc,
+    0xbc267848, 0x4e4dfb4b, 0x20bd8ede, 0xd2d60ddd, 0xc186fe29, 0x33ed7d2a,
+    0xe72719c1, 0x154c9ac2, 0x061c6936, 0xf477ea35, 0xaa64d611, 0x580f5512,
+    0x4b5fa6e6, 0xb93425e5, 0x6dfe410e, 0x9f95c20d, 0x8cc531f9, 0x7eaeb2fa,
+    0x30e349b1, 0xc288cab2, 0xd1d83946, 0x23b3ba45, 0xf779deae, 0x05125dad,
+    0x1642ae59, 0xe4292d5a, 0xba3a117e, 0x4851927d, 0x5b016189, 0xa96ae28a,
+    0x7da08661, 0x8fcb0562, 0x9c9bf696, 0x6ef07595, 0x417b1dbc, 0xb3109ebf,
+    0xa0406d4b, 0x522bee48, 0x86e18aa3, 0x748a09a0, 0x67dafa54, 0x95b17957,
+    0xcba24573, 0x39c9c670, 0x2a993584, 0xd8f2b687, 0x0c38d26c, 0xfe53516f,
+    0xed03a29b, 0x1f682198, 0x5125dad3, 0xa34e59d0, 0xb01eaa24, 0x42752927,
+    0x96bf4dcc, 0x64d4cecf, 0x77843d3b, 0x85efbe38, 0xdbfc821c, 0x2997011f,
+    0x3ac7f2eb, 0xc8ac71e8, 0x1c661503, 0xee0d9600, 0xfd5d65f4, 0x0f36e6f7,
+    0x61c69362, 0x93ad1061, 0x80fde395, 0x72966096, 0xa65c047d, 0x5437877e,
+    0x4767748a, 0xb50cf789, 0xeb1fcbad, 0x197448ae, 0x0a24bb5a, 0xf84f3859,
+    0x2c855cb2, 0xdeeedfb1, 0xcdbe2c45, 0x3fd5af46, 0x7198540d, 0x83f3d70e,
+    0x90a324fa, 0x62c8a7f9, 0xb602c312, 0x44694011, 0x5739b3e5, 0xa55230e6,
+    0xfb410cc2, 0x092a8fc1, 0x1a7a7c35, 0xe811ff36, 0x3cdb9bdd, 0xceb018de,
+    0xdde0eb2a, 0x2f8b6829, 0x82f63b78, 0x709db87b, 0x63cd4b8f, 0x91a6c88c,
+    0x456cac67, 0xb7072f64, 0xa457dc90, 0x563c5f93, 0x082f63b7, 0xfa44e0b4,
+    0xe9141340, 0x1b7f9043, 0xcfb5f4a8, 0x3dde77ab, 0x2e8e845f, 0xdce5075c,
+    0x92a8fc17, 0x60c37f14, 0x73938ce0, 0x81f80fe3, 0x55326b08, 0xa759e80b,
+    0xb4091bff, 0x466298fc, 0x1871a4d8, 0xea1a27db, 0xf94ad42f, 0x0b21572c,
+    0xdfeb33c7, 0x2d80b0c4, 0x3ed04330, 0xccbbc033, 0xa24bb5a6, 0x502036a5,
+    0x4370c551, 0xb11b4652, 0x65d122b9, 0x97baa1ba, 0x84ea524e, 0x7681d14d,
+    0x2892ed69, 0xdaf96e6a, 0xc9a99d9e, 0x3bc21e9d, 0xef087a76, 0x1d63f975,
+    0x0e330a81, 0xfc588982, 0xb21572c9, 0x407ef1ca, 0x532e023e, 0xa145813d,
+    0x758fe5d6, 0x87e466d5, 0x94b49521, 0x66df1622, 0x38cc2a06, 0xcaa7a905,
+    0xd9f75af1, 0x2b9cd9f2, 0xff56bd19, 0x0d3d3e1a, 0x1e6dcdee, 0xec064eed,
+    0xc38d26c4, 0x31e6a5c7, 0x22b65633, 0xd0ddd530, 0x0417b1db, 0xf67c32d8,
+    0xe52cc12c, 0x1747422f, 0x49547e0b, 0xbb3ffd08, 0xa86f0efc, 0x5a048dff,
+    0x8ecee914, 0x7ca56a17, 0x6ff599e3, 0x9d9e1ae0, 0xd3d3e1ab, 0x21b862a8,
+    0x32e8915c, 0xc083125f, 0x144976b4, 0xe622f5b7, 0xf5720643, 0x07198540,
+    0x590ab964, 0xab613a67, 0xb831c993, 0x4a5a4a90, 0x9e902e7b, 0x6cfbad78,
+    0x7fab5e8c, 0x8dc0dd8f, 0xe330a81a, 0x115b2b19, 0x020bd8ed, 0xf0605bee,
+    0x24aa3f05, 0xd6c1bc06, 0xc5914ff2, 0x37faccf1, 0x69e9f0d5, 0x9b8273d6,
+    0x88d28022, 0x7ab90321, 0xae7367ca, 0x5c18e4c9, 0x4f48173d, 0xbd23943e,
+    0xf36e6f75, 0x0105ec76, 0x12551f82, 0xe03e9c81, 0x34f4f86a, 0xc69f7b69,
+    0xd5cf889d, 0x27a40b9e, 0x79b737ba, 0x8bdcb4b9, 0x988c474d, 0x6ae7c44e,
+    0xbe2da0a5, 0x4c4623a6, 0x5f16d052, 0xad7d5351
+};
+
+#if defined(__x86_64__) && defined(__GNUC__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const uint8_t *data, uint64_t length) {
+    uint64_t crc64 = crc;
+    uint64_t word = 0;
+
+    for (; length >= 8; data += 8, length -= 8) {
+        memcpy(&word, data, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+
+    crc = crc64;
+    for (; length > 0; data++, length--) {
+        crc = _mm_crc32_u8(crc, *data);
+    }
+
+    return crc;
+}
+#endif
+
+/**
+* CRC32C (Castagnoli) of length bytes, continuing from the crc of the bytes
+* before them. Start with 0. Uses the SSE4.2 CRC instruction when the CPU
+* has it, or the ARMv8 one when built for it, and a table otherwise.
+*/
+uint32_t crc32c(uint32_t crc, const uint8_t *data, uint64_t length) {
+    crc = ~crc;
+
+#if defined(__x86_64__) && defined(__GNUC__)
+    if (__builtin_cpu_supports("sse4.2")) {
+        return ~crc32c_sse42(crc, data, length);
+    }
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+    uint64_t word = 0;
+
+    for (; length >= 8; data += 8, length -= 8) {
+        memcpy(&word, data, 8);
+        crc = __crc32cd(crc, word);
+    }
+#endif
+
+    for (; length > 0; data++, length--) {
+        crc = crc32c_table[(crc ^ *data) & 0xff] ^ (crc >> 8);
+    }
+
+    return ~crc;
+}
+
+/**
+* Number of checksum chunks the extent [first, final] touches
+*/
+uint64_t extent_chunks(uint64_t first, uint64_t final) {
+    return final / CHECKSUM_CHUNK - first / CHECKSUM_CHUNK + 1;
+}
+
+/**
+* The checksum of the given chunk of an extent. They follow its offsets, one
+* per chunk. Extents without one for every chunk, like those written before
+* checksums were added, are not checked.
+*/
+bool extent_crc(json_object *location_array, uint64_t chunk, uint32_t *crc) {
+    uint64_t first = json_object_get_int64(json_object_array_get_idx(location_array, 1));
+    uint64_t final = json_object_get_int64(json_object_array_get_idx(location_array, 2));
+    uint64_t chunks = extent_chunks(first, final);
+
+    if (json_object_array_length(location_array) != 3 + chunks || chunk >= chunks) {
+        return false;
+    }
+
+    *crc = json_object_get_int64(json_object_array_get_idx(location_array, 3 + chunk));
+    return true;
+}
+
+/**
+* Size of the buffer copy_from_store needs for extents of at most largest
+* bytes. A chunk starts anywhere in its first aligned block.
+*/
+uint64_t chunk_buffer_size(uint64_t largest) {
+    if (largest > CHECKSUM_CHUNK) {
+        largest = CHECKSUM_CHUNK;
+    }
+
+    return (largest / DIRECT_IO_ALIGN + 2) * DIRECT_IO_ALIGN;
+}
+
+/**
+* Copy length bytes of data into the map store at offset. Full chunks go to
+* out_fd, a short last chunk to buffered_fd as it can't be written directly.
+* copied stops short of length if the data ends early. Reads stop at checksum
+* chunk boundaries, where the CRC of the chunk is added to location_array.
+*/
+static int copy_to_store(int data_fd, uint64_t data_offset, int out_fd, int buffered_fd,
+                         uint64_t offset, uint64_t length, char *buf, uint64_t buffer_size,
+                         struct sha256_ctx *hasher, json_object *location_array, uint32_t *crc,
+                         uint64_t *copied) {
+    uint64_t bytes_to_read = 0;
+    uint64_t boundary = 0;
+    ssize_t bytes_read = 0;
+
+    *copied = 0;
+    while (*copied < length) {
+        bytes_to_read = (length - *copied > buffer_size) ? buffer_size : length - *copied;
+        boundary = CHECKSUM_CHUNK - (offset + *copied) % CHECKSUM_CHUNK;
+        bytes_to_read = (bytes_to_read > boundary) ? boundary : bytes_to_read;
+
+        if ((bytes_read = read_data(data_fd, buf, bytes_to_read, data_offset + *copied)) <= 0) {
+            break;
+        }
+
+        if (hasher) {
+            sha256_update(hasher, bytes_read, (uint8_t *)buf);
+        }
+        *crc = crc32c(*crc, (uint8_t *)buf, bytes_read);
+
+        if (pwrite((bytes_read == bytes_to_read) ? out_fd : buffered_fd, buf, bytes_read, offset + *copied) != bytes_read) {
+            fprintf(stderr, "Error writing to mapstore: %s\n", strerror(errno));
+            return 1;
+        }
+
+        *copied += bytes_read;
+        if ((offset + *copied) % CHECKSUM_CHUNK == 0) {
+            json_object_array_add(location_array, json_object_new_int64(*crc));
+            *crc = 0;
+        }
+        if (bytes_read < bytes_to_read) {
+            break;
+        }
+    }
+
+    return 0;
+}
+
+/**
+* Data is read from data_fd in order, so hasher sees it as one stream. With
+* direct set, the aligned middle of every extent bypasses the page cache and
+* the unaligned head and tail are written through it. The CRC32C of every
+* checksum chunk an extent touches is added to it after its offsets.
+*/
+int write_to_store(int data_fd, char *store_dir, json_object *data_locations, struct sha256_ctx *hasher, bool direct) {
     int status = 0;
 
     char mapstore_path[BUFSIZ];
-    FILE *mapstore = NULL;
+    int store_fd = -1;
+    int direct_fd = -1;
     uint64_t arr_i = 0;
     json_object *location_array = NULL;
     uint64_t first;
     uint64_t final;
-    uint64_t sector_size = 0;
-    uint64_t bytes_read = 0;
+    uint64_t start;
+    uint64_t end;
     char buf[BUFSIZ];
+    char *aligned = NULL;
     uint64_t total_written_to_file = 0;
-    uint64_t total_written_for_sector = 0;
-    uint64_t bytes_written = 0;
-    uint64_t bytes_to_read = 0;
+    uint64_t copied = 0;
+    uint64_t extent_copied = 0;
+    uint32_t crc = 0;
+    bool ended = false;
+
+    if (direct && !(aligned = direct_buffer(DIRECT_IO_BUFFER))) {
+        direct = false;
+    }
 
     json_object_object_foreach(data_locations, file, arr) {
         memset(mapstore_path, '\0', BUFSIZ);
         sprintf(mapstore_path, "%s%s.map", store_dir, file);
-        mapstore = fopen(mapstore_path, "a+");
+        /* Append mode would ignore the offsets given to pwrite */
+        store_fd = open(mapstore_path, O_RDWR);
 
-        if (!mapstore) {
+        if (store_fd < 0) {
             fprintf(stderr, "Error opening mapstore for writing: %s\n", mapstore_path);
             status = 1;
             goto end_write;
         }
 
-        for (arr_i = 0; arr_i < json_object_array_length(arr); arr_i++) {
+        direct_fd = (direct) ? open_direct(mapstore_path, O_RDWR) : -1;
+
+        for (arr_i = 0; arr_i < json_object_array_length(arr) && !ended; arr_i++) {
             location_array = json_object_array_get_idx(arr, arr_i);
             first = json_object_get_int64(json_object_array_get_idx(location_array, 1));
             final = json_object_get_int64(json_object_array_get_idx(location_array, 2));
-            sector_size = final - first + 1;
 
-            bytes_read = 0;
-            bytes_written = 0;
-            total_written_for_sector = 0;
+            start = end = first;
+            if (direct_fd >= 0) {
+                direct_span(first, final, &start, &end);
+            }
+
+            crc = 0;
+            extent_copied = 0;
 
-            do {
-                memset(buf, '\0', BUFSIZ);
-                bytes_to_read = ((sector_size - total_written_for_sector) > BUFSIZ) ? BUFSIZ : sector_size - total_written_for_sector;
+            uint64_t segments[3][2] = {{first, start - first}, {start, end - start}, {end, final + 1 - end}};
+            for (int s = 0; s < 3 && !ended; s++) {
+                if (segments[s][1] == 0) {
+                    continue;
+                }
 
-                if (data_fd == STDIN_FILENO) {
-                    bytes_read = read(data_fd, buf, bytes_to_read);
+                if (s == 1) {
+                    status = copy_to_store(data_fd, total_written_to_file, direct_fd, store_fd, segments[s][0],
+                                           segments[s][1], aligned, DIRECT_IO_BUFFER, hasher, location_array,
+                                           &crc, &copied);
                 } else {
-                    bytes_read = pread(data_fd, buf, bytes_to_read, total_written_to_file);
+                    status = copy_to_store(data_fd, total_written_to_file, store_fd, store_fd, segments[s][0],
+                                           segments[s][1], buf, BUFSIZ, hasher, location_array, &crc, &copied);
                 }
 
-                bytes_written = pwrite(fileno(mapstore), buf, bytes_read, total_written_for_sector + first);
+                if (status != 0) {
+                    goto end_write;
+                }
 
-                total_written_to_file += bytes_written;
-                total_written_for_sector += bytes_written;
-            } while (total_written_for_sector < sector_size && bytes_read > 0);
+                total_written_to_file += copied;
+                extent_copied += copied;
+                ended = copied < segments[s][1];
+            }
 
+            if ((first + extent_copied) % CHECKSUM_CHUNK != 0) {
+                json_object_array_add(location_array, json_object_new_int64(crc));
+            }
         }
 
-        if (mapstore) {
-            fclose(mapstore);
+        if (direct_fd >= 0) {
+            close(direct_fd);
+            direct_fd = -1;
         }
+        close(store_fd);
+        store_fd = -1;
     }
 
 end_write:
+    if (direct_fd >= 0) {
+        close(direct_fd);
+    }
+    if (store_fd >= 0) {
+        close(store_fd);
+    }
+    free(aligned);
     return status;
 }
 
-int read_from_store(int output_fd, char *store_dir, json_object *data_locations) {
+/**
+* Read the part [first, final] of a checksum chunk into buf at its offset in
+* the first aligned block. The aligned middle is read from direct_fd when
+* given, falling back to store_fd if that comes back short.
+*/
+static int read_chunk(int store_fd, int direct_fd, uint64_t first, uint64_t final, char *buf) {
+    uint64_t base = first / DIRECT_IO_ALIGN * DIRECT_IO_ALIGN;
+    uint64_t start = first;
+    uint64_t end = first;
+
+    if (direct_fd >= 0) {
+        direct_span(first, final, &start, &end);
+    }
+
+    uint64_t segments[3][2] = {{first, start - first}, {start, end - start}, {end, final + 1 - end}};
+    for (int s = 0; s < 3; s++) {
+        if (segments[s][1] == 0) {
+            continue;
+        }
+
+        if (s == 1 &&
+            read_data(direct_fd, buf + segments[s][0] - base, segments[s][1], segments[s][0]) == (ssize_t)segments[s][1]) {
+            continue;
+        }
+
+        if (read_data(store_fd, buf + segments[s][0] - base, segments[s][1], segments[s][0]) != (ssize_t)segments[s][1]) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+* Copy the extent in location_array to output_fd, in order when in_order is
+* set and at its position otherwise. Each checksum chunk is read into buf,
+* which holds chunk_buffer_size bytes aligned for direct_fd, and with verify
+* set it is checked before it is written. Corrupt data never reaches the
+* output.
+*/
+int copy_from_store(int store_fd, int direct_fd, json_object *location_array, int output_fd,
+                    bool in_order, bool verify, char *buf) {
+    uint64_t position = json_object_get_int64(json_object_array_get_idx(location_array, 0));
+    uint64_t first = json_object_get_int64(json_object_array_get_idx(location_array, 1));
+    uint64_t final = json_object_get_int64(json_object_array_get_idx(location_array, 2));
+    uint64_t chunk_first = first;
+    uint64_t chunk_final = 0;
+    uint64_t length = 0;
+    uint32_t expected = 0;
+    char *data = NULL;
+    bool check = verify && extent_crc(location_array, 0, &expected);
+
+    for (uint64_t chunk = 0; chunk_first <= final; chunk++, chunk_first = chunk_final + 1) {
+        chunk_final = (chunk_first / CHECKSUM_CHUNK + 1) * CHECKSUM_CHUNK - 1;
+        chunk_final = (chunk_final > final) ? final : chunk_final;
+        length = chunk_final - chunk_first + 1;
+        data = buf + chunk_first % DIRECT_IO_ALIGN;
+
+        if (read_chunk(store_fd, direct_fd, chunk_first, chunk_final, buf) != 0) {
+            return 1;
+        }
+
+        if (check && (!extent_crc(location_array, chunk, &expected) ||
+                      crc32c(0, (uint8_t *)data, length) != expected)) {
+            fprintf(stderr, "Checksum mismatch at %"PRIu64"\n", chunk_first);
+            return 1;
+        }
+
+        if (in_order) {
+            if (write_all(output_fd, data, length) != 0) {
+                return 1;
+            }
+        } else if (pwrite(output_fd, data, length, position + chunk_first - first) != (ssize_t)length) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+* With verify set every extent that has checksums is checked chunk by chunk
+* before the chunk is written to output_fd.
+*/
+int read_from_store(int output_fd, char *store_dir, json_object *data_locations, bool direct, bool verify) {
     int status = 0;
     char mapstore_path[BUFSIZ];
-    FILE *mapstore = NULL;
+    int store_fd = -1;
+    int direct_fd = -1;
     uint64_t arr_i = 0;
-    json_object *location_array = NULL;
-    uint64_t first;
-    uint64_t final;
-    uint64_t position;
-    uint64_t sector_size = 0;
-    uint64_t bytes_read = 0;
-    char buf[BUFSIZ];
-    uint64_t total_written_for_sector = 0;
-    uint64_t bytes_written = 0;
-    uint64_t bytes_to_read = 0;
+    uint64_t buffer_size = chunk_buffer_size(positions_size(data_locations));
+    char *buf = NULL;
+
+    if (direct && !(buf = direct_buffer(buffer_size))) {
+        direct = false;
+    }
+
+    if (!buf && !(buf = malloc(buffer_size))) {
+        return 1;
+    }
 
     json_object_object_foreach(data_locations, mapstore_id, coordinates) {
         memset(mapstore_path, '\0', BUFSIZ);
         sprintf(mapstore_path, "%s%s.map", store_dir, mapstore_id);
-        mapstore = fopen(mapstore_path, "r");
+        store_fd = open(mapstore_path, O_RDONLY);
 
-        if (!mapstore) {
+        if (store_fd < 0) {
             fprintf(stderr, "Error opening mapstore for reading: %s\n", mapstore_path);
             status = 1;
             goto end_read;
         }
 
+        direct_fd = (direct) ? open_direct(mapstore_path, O_RDONLY) : -1;
+
         for (arr_i = 0; arr_i < json_object_array_length(coordinates); arr_i++) {
-            location_array = json_object_array_get_idx(coordinates, arr_i);
-            position = json_object_get_int64(json_object_array_get_idx(location_array, 0));
-            first = json_object_get_int64(json_object_array_get_idx(location_array, 1));
-            final = json_object_get_int64(json_object_array_get_idx(location_array, 2));
-            sector_size = final - first + 1;
+            // TODO: Data could be out of order on stdout...
+            if (copy_from_store(store_fd, direct_fd, json_object_array_get_idx(coordinates, arr_i), output_fd,
+                                output_fd == STDOUT_FILENO, verify, buf) != 0) {
+                fprintf(stderr, "Error reading from mapstore: %s\n", mapstore_path);
+                status = 1;
+                goto end_read;
+            }
+        }
 
-            bytes_read = 0;
-            bytes_written = 0;
-            total_written_for_sector = 0;
+        if (direct_fd >= 0) {
+            close(direct_fd);
+            direct_fd = -1;
+        }
+        close(store_fd);
+        store_fd = -1;
+    }
 
-            do {
-                memset(buf, '\0', BUFSIZ);
-                bytes_to_read = ((sector_size - total_written_for_sector) > BUFSIZ) ? BUFSIZ : sector_size - total_written_for_sector;
-                bytes_read = pread(fileno(mapstore), buf, bytes_to_read, first + total_written_for_sector);
+end_read:
+    if (direct_fd >= 0) {
+        close(direct_fd);
+    }
+    if (store_fd >= 0) {
+        close(store_fd);
+    }
+    free(buf);
+    return status;
+}
 
-                if (output_fd == STDOUT_FILENO) {
-                    // TODO: Data could be out of order here...
-                    bytes_written = write(output_fd, buf, bytes_read);
-                } else {
-                    bytes_written = pwrite(output_fd, buf, bytes_read, position + total_written_for_sector);
-                }
+/**
+* Write all of data to fd from its current position
+*/
+int write_all(int fd, const char *data, uint64_t length) {
+    ssize_t written = 0;
 
-                total_written_for_sector += bytes_written;
-            } while (total_written_for_sector < sector_size && bytes_read > 0);
+    while (length > 0) {
+        if ((written = write(fd, data, length)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return 1;
+        }
+        data += written;
+        length -= written;
+    }
 
+    return 0;
+}
+
+/**
+* Hint the page cache about a range of a file. willneed starts reading it in
+* the background, otherwise its clean pages are dropped. Platforms without
+* fadvise only get the readahead hint.
+*/
+int advise_range(int fd, uint64_t offset, uint64_t length, bool willneed) {
+#if HAVE_POSIX_FADVISE
+    return posix_fadvise(fd, offset, length, (willneed) ? POSIX_FADV_WILLNEED : POSIX_FADV_DONTNEED);
+#elif __APPLE__
+    if (willneed) {
+        struct radvisory advice = {offset, (length > INT_MAX) ? INT_MAX : length};
+        if (fcntl(fd, F_RDADVISE, &advice) == -1) {
+            return errno;
         }
+    }
+    return 0;
+#else
+    return 0;
+#endif
+}
+
+/**
+* Content hash used for stored data: RIPEMD-160 of the SHA-256 digest, as hex
+*/
+char *hash_digest(struct sha256_ctx *sha256ctx) {
+    uint8_t prehash_sha256[SHA256_DIGEST_SIZE];
+    uint8_t digest[RIPEMD160_DIGEST_SIZE];
+    struct ripemd160_ctx ripemd160ctx;
+    char *hash = NULL;
+
+    sha256_digest(sha256ctx, SHA256_DIGEST_SIZE, prehash_sha256);
+
+    ripemd160_init(&ripemd160ctx);
+    ripemd160_update(&ripemd160ctx, SHA256_DIGEST_SIZE, prehash_sha256);
+    ripemd160_digest(&ripemd160ctx, RIPEMD160_DIGEST_SIZE, digest);
+
+    if (!(hash = calloc(BASE16_ENCODE_LENGTH(RIPEMD160_DIGEST_SIZE) + 1, sizeof(char)))) {
+        return NULL;
+    }
+
+    base16_encode_update(hash, RIPEMD160_DIGEST_SIZE, digest);
+
+    return hash;
+}
+
+/**
+* Flush the map stores that hold data_locations to disk
+*/
+int sync_map_stores(char *store_dir, json_object *data_locations) {
+    int status = 0;
+    int fd = -1;
+    char mapstore_path[BUFSIZ];
 
-        if (mapstore) {
-            fclose(mapstore);
+    json_object_object_foreach(data_locations, mapstore_id, coordinates) {
+        (void)coordinates;
+        memset(mapstore_path, '\0', BUFSIZ);
+        sprintf(mapstore_path, "%s%s.map", store_dir, mapstore_id);
+
+        if ((fd = open(mapstore_path, O_RDWR)) < 0 || fsync(fd) != 0) {
+            fprintf(stderr, "Error syncing mapstore: %s\n", mapstore_path);
+            status = 1;
+        }
+
+        if (fd >= 0) {
+            close(fd);
+            fd = -1;
         }
     }
 
-end_read:
     return status;
 }
 
@@ -553,3 +1303,141 @@ json_object *combine_positions(json_object *locations, uint64_t *freespace) {
 
     return combined_pos;
 }
+
+/**
+* Total bytes covered by a data_locations positions object
+*/
+uint64_t positions_size(json_object *positions) {
+    uint64_t size = 0;
+    json_object *location_array = NULL;
+
+    json_object_object_foreach(positions, store_id, arr) {
+        (void)store_id;
+        for (int i = 0; i < json_object_array_length(arr); i++) {
+            location_array = json_object_array_get_idx(arr, i);
+            size += json_object_get_int64(json_object_array_get_idx(location_array, 2)) -
+                    json_object_get_int64(json_object_array_get_idx(location_array, 1)) + 1;
+        }
+    }
+
+    return size;
+}
+
+/**
+* Number of extents an object was split into
+*/
+uint64_t positions_extents(json_object *positions) {
+    uint64_t extents = 0;
+
+    json_object_object_foreach(positions, store_id, arr) {
+        (void)store_id;
+        extents += json_object_array_length(arr);
+    }
+
+    return extents;
+}
+
+/**
+* Extents of [2^n, 2^(n+1)) bytes fall into size class n
+*/
+uint64_t extent_size_class(uint64_t size) {
+    return (size == 0) ? 0 : 63 - __builtin_clzll(size);
+}
+
+void free_list_stats(json_object *free_locations, uint64_t *extents, uint64_t *largest, uint64_t *histogram) {
+    json_object *range = NULL;
+    uint64_t size = 0;
+
+    *extents = 0;
+    *largest = 0;
+    memset(histogram, 0, EXTENT_SIZE_CLASSES * sizeof(uint64_t));
+
+    for (int i = 0; i < json_object_array_length(free_locations); i++) {
+        range = json_object_array_get_idx(free_locations, i);
+        size = json_object_get_int64(json_object_array_get_idx(range, 1)) -
+               json_object_get_int64(json_object_array_get_idx(range, 0)) + 1;
+
+        (*extents)++;
+        histogram[extent_size_class(size)]++;
+        if (size > *largest) {
+            *largest = size;
+        }
+    }
+}
+
+/**
+* JSON array of extent counts per size class. Trailing empty classes are left
+* out to keep rows small. Returned string must be freed.
+*/
+char *extent_histogram_json(uint64_t *histogram) {
+    json_object *histogram_obj = json_object_new_array();
+    char *json = NULL;
+    int classes = 0;
+
+    for (int c = 0; c < EXTENT_SIZE_CLASSES; c++) {
+        if (histogram[c] > 0) {
+            classes = c + 1;
+        }
+    }
+
+    for (int c = 0; c < classes; c++) {
+        json_object_array_add(histogram_obj, json_object_new_int64(histogram[c]));
+    }
+
+    json = strdup(json_object_to_json_string(histogram_obj));
+    json_object_put(histogram_obj);
+    return json;
+}
+
+/**
+* SET clause columns that keep the fragmentation stats of a map store in step
+* with its free list. Returned string must be freed.
+*/
+char *free_list_stats_set(json_object *free_locations) {
+    uint64_t extents = 0;
+    uint64_t largest = 0;
+    uint64_t histogram[EXTENT_SIZE_CLASSES];
+    char *histogram_json = NULL;
+    char *set = NULL;
+
+    free_list_stats(free_locations, &extents, &largest, histogram);
+    histogram_json = extent_histogram_json(histogram);
+
+    set = calloc(70 + 2 * MAX_UINT64_STR + strlen(histogram_json) + 1, sizeof(char));
+    sprintf(set,
+            "free_extents = %"PRIu64", largest_free_extent = %"PRIu64", extent_histogram = '%s'",
+            extents,
+            largest,
+            histogram_json);
+
+    free(histogram_json);
+    return set;
+}
+
+/**
+* VALUES clause for a new map store whose whole size is one free extent.
+* Returned string must be freed.
+*/
+char *new_map_store_values(uint64_t id, uint64_t size) {
+    uint64_t histogram[EXTENT_SIZE_CLASSES];
+    char *histogram_json = NULL;
+    char *values = NULL;
+
+    memset(histogram, 0, EXTENT_SIZE_CLASSES * sizeof(uint64_t));
+    histogram[extent_size_class(size)] = 1;
+    histogram_json = extent_histogram_json(histogram);
+
+    values = calloc(130 + 5 * MAX_UINT64_STR + strlen(histogram_json) + 1, sizeof(char));
+    sprintf(values,
+            "(Id,free_locations,free_space,size,free_extents,largest_free_extent,extent_histogram) "
+            "VALUES(%"PRIu64", '[[ 0, %"PRIu64" ]]', %"PRIu64", %"PRIu64", 1, %"PRIu64", '%s')",
+            id,
+            size - 1,
+            size,
+            size,
+            size,
+            histogram_json);
+
+    free(histogram_json);
+    return values;
+}
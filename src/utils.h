@@ -10,9 +10,13 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <limits.h>
 #include <math.h>
 
 #include <json-c/json.h>
+#include <nettle/sha2.h>
+#include <nettle/ripemd160.h>
+#include <nettle/base16.h>
 
 #include <stdarg.h>
 #include <stdbool.h>
@@ -35,31 +39,82 @@ ssize_t pwrite(int fd, const void *buf, size_t count, uint64_t offset);
 #else
 #include <sys/time.h>
 #include <sys/mman.h>
+#include <dirent.h>
+#endif
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#if defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
 #endif
 
 #include "utils.h"
 #include "database_utils.h"
 
+#define DIRECT_IO_ALIGN 4096
+#define DIRECT_IO_BUFFER (1024 * 1024)
+/* Checksum chunks are aligned in the map file and fit the direct I/O buffer */
+#define CHECKSUM_CHUNK DIRECT_IO_BUFFER
+
 int allocatefile(int fd, uint64_t length);
+int punch_hole(int fd, uint64_t offset, uint64_t length);
 int unmap_file(uint8_t *map, uint64_t filesize);
 int map_file(int fd, uint64_t filesize, uint8_t **map, bool read_only);
 int create_directory(char *path);
+int remove_directory(char *path);
+bool valid_hash(char *hash);
+bool path_exists(char *path);
 int create_map_store(char *path, uint64_t size, bool prealloc);
-int write_to_store(int data_fd, char *store_dir, json_object *data_locations);
-int read_from_store(int output_fd, char *store_dir, json_object *data_locations);
+int extend_map_store(char *path, uint64_t size, bool prealloc);
+int write_to_store(int data_fd, char *store_dir, json_object *data_locations, struct sha256_ctx *hasher, bool direct);
+int read_to_buffer(int data_fd, uint64_t size, uint8_t **data, struct sha256_ctx *hasher);
+int read_from_store(int output_fd, char *store_dir, json_object *data_locations, bool direct, bool verify);
+uint32_t crc32c(uint32_t crc, const uint8_t *data, uint64_t length);
+uint64_t extent_chunks(uint64_t first, uint64_t final);
+bool extent_crc(json_object *location_array, uint64_t chunk, uint32_t *crc);
+uint64_t chunk_buffer_size(uint64_t largest);
+int copy_from_store(int store_fd, int direct_fd, json_object *location_array, int output_fd,
+                    bool in_order, bool verify, char *buf);
+int open_direct(char *path, int flags);
+void *direct_buffer(uint64_t size);
+int sync_map_stores(char *store_dir, json_object *data_locations);
+char *hash_digest(struct sha256_ctx *sha256ctx);
+int write_all(int fd, const char *data, uint64_t length);
+int advise_range(int fd, uint64_t offset, uint64_t length, bool willneed);
 uint64_t get_file_size(int fd);
+uint64_t get_allocated_size(int fd);
+uint64_t get_block_size(int fd);
 uint64_t sector_min(uint64_t data_size);
 uint64_t prepare_store_positions(uint64_t store_id,
                                  json_object *free_locations_arr,
                                  uint64_t data_position,
                                  uint64_t data_size,
+                                 uint64_t align,
                                  json_object *map_plan);
+uint64_t log_head(json_object *free_locations_arr, uint64_t size);
+uint64_t prepare_log_positions(uint64_t store_id,
+                               json_object *free_locations_arr,
+                               uint64_t size,
+                               uint64_t data_position,
+                               uint64_t data_size,
+                               json_object *map_plan);
+uint64_t prepare_region_positions(uint64_t store_id, json_object *free_locations_arr, uint64_t length, json_object *map_plan);
 
 /* Json Functions */
 json_object *json_free_space_array(uint64_t start, uint64_t end);
 json_object *json_data_positions_array(uint64_t file_pos, uint64_t start, uint64_t end);
 json_object *expand_free_space_list(json_object *old_free_space, uint64_t old_size, uint64_t new_size);
 json_object *combine_positions(json_object *locations, uint64_t *freespace);
+uint64_t positions_size(json_object *positions);
+uint64_t positions_extents(json_object *positions);
+uint64_t extent_size_class(uint64_t size);
+void free_list_stats(json_object *free_locations, uint64_t *extents, uint64_t *largest, uint64_t *histogram);
+char *extent_histogram_json(uint64_t *histogram);
+char *free_list_stats_set(json_object *free_locations);
+char *new_map_store_values(uint64_t id, uint64_t size);
 
 static inline char separator()
 {
@@ -55,6 +55,82 @@ int get_file_hash(int fd, char **hash) {
     return 0;
 }
 
+int create_test_file(char *path, uint64_t size, char **hash) {
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+
+    for (uint64_t i = 0; i < size; i++) {
+        char c = "ABCDEFGHIJKLMNOPQRSTUVWXYZ"[rand() % 26];
+        if (write(fd, &c, 1) != 1) {
+            close(fd);
+            return -1;
+        }
+    }
+
+    if (hash && get_file_hash(fd, hash) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+bool files_equal(int fd1, int fd2) {
+    char buf1[BUFSIZ];
+    char buf2[BUFSIZ];
+    ssize_t read1 = 0;
+    ssize_t read2 = 0;
+    uint64_t offset = 0;
+
+    if (get_file_size(fd1) != get_file_size(fd2)) {
+        return false;
+    }
+
+    do {
+        read1 = pread(fd1, buf1, BUFSIZ, offset);
+        read2 = pread(fd2, buf2, BUFSIZ, offset);
+        if (read1 != read2 || memcmp(buf1, buf2, read1) != 0) {
+            return false;
+        }
+        offset += read1;
+    } while (read1 > 0);
+
+    return true;
+}
+
+/**
+* Creates an empty directory for a test store under the test folder.
+*/
+void setup_test_store(char *base_path, size_t size, char *name) {
+    memset(base_path, '\0', size);
+    snprintf(base_path, size, "%s%c%s", folder, separator(), name);
+    create_directory(base_path);
+}
+
+/**
+* Removes the map files and metadata of ctx, frees it and removes the store
+* directories made by setup_test_store.
+*/
+void teardown_test_store(mapstore_ctx *ctx, char *base_path) {
+    char path[BUFSIZ];
+
+    for (uint64_t i = 1; i <= ctx->total_mapstores; i++) {
+        memset(path, '\0', BUFSIZ);
+        snprintf(path, BUFSIZ, "%s%"PRIu64".map", ctx->mapstore_path, i);
+        remove(path);
+    }
+    remove(ctx->database_path);
+    mapstore_ctx_free(ctx);
+
+    memset(path, '\0', BUFSIZ);
+    if (snprintf(path, BUFSIZ, "%s%cshards", base_path, separator()) < BUFSIZ) {
+        remove_directory(path);
+    }
+    remove_directory(base_path);
+}
+
 void test_json_free_space_array() {
     json_object *jarray = NULL;
 
@@ -91,6 +167,33 @@ void test_json_free_space_array() {
     return;
 }
 
+void test_expand_free_space_list() {
+    json_object *old_free_space = NULL;
+    json_object *new_free_space = NULL;
+
+    memset(expected, '\0', BUFSIZ);
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should extend free space touching the end", __func__);
+    sprintf(expected, "[ [ 0, 9 ], [ 20, 49 ] ]");
+    old_free_space = json_tokener_parse("[ [ 0, 9 ], [ 20, 29 ] ]");
+    new_free_space = expand_free_space_list(old_free_space, 30, 50);
+    assert_equal_str(test_case, expected, (char *)json_object_to_json_string(new_free_space));
+    json_object_put(new_free_space);
+    json_object_put(old_free_space);
+
+    memset(expected, '\0', BUFSIZ);
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should append free space when the end is used", __func__);
+    sprintf(expected, "[ [ 0, 9 ], [ 30, 49 ] ]");
+    old_free_space = json_tokener_parse("[ [ 0, 9 ] ]");
+    new_free_space = expand_free_space_list(old_free_space, 30, 50);
+    assert_equal_str(test_case, expected, (char *)json_object_to_json_string(new_free_space));
+    json_object_put(new_free_space);
+    json_object_put(old_free_space);
+
+    return;
+}
+
 void test_initialize_mapstore() {
     sqlite3 *db = NULL; // Database
     char query[BUFSIZ];
@@ -101,7 +204,7 @@ void test_initialize_mapstore() {
 
     sprintf(test_case, "%s: Should successfully initialize context", __func__);
     mapstore_ctx ctx;
-    mapstore_opts opts;
+    mapstore_opts opts = {0};
 
     opts.allocation_size = 25;
     opts.map_size = 14;
@@ -230,6 +333,90 @@ void test_initialize_mapstore() {
     if (db) {
         sqlite3_close(db);
     }
+    mapstore_ctx_free(&ctx);
+}
+
+void test_grow_mapstore() {
+    char store_path[BUFSIZ];
+    char where[BUFSIZ];
+    mapstore_row store_row;
+    struct stat st;
+
+    memset(test_case, '\0', BUFSIZ);
+    mapstore_ctx ctx;
+    mapstore_opts opts = {0};
+
+    opts.allocation_size = 25;
+    opts.map_size = 14;
+    opts.path = folder;
+    opts.prealloc = false;
+
+    if (initialize_mapstore(&ctx, opts) != 0) {
+        printf("Error initializing mapstore\n");
+        return;
+    }
+    mapstore_ctx_free(&ctx);
+
+    /* Raise both map size and allocation size */
+    opts.allocation_size = 50;
+    opts.map_size = 20;
+
+    sprintf(test_case, "%s: Should reopen store with larger sizes", __func__);
+    if (initialize_mapstore(&ctx, opts) != 0) {
+        test_fail(test_case, NULL, NULL);
+        return;
+    }
+    test_pass(test_case);
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should add a map store for the new allocation", __func__);
+    assert_equal_int64(test_case, 3, ctx.total_mapstores);
+
+    uint64_t expected_sizes[3] = { 20, 20, 10 };
+    for (int i = 1; i <= ctx.total_mapstores; i++) {
+        memset(where, '\0', BUFSIZ);
+        sprintf(where, "WHERE Id='%d'", i);
+        get_store_rows(ctx.db, where, &store_row);
+
+        memset(test_case, '\0', BUFSIZ);
+        sprintf(test_case, "%s: Should grow free_space for map %d", __func__, i);
+        assert_equal_int64(test_case, expected_sizes[i - 1], store_row.free_space);
+
+        memset(test_case, '\0', BUFSIZ);
+        memset(expected, '\0', BUFSIZ);
+        sprintf(test_case, "%s: Should extend free_locations for map %d", __func__, i);
+        sprintf(expected, "[ [ 0, %"PRIu64" ] ]", expected_sizes[i - 1] - 1);
+        assert_equal_str(test_case, expected, (char *)json_object_to_json_string(store_row.free_locations));
+        json_object_put(store_row.free_locations);
+
+        memset(test_case, '\0', BUFSIZ);
+        sprintf(test_case, "%s: Should resize map file %d", __func__, i);
+        memset(store_path, '\0', BUFSIZ);
+        sprintf(store_path, "%s%d.map", ctx.mapstore_path, i);
+        stat(store_path, &st);
+        assert_equal_int64(test_case, expected_sizes[i - 1], st.st_size);
+    }
+
+    mapstore_ctx_free(&ctx);
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should refuse to shrink in place", __func__);
+    opts.allocation_size = 30;
+    if (initialize_mapstore(&ctx, opts) != 0) {
+        test_pass(test_case);
+    } else {
+        test_fail(test_case, NULL, NULL);
+        mapstore_ctx_free(&ctx);
+    }
+
+    for (int i = 1; i <= 3; i++) {
+        memset(store_path, '\0', BUFSIZ);
+        sprintf(store_path, "%s%cshards%c%d.map", folder, separator(), separator(), i);
+        remove(store_path);
+    }
+    memset(store_path, '\0', BUFSIZ);
+    sprintf(store_path, "%s%cshards.sqlite", folder, separator());
+    remove(store_path);
 }
 
 void test_store_data() {
@@ -243,7 +430,7 @@ void test_store_data() {
 
     sprintf(test_case, "%s: Should successfully initialize context", __func__);
     mapstore_ctx ctx;
-    mapstore_opts opts;
+    mapstore_opts opts = {0};
 
     opts.allocation_size = 512; // 10GB
     opts.map_size = 128;         // 2GB
@@ -291,7 +478,10 @@ void test_store_data() {
     memset(test_case, '\0', BUFSIZ);
     memset(expected, '\0', BUFSIZ);
     sprintf(test_case, "%s: Should set positions in map store", __func__);
-    sprintf(expected, "{ \"1\": [ [ 0, 0, 127 ] ], \"2\": [ [ 128, 0, 127 ] ] }");
+    uint8_t extent_data[256];
+    pread(fileno(data), extent_data, 256, 0);
+    sprintf(expected, "{ \"1\": [ [ 0, 0, 127, %"PRIu32" ] ], \"2\": [ [ 128, 0, 127, %"PRIu32" ] ] }",
+            crc32c(0, extent_data, 128), crc32c(0, extent_data + 128, 128));
     assert_equal_str(test_case, expected, (char *)json_object_to_json_string(row.positions));
 
     char where[BUFSIZ];
@@ -340,42 +530,2577 @@ void test_store_data() {
     if (db) {
         sqlite3_close(db);
     }
+    mapstore_ctx_free(&ctx);
 }
 
 void test_retrieve_data() {
-    memset(expected, '\0', BUFSIZ);
-    memset(actual, '\0', BUFSIZ);
+    char data_path[BUFSIZ];
+    char output_path[BUFSIZ];
+    char *hash = NULL;
+    int data_fd = -1;
+    int output_fd = -1;
+
     memset(test_case, '\0', BUFSIZ);
+    mapstore_ctx ctx;
+    mapstore_opts opts = {0};
+
+    opts.allocation_size = 512;
+    opts.map_size = 128;
+    opts.path = folder;
+    opts.prealloc = false;
+
+    if (initialize_mapstore(&ctx, opts) != 0) {
+        printf("Error initializing mapstore\n");
+        return;
+    }
+
+    memset(data_path, '\0', BUFSIZ);
+    sprintf(data_path, "%s%cretrieve.data", folder, separator());
+    memset(output_path, '\0', BUFSIZ);
+    sprintf(output_path, "%s%cretrieve.out", folder, separator());
+
+    data_fd = create_test_file(data_path, 300, &hash);
+    output_fd = open(output_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
 
     sprintf(test_case, "%s: Should successfully retrieve data", __func__);
-    test_fail(test_case, NULL, NULL);
+    if (store_data(&ctx, data_fd, 0, hash) != 0 ||
+        retrieve_data(&ctx, output_fd, hash) != 0) {
+        test_fail(test_case, NULL, NULL);
+    } else {
+        test_pass(test_case);
+    }
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should retrieve the same bytes across map stores", __func__);
+    if (files_equal(data_fd, output_fd)) {
+        test_pass(test_case);
+    } else {
+        test_fail(test_case, NULL, NULL);
+    }
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should fail for unknown hash", __func__);
+    if (retrieve_data(&ctx, output_fd, "0000000000000000000000000000000000000000") != 0) {
+        test_pass(test_case);
+    } else {
+        test_fail(test_case, NULL, NULL);
+    }
+
+    close(data_fd);
+    close(output_fd);
+    remove(data_path);
+    remove(output_path);
+    free(hash);
+
+    for (int i = 1; i <= ctx.total_mapstores; i++) {
+        memset(data_path, '\0', BUFSIZ);
+        sprintf(data_path, "%s%"PRIu64".map", ctx.mapstore_path, (uint64_t)i);
+        remove(data_path);
+    }
+    remove(ctx.database_path);
+    mapstore_ctx_free(&ctx);
+}
+
+void test_restructure() {
+    char data_path[BUFSIZ];
+    char output_path[BUFSIZ];
+    char path[BUFSIZ];
+    char *hash = NULL;
+    char *hash2 = NULL;
+    int data_fd = -1;
+    int data_fd2 = -1;
+    int output_fd = -1;
+    mapstore_layout_row layout;
+    restructure_checkpoint_row checkpoint;
+
+    memset(test_case, '\0', BUFSIZ);
+    mapstore_ctx ctx;
+    mapstore_opts opts = {0};
+
+    opts.allocation_size = 512;
+    opts.map_size = 128;
+    opts.path = folder;
+    opts.prealloc = false;
+
+    if (initialize_mapstore(&ctx, opts) != 0) {
+        printf("Error initializing mapstore\n");
+        return;
+    }
+
+    memset(data_path, '\0', BUFSIZ);
+    sprintf(data_path, "%s%crestructure.data", folder, separator());
+    memset(path, '\0', BUFSIZ);
+    sprintf(path, "%s%crestructure2.data", folder, separator());
+    memset(output_path, '\0', BUFSIZ);
+    sprintf(output_path, "%s%crestructure.out", folder, separator());
+
+    data_fd = create_test_file(data_path, 200, &hash);
+    data_fd2 = create_test_file(path, 100, &hash2);
+    store_data(&ctx, data_fd, 0, hash);
+    store_data(&ctx, data_fd2, 0, hash2);
+
+    sprintf(test_case, "%s: Should successfully restructure", __func__);
+    if (restructure(&ctx, 256, 384) != 0) {
+        test_fail(test_case, NULL, NULL);
+    } else {
+        test_pass(test_case);
+    }
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should update context to new layout", __func__);
+    assert_equal_int64(test_case, 2, ctx.total_mapstores);
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should record new layout", __func__);
+    get_latest_layout_row(ctx.db, &layout);
+    assert_equal_int64(test_case, 256, layout.map_size);
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should clear checkpoint", __func__);
+    get_restructure_checkpoint(ctx.db, &checkpoint);
+    assert_equal_int64(test_case, 0, checkpoint.id);
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should remove restructure folder", __func__);
+    memset(path, '\0', BUFSIZ);
+    sprintf(path, "%s%c%s", folder, separator(), RESTRUCTURE_DIR);
+    assert_equal_int64(test_case, false, path_exists(path));
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should keep data after restructure", __func__);
+    output_fd = open(output_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (retrieve_data(&ctx, output_fd, hash) == 0 && files_equal(data_fd, output_fd)) {
+        test_pass(test_case);
+    } else {
+        test_fail(test_case, NULL, NULL);
+    }
+    close(output_fd);
+
+    /* Simulate an interrupted restructure by leaving only the checkpoint behind */
+    checkpoint.map_size = 128;
+    checkpoint.allocation_size = 512;
+    checkpoint.last_id = 0;
+    checkpoint.migrated = 0;
+    save_restructure_checkpoint(ctx.db, &checkpoint);
+    mapstore_ctx_free(&ctx);
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should resume restructure on open", __func__);
+    if (initialize_mapstore(&ctx, opts) == 0 && ctx.total_mapstores == 4) {
+        test_pass(test_case);
+    } else {
+        test_fail(test_case, NULL, NULL);
+    }
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should keep data after resumed restructure", __func__);
+    output_fd = open(output_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (retrieve_data(&ctx, output_fd, hash2) == 0 && files_equal(data_fd2, output_fd)) {
+        test_pass(test_case);
+    } else {
+        test_fail(test_case, NULL, NULL);
+    }
+    close(output_fd);
+
+    close(data_fd);
+    close(data_fd2);
+    remove(data_path);
+    memset(path, '\0', BUFSIZ);
+    sprintf(path, "%s%crestructure2.data", folder, separator());
+    remove(path);
+    remove(output_path);
+    free(hash);
+    free(hash2);
+
+    for (int i = 1; i <= ctx.total_mapstores; i++) {
+        memset(path, '\0', BUFSIZ);
+        sprintf(path, "%s%"PRIu64".map", ctx.mapstore_path, (uint64_t)i);
+        remove(path);
+    }
+    remove(ctx.database_path);
+    mapstore_ctx_free(&ctx);
 }
 
 void test_delete_data() {
-    memset(expected, '\0', BUFSIZ);
-    memset(actual, '\0', BUFSIZ);
+    char data_path[BUFSIZ];
+    char where[BUFSIZ];
+    char *hash = NULL;
+    int data_fd = -1;
+    uint64_t free_space = 0;
+    mapstore_row store_row;
+
     memset(test_case, '\0', BUFSIZ);
+    mapstore_ctx ctx;
+    mapstore_opts opts = {0};
+
+    opts.allocation_size = 512;
+    opts.map_size = 128;
+    opts.path = folder;
+    opts.prealloc = false;
+
+    if (initialize_mapstore(&ctx, opts) != 0) {
+        printf("Error initializing mapstore\n");
+        return;
+    }
+
+    memset(data_path, '\0', BUFSIZ);
+    sprintf(data_path, "%s%cdelete.data", folder, separator());
+    data_fd = create_test_file(data_path, 300, &hash);
+    store_data(&ctx, data_fd, 0, hash);
 
     sprintf(test_case, "%s: Should successfully delete data", __func__);
-    test_fail(test_case, NULL, NULL);
+    if (delete_data(&ctx, hash) != 0) {
+        test_fail(test_case, NULL, NULL);
+    } else {
+        test_pass(test_case);
+    }
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should remove data meta from database", __func__);
+    assert_equal_int64(test_case, 0, get_count(ctx.db, "SELECT count(*) FROM 'data_locations';"));
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should free all space", __func__);
+    sum_column_for_table(ctx.db, "free_space", "map_stores", &free_space);
+    assert_equal_int64(test_case, 512, free_space);
+
+    for (int i = 1; i <= 3; i++) {
+        memset(where, '\0', BUFSIZ);
+        sprintf(where, "WHERE Id='%d'", i);
+        get_store_rows(ctx.db, where, &store_row);
+
+        memset(test_case, '\0', BUFSIZ);
+        sprintf(test_case, "%s: Should restore free_locations for map %d", __func__, i);
+        assert_equal_str(test_case, "[ [ 0, 127 ] ]", (char *)json_object_to_json_string(store_row.free_locations));
+        json_object_put(store_row.free_locations);
+    }
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should fail to delete data twice", __func__);
+    if (delete_data(&ctx, hash) != 0) {
+        test_pass(test_case);
+    } else {
+        test_fail(test_case, NULL, NULL);
+    }
+
+    close(data_fd);
+    remove(data_path);
+    free(hash);
+
+    for (int i = 1; i <= ctx.total_mapstores; i++) {
+        memset(data_path, '\0', BUFSIZ);
+        sprintf(data_path, "%s%"PRIu64".map", ctx.mapstore_path, (uint64_t)i);
+        remove(data_path);
+    }
+    remove(ctx.database_path);
+    mapstore_ctx_free(&ctx);
 }
 
-void test_get_data_info() {
-    memset(expected, '\0', BUFSIZ);
-    memset(actual, '\0', BUFSIZ);
+#define CONCURRENT_THREADS 8
+#define CONCURRENT_ITEMS 4
+
+typedef struct {
+    mapstore_ctx *ctx;
+    int fds[CONCURRENT_ITEMS];
+    char *hashes[CONCURRENT_ITEMS];
+    int failures;
+} concurrent_store_job;
+
+void concurrent_store_worker(void *arg) {
+    concurrent_store_job *job = arg;
+
+    for (int i = 0; i < CONCURRENT_ITEMS; i++) {
+        if (store_data(job->ctx, job->fds[i], 0, job->hashes[i]) != 0) {
+            job->failures++;
+        }
+    }
+}
+
+void test_concurrent_store() {
+    char path[BUFSIZ];
+    char output_path[BUFSIZ];
+    int output_fd = -1;
+    int failures = 0;
+    uint64_t free_space = 0;
+    uv_thread_t threads[CONCURRENT_THREADS];
+    concurrent_store_job jobs[CONCURRENT_THREADS];
+
     memset(test_case, '\0', BUFSIZ);
+    mapstore_ctx ctx;
+    mapstore_opts opts = {0};
 
-    sprintf(test_case, "%s: Should successfully retrieve data meta", __func__);
-    test_fail(test_case, NULL, NULL);
+    opts.allocation_size = 4000;
+    opts.map_size = 1000;
+    opts.path = folder;
+    opts.prealloc = false;
+
+    if (initialize_mapstore(&ctx, opts) != 0) {
+        printf("Error initializing mapstore\n");
+        return;
+    }
+
+    for (int t = 0; t < CONCURRENT_THREADS; t++) {
+        jobs[t].ctx = &ctx;
+        jobs[t].failures = 0;
+        for (int i = 0; i < CONCURRENT_ITEMS; i++) {
+            memset(path, '\0', BUFSIZ);
+            sprintf(path, "%s%cconcurrent_%d_%d.data", folder, separator(), t, i);
+            jobs[t].fds[i] = create_test_file(path, 100, &jobs[t].hashes[i]);
+        }
+    }
+
+    for (int t = 0; t < CONCURRENT_THREADS; t++) {
+        uv_thread_create(&threads[t], concurrent_store_worker, &jobs[t]);
+    }
+
+    for (int t = 0; t < CONCURRENT_THREADS; t++) {
+        uv_thread_join(&threads[t]);
+        failures += jobs[t].failures;
+    }
+
+    sprintf(test_case, "%s: Should store data from every thread", __func__);
+    assert_equal_int64(test_case, 0, failures);
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should account for all used space", __func__);
+    sum_column_for_table(ctx.db, "free_space", "map_stores", &free_space);
+    assert_equal_int64(test_case, 4000 - CONCURRENT_THREADS * CONCURRENT_ITEMS * 100, free_space);
+
+    memset(output_path, '\0', BUFSIZ);
+    sprintf(output_path, "%s%cconcurrent.out", folder, separator());
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should never hand out the same extent twice", __func__);
+    failures = 0;
+    for (int t = 0; t < CONCURRENT_THREADS; t++) {
+        for (int i = 0; i < CONCURRENT_ITEMS; i++) {
+            output_fd = open(output_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+            if (retrieve_data(&ctx, output_fd, jobs[t].hashes[i]) != 0 ||
+                !files_equal(jobs[t].fds[i], output_fd)) {
+                failures++;
+            }
+            close(output_fd);
+
+            close(jobs[t].fds[i]);
+            free(jobs[t].hashes[i]);
+            memset(path, '\0', BUFSIZ);
+            sprintf(path, "%s%cconcurrent_%d_%d.data", folder, separator(), t, i);
+            remove(path);
+        }
+    }
+    assert_equal_int64(test_case, 0, failures);
+    remove(output_path);
+
+    for (int i = 1; i <= ctx.total_mapstores; i++) {
+        memset(path, '\0', BUFSIZ);
+        sprintf(path, "%s%"PRIu64".map", ctx.mapstore_path, (uint64_t)i);
+        remove(path);
+    }
+    remove(ctx.database_path);
+    mapstore_ctx_free(&ctx);
 }
 
-void test_get_get_store_info() {
-    memset(expected, '\0', BUFSIZ);
-    memset(actual, '\0', BUFSIZ);
+void test_multi_process_store() {
+    char path[BUFSIZ];
+    char where[11 + MAX_UINT64_STR + 1];
+    char output_path[BUFSIZ];
+    char *hashes[2][CONCURRENT_ITEMS];
+    int fds[2][CONCURRENT_ITEMS];
+    int output_fd = -1;
+    int failures = 0;
+    int child_status = 0;
+    uint64_t free_space = 0;
+    pid_t pid;
+
     memset(test_case, '\0', BUFSIZ);
+    mapstore_ctx ctx;
+    mapstore_opts opts = {0};
 
-    sprintf(test_case, "%s: Should successfully retrieve store meta", __func__);
-    test_fail(test_case, NULL, NULL);
+    opts.allocation_size = 1000;
+    opts.map_size = 250;
+    opts.path = folder;
+    opts.multi_process = true;
+
+    for (int p = 0; p < 2; p++) {
+        for (int i = 0; i < CONCURRENT_ITEMS; i++) {
+            memset(path, '\0', BUFSIZ);
+            sprintf(path, "%s%cprocess_%d_%d.data", folder, separator(), p, i);
+            fds[p][i] = create_test_file(path, 100, &hashes[p][i]);
+        }
+    }
+
+    /* Create the store before forking so both processes open the same layout */
+    if (initialize_mapstore(&ctx, opts) != 0) {
+        printf("Error initializing mapstore\n");
+        return;
+    }
+    mapstore_ctx_free(&ctx);
+
+    fflush(stdout);
+    if ((pid = fork()) == 0) {
+        if (initialize_mapstore(&ctx, opts) != 0) {
+            exit(1);
+        }
+        for (int i = 0; i < CONCURRENT_ITEMS; i++) {
+            if (store_data(&ctx, fds[1][i], 0, hashes[1][i]) != 0) {
+                exit(1);
+            }
+        }
+        mapstore_ctx_free(&ctx);
+        exit(0);
+    }
+
+    if (initialize_mapstore(&ctx, opts) != 0) {
+        printf("Error initializing mapstore\n");
+        return;
+    }
+
+    for (int i = 0; i < CONCURRENT_ITEMS; i++) {
+        if (store_data(&ctx, fds[0][i], 0, hashes[0][i]) != 0) {
+            failures++;
+        }
+    }
+
+    waitpid(pid, &child_status, 0);
+
+    sprintf(test_case, "%s: Should store data from both processes", __func__);
+    if (failures == 0 && WIFEXITED(child_status) && WEXITSTATUS(child_status) == 0) {
+        test_pass(test_case);
+    } else {
+        test_fail(test_case, NULL, NULL);
+    }
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should account for all used space", __func__);
+    sum_column_for_table(ctx.db, "free_space", "map_stores", &free_space);
+    assert_equal_int64(test_case, 1000 - 2 * CONCURRENT_ITEMS * 100, free_space);
+
+    memset(output_path, '\0', BUFSIZ);
+    sprintf(output_path, "%s%cprocess.out", folder, separator());
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should never hand out the same extent twice", __func__);
+    failures = 0;
+    for (int p = 0; p < 2; p++) {
+        for (int i = 0; i < CONCURRENT_ITEMS; i++) {
+            output_fd = open(output_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+            if (retrieve_data(&ctx, output_fd, hashes[p][i]) != 0 ||
+                !files_equal(fds[p][i], output_fd)) {
+                failures++;
+            }
+            close(output_fd);
+
+            close(fds[p][i]);
+            free(hashes[p][i]);
+            memset(path, '\0', BUFSIZ);
+            sprintf(path, "%s%cprocess_%d_%d.data", folder, separator(), p, i);
+            remove(path);
+        }
+    }
+    assert_equal_int64(test_case, 0, failures);
+    remove(output_path);
+
+    memset(path, '\0', BUFSIZ);
+    sprintf(path, "%s%cprocess_shared.data", folder, separator());
+
+    /* The database free lists are emptied, so only the shared ones have room */
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should reserve space from the shared free lists", __func__);
+    fds[0][0] = create_test_file(path, 10, &hashes[0][0]);
+    for (uint64_t f = 1; f <= ctx.total_mapstores; f++) {
+        sprintf(where, "WHERE Id = %"PRIu64, f);
+        update_map_store(ctx.db, where, "SET free_locations = '[]'");
+    }
+    assert_equal_int64(test_case, 0, store_data(&ctx, fds[0][0], 0, hashes[0][0]));
+    close(fds[0][0]);
+    free(hashes[0][0]);
+
+    /* As if a process died after writing the database but before the state */
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should reload map stores a crashed process was updating", __func__);
+    fds[0][0] = create_test_file(path, 20, &hashes[0][0]);
+    for (uint64_t f = 1; f <= ctx.total_mapstores; f++) {
+        sprintf(where, "WHERE Id = %"PRIu64, f);
+        update_map_store(ctx.db, where, "SET free_space = 0, free_locations = '[]'");
+        lock_map_store(&ctx, f);
+        begin_shared_store_update(&ctx, f);
+        unlock_map_store(&ctx, f);
+    }
+    failures = (store_data(&ctx, fds[0][0], 0, hashes[0][0]) == 0);
+    assert_equal_int64(test_case, 0, failures + get_shared_total_free_space(&ctx));
+    close(fds[0][0]);
+    free(hashes[0][0]);
+    remove(path);
+
+    for (int i = 1; i <= ctx.total_mapstores; i++) {
+        memset(path, '\0', BUFSIZ);
+        sprintf(path, "%s%"PRIu64".map", ctx.mapstore_path, (uint64_t)i);
+        remove(path);
+    }
+    remove(ctx.database_path);
+    memset(path, '\0', BUFSIZ);
+    sprintf(path, "%s%cshards.state", folder, separator());
+    remove(path);
+    mapstore_ctx_free(&ctx);
+}
+
+void test_get_data_info() {
+    char data_path[BUFSIZ];
+    char *hash = NULL;
+    int data_fd = -1;
+    data_info info;
+
+    memset(test_case, '\0', BUFSIZ);
+    mapstore_ctx ctx;
+    mapstore_opts opts = {0};
+
+    opts.allocation_size = 512;
+    opts.map_size = 128;
+    opts.path = folder;
+    opts.read_connections = 2;
+
+    if (initialize_mapstore(&ctx, opts) != 0) {
+        printf("Error initializing mapstore\n");
+        return;
+    }
+
+    sprintf(test_case, "%s: Should open read connections", __func__);
+    assert_equal_int64(test_case, 2, ctx.total_readers);
+
+    memset(data_path, '\0', BUFSIZ);
+    sprintf(data_path, "%s%cinfo.data", folder, separator());
+    data_fd = create_test_file(data_path, 200, &hash);
+    store_data(&ctx, data_fd, 0, hash);
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should successfully retrieve data meta", __func__);
+    if (get_data_info(&ctx, hash, &info) != 0) {
+        test_fail(test_case, NULL, NULL);
+    } else {
+        test_pass(test_case);
+
+        memset(test_case, '\0', BUFSIZ);
+        sprintf(test_case, "%s: Should return data hash", __func__);
+        assert_equal_str(test_case, hash, info.hash);
+
+        memset(test_case, '\0', BUFSIZ);
+        sprintf(test_case, "%s: Should return data size", __func__);
+        assert_equal_int64(test_case, 200, info.size);
+        free(info.hash);
+    }
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should return connections to the pool", __func__);
+    assert_equal_int64(test_case, 2, ctx.available_readers);
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should fail for unknown hash", __func__);
+    if (get_data_info(&ctx, "0000000000000000000000000000000000000000", &info) != 0) {
+        test_pass(test_case);
+    } else {
+        test_fail(test_case, NULL, NULL);
+    }
+
+    close(data_fd);
+    remove(data_path);
+    free(hash);
+
+    for (int i = 1; i <= ctx.total_mapstores; i++) {
+        memset(data_path, '\0', BUFSIZ);
+        sprintf(data_path, "%s%"PRIu64".map", ctx.mapstore_path, (uint64_t)i);
+        remove(data_path);
+    }
+    remove(ctx.database_path);
+    mapstore_ctx_free(&ctx);
+}
+
+void test_metadata_shards() {
+    char base_path[BUFSIZ / 2];
+    char data_path[BUFSIZ];
+    char output_path[BUFSIZ];
+    char path[BUFSIZ];
+    char *hashes[6];
+    int data_fds[6];
+    int output_fd = -1;
+    bool routed = true;
+    bool retrieved = true;
+    mapstore_row store_row;
+    store_info info;
+
+    memset(test_case, '\0', BUFSIZ);
+    mapstore_ctx ctx;
+    mapstore_opts opts = {0};
+
+    setup_test_store(base_path, sizeof(base_path), "sharded");
+
+    opts.allocation_size = 512;
+    opts.map_size = 128;
+    opts.path = base_path;
+    opts.metadata_shards = 3;
+
+    if (initialize_mapstore(&ctx, opts) != 0) {
+        printf("Error initializing mapstore\n");
+        return;
+    }
+
+    sprintf(test_case, "%s: Should create a database per shard", __func__);
+    shard_database_path(base_path, 2, path, BUFSIZ);
+    if (ctx.shards.total == 3 && path_exists(path)) {
+        test_pass(test_case);
+    } else {
+        test_fail(test_case, NULL, NULL);
+    }
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should route map stores by id range", __func__);
+    get_store_rows(ctx.shards.dbs[1], "WHERE Id = 3", &store_row);
+    assert_equal_int64(test_case, 3, store_row.id);
+    if (store_row.free_locations) {
+        json_object_put(store_row.free_locations);
+    }
+
+    for (int i = 0; i < 6; i++) {
+        memset(data_path, '\0', BUFSIZ);
+        snprintf(data_path, sizeof(data_path), "%s%c%d.data", base_path, separator(), i);
+        data_fds[i] = create_test_file(data_path, 60, &hashes[i]);
+        store_data(&ctx, data_fds[i], 0, hashes[i]);
+
+        if (hash_exists_in_mapstore(db_for_hash(&ctx.shards, hashes[i]), hashes[i]) != 1) {
+            routed = false;
+        }
+    }
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should route data by hash prefix", __func__);
+    assert_equal_int64(test_case, true, routed);
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should count data across shards", __func__);
+    get_store_info(&ctx, &info);
+    assert_equal_int64(test_case, 6, info.data_count);
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should keep data after restructure", __func__);
+    memset(output_path, '\0', BUFSIZ);
+    snprintf(output_path, sizeof(output_path), "%s%cshards.out", base_path, separator());
+    restructure(&ctx, 256, 512);
+    for (int i = 0; i < 6; i++) {
+        output_fd = open(output_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (retrieve_data(&ctx, output_fd, hashes[i]) != 0 || !files_equal(data_fds[i], output_fd)) {
+            retrieved = false;
+        }
+        close(output_fd);
+    }
+    assert_equal_int64(test_case, true, retrieved && ctx.shards.total == 3);
+    mapstore_ctx_free(&ctx);
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should not change shard count of existing store", __func__);
+    opts.map_size = 256;
+    opts.metadata_shards = 2;
+    if (initialize_mapstore(&ctx, opts) != 0) {
+        test_pass(test_case);
+    } else {
+        test_fail(test_case, NULL, NULL);
+        mapstore_ctx_free(&ctx);
+    }
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should reopen with stored shard count", __func__);
+    opts.metadata_shards = 0;
+    if (initialize_mapstore(&ctx, opts) != 0) {
+        test_fail(test_case, NULL, NULL);
+        return;
+    }
+    assert_equal_int64(test_case, 3, ctx.shards.total);
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should not batch across shards", __func__);
+    assert_equal_int64(test_case, 1, mapstore_begin_batch(&ctx));
+
+    for (int i = 0; i < 6; i++) {
+        delete_data(&ctx, hashes[i]);
+        close(data_fds[i]);
+        free(hashes[i]);
+    }
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should free space across shards", __func__);
+    get_store_info(&ctx, &info);
+    assert_equal_int64(test_case, 512, info.free_space);
+    teardown_test_store(&ctx, base_path);
+}
+
+void test_store_metrics() {
+    char data_path[BUFSIZ];
+    char output_path[BUFSIZ];
+    char *hash = NULL;
+    int data_fd = -1;
+    int output_fd = -1;
+    store_metrics metrics;
+
+    memset(test_case, '\0', BUFSIZ);
+    mapstore_ctx ctx;
+    mapstore_opts opts = {0};
+
+    opts.allocation_size = 512;
+    opts.map_size = 128;
+    opts.path = folder;
+
+    if (initialize_mapstore(&ctx, opts) != 0) {
+        printf("Error initializing mapstore\n");
+        return;
+    }
+
+    memset(data_path, '\0', BUFSIZ);
+    sprintf(data_path, "%s%cmetrics.data", folder, separator());
+    memset(output_path, '\0', BUFSIZ);
+    sprintf(output_path, "%s%cmetrics.out", folder, separator());
+    data_fd = create_test_file(data_path, 200, &hash);
+    output_fd = open(output_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+    store_data(&ctx, data_fd, 0, hash);
+    store_data(&ctx, data_fd, 0, hash);
+    retrieve_data(&ctx, output_fd, hash);
+    delete_data(&ctx, hash);
+
+    sprintf(test_case, "%s: Should return metrics", __func__);
+#ifdef MAPSTORE_DISABLE_METRICS
+    assert_equal_int64(test_case, 1, get_store_metrics(&ctx, &metrics));
+#else
+    assert_equal_int64(test_case, 0, get_store_metrics(&ctx, &metrics));
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should count operations", __func__);
+    assert_equal_int64(test_case, 3,
+                       metrics.ops[MAPSTORE_OP_STORE].count +
+                       metrics.ops[MAPSTORE_OP_RETRIEVE].count +
+                       metrics.ops[MAPSTORE_OP_DELETE].count);
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should count failed stores as errors", __func__);
+    assert_equal_int64(test_case, 1, metrics.ops[MAPSTORE_OP_STORE].errors);
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should count bytes", __func__);
+    assert_equal_int64(test_case, 200, metrics.ops[MAPSTORE_OP_RETRIEVE].bytes);
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should time every phase", __func__);
+    assert_equal_int64(test_case, 1, metrics.phases[MAPSTORE_PHASE_MARK_UPLOADED].count);
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should record latency percentiles", __func__);
+    if (metrics.ops[MAPSTORE_OP_STORE].p50_ns > 0 &&
+        metrics.ops[MAPSTORE_OP_STORE].p50_ns <= metrics.ops[MAPSTORE_OP_STORE].max_ns) {
+        test_pass(test_case);
+    } else {
+        test_fail(test_case, NULL, NULL);
+    }
+#endif
+
+    close(data_fd);
+    close(output_fd);
+    remove(data_path);
+    remove(output_path);
+    free(hash);
+
+    for (int i = 1; i <= ctx.total_mapstores; i++) {
+        memset(data_path, '\0', BUFSIZ);
+        sprintf(data_path, "%s%"PRIu64".map", ctx.mapstore_path, (uint64_t)i);
+        remove(data_path);
+    }
+    remove(ctx.database_path);
+    mapstore_ctx_free(&ctx);
+}
+
+void test_metrics_histogram() {
+    metrics_histogram *histogram = calloc(1, sizeof(metrics_histogram));
+    latency_summary summary;
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should keep small values exact", __func__);
+    assert_equal_int64(test_case, 7, metrics_bucket_value(metrics_bucket_index(7)));
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should keep large values within bucket precision", __func__);
+    uint64_t value = 123456789;
+    uint64_t bucketed = metrics_bucket_value(metrics_bucket_index(value));
+    if (bucketed > value - value / 16 && bucketed < value + value / 16) {
+        test_pass(test_case);
+    } else {
+        test_fail(test_case, NULL, NULL);
+    }
+
+    for (uint64_t v = 1; v <= 1000; v++) {
+        metrics_record(histogram, v * 1000, 0, 0);
+    }
+    metrics_summarize(histogram, &summary);
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should estimate p50", __func__);
+    if (summary.p50_ns > 500000 - 500000 / 16 && summary.p50_ns < 500000 + 500000 / 16) {
+        test_pass(test_case);
+    } else {
+        test_fail(test_case, NULL, NULL);
+    }
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should track max", __func__);
+    assert_equal_int64(test_case, 1000000, summary.max_ns);
+
+    free(histogram);
+}
+
+void test_get_fragmentation_info() {
+    char data_path[BUFSIZ];
+    char *hashes[4] = {NULL, NULL, NULL, NULL};
+    uint64_t sizes[4] = {40, 40, 40, 200};
+    int data_fds[4] = {-1, -1, -1, -1};
+    fragmentation_info info;
+
+    memset(test_case, '\0', BUFSIZ);
+    mapstore_ctx ctx;
+    mapstore_opts opts = {0};
+
+    opts.allocation_size = 512;
+    opts.map_size = 128;
+    opts.path = folder;
+
+    if (initialize_mapstore(&ctx, opts) != 0) {
+        printf("Error initializing mapstore\n");
+        return;
+    }
+
+    for (int i = 0; i < 4; i++) {
+        memset(data_path, '\0', BUFSIZ);
+        sprintf(data_path, "%s%cfragmentation%d.data", folder, separator(), i);
+        data_fds[i] = create_test_file(data_path, sizes[i], &hashes[i]);
+        store_data(&ctx, data_fds[i], 0, hashes[i]);
+    }
+
+    // Leave a hole between the first and third object
+    delete_data(&ctx, hashes[1]);
+
+    sprintf(test_case, "%s: Should return fragmentation info", __func__);
+    assert_equal_int64(test_case, 0, get_fragmentation_info(&ctx, &info));
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should report every map store", __func__);
+    assert_equal_int64(test_case, 4, info.total_stores);
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should match free space", __func__);
+    assert_equal_int64(test_case, 512 - 280, info.total.free_space);
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should count the hole as a free extent", __func__);
+    assert_equal_int64(test_case, 1, info.stores[0].free_extents);
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should count free extents of all stores", __func__);
+    assert_equal_int64(test_case, 3, info.total.free_extents);
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should find the largest free extent", __func__);
+    assert_equal_int64(test_case, 128, info.total.largest_free_extent);
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should bucket extents by size class", __func__);
+    assert_equal_int64(test_case, 1, info.stores[0].extent_histogram[5]);
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should report a fragmented store", __func__);
+    if (info.total.fragmentation_index > 0 && info.stores[3].fragmentation_index == 0) {
+        test_pass(test_case);
+    } else {
+        test_fail(test_case, NULL, NULL);
+    }
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should count stored objects", __func__);
+    assert_equal_int64(test_case, 3, info.objects);
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should count extents of split objects", __func__);
+    if (info.max_object_extents >= 2 && info.average_object_extents > 1) {
+        test_pass(test_case);
+    } else {
+        test_fail(test_case, NULL, NULL);
+    }
+
+    fragmentation_info_free(&info);
+
+    for (int i = 0; i < 4; i++) {
+        close(data_fds[i]);
+        memset(data_path, '\0', BUFSIZ);
+        sprintf(data_path, "%s%cfragmentation%d.data", folder, separator(), i);
+        remove(data_path);
+        free(hashes[i]);
+    }
+
+    for (int i = 1; i <= ctx.total_mapstores; i++) {
+        memset(data_path, '\0', BUFSIZ);
+        sprintf(data_path, "%s%"PRIu64".map", ctx.mapstore_path, (uint64_t)i);
+        remove(data_path);
+    }
+    remove(ctx.database_path);
+    mapstore_ctx_free(&ctx);
+}
+
+typedef struct  {
+  uint64_t begins[MAPSTORE_TRACE_POINTS];
+  uint64_t ends[MAPSTORE_TRACE_POINTS];
+  uint64_t failures;
+  uint64_t write_stores;
+  uint64_t write_bytes;
+} trace_counts;
+
+static void count_trace_begin(void *data, const mapstore_trace_event *event) {
+    ((trace_counts *)data)->begins[event->point]++;
+}
+
+static void count_trace_end(void *data, const mapstore_trace_event *event) {
+    trace_counts *counts = data;
+
+    counts->ends[event->point]++;
+    if (event->status != 0) {
+        counts->failures++;
+    }
+
+    if (event->point == MAPSTORE_TRACE_DATA_WRITE) {
+        counts->write_stores = event->total_store_ids;
+        counts->write_bytes = event->bytes;
+    }
+}
+
+void test_trace_callbacks() {
+    char data_path[BUFSIZ];
+    char output_path[BUFSIZ];
+    char *hash = NULL;
+    int data_fd = -1;
+    int output_fd = -1;
+    bool balanced = true;
+    trace_counts counts;
+    mapstore_trace_callbacks callbacks;
+
+    memset(test_case, '\0', BUFSIZ);
+    memset(&counts, 0, sizeof(trace_counts));
+    mapstore_ctx ctx;
+    mapstore_opts opts = {0};
+
+    opts.allocation_size = 512;
+    opts.map_size = 128;
+    opts.path = folder;
+    opts.sync_writes = true;
+
+    if (initialize_mapstore(&ctx, opts) != 0) {
+        printf("Error initializing mapstore\n");
+        return;
+    }
+
+    callbacks.begin = count_trace_begin;
+    callbacks.end = count_trace_end;
+    callbacks.data = &counts;
+    mapstore_set_trace(&ctx, &callbacks);
+
+    memset(data_path, '\0', BUFSIZ);
+    sprintf(data_path, "%s%ctrace.data", folder, separator());
+    memset(output_path, '\0', BUFSIZ);
+    sprintf(output_path, "%s%ctrace.out", folder, separator());
+    data_fd = create_test_file(data_path, 200, &hash);
+    output_fd = open(output_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+    store_data(&ctx, data_fd, 0, hash);
+    store_data(&ctx, data_fd, 0, hash);
+    retrieve_data(&ctx, output_fd, hash);
+    delete_data(&ctx, hash);
+
+    mapstore_set_trace(&ctx, NULL);
+    retrieve_data(&ctx, output_fd, hash);
+
+    sprintf(test_case, "%s: Should end every event it begins", __func__);
+    for (int point = 0; point < MAPSTORE_TRACE_POINTS; point++) {
+        balanced = balanced && counts.begins[point] == counts.ends[point];
+    }
+    if (balanced) {
+        test_pass(test_case);
+    } else {
+        test_fail(test_case, NULL, NULL);
+    }
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should trace every hash check", __func__);
+    assert_equal_int64(test_case, 2, counts.ends[MAPSTORE_TRACE_HASH_CHECK]);
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should report failed events", __func__);
+    assert_equal_int64(test_case, 1, counts.failures);
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should trace fsync when syncing writes", __func__);
+    assert_equal_int64(test_case, 1, counts.ends[MAPSTORE_TRACE_FSYNC]);
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should trace store, retrieve and delete metadata", __func__);
+    assert_equal_int64(test_case, 3, counts.ends[MAPSTORE_TRACE_METADATA]);
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should carry store ids and bytes", __func__);
+    if (counts.write_stores == 2 && counts.write_bytes == 200) {
+        test_pass(test_case);
+    } else {
+        test_fail(test_case, NULL, NULL);
+    }
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should stop tracing once cleared", __func__);
+    assert_equal_int64(test_case, 1, counts.ends[MAPSTORE_TRACE_DATA_READ]);
+
+    close(data_fd);
+    close(output_fd);
+    remove(data_path);
+    remove(output_path);
+    free(hash);
+
+    for (int i = 1; i <= ctx.total_mapstores; i++) {
+        memset(data_path, '\0', BUFSIZ);
+        sprintf(data_path, "%s%"PRIu64".map", ctx.mapstore_path, (uint64_t)i);
+        remove(data_path);
+    }
+    remove(ctx.database_path);
+    mapstore_ctx_free(&ctx);
+}
+
+void test_capture_replay() {
+    char base_path[BUFSIZ / 2];
+    char capture_path[BUFSIZ];
+    char salt_path[BUFSIZ];
+    char data_path[BUFSIZ];
+    char output_path[BUFSIZ];
+    char *hash = NULL;
+    int data_fd = -1;
+    int output_fd = -1;
+    int capture_fd = -1;
+    uint8_t first_record[48];
+    uint8_t last_record[48];
+    struct stat st;
+    replay_report report;
+
+    memset(test_case, '\0', BUFSIZ);
+    mapstore_ctx ctx;
+    mapstore_ctx replay_ctx;
+    mapstore_opts opts = {0};
+
+    setup_test_store(base_path, sizeof(base_path), "replay");
+
+    opts.allocation_size = 512;
+    opts.map_size = 128;
+    opts.path = folder;
+
+    if (initialize_mapstore(&ctx, opts) != 0) {
+        printf("Error initializing mapstore\n");
+        return;
+    }
+
+    memset(capture_path, '\0', BUFSIZ);
+    sprintf(capture_path, "%s%ctest.capture", folder, separator());
+    remove(capture_path);
+    memset(data_path, '\0', BUFSIZ);
+    sprintf(data_path, "%s%ccapture.data", folder, separator());
+    memset(output_path, '\0', BUFSIZ);
+    sprintf(output_path, "%s%ccapture.out", folder, separator());
+    data_fd = create_test_file(data_path, 150, &hash);
+    output_fd = open(output_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+    sprintf(test_case, "%s: Should start capturing", __func__);
+    assert_equal_int64(test_case, 0, start_capture(&ctx, capture_path, true));
+
+    store_data(&ctx, data_fd, 0, hash);
+    retrieve_data(&ctx, output_fd, hash);
+    delete_data(&ctx, hash);
+    stop_capture(&ctx);
+    retrieve_data(&ctx, output_fd, hash);
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should write a record per operation", __func__);
+    stat(capture_path, &st);
+    assert_equal_int64(test_case, 8 + 32 + 3 * 48, st.st_size);
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should keep the salt private", __func__);
+    memset(salt_path, '\0', BUFSIZ);
+    if (snprintf(salt_path, sizeof(salt_path), "%s.salt", capture_path) < (int)sizeof(salt_path) &&
+        stat(salt_path, &st) == 0 && (st.st_mode & 0777) == 0600) {
+        test_pass(test_case);
+    } else {
+        test_fail(test_case, NULL, NULL);
+    }
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should anonymize hashes the same way when appending", __func__);
+    start_capture(&ctx, capture_path, true);
+    store_data(&ctx, data_fd, 0, hash);
+    delete_data(&ctx, hash);
+    stop_capture(&ctx);
+    capture_fd = open(capture_path, O_RDONLY);
+    pread(capture_fd, first_record, 48, 8 + 32);
+    pread(capture_fd, last_record, 48, 8 + 32 + 3 * 48);
+    close(capture_fd);
+    if (memcmp(first_record + 28, last_record + 28, 20) == 0) {
+        test_pass(test_case);
+    } else {
+        test_fail(test_case, NULL, NULL);
+    }
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should refuse to append with different anonymization", __func__);
+    if (start_capture(&ctx, capture_path, false) != 0) {
+        test_pass(test_case);
+    } else {
+        test_fail(test_case, NULL, NULL);
+        stop_capture(&ctx);
+    }
+
+    opts.path = base_path;
+    if (initialize_mapstore(&replay_ctx, opts) != 0) {
+        printf("Error initializing mapstore\n");
+        return;
+    }
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should replay the capture", __func__);
+    assert_equal_int64(test_case, 0, replay_capture(&replay_ctx, capture_path, 0, &report));
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should replay every operation", __func__);
+    assert_equal_int64(test_case, 5, report.operations);
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should replay without errors", __func__);
+    assert_equal_int64(test_case, 0, report.errors);
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should report latency per operation", __func__);
+    assert_equal_int64(test_case, 150, report.ops[MAPSTORE_OP_RETRIEVE].bytes);
+
+    close(data_fd);
+    close(output_fd);
+    remove(data_path);
+    remove(output_path);
+    remove(capture_path);
+    remove(salt_path);
+    free(hash);
+
+    teardown_test_store(&replay_ctx, base_path);
+    teardown_test_store(&ctx, base_path);
+}
+
+void test_metadata_only() {
+    char base_path[BUFSIZ / 2];
+    char path[BUFSIZ];
+    char *hash = "0123456789abcdef0123456789abcdef01234567";
+    struct stat st;
+    store_info info;
+
+    memset(test_case, '\0', BUFSIZ);
+    mapstore_ctx ctx;
+    mapstore_opts opts = {0};
+
+    setup_test_store(base_path, sizeof(base_path), "metadata_only");
+
+    opts.allocation_size = 512;
+    opts.map_size = 128;
+    opts.path = base_path;
+    opts.metadata_only = true;
+
+    if (initialize_mapstore(&ctx, opts) != 0) {
+        printf("Error initializing mapstore\n");
+        return;
+    }
+
+    memset(path, '\0', BUFSIZ);
+    sprintf(path, "%s1.map", ctx.mapstore_path);
+    sprintf(test_case, "%s: Should not create map files", __func__);
+    assert_equal_int64(test_case, -1, stat(path, &st));
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should store without data", __func__);
+    assert_equal_int64(test_case, 0, store_data(&ctx, -1, 300, hash));
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should reserve space", __func__);
+    get_store_info(&ctx, &info);
+    assert_equal_int64(test_case, 512 - 300, info.free_space);
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should retrieve without data", __func__);
+    assert_equal_int64(test_case, 0, retrieve_data(&ctx, -1, hash));
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should delete", __func__);
+    assert_equal_int64(test_case, 0, delete_data(&ctx, hash));
+
+    teardown_test_store(&ctx, base_path);
+}
+
+void test_serve() {
+    char base_path[BUFSIZ / 2];
+    char socket_path[BUFSIZ];
+    char data_path[BUFSIZ];
+    char output_path[BUFSIZ];
+    char *hash = NULL;
+    char *missing = "0123456789abcdef0123456789abcdef01234567";
+    int data_fd = -1;
+    int output_fd = -1;
+    int fd = -1;
+    int child_status = 0;
+    int answered = 0;
+    pid_t pid;
+    struct stat st;
+    server_frame frame;
+    store_info info;
+
+    memset(test_case, '\0', BUFSIZ);
+    mapstore_ctx ctx;
+    mapstore_opts opts = {0};
+
+    setup_test_store(base_path, sizeof(base_path), "serve");
+
+    opts.allocation_size = 1000;
+    opts.map_size = 250;
+    opts.path = base_path;
+
+    memset(socket_path, '\0', BUFSIZ);
+    snprintf(socket_path, sizeof(socket_path), "%s%cserve.sock", base_path, separator());
+    memset(data_path, '\0', BUFSIZ);
+    sprintf(data_path, "%s%cserve.data", folder, separator());
+    memset(output_path, '\0', BUFSIZ);
+    sprintf(output_path, "%s%cserve.out", folder, separator());
+    data_fd = create_test_file(data_path, 300, &hash);
+
+    fflush(stdout);
+    if ((pid = fork()) == 0) {
+        if (initialize_mapstore(&ctx, opts) != 0) {
+            exit(1);
+        }
+        child_status = serve_mapstore(&ctx, socket_path);
+        mapstore_ctx_free(&ctx);
+        exit(child_status);
+    }
+
+    /* Wait for the server to start listening */
+    for (int i = 0; i < 100 && fd < 0; i++) {
+        if (stat(socket_path, &st) != 0 || client_connect(socket_path, &fd) != 0) {
+            usleep(50000);
+        }
+    }
+
+    sprintf(test_case, "%s: Should accept connections", __func__);
+    if (fd >= 0) {
+        test_pass(test_case);
+    } else {
+        test_fail(test_case, NULL, NULL);
+        kill(pid, SIGKILL);
+        waitpid(pid, &child_status, 0);
+        return;
+    }
+
+    /* Both requests are sent before reading either response */
+    client_send(fd, 1, SERVER_OP_STORE, hash, data_fd, 300);
+    client_send(fd, 2, SERVER_OP_DATA_INFO, missing, -1, 0);
+    for (int i = 0; i < 2 && client_receive(fd, &frame, -1) == 0; i++) {
+        if ((frame.id == 1 && frame.op == 0) || (frame.id == 2 && frame.op != 0)) {
+            answered++;
+        }
+    }
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should answer pipelined requests", __func__);
+    assert_equal_int64(test_case, 2, answered);
+
+    output_fd = open(output_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    client_send(fd, 3, SERVER_OP_RETRIEVE, hash, -1, 0);
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should retrieve stored data", __func__);
+    if (client_receive(fd, &frame, output_fd) == 0 && frame.id == 3 && frame.op == 0 &&
+        files_equal(data_fd, output_fd)) {
+        test_pass(test_case);
+    } else {
+        test_fail(test_case, NULL, NULL);
+    }
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should only let the owner connect", __func__);
+    if (stat(socket_path, &st) == 0 && (st.st_mode & 0777) == 0600) {
+        test_pass(test_case);
+    } else {
+        test_fail(test_case, NULL, NULL);
+    }
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should close connections sending invalid hashes", __func__);
+    client_send(fd, 4, SERVER_OP_DELETE, "' OR '1'='1' OR hash='0123456789abcdef01", -1, 0);
+    if (client_receive(fd, &frame, -1) != 0) {
+        test_pass(test_case);
+    } else {
+        test_fail(test_case, NULL, NULL);
+    }
+
+    close(fd);
+    kill(pid, SIGTERM);
+    waitpid(pid, &child_status, 0);
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should shut down cleanly", __func__);
+    if (WIFEXITED(child_status) && WEXITSTATUS(child_status) == 0 && stat(socket_path, &st) != 0) {
+        test_pass(test_case);
+    } else {
+        test_fail(test_case, NULL, NULL);
+    }
+
+    if (initialize_mapstore(&ctx, opts) != 0) {
+        printf("Error initializing mapstore\n");
+        return;
+    }
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should keep data stored through the server", __func__);
+    get_store_info(&ctx, &info);
+    assert_equal_int64(test_case, 1, info.data_count);
+
+    close(data_fd);
+    close(output_fd);
+    remove(data_path);
+    remove(output_path);
+    free(hash);
+
+    teardown_test_store(&ctx, base_path);
+}
+
+void test_batch() {
+    char base_path[BUFSIZ / 2];
+    char data_path[BUFSIZ];
+    char large_path[BUFSIZ];
+    char *hash = NULL;
+    char *large_hashes[2];
+    int data_fd = -1;
+    int large_fds[2];
+    data_info info;
+
+    memset(test_case, '\0', BUFSIZ);
+    mapstore_ctx ctx;
+    mapstore_opts opts = {0};
+
+    setup_test_store(base_path, sizeof(base_path), "batch");
+
+    opts.allocation_size = 1000;
+    opts.map_size = 250;
+    opts.path = base_path;
+
+    memset(data_path, '\0', BUFSIZ);
+    sprintf(data_path, "%s%cbatch.data", folder, separator());
+    data_fd = create_test_file(data_path, 300, &hash);
+
+    if (initialize_mapstore(&ctx, opts) != 0) {
+        printf("Error initializing mapstore\n");
+        return;
+    }
+
+    sprintf(test_case, "%s: Should begin a batch", __func__);
+    assert_equal_int64(test_case, 0, mapstore_begin_batch(&ctx));
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should not nest batches", __func__);
+    assert_equal_int64(test_case, 1, mapstore_begin_batch(&ctx));
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should store inside a batch", __func__);
+    assert_equal_int64(test_case, 0, store_data(&ctx, data_fd, 0, hash));
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should reject a duplicate inside a batch", __func__);
+    assert_equal_int64(test_case, 1, store_data(&ctx, data_fd, 0, hash));
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should hide data until the batch ends", __func__);
+    assert_equal_int64(test_case, 1, get_data_info(&ctx, hash, &info));
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should end the batch", __func__);
+    assert_equal_int64(test_case, 0, mapstore_end_batch(&ctx));
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should show data once the batch ends", __func__);
+    if (get_data_info(&ctx, hash, &info) == 0 && info.size == 300) {
+        free(info.hash);
+        test_pass(test_case);
+    } else {
+        test_fail(test_case, NULL, NULL);
+    }
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should not end a batch twice", __func__);
+    assert_equal_int64(test_case, 1, mapstore_end_batch(&ctx));
+
+    delete_data(&ctx, hash);
+    for (int i = 0; i < 2; i++) {
+        memset(large_path, '\0', BUFSIZ);
+        snprintf(large_path, sizeof(large_path), "%s%cbatch%d.data", folder, separator(), i);
+        large_fds[i] = create_test_file(large_path, 600, &large_hashes[i]);
+        remove(large_path);
+    }
+    store_data(&ctx, large_fds[0], 0, large_hashes[0]);
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should not reuse space freed in the batch", __func__);
+    mapstore_begin_batch(&ctx);
+    delete_data(&ctx, large_hashes[0]);
+    assert_equal_int64(test_case, 1, store_data(&ctx, large_fds[1], 0, large_hashes[1]));
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should reuse freed space once the batch ends", __func__);
+    mapstore_end_batch(&ctx);
+    assert_equal_int64(test_case, 0, store_data(&ctx, large_fds[1], 0, large_hashes[1]));
+
+    delete_data(&ctx, large_hashes[1]);
+    for (int i = 0; i < 2; i++) {
+        close(large_fds[i]);
+        free(large_hashes[i]);
+    }
+
+    close(data_fd);
+    remove(data_path);
+    free(hash);
+
+    teardown_test_store(&ctx, base_path);
+}
+
+void test_store_data_hashed() {
+    char base_path[BUFSIZ / 2];
+    char data_path[BUFSIZ];
+    char *expected = NULL;
+    char *hash = NULL;
+    char *wrong = "0123456789abcdef0123456789abcdef01234567";
+    int data_fd = -1;
+    store_info info;
+
+    memset(test_case, '\0', BUFSIZ);
+    mapstore_ctx ctx;
+    mapstore_opts opts = {0};
+
+    setup_test_store(base_path, sizeof(base_path), "hashed");
+
+    opts.allocation_size = 1000;
+    opts.map_size = 250;
+    opts.path = base_path;
+
+    memset(data_path, '\0', BUFSIZ);
+    sprintf(data_path, "%s%chashed.data", folder, separator());
+    data_fd = create_test_file(data_path, 300, &expected);
+
+    if (initialize_mapstore(&ctx, opts) != 0) {
+        printf("Error initializing mapstore\n");
+        return;
+    }
+
+    sprintf(test_case, "%s: Should roll back data that does not match", __func__);
+    store_data_hashed(&ctx, data_fd, 0, wrong, &hash);
+    get_store_info(&ctx, &info);
+    assert_equal_int64(test_case, 1000, info.free_space);
+    free(hash);
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should store and return the content hash", __func__);
+    if (store_data_hashed(&ctx, data_fd, 0, NULL, &hash) == 0 && hash) {
+        assert_equal_str(test_case, expected, hash);
+    } else {
+        test_fail(test_case, NULL, NULL);
+    }
+    free(hash);
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should reject data that is already stored", __func__);
+    assert_equal_int64(test_case, 1, store_data_hashed(&ctx, data_fd, 0, NULL, &hash));
+    free(hash);
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should keep space for one copy", __func__);
+    get_store_info(&ctx, &info);
+    assert_equal_int64(test_case, 700, info.free_space);
+
+    close(data_fd);
+    remove(data_path);
+    free(expected);
+
+    teardown_test_store(&ctx, base_path);
+}
+
+void test_retrieve_data_multi() {
+    char base_path[BUFSIZ / 2];
+    char path[BUFSIZ];
+    char *hashes[4] = {NULL, NULL, NULL, "0123456789abcdef0123456789abcdef01234567"};
+    int data_fds[3];
+    int outputs[4];
+    int statuses[4];
+    int pipe_fds[2];
+    char received[100];
+    char expected_data[100];
+    uint64_t sizes[3] = {300, 200, 100};
+
+    memset(test_case, '\0', BUFSIZ);
+    mapstore_ctx ctx;
+    mapstore_opts opts = {0};
+
+    setup_test_store(base_path, sizeof(base_path), "multi");
+
+    opts.allocation_size = 1000;
+    opts.map_size = 250;
+    opts.path = base_path;
+
+    if (initialize_mapstore(&ctx, opts) != 0) {
+        printf("Error initializing mapstore\n");
+        return;
+    }
+
+    for (int i = 0; i < 3; i++) {
+        memset(path, '\0', BUFSIZ);
+        sprintf(path, "%s%cmulti_%d.data", folder, separator(), i);
+        data_fds[i] = create_test_file(path, sizes[i], &hashes[i]);
+        store_data(&ctx, data_fds[i], 0, hashes[i]);
+
+        memset(path, '\0', BUFSIZ);
+        sprintf(path, "%s%cmulti_%d.out", folder, separator(), i);
+        outputs[i] = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    }
+
+    /* The last object goes through a pipe so it must arrive in order */
+    pipe(pipe_fds);
+    close(outputs[2]);
+    outputs[2] = pipe_fds[WRITE_END];
+    outputs[3] = -1;
+
+    sprintf(test_case, "%s: Should fail when any object is missing", __func__);
+    assert_equal_int64(test_case, 1, retrieve_data_multi(&ctx, hashes, outputs, 4, statuses));
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should report each object", __func__);
+    if (statuses[0] == 0 && statuses[1] == 0 && statuses[2] == 0 && statuses[3] == 1) {
+        test_pass(test_case);
+    } else {
+        test_fail(test_case, NULL, NULL);
+    }
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should write objects at their offsets", __func__);
+    if (files_equal(data_fds[0], outputs[0]) && files_equal(data_fds[1], outputs[1])) {
+        test_pass(test_case);
+    } else {
+        test_fail(test_case, NULL, NULL);
+    }
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should stream objects in order", __func__);
+    close(pipe_fds[WRITE_END]);
+    pread(data_fds[2], expected_data, 100, 0);
+    if (read(pipe_fds[READ_END], received, 100) == 100 && memcmp(received, expected_data, 100) == 0) {
+        test_pass(test_case);
+    } else {
+        test_fail(test_case, NULL, NULL);
+    }
+    close(pipe_fds[READ_END]);
+
+    for (int i = 0; i < 3; i++) {
+        close(data_fds[i]);
+        memset(path, '\0', BUFSIZ);
+        sprintf(path, "%s%cmulti_%d.data", folder, separator(), i);
+        remove(path);
+        if (i < 2) {
+            close(outputs[i]);
+        }
+        memset(path, '\0', BUFSIZ);
+        sprintf(path, "%s%cmulti_%d.out", folder, separator(), i);
+        remove(path);
+        free(hashes[i]);
+    }
+
+    teardown_test_store(&ctx, base_path);
+}
+
+void test_prefetch_evict() {
+    char base_path[BUFSIZ / 2];
+    char path[BUFSIZ];
+    char *hashes[3] = {NULL, NULL, "0123456789abcdef0123456789abcdef01234567"};
+    int data_fds[2];
+    int output_fd = -1;
+    uint64_t sizes[2] = {300, 200};
+
+    memset(test_case, '\0', BUFSIZ);
+    mapstore_ctx ctx;
+    mapstore_opts opts = {0};
+
+    setup_test_store(base_path, sizeof(base_path), "prefetch");
+
+    opts.allocation_size = 1000;
+    opts.map_size = 250;
+    opts.path = base_path;
+
+    if (initialize_mapstore(&ctx, opts) != 0) {
+        printf("Error initializing mapstore\n");
+        return;
+    }
+
+    for (int i = 0; i < 2; i++) {
+        memset(path, '\0', BUFSIZ);
+        sprintf(path, "%s%cprefetch_%d.data", folder, separator(), i);
+        data_fds[i] = create_test_file(path, sizes[i], &hashes[i]);
+        store_data(&ctx, data_fds[i], 0, hashes[i]);
+    }
+
+    sprintf(test_case, "%s: Should prefetch stored objects", __func__);
+    assert_equal_int64(test_case, 0, mapstore_prefetch(&ctx, hashes, 2));
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should fail when any object is missing", __func__);
+    assert_equal_int64(test_case, 1, mapstore_prefetch(&ctx, hashes, 3));
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should evict stored objects", __func__);
+    assert_equal_int64(test_case, 0, mapstore_evict(&ctx, hashes, 2));
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should still retrieve evicted objects", __func__);
+    memset(path, '\0', BUFSIZ);
+    sprintf(path, "%s%cprefetch.out", folder, separator());
+    output_fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (retrieve_data(&ctx, output_fd, hashes[0]) == 0 && files_equal(data_fds[0], output_fd)) {
+        test_pass(test_case);
+    } else {
+        test_fail(test_case, NULL, NULL);
+    }
+    close(output_fd);
+    remove(path);
+
+    for (int i = 0; i < 2; i++) {
+        close(data_fds[i]);
+        memset(path, '\0', BUFSIZ);
+        sprintf(path, "%s%cprefetch_%d.data", folder, separator(), i);
+        remove(path);
+        free(hashes[i]);
+    }
+
+    teardown_test_store(&ctx, base_path);
+}
+
+void test_direct_io() {
+    char base_path[BUFSIZ / 2];
+    char path[BUFSIZ];
+    char *hashes[3] = {NULL, NULL, NULL};
+    int data_fds[3];
+    int output_fd = -1;
+    uint64_t sizes[3] = {100, 20000, 1000};
+    json_object *positions[3] = {NULL, NULL, NULL};
+    json_object *extents = NULL;
+    json_object *extent = NULL;
+
+    memset(test_case, '\0', BUFSIZ);
+    mapstore_ctx ctx;
+    mapstore_opts opts = {0};
+
+    setup_test_store(base_path, sizeof(base_path), "direct");
+
+    opts.allocation_size = 65536;
+    opts.map_size = 65536;
+    opts.path = base_path;
+    opts.direct_io_threshold = 8192;
+
+    if (initialize_mapstore(&ctx, opts) != 0) {
+        printf("Error initializing mapstore\n");
+        return;
+    }
+
+    for (int i = 0; i < 3; i++) {
+        memset(path, '\0', BUFSIZ);
+        sprintf(path, "%s%cdirect_%d.data", folder, separator(), i);
+        data_fds[i] = create_test_file(path, sizes[i], &hashes[i]);
+        store_data(&ctx, data_fds[i], 0, hashes[i]);
+        get_pos_from_data_locations(db_for_hash(&ctx.shards, hashes[i]), hashes[i], &positions[i]);
+    }
+
+    sprintf(test_case, "%s: Should start large objects on an aligned offset", __func__);
+    json_object_object_get_ex(positions[1], "1", &extents);
+    extent = json_object_array_get_idx(extents, 0);
+    assert_equal_int64(test_case, DIRECT_IO_ALIGN, json_object_get_int64(json_object_array_get_idx(extent, 1)));
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should keep the skipped bytes free", __func__);
+    json_object_object_get_ex(positions[2], "1", &extents);
+    extent = json_object_array_get_idx(extents, 0);
+    assert_equal_int64(test_case, sizes[0], json_object_get_int64(json_object_array_get_idx(extent, 1)));
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should retrieve data stored directly", __func__);
+    memset(path, '\0', BUFSIZ);
+    sprintf(path, "%s%cdirect.out", folder, separator());
+    output_fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (retrieve_data(&ctx, output_fd, hashes[1]) == 0 && files_equal(data_fds[1], output_fd)) {
+        test_pass(test_case);
+    } else {
+        test_fail(test_case, NULL, NULL);
+    }
+    close(output_fd);
+    remove(path);
+
+    for (int i = 0; i < 3; i++) {
+        close(data_fds[i]);
+        memset(path, '\0', BUFSIZ);
+        sprintf(path, "%s%cdirect_%d.data", folder, separator(), i);
+        remove(path);
+        free(hashes[i]);
+        if (positions[i]) {
+            json_object_put(positions[i]);
+        }
+    }
+
+    teardown_test_store(&ctx, base_path);
+}
+
+void test_lazy_create() {
+    char base_path[BUFSIZ / 2];
+    char data_path[BUFSIZ];
+    char path[BUFSIZ];
+    char *hash = NULL;
+    int data_fd = -1;
+    int output_fd = -1;
+    bool created = true;
+    struct stat st;
+    store_info info;
+#ifndef MAPSTORE_DISABLE_METRICS
+    store_metrics metrics;
+#endif
+
+    memset(test_case, '\0', BUFSIZ);
+    mapstore_ctx ctx;
+    mapstore_opts opts = {0};
+
+    setup_test_store(base_path, sizeof(base_path), "lazy");
+
+    opts.allocation_size = 4 * 65536;
+    opts.map_size = 65536;
+    opts.path = base_path;
+    opts.prealloc = true;
+    opts.lazy_create = true;
+
+    if (initialize_mapstore(&ctx, opts) != 0) {
+        printf("Error initializing mapstore\n");
+        return;
+    }
+
+    sprintf(test_case, "%s: Should not create map files at startup", __func__);
+    memset(path, '\0', BUFSIZ);
+    sprintf(path, "%s1.map", ctx.mapstore_path);
+    get_store_info(&ctx, &info);
+    if (!path_exists(path) && info.pending_map_stores == 4) {
+        test_pass(test_case);
+    } else {
+        test_fail(test_case, NULL, NULL);
+    }
+
+#ifndef MAPSTORE_DISABLE_METRICS
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should time startup before map files are ready", __func__);
+    get_store_metrics(&ctx, &metrics);
+    if (metrics.startup_ns > 0 && metrics.map_files_ns == 0) {
+        test_pass(test_case);
+    } else {
+        test_fail(test_case, NULL, NULL);
+    }
+#endif
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should create a map file on first allocation", __func__);
+    memset(data_path, '\0', BUFSIZ);
+    sprintf(data_path, "%s%clazy.data", folder, separator());
+    data_fd = create_test_file(data_path, 1000, &hash);
+    store_data(&ctx, data_fd, 0, hash);
+    get_store_info(&ctx, &info);
+    if (path_exists(path) && info.pending_map_stores == 3) {
+        test_pass(test_case);
+    } else {
+        test_fail(test_case, NULL, NULL);
+    }
+    mapstore_ctx_free(&ctx);
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should finish map files when reopened without lazy_create", __func__);
+    opts.lazy_create = false;
+    if (initialize_mapstore(&ctx, opts) != 0) {
+        printf("Error initializing mapstore\n");
+        return;
+    }
+    for (int i = 1; i <= ctx.total_mapstores; i++) {
+        memset(path, '\0', BUFSIZ);
+        sprintf(path, "%s%d.map", ctx.mapstore_path, i);
+        created = created && stat(path, &st) == 0 && st.st_size == 65536;
+    }
+    if (created) {
+        test_pass(test_case);
+    } else {
+        test_fail(test_case, NULL, NULL);
+    }
+    mapstore_ctx_free(&ctx);
+
+    for (int i = 2; i <= 4; i++) {
+        memset(path, '\0', BUFSIZ);
+        sprintf(path, "%s%clazy%cshards%c%d.map", folder, separator(), separator(), separator(), i);
+        remove(path);
+    }
+
+    opts.lazy_create = true;
+    opts.create_threads = 2;
+    if (initialize_mapstore(&ctx, opts) != 0) {
+        printf("Error initializing mapstore\n");
+        return;
+    }
+
+    for (int i = 0; i < 1000 && pending_map_stores(&ctx) > 0; i++) {
+        usleep(1000);
+    }
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should create the rest in the background", __func__);
+    for (int i = 1; i <= ctx.total_mapstores; i++) {
+        memset(path, '\0', BUFSIZ);
+        sprintf(path, "%s%d.map", ctx.mapstore_path, i);
+        created = created && path_exists(path);
+    }
+    get_store_info(&ctx, &info);
+    if (created && info.pending_map_stores == 0) {
+        test_pass(test_case);
+    } else {
+        test_fail(test_case, NULL, NULL);
+    }
+
+#ifndef MAPSTORE_DISABLE_METRICS
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should time map file creation", __func__);
+    get_store_metrics(&ctx, &metrics);
+    assert_equal_int64(test_case, true, metrics.map_files_ns > 0);
+#endif
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should keep data in files created earlier", __func__);
+    memset(path, '\0', BUFSIZ);
+    sprintf(path, "%s%clazy.out", folder, separator());
+    output_fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (retrieve_data(&ctx, output_fd, hash) == 0 && files_equal(data_fd, output_fd)) {
+        test_pass(test_case);
+    } else {
+        test_fail(test_case, NULL, NULL);
+    }
+    close(output_fd);
+    remove(path);
+
+    close(data_fd);
+    remove(data_path);
+    free(hash);
+
+    teardown_test_store(&ctx, base_path);
+}
+
+void test_inline_data() {
+    char base_path[BUFSIZ / 2];
+    char path[BUFSIZ];
+    char *hashes[2] = {NULL, NULL};
+    char *hash = NULL;
+    int data_fds[2];
+    int outputs[2];
+    uint8_t *data = NULL;
+    uint64_t size = 0;
+    json_object *positions = NULL;
+    store_info info;
+    fragmentation_info frag;
+
+    memset(test_case, '\0', BUFSIZ);
+    mapstore_ctx ctx;
+    mapstore_opts opts = {0};
+
+    setup_test_store(base_path, sizeof(base_path), "inline");
+
+    opts.allocation_size = 1000;
+    opts.map_size = 250;
+    opts.path = base_path;
+    opts.inline_threshold = 100;
+
+    if (initialize_mapstore(&ctx, opts) != 0) {
+        printf("Error initializing mapstore\n");
+        return;
+    }
+
+    for (int i = 0; i < 2; i++) {
+        memset(path, '\0', BUFSIZ);
+        sprintf(path, "%s%cinline_%d.data", folder, separator(), i);
+        data_fds[i] = create_test_file(path, 100 + i, &hashes[i]);
+        store_data(&ctx, data_fds[i], 0, hashes[i]);
+    }
+
+    sprintf(test_case, "%s: Should keep tiny objects out of the map stores", __func__);
+    get_store_info(&ctx, &info);
+    get_pos_from_data_locations(db_for_hash(&ctx.shards, hashes[0]), hashes[0], &positions);
+    if (info.free_space == 899 && positions && positions_extents(positions) == 0) {
+        test_pass(test_case);
+    } else {
+        test_fail(test_case, NULL, NULL);
+    }
+    json_object_put(positions);
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should only count mapped objects in the extent stats", __func__);
+    if (get_fragmentation_info(&ctx, &frag) == 0 && frag.objects == 1 && frag.average_object_extents == 1) {
+        test_pass(test_case);
+    } else {
+        test_fail(test_case, NULL, NULL);
+    }
+    fragmentation_info_free(&frag);
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should retrieve inline and mapped data", __func__);
+    for (int i = 0; i < 2; i++) {
+        memset(path, '\0', BUFSIZ);
+        sprintf(path, "%s%cinline_%d.out", folder, separator(), i);
+        outputs[i] = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    }
+    if (retrieve_data(&ctx, outputs[0], hashes[0]) == 0 && files_equal(data_fds[0], outputs[0]) &&
+        retrieve_data_multi(&ctx, hashes, outputs, 2, NULL) == 0 &&
+        files_equal(data_fds[0], outputs[0]) && files_equal(data_fds[1], outputs[1])) {
+        test_pass(test_case);
+    } else {
+        test_fail(test_case, NULL, NULL);
+    }
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should delete data stored inline", __func__);
+    delete_data(&ctx, hashes[0]);
+    get_inline_data(db_for_hash(&ctx.shards, hashes[0]), hashes[0], &data, &size);
+    if (!data && retrieve_data(&ctx, outputs[0], hashes[0]) == 1) {
+        test_pass(test_case);
+    } else {
+        test_fail(test_case, NULL, NULL);
+    }
+    free(data);
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should hash data stored inline", __func__);
+    ftruncate(outputs[0], 0);
+    if (store_data_hashed(&ctx, data_fds[0], 0, NULL, &hash) == 0 && hash &&
+        strcmp(hash, hashes[0]) == 0 && retrieve_data(&ctx, outputs[0], hash) == 0 &&
+        files_equal(data_fds[0], outputs[0])) {
+        test_pass(test_case);
+    } else {
+        test_fail(test_case, NULL, NULL);
+    }
+    free(hash);
+
+    for (int i = 0; i < 2; i++) {
+        close(outputs[i]);
+        close(data_fds[i]);
+        memset(path, '\0', BUFSIZ);
+        sprintf(path, "%s%cinline_%d.out", folder, separator(), i);
+        remove(path);
+        memset(path, '\0', BUFSIZ);
+        sprintf(path, "%s%cinline_%d.data", folder, separator(), i);
+        remove(path);
+        free(hashes[i]);
+    }
+
+    teardown_test_store(&ctx, base_path);
+}
+
+void test_log_engine() {
+    char base_path[BUFSIZ / 2];
+    char path[BUFSIZ];
+    char *hashes[5] = {NULL, NULL, NULL, NULL, NULL};
+    int data_fds[5];
+    int output_fd = -1;
+    uint64_t sizes[5] = {200, 100, 200, 50, 300};
+    json_object *positions = NULL;
+    json_object *store_positions = NULL;
+    gc_report report;
+    store_info info;
+
+    memset(test_case, '\0', BUFSIZ);
+    mapstore_ctx ctx;
+    mapstore_opts opts = {0};
+
+    setup_test_store(base_path, sizeof(base_path), "log");
+
+    opts.allocation_size = 750;
+    opts.map_size = 250;
+    opts.path = base_path;
+    opts.engine = MAPSTORE_ENGINE_LOG;
+
+    if (initialize_mapstore(&ctx, opts) != 0) {
+        printf("Error initializing mapstore\n");
+        return;
+    }
+
+    for (int i = 0; i < 5; i++) {
+        memset(path, '\0', BUFSIZ);
+        sprintf(path, "%s%clog_%d.data", folder, separator(), i);
+        data_fds[i] = create_test_file(path, sizes[i], &hashes[i]);
+    }
+
+    memset(path, '\0', BUFSIZ);
+    sprintf(path, "%s%clog.out", folder, separator());
+    output_fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+    for (int i = 0; i < 3; i++) {
+        store_data(&ctx, data_fds[i], 0, hashes[i]);
+    }
+    delete_data(&ctx, hashes[0]);
+
+    sprintf(test_case, "%s: Should append instead of reusing deleted space", __func__);
+    store_data(&ctx, data_fds[3], 0, hashes[3]);
+    get_pos_from_data_locations(db_for_hash(&ctx.shards, hashes[3]), hashes[3], &positions);
+    if (positions && json_object_object_get_ex(positions, "3", &store_positions) &&
+        json_object_object_length(positions) == 1) {
+        test_pass(test_case);
+    } else {
+        test_fail(test_case, NULL, NULL);
+    }
+    json_object_put(positions);
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should collect segments when the log is full", __func__);
+    if (store_data(&ctx, data_fds[4], 0, hashes[4]) == 0 &&
+        retrieve_data(&ctx, output_fd, hashes[1]) == 0 && files_equal(data_fds[1], output_fd)) {
+        test_pass(test_case);
+    } else {
+        test_fail(test_case, NULL, NULL);
+    }
+
+    delete_data(&ctx, hashes[2]);
+    delete_data(&ctx, hashes[3]);
+    delete_data(&ctx, hashes[1]);
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should move live data out of sparse segments", __func__);
+    if (mapstore_gc(&ctx, &report) == 0 && report.segments == 1 && report.objects == 1 && report.bytes == 300) {
+        test_pass(test_case);
+    } else {
+        test_fail(test_case, NULL, NULL);
+    }
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should keep moved data", __func__);
+    ftruncate(output_fd, 0);
+    get_store_info(&ctx, &info);
+    if (info.free_space == 450 && retrieve_data(&ctx, output_fd, hashes[4]) == 0 &&
+        files_equal(data_fds[4], output_fd)) {
+        test_pass(test_case);
+    } else {
+        test_fail(test_case, NULL, NULL);
+    }
+
+    close(output_fd);
+    remove(path);
+
+    for (int i = 0; i < 5; i++) {
+        close(data_fds[i]);
+        memset(path, '\0', BUFSIZ);
+        sprintf(path, "%s%clog_%d.data", folder, separator(), i);
+        remove(path);
+        free(hashes[i]);
+    }
+
+    teardown_test_store(&ctx, base_path);
+}
+
+void test_slab_classes() {
+    char base_path[BUFSIZ / 2];
+    char path[BUFSIZ];
+    char *hashes[4] = {NULL, NULL, NULL, NULL};
+    int data_fds[4];
+    int output_fd = -1;
+    uint64_t sizes[4] = {100, 100, 50, 100};
+    uint64_t classes[1] = {100};
+    json_object *positions[2] = {NULL, NULL};
+    json_object *store_positions = NULL;
+    store_info info;
+
+    memset(test_case, '\0', BUFSIZ);
+    mapstore_ctx ctx;
+    mapstore_opts opts = {0};
+
+    setup_test_store(base_path, sizeof(base_path), "slabs");
+
+    opts.allocation_size = 1000;
+    opts.map_size = 500;
+    opts.path = base_path;
+    opts.slab_classes = classes;
+    opts.total_slab_classes = 1;
+
+    if (initialize_mapstore(&ctx, opts) != 0) {
+        printf("Error initializing mapstore\n");
+        return;
+    }
+
+    for (int i = 0; i < 4; i++) {
+        memset(path, '\0', BUFSIZ);
+        sprintf(path, "%s%cslabs_%d.data", folder, separator(), i);
+        data_fds[i] = create_test_file(path, sizes[i], &hashes[i]);
+    }
+
+    for (int i = 0; i < 3; i++) {
+        store_data(&ctx, data_fds[i], 0, hashes[i]);
+    }
+
+    sprintf(test_case, "%s: Should dedicate a region to the class", __func__);
+    get_store_info(&ctx, &info);
+    get_pos_from_data_locations(db_for_hash(&ctx.shards, hashes[1]), hashes[1], &positions[0]);
+    get_pos_from_data_locations(db_for_hash(&ctx.shards, hashes[2]), hashes[2], &positions[1]);
+    if (info.free_space == 450 && positions[0] && positions[1] &&
+        json_object_object_get_ex(positions[0], "1", &store_positions) &&
+        json_object_get_int64(json_object_array_get_idx(json_object_array_get_idx(store_positions, 0), 1)) == 100 &&
+        json_object_object_get_ex(positions[1], "2", &store_positions)) {
+        test_pass(test_case);
+    } else {
+        test_fail(test_case, NULL, NULL);
+    }
+    json_object_put(positions[0]);
+    json_object_put(positions[1]);
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should reuse freed slots", __func__);
+    delete_data(&ctx, hashes[0]);
+    store_data(&ctx, data_fds[3], 0, hashes[3]);
+    get_pos_from_data_locations(db_for_hash(&ctx.shards, hashes[3]), hashes[3], &positions[0]);
+    if (positions[0] && json_object_object_get_ex(positions[0], "1", &store_positions) &&
+        json_object_get_int64(json_object_array_get_idx(json_object_array_get_idx(store_positions, 0), 1)) == 0) {
+        test_pass(test_case);
+    } else {
+        test_fail(test_case, NULL, NULL);
+    }
+    json_object_put(positions[0]);
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should retrieve data from slots", __func__);
+    memset(path, '\0', BUFSIZ);
+    sprintf(path, "%s%cslabs.out", folder, separator());
+    output_fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (retrieve_data(&ctx, output_fd, hashes[1]) == 0 && files_equal(data_fds[1], output_fd)) {
+        test_pass(test_case);
+    } else {
+        test_fail(test_case, NULL, NULL);
+    }
+    close(output_fd);
+    remove(path);
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should give empty slabs back without slab classes", __func__);
+    mapstore_ctx_free(&ctx);
+    opts.total_slab_classes = 0;
+    initialize_mapstore(&ctx, opts);
+    delete_data(&ctx, hashes[1]);
+    delete_data(&ctx, hashes[3]);
+    get_store_info(&ctx, &info);
+    assert_equal_int64(test_case, 950, info.free_space);
+
+    for (int i = 0; i < 4; i++) {
+        close(data_fds[i]);
+        memset(path, '\0', BUFSIZ);
+        sprintf(path, "%s%cslabs_%d.data", folder, separator(), i);
+        remove(path);
+        free(hashes[i]);
+    }
+
+    teardown_test_store(&ctx, base_path);
+}
+
+void test_bitmap_engine() {
+    char base_path[BUFSIZ / 2];
+    char path[BUFSIZ];
+    char *hashes[3] = {NULL, NULL, NULL};
+    int data_fds[3];
+    int bitmap_fd = -1;
+    int output_fd = -1;
+    uint64_t sizes[3] = {100, 600, 512};
+    uint64_t clean = 0;
+    json_object *positions = NULL;
+    json_object *store_positions = NULL;
+    json_object *location_array = NULL;
+    store_info info;
+    fragmentation_info frag;
+
+    memset(test_case, '\0', BUFSIZ);
+    mapstore_ctx ctx;
+    mapstore_opts opts = {0};
+
+    setup_test_store(base_path, sizeof(base_path), "bitmap");
+
+    opts.allocation_size = 12288;
+    opts.map_size = 4096;
+    opts.path = base_path;
+    opts.engine = MAPSTORE_ENGINE_BITMAP;
+    opts.block_size = 512;
+
+    if (initialize_mapstore(&ctx, opts) != 0) {
+        printf("Error initializing mapstore\n");
+        return;
+    }
+
+    for (int i = 0; i < 3; i++) {
+        memset(path, '\0', BUFSIZ);
+        sprintf(path, "%s%cbitmap_%d.data", folder, separator(), i);
+        data_fds[i] = create_test_file(path, sizes[i], &hashes[i]);
+    }
+
+    memset(path, '\0', BUFSIZ);
+    sprintf(path, "%s%cbitmap.out", folder, separator());
+    output_fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+    store_data(&ctx, data_fds[0], 0, hashes[0]);
+    store_data(&ctx, data_fds[1], 0, hashes[1]);
+
+    sprintf(test_case, "%s: Should start extents on a block", __func__);
+    get_pos_from_data_locations(db_for_hash(&ctx.shards, hashes[1]), hashes[1], &positions);
+    if (positions && json_object_object_get_ex(positions, "1", &store_positions) &&
+        json_object_array_length(store_positions) == 1 &&
+        (location_array = json_object_array_get_idx(store_positions, 0)) &&
+        json_object_get_int64(json_object_array_get_idx(location_array, 1)) == 512 &&
+        json_object_get_int64(json_object_array_get_idx(location_array, 2)) == 1111) {
+        test_pass(test_case);
+    } else {
+        test_fail(test_case, NULL, NULL);
+    }
+    json_object_put(positions);
+    positions = NULL;
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should free whole blocks", __func__);
+    delete_data(&ctx, hashes[0]);
+    get_store_info(&ctx, &info);
+    if (info.free_space == 11264 && get_fragmentation_info(&ctx, &frag) == 0 &&
+        frag.total.free_space == 11264 && frag.total.free_extents == 4) {
+        test_pass(test_case);
+    } else {
+        test_fail(test_case, NULL, NULL);
+    }
+    fragmentation_info_free(&frag);
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should reuse blocks after a clean reopen", __func__);
+    mapstore_ctx_free(&ctx);
+    initialize_mapstore(&ctx, opts);
+    store_data(&ctx, data_fds[2], 0, hashes[2]);
+    get_pos_from_data_locations(db_for_hash(&ctx.shards, hashes[2]), hashes[2], &positions);
+    if (positions && json_object_object_get_ex(positions, "1", &store_positions) &&
+        (location_array = json_object_array_get_idx(store_positions, 0)) &&
+        json_object_get_int64(json_object_array_get_idx(location_array, 1)) == 0) {
+        test_pass(test_case);
+    } else {
+        test_fail(test_case, NULL, NULL);
+    }
+    json_object_put(positions);
+    positions = NULL;
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should rebuild a bitmap that was not closed cleanly", __func__);
+    mapstore_ctx_free(&ctx);
+    memset(path, '\0', BUFSIZ);
+    snprintf(path, sizeof(path), "%s%cshards%cblocks.bitmap", base_path, separator(), separator());
+    bitmap_fd = open(path, O_RDWR);
+    pwrite(bitmap_fd, &clean, sizeof(uint64_t), 3 * sizeof(uint64_t));
+    close(bitmap_fd);
+    initialize_mapstore(&ctx, opts);
+    get_store_info(&ctx, &info);
+    if (info.free_space == 10752 && retrieve_data(&ctx, output_fd, hashes[1]) == 0 &&
+        files_equal(data_fds[1], output_fd)) {
+        test_pass(test_case);
+    } else {
+        test_fail(test_case, NULL, NULL);
+    }
+    mapstore_ctx_free(&ctx);
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should refuse other engines", __func__);
+    opts.engine = MAPSTORE_ENGINE_EXTENT;
+    if (initialize_mapstore(&ctx, opts) != 0) {
+        test_pass(test_case);
+    } else {
+        test_fail(test_case, NULL, NULL);
+        mapstore_ctx_free(&ctx);
+    }
+    opts.engine = MAPSTORE_ENGINE_BITMAP;
+    initialize_mapstore(&ctx, opts);
+
+    close(output_fd);
+    memset(path, '\0', BUFSIZ);
+    sprintf(path, "%s%cbitmap.out", folder, separator());
+    remove(path);
+
+    for (int i = 0; i < 3; i++) {
+        close(data_fds[i]);
+        memset(path, '\0', BUFSIZ);
+        sprintf(path, "%s%cbitmap_%d.data", folder, separator(), i);
+        remove(path);
+        free(hashes[i]);
+    }
+
+    teardown_test_store(&ctx, base_path);
+}
+
+void test_extent_checksums() {
+    char base_path[BUFSIZ / 2];
+    char path[BUFSIZ];
+    char *hashes[2] = {NULL, NULL};
+    int data_fds[2];
+    int output_fds[2];
+    int statuses[2] = {0, 0};
+    int store_fd = -1;
+    int chunk_fds[2] = {-1, -1};
+    char store_dir[BUFSIZ / 2 + 1];
+    char chunk_path[BUFSIZ];
+    char *chunk_data = NULL;
+    uint64_t length = 2 * CHECKSUM_CHUNK + 100;
+    uint64_t first = 0;
+    uint32_t crc = 0;
+    uint8_t byte = 0;
+    json_object *positions = NULL;
+    json_object *store_positions = NULL;
+    json_object *location_array = NULL;
+
+    memset(test_case, '\0', BUFSIZ);
+    mapstore_ctx ctx;
+    mapstore_opts opts = {0};
+
+    sprintf(test_case, "%s: Should compute the standard CRC32C", __func__);
+    assert_equal_int64(test_case, 0xE3069283, crc32c(0, (uint8_t *)"123456789", 9));
+
+    setup_test_store(base_path, sizeof(base_path), "checksums");
+
+    opts.allocation_size = 8192;
+    opts.map_size = 4096;
+    opts.path = base_path;
+
+    if (initialize_mapstore(&ctx, opts) != 0) {
+        printf("Error initializing mapstore\n");
+        return;
+    }
+
+    for (int i = 0; i < 2; i++) {
+        memset(path, '\0', BUFSIZ);
+        sprintf(path, "%s%cchecksums_%d.data", folder, separator(), i);
+        data_fds[i] = create_test_file(path, 600, &hashes[i]);
+        memset(path, '\0', BUFSIZ);
+        sprintf(path, "%s%cchecksums_%d.out", folder, separator(), i);
+        output_fds[i] = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        store_data(&ctx, data_fds[i], 0, hashes[i]);
+    }
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should store a checksum with every extent", __func__);
+    get_pos_from_data_locations(db_for_hash(&ctx.shards, hashes[0]), hashes[0], &positions);
+    if (positions && json_object_object_get_ex(positions, "1", &store_positions) &&
+        (location_array = json_object_array_get_idx(store_positions, 0)) &&
+        extent_crc(location_array, 0, &crc)) {
+        test_pass(test_case);
+        first = json_object_get_int64(json_object_array_get_idx(location_array, 1));
+    } else {
+        test_fail(test_case, NULL, NULL);
+    }
+    json_object_put(positions);
+    positions = NULL;
+
+    memset(path, '\0', BUFSIZ);
+    sprintf(path, "%s1.map", ctx.mapstore_path);
+    store_fd = open(path, O_RDWR);
+    pread(store_fd, &byte, 1, first + 10);
+    byte ^= 0xff;
+    pwrite(store_fd, &byte, 1, first + 10);
+    close(store_fd);
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should fail to retrieve corrupted data before writing it", __func__);
+    if (retrieve_data(&ctx, output_fds[0], hashes[0]) != 0 && get_file_size(output_fds[0]) == 0) {
+        test_pass(test_case);
+    } else {
+        test_fail(test_case, NULL, NULL);
+    }
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should fail only the corrupted object of a multi get", __func__);
+    ftruncate(output_fds[0], 0);
+    retrieve_data_multi(&ctx, hashes, output_fds, 2, statuses);
+    if (statuses[0] != 0 && statuses[1] == 0 && files_equal(data_fds[1], output_fds[1])) {
+        test_pass(test_case);
+    } else {
+        test_fail(test_case, NULL, NULL);
+    }
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should retrieve without verifying when asked", __func__);
+    mapstore_ctx_free(&ctx);
+    opts.skip_verify = true;
+    initialize_mapstore(&ctx, opts);
+    ftruncate(output_fds[0], 0);
+    lseek(output_fds[0], 0, SEEK_SET);
+    if (retrieve_data(&ctx, output_fds[0], hashes[0]) == 0 && !files_equal(data_fds[0], output_fds[0])) {
+        test_pass(test_case);
+    } else {
+        test_fail(test_case, NULL, NULL);
+    }
+
+    memset(store_dir, '\0', sizeof(store_dir));
+    snprintf(store_dir, sizeof(store_dir), "%s%c", base_path, separator());
+    memset(chunk_path, '\0', BUFSIZ);
+    snprintf(chunk_path, sizeof(chunk_path), "%s9.map", store_dir);
+    create_map_store(chunk_path, 3 * CHECKSUM_CHUNK, false);
+    memset(path, '\0', BUFSIZ);
+    snprintf(path, sizeof(path), "{ \"9\": [ [ 0, 1000, %"PRIu64" ] ] }", 1000 + length - 1);
+    positions = json_tokener_parse(path);
+    location_array = json_object_array_get_idx(json_object_object_get(positions, "9"), 0);
+
+    chunk_data = malloc(length);
+    for (uint64_t i = 0; i < length; i++) {
+        chunk_data[i] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ"[rand() % 26];
+    }
+    for (int i = 0; i < 2; i++) {
+        memset(path, '\0', BUFSIZ);
+        sprintf(path, "%s%cchunks_%d", folder, separator(), i);
+        chunk_fds[i] = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        remove(path);
+    }
+    write_all(chunk_fds[0], chunk_data, length);
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should checksum every chunk of an extent", __func__);
+    write_to_store(chunk_fds[0], store_dir, positions, NULL, false);
+    if (json_object_array_length(location_array) == 3 + extent_chunks(1000, 1000 + length - 1) &&
+        extent_crc(location_array, 2, &crc) && !extent_crc(location_array, 3, &crc)) {
+        test_pass(test_case);
+    } else {
+        test_fail(test_case, NULL, NULL);
+    }
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should read an extent across chunks", __func__);
+    if (read_from_store(chunk_fds[1], store_dir, positions, true, true) == 0 && files_equal(chunk_fds[0], chunk_fds[1])) {
+        test_pass(test_case);
+    } else {
+        test_fail(test_case, NULL, NULL);
+    }
+
+    store_fd = open(chunk_path, O_RDWR);
+    pread(store_fd, &byte, 1, CHECKSUM_CHUNK + 10);
+    byte ^= 0xff;
+    pwrite(store_fd, &byte, 1, CHECKSUM_CHUNK + 10);
+    close(store_fd);
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should stop before the corrupted chunk", __func__);
+    ftruncate(chunk_fds[1], 0);
+    if (read_from_store(chunk_fds[1], store_dir, positions, false, true) != 0 &&
+        get_file_size(chunk_fds[1]) == CHECKSUM_CHUNK - 1000) {
+        test_pass(test_case);
+    } else {
+        test_fail(test_case, NULL, NULL);
+    }
+
+    json_object_put(positions);
+    free(chunk_data);
+    close(chunk_fds[0]);
+    close(chunk_fds[1]);
+    remove(chunk_path);
+
+    for (int i = 0; i < 2; i++) {
+        close(data_fds[i]);
+        close(output_fds[i]);
+        memset(path, '\0', BUFSIZ);
+        sprintf(path, "%s%cchecksums_%d.data", folder, separator(), i);
+        remove(path);
+        memset(path, '\0', BUFSIZ);
+        sprintf(path, "%s%cchecksums_%d.out", folder, separator(), i);
+        remove(path);
+        free(hashes[i]);
+    }
+
+    teardown_test_store(&ctx, base_path);
+}
+
+void test_get_get_store_info() {
+    char base_path[BUFSIZ / 2];
+    char data_path[BUFSIZ];
+    char *hash = NULL;
+    int data_fd = -1;
+    store_info info;
+
+    memset(expected, '\0', BUFSIZ);
+    memset(actual, '\0', BUFSIZ);
+    memset(test_case, '\0', BUFSIZ);
+    mapstore_ctx ctx;
+    mapstore_opts opts = {0};
+
+    setup_test_store(base_path, sizeof(base_path), "storeinfo");
+
+    opts.allocation_size = 1048576;
+    opts.map_size = 1048576;
+    opts.path = base_path;
+    opts.punch_holes = true;
+
+    if (initialize_mapstore(&ctx, opts) != 0) {
+        printf("Error initializing mapstore\n");
+        return;
+    }
+
+    memset(data_path, '\0', BUFSIZ);
+    sprintf(data_path, "%s%cstoreinfo.data", folder, separator());
+    data_fd = create_test_file(data_path, 262144, &hash);
+    store_data(&ctx, data_fd, 0, hash);
+
+    sprintf(test_case, "%s: Should successfully retrieve store meta", __func__);
+    if (get_store_info(&ctx, &info) != 0) {
+        test_fail(test_case, NULL, NULL);
+    } else {
+        test_pass(test_case);
+
+        memset(test_case, '\0', BUFSIZ);
+        sprintf(test_case, "%s: Should return used space", __func__);
+        assert_equal_int64(test_case, 262144, info.used_space);
+
+        memset(test_case, '\0', BUFSIZ);
+        sprintf(test_case, "%s: Should return free space", __func__);
+        assert_equal_int64(test_case, 1048576 - 262144, info.free_space);
+
+        memset(test_case, '\0', BUFSIZ);
+        sprintf(test_case, "%s: Should return data count", __func__);
+        assert_equal_int64(test_case, 1, info.data_count);
+
+        memset(test_case, '\0', BUFSIZ);
+        sprintf(test_case, "%s: Should count written blocks as physical space", __func__);
+        if (info.physical_space >= 262144 && info.physical_space < 1048576) {
+            test_pass(test_case);
+        } else {
+            test_fail(test_case, NULL, NULL);
+        }
+    }
+
+    memset(test_case, '\0', BUFSIZ);
+    sprintf(test_case, "%s: Should punch holes for deleted data", __func__);
+    delete_data(&ctx, hash);
+    get_store_info(&ctx, &info);
+    if (info.used_space == 0 && info.physical_space < 262144) {
+        test_pass(test_case);
+    } else {
+        test_fail(test_case, NULL, NULL);
+    }
+
+    close(data_fd);
+    remove(data_path);
+    free(hash);
+
+    teardown_test_store(&ctx, base_path);
 }
 
 int main(void)
@@ -420,10 +3145,32 @@ int main(void)
 
     printf("Test Suite: API\n");
     test_initialize_mapstore();
+    test_grow_mapstore();
     test_store_data();
     test_retrieve_data();
+    test_restructure();
     test_delete_data();
+    test_concurrent_store();
+    test_multi_process_store();
     test_get_data_info();
+    test_metadata_shards();
+    test_store_metrics();
+    test_get_fragmentation_info();
+    test_trace_callbacks();
+    test_capture_replay();
+    test_metadata_only();
+    test_serve();
+    test_batch();
+    test_store_data_hashed();
+    test_retrieve_data_multi();
+    test_prefetch_evict();
+    test_direct_io();
+    test_lazy_create();
+    test_inline_data();
+    test_log_engine();
+    test_slab_classes();
+    test_bitmap_engine();
+    test_extent_checksums();
     test_get_get_store_info();
     printf("\n");
 
@@ -432,6 +3179,8 @@ int main(void)
 
     printf("Test Suite: Utils\n");
     test_json_free_space_array();
+    test_expand_free_space_list();
+    test_metrics_histogram();
     printf("\n");
 
     // End Tests
@@ -1,7 +1,11 @@
 #include "./../src/mapstore.h"
+#include "./../src/metrics.h"
+#include "./../src/shared_state.h"
+#include "./../src/server.h"
 #include "leitner_test.h"
 #include "./../src/cli_helper.h"
 #include <nettle/ripemd160.h>
 #include <nettle/sha.h>
 #include <nettle/base16.h>
 #include <time.h>
+#include <signal.h>